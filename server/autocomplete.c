@@ -0,0 +1,352 @@
+/*
+ *  autocomplete.c
+ *  Ranked searches of ontology labels.  The entries of an index are kept
+ *  in the order of the texts they are filed under, so the entries whose
+ *  texts start with a given prefix form a run, found by binary search; a
+ *  sparse table over the entries' lengths then picks out the shortest few
+ *  in the run without visiting the rest of it.
+ *
+ *  An autocomplete index files each label under the label itself; a word
+ *  index files it once under each word in it (running on to the end of
+ *  the label, so that a prefix can span several words), ignoring case.
+ */
+#include "lyph.h"
+
+autocomplete_index *label_autocomplete;
+autocomplete_index *lowercase_autocomplete;
+autocomplete_index *label_word_index;
+
+void populate_autocomplete_keys( trie ***kptr, trie *t );
+void rank_autocomplete_index( autocomplete_index *idx );
+int cmp_folded_keys( const void *a, const void *b );
+int strncmp_folded( const char *x, const char *y, size_t len );
+int autocomplete_bound( autocomplete_index *idx, const char *prefix, size_t len, int upper );
+int autocomplete_shortest( autocomplete_index *idx, int lo, int hi );
+
+/*
+ * Index the keys (with data) of a trie.  The trie's children are kept
+ * sorted, so a walk in child order lists the keys in strcmp order.
+ */
+autocomplete_index *build_autocomplete_index( trie *base )
+{
+  autocomplete_index *idx;
+  trie **kptr;
+  int i;
+
+  CREATE( idx, autocomplete_index, 1 );
+
+  CREATE( idx->keys, trie *, count_nontrivial_members( base ) + 1 );
+  kptr = idx->keys;
+  populate_autocomplete_keys( &kptr, base );
+  *kptr = NULL;
+  idx->cnt = kptr - idx->keys;
+
+  CREATE( idx->texts, const char *, idx->cnt + 1 );
+
+  for ( i = 0; i < idx->cnt; i++ )
+    idx->texts[i] = trie_to_static( idx->keys[i] );
+
+  rank_autocomplete_index( idx );
+
+  return idx;
+}
+
+/*
+ * Index the keys (with data) of a trie by the words in them
+ */
+autocomplete_index *build_word_index( trie *base )
+{
+  autocomplete_index *idx;
+  trie **keys, **kptr;
+  trie_key *words;
+  const char *key, *kp;
+  int cnt = 0, i;
+
+  CREATE( keys, trie *, count_nontrivial_members( base ) + 1 );
+  kptr = keys;
+  populate_autocomplete_keys( &kptr, base );
+  *kptr = NULL;
+
+  for ( kptr = keys; *kptr; kptr++ )
+    for ( kp = key = trie_to_static( *kptr ); *kp; kp++ )
+      if ( kp == key || kp[-1] == ' ' )
+        cnt++;
+
+  CREATE( words, trie_key, cnt + 1 );
+  cnt = 0;
+
+  for ( kptr = keys; *kptr; kptr++ )
+  {
+    for ( kp = key = trie_to_static( *kptr ); *kp; kp++ )
+    {
+      if ( kp == key || kp[-1] == ' ' )
+      {
+        words[cnt].key = kp;
+        words[cnt].node = *kptr;
+        words[cnt].index = cnt;
+        cnt++;
+      }
+    }
+  }
+
+  qsort( words, cnt, sizeof(trie_key), cmp_folded_keys );
+
+  CREATE( idx, autocomplete_index, 1 );
+  CREATE( idx->keys, trie *, cnt + 1 );
+  CREATE( idx->texts, const char *, cnt + 1 );
+  idx->cnt = cnt;
+  idx->fold_case = 1;
+
+  for ( i = 0; i < cnt; i++ )
+  {
+    idx->keys[i] = words[i].node;
+    idx->texts[i] = words[i].key;
+  }
+
+  rank_autocomplete_index( idx );
+
+  MULTIFREE( keys, words );
+
+  return idx;
+}
+
+void populate_autocomplete_keys( trie ***kptr, trie *t )
+{
+  if ( t->data && *t->data )
+  {
+    **kptr = t;
+    (*kptr)++;
+  }
+
+  TRIE_RECURSE( populate_autocomplete_keys( kptr, *child ) );
+}
+
+/*
+ * Fill in the lengths and the sparse table, once the entries are in order
+ */
+void rank_autocomplete_index( autocomplete_index *idx )
+{
+  int i, j, span;
+
+  CREATE( idx->lens, int, idx->cnt + 1 );
+
+  for ( i = 0; i < idx->cnt; i++ )
+    idx->lens[i] = TRIE_KEY_LEN( idx->keys[i] );
+
+  for ( idx->levels = 1; (1 << idx->levels) <= idx->cnt; idx->levels++ )
+    ;
+
+  CREATE( idx->best, int *, idx->levels );
+  CREATE( idx->best[0], int, idx->cnt + 1 );
+
+  for ( i = 0; i < idx->cnt; i++ )
+    idx->best[0][i] = i;
+
+  for ( j = 1; j < idx->levels; j++ )
+  {
+    span = 1 << (j-1);
+
+    CREATE( idx->best[j], int, idx->cnt - 2 * span + 1 );
+
+    for ( i = 0; i + 2 * span <= idx->cnt; i++ )
+    {
+      int left = idx->best[j-1][i], right = idx->best[j-1][i+span];
+
+      idx->best[j][i] = idx->lens[right] < idx->lens[left] ? right : left;
+    }
+  }
+}
+
+int cmp_folded_keys( const void *a, const void *b )
+{
+  const trie_key *x = (const trie_key *) a, *y = (const trie_key *) b;
+  int cmp = strncmp_folded( x->key, y->key, (size_t) -1 );
+
+  return cmp ? cmp : x->index - y->index;
+}
+
+/*
+ * strncmp, but with capitals taken for lowercase (the same way as by
+ * str_begins)
+ */
+int strncmp_folded( const char *x, const char *y, size_t len )
+{
+  for ( ; len; x++, y++, len-- )
+  {
+    unsigned char cx = LOWER( *x ), cy = LOWER( *y );
+
+    if ( cx != cy )
+      return cx - cy;
+
+    if ( !cx )
+      break;
+  }
+
+  return 0;
+}
+
+/*
+ * The first entry which is not before the prefix (or, for upper, the first
+ * one after everything starting with it)
+ */
+int autocomplete_bound( autocomplete_index *idx, const char *prefix, size_t len, int upper )
+{
+  int lo = 0, hi = idx->cnt;
+
+  while ( lo < hi )
+  {
+    int mid = lo + (hi - lo) / 2;
+    int cmp;
+
+    if ( idx->fold_case )
+      cmp = strncmp_folded( idx->texts[mid], prefix, len );
+    else
+      cmp = strncmp( idx->texts[mid], prefix, len );
+
+    if ( cmp < 0 || ( upper && !cmp ) )
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+
+  return lo;
+}
+
+/*
+ * Which of entries lo .. hi-1 is shortest (the first of them, on a tie)
+ */
+int autocomplete_shortest( autocomplete_index *idx, int lo, int hi )
+{
+  int j = 0, left, right;
+
+  while ( (2 << j) <= hi - lo )
+    j++;
+
+  left = idx->best[j][lo];
+  right = idx->best[j][hi - (1 << j)];
+
+  return idx->lens[right] < idx->lens[left] ? right : left;
+}
+
+/*
+ * The range of entries starting with prefix, returning the number of them
+ */
+int autocomplete_run( autocomplete_index *idx, const char *prefix, int *lo, int *hi )
+{
+  size_t len = strlen( prefix );
+
+  *lo = autocomplete_bound( idx, prefix, len, 0 );
+  *hi = autocomplete_bound( idx, prefix, len, 1 );
+
+  return *hi - *lo;
+}
+
+/*
+ * Put the (at most max) shortest keys with entries starting with prefix
+ * in buf, shortest first and NULL-terminated, and return how many there
+ * are.  Each entry taken splits the run it came from in two, so the runs
+ * to choose among only grow by one per entry (the scratch space for them
+ * is kept from call to call).  A key filed under two matching words is
+ * only given once.
+ */
+int autocomplete( autocomplete_index *idx, const char *prefix, trie **buf, int max )
+{
+  static __thread autocomplete_span *spans;
+  static __thread int spans_size;
+  int runs = 0, finds = 0, lo, hi;
+
+  if ( idx && max > 0 && autocomplete_run( idx, prefix, &lo, &hi ) )
+  {
+    if ( !spans )
+    {
+      spans_size = MAX_AUTOCOMPLETE_RESULTS + 1;
+      CREATE( spans, autocomplete_span, spans_size );
+    }
+
+    spans[0].lo = lo;
+    spans[0].hi = hi;
+    spans[0].best = autocomplete_shortest( idx, lo, hi );
+    runs = 1;
+  }
+
+  while ( runs && finds < max )
+  {
+    int i, r = 0, b;
+    trie **dupe;
+
+    for ( i = 1; i < runs; i++ )
+    {
+      int x = spans[i].best, y = spans[r].best;
+
+      if ( idx->lens[x] < idx->lens[y] || ( idx->lens[x] == idx->lens[y] && x < y ) )
+        r = i;
+    }
+
+    b = spans[r].best;
+    lo = spans[r].lo;
+    hi = spans[r].hi;
+    spans[r] = spans[--runs];
+
+    for ( dupe = buf; dupe < &buf[finds]; dupe++ )
+      if ( *dupe == idx->keys[b] )
+        break;
+
+    if ( dupe == &buf[finds] )
+      buf[finds++] = idx->keys[b];
+
+    if ( runs + 2 > spans_size )
+    {
+      spans_size *= 2;
+
+      if ( !(spans = realloc( spans, spans_size * sizeof(autocomplete_span) )) )
+      {
+        fprintf( stderr, "Malloc failure at %s:%d\n", __FILE__, __LINE__ );
+        abort();
+      }
+    }
+
+    if ( lo < b )
+    {
+      spans[runs].lo = lo;
+      spans[runs].hi = b;
+      spans[runs].best = autocomplete_shortest( idx, lo, b );
+      runs++;
+    }
+
+    if ( b + 1 < hi )
+    {
+      spans[runs].lo = b + 1;
+      spans[runs].hi = hi;
+      spans[runs].best = autocomplete_shortest( idx, b + 1, hi );
+      runs++;
+    }
+  }
+
+  buf[finds] = NULL;
+
+  return finds;
+}
+
+/*
+ * Every key starting with prefix, shortest first, in a NULL-terminated
+ * array for the caller to free (for indices of whole keys)
+ */
+trie **autocomplete_all( autocomplete_index *idx, const char *prefix )
+{
+  trie **buf;
+  int lo = 0, hi = 0;
+
+  if ( idx )
+    autocomplete_run( idx, prefix, &lo, &hi );
+
+  CREATE( buf, trie *, hi - lo + 1 );
+
+  if ( hi > lo )
+    memcpy( buf, &idx->keys[lo], (hi - lo) * sizeof(trie *) );
+
+  buf[hi - lo] = NULL;
+
+  qsort( buf, hi - lo, sizeof(trie *), cmp_trie_data );
+
+  return buf;
+}
@@ -150,6 +150,8 @@ HANDLER( do_editlyphnode )
   if ( loctypestr )
     n->loctype = loctype;
 
+  lyph_containment_changed();
+
   save_lyphs();
 
   send_response( req, lyphnode_to_json( n ) );
@@ -268,8 +270,10 @@ HANDLER( do_editlyph )
     if ( e->name )
       e->name->data = NULL;
 
+    unindex_lyph( e );
     e->name = name;
     name->data = (trie **)e;
+    index_lyph( e );
   }
 
   if ( typestr )
@@ -278,6 +282,9 @@ HANDLER( do_editlyph )
   if ( L )
     e->lyphplt = L;
 
+  if ( typestr || L )
+    lyph_graph_changed();
+
   projstr = get_param( params, "projection_strength" );
 
   if ( projstr )
@@ -340,6 +347,8 @@ HANDLER( do_editlyph )
     e->to->location = NULL;
   }
 
+  lyph_containment_changed();
+
   speciesstr = get_param( params, "species" );
 
   if ( speciesstr )
@@ -487,6 +496,7 @@ HANDLER( do_edit_template )
     free( L->misc_material );
 
     L->misc_material = misc_mats;
+    lyphplate_graph_changed();
   }
 
   if ( movelayerstr && newpos != oldpos )
@@ -597,7 +607,7 @@ HANDLER( do_editlayer )
           HND_ERR( "One of the indicated templates was not recognized" );
       }
 
-      if ( is_Xs_built_from_Y( mat, lyr ) )
+      if ( is_Xs_built_from_layer( mat, lyr ) )
       {
         free( mat );
         HND_ERR( "The layer in question is already part of the construction of one of the materials in question" );
@@ -623,7 +633,10 @@ HANDLER( do_editlayer )
   }
     
   if ( mat )
+  {
     lyr->material = mat;
+    lyphplate_graph_changed();
+  }
 
   if ( thk != -1 )
     lyr->thickness = thk;
@@ -633,108 +646,67 @@ HANDLER( do_editlayer )
   send_response( req, layer_to_json( lyr ) );
 }
 
-void remove_exit_data( lyphnode *n, lyph *e )
-{
-  exit_data **xptr, **xnew, **xnewptr;
-
-  CREATE( xnew, exit_data *, VOIDLEN( n->exits ) );
-
-  for ( xptr = n->exits, xnewptr = xnew; *xptr; xptr++ )
-  {
-    if ( (*xptr)->via != e )
-      *xnewptr++ = *xptr;
-  }
-
- *xnewptr = NULL;
-
- free( n->exits );
- n->exits = xnew;
-}
-
-void delete_located_measures_involving_lyph( lyph *e )
+/*
+ * Delete the located measures on lyphs marked LYPH_DELETED (which
+ * remove_deleted_lyphs_from_bops has already taken out of the bops)
+ */
+int delete_located_measures_of_deleted_lyphs( void )
 {
   located_measure *m, *m_next;
+  int fMatch = 0;
 
   for ( m = first_located_measure; m; m = m_next )
   {
     m_next = m->next;
 
-    if ( m->loc == e )
-      delete_located_measure( m );
+    if ( m->loc->type == LYPH_DELETED )
+    {
+      free_located_measure( m );
+      fMatch = 1;
+    }
   }
+
+  return fMatch;
 }
 
 void delete_correlations_involving_lyph( lyph *e )
 {
-  correlation *c, *c_next;
-  variable **v;
-
-  for ( c = first_correlation; c; c = c_next )
-  {
-    c_next = c->next;
-
-    for ( v = c->vars; *v; v++ )
-      if ( (*v)->type == VARIABLE_LOCATED && (*v)->loc == e )
-        break;
-
-    if ( *v )
-      delete_correlation( c );
-  }
+  /*
+   * delete_correlation takes each correlation out of e's list
+   */
+  while ( e->correlations )
+    delete_correlation( *e->correlations );
 }
 
+/*
+ * Take a lyph out of the database.  Whatever else refers to it should
+ * have been dealt with already (see delete_lyphs).  Returns whether the
+ * lyph had any annotations.
+ */
 int delete_lyph( lyph *e )
 {
   int fAnnot;
-  lyph *prev;
-
-  if ( remove_lyph_from_bops( e ) )
-    save_bops();
 
   if ( *e->annots )
     fAnnot = 1;
   else
     fAnnot = 0;
 
+  unindex_lyph( e );
   e->id->data = NULL;
 
-  if ( e == first_lyph )
-  {
-    if ( e == last_lyph )
-      last_lyph = NULL;
-
-    first_lyph = e->next;
-  }
-  else
-  {
-    for ( prev = first_lyph; prev; prev = prev->next )
-      if ( prev->next == e )
-        break;
-
-    if ( prev )
-    {
-      prev->next = e->next;
-
-      if ( last_lyph == e )
-        last_lyph = prev;
-    }
-    else
-    {
-      error_messagef( "Fatal error in delete_lyph:  lyph is not first_lyph, and yet has no prev" );
-      EXIT();
-    }
-  }
+  if ( e->name && e->name->data == (trie **)e )
+    e->name->data = NULL;
 
+  UNLINK2( e, first_lyph, last_lyph, next, prev );
+  lyph_containment_changed();
   lyphcnt--;
 
   free( e->constraints );
   free( e->annots );
 
-  remove_exit_data( e->from, e );
-
-  delete_correlations_involving_lyph( e );
-  save_correlations();
-  delete_located_measures_involving_lyph( e );
-  save_located_measures();
+  remove_from_exits( e, &e->from->exits );
+  remove_from_exits( e, &e->to->incoming );
 
   free( e );
 
@@ -781,7 +753,7 @@ int remove_doomed_items_from_views( void )
     v = views[i];
 
     for ( nptr = v->nodes; *nptr; nptr++ )
-      if ( (*nptr)->flags == LYPHNODE_BEING_DELETED )
+      if ( (*nptr)->flags[worker_slot] == LYPHNODE_BEING_DELETED )
         break;
 
     if ( *nptr )
@@ -792,7 +764,7 @@ int remove_doomed_items_from_views( void )
       v->modified = longtime();
 
       for ( nptr = v->nodes, size = 0; *nptr; nptr++ )
-        if ( (*nptr)->flags != LYPHNODE_BEING_DELETED )
+        if ( (*nptr)->flags[worker_slot] != LYPHNODE_BEING_DELETED )
           size++;
 
       CREATE( buf, lyphnode *, size + 1 );
@@ -802,7 +774,7 @@ int remove_doomed_items_from_views( void )
 
       for ( nptr = v->nodes, cptr = v->coords; *nptr; nptr++ )
       {
-        if ( (*nptr)->flags == LYPHNODE_BEING_DELETED )
+        if ( (*nptr)->flags[worker_slot] == LYPHNODE_BEING_DELETED )
         {
           free( *cptr++ );
           free( *cptr++ );
@@ -848,7 +820,7 @@ int remove_doomed_items_from_views( void )
           *bptr++ = *rptr;
       }
 
-      *rptr = NULL;
+      *bptr = NULL;
       free( v->rects );
       v->rects = buf;
     }
@@ -857,10 +829,57 @@ int remove_doomed_items_from_views( void )
   return fMatch;
 }
 
+/*
+ * Delete a batch of lyphs, each marked LYPH_DELETED and listed once.
+ * Everything which refers to them is cleaned up in one pass for the
+ * whole batch, and each affected file is saved once.  Returns whether
+ * any of the lyphs had annotations.
+ */
+int delete_lyphs( lyph **doomed )
+{
+  lyph **eptr;
+  int fAnnot = 0, fCorr = 0;
+
+  if ( !*doomed )
+    return 0;
+
+  if ( remove_doomed_items_from_views() )
+    save_lyphviews();
+
+  remove_deleted_lyph_locations( lyphnode_ids );
+
+  if ( remove_deleted_lyphs_from_bops() )
+    save_bops();
+
+  if ( delete_located_measures_of_deleted_lyphs() )
+    save_located_measures();
+
+  /*
+   * A correlation may involve several of the lyphs, so get rid of the
+   * correlations before freeing any of the lyphs
+   */
+  for ( eptr = doomed; *eptr; eptr++ )
+  {
+    if ( (*eptr)->correlations )
+    {
+      delete_correlations_involving_lyph( *eptr );
+      fCorr = 1;
+    }
+  }
+
+  if ( fCorr )
+    save_correlations();
+
+  for ( eptr = doomed; *eptr; eptr++ )
+    fAnnot |= delete_lyph( *eptr );
+
+  return fAnnot;
+}
+
 HANDLER( do_delete_lyphs )
 {
   char *lyphstr, *err;
-  lyph **e, **eptr, dupe;
+  lyph **e, **eptr, **dptr;
   int fAnnot;
 
   TRY_TWO_PARAMS( lyphstr, "lyphs", "lyph", "You did not specify which lyphs to delete." );
@@ -875,22 +894,18 @@ HANDLER( do_delete_lyphs )
       HND_ERR( "One of the indicated lyphs was not found in the database." );
   }
 
-  for ( eptr = e; *eptr; eptr++ )
+  for ( eptr = e, dptr = e; *eptr; eptr++ )
   {
-    if ( (*eptr)->type == LYPH_DELETED )
-      *eptr = &dupe;
-    else
+    if ( (*eptr)->type != LYPH_DELETED )
+    {
       (*eptr)->type = LYPH_DELETED;
+      *dptr++ = *eptr;
+    }
   }
 
-  if ( remove_doomed_items_from_views() )
-    save_lyphviews();
+  *dptr = NULL;
 
-  remove_deleted_lyph_locations(lyphnode_ids);
-
-  for ( eptr = e, fAnnot = 0; *eptr; eptr++ )
-    if ( *eptr != &dupe )
-      fAnnot |= delete_lyph( *eptr );
+  fAnnot = delete_lyphs( e );
 
   free( e );
 
@@ -902,20 +917,35 @@ HANDLER( do_delete_lyphs )
   send_ok( req );
 }
 
+/*
+ * Delete the lyphs incident to nodes marked LYPHNODE_BEING_DELETED.  The
+ * nodes' exits are not enough to go by: a clone shares its original's
+ * nodes without being among their exits.
+ */
 int remove_lyphs_with_doomed_nodes( void )
 {
-  lyph *e, *e_next;
-  int fAnnot = 0;
+  lyph *e, **buf, **bptr;
+  int fAnnot;
 
-  for ( e = first_lyph; e; e = e_next )
-  {
-    e_next = e->next;
+  CREATE( buf, lyph *, lyphcnt + 1 );
+  bptr = buf;
 
-    if ( e->from->flags == LYPHNODE_BEING_DELETED
-    ||   e->to->flags   == LYPHNODE_BEING_DELETED )
-      fAnnot = delete_lyph( e );
+  for ( e = first_lyph; e; e = e->next )
+  {
+    if ( e->from->flags[worker_slot] == LYPHNODE_BEING_DELETED
+    ||   e->to->flags[worker_slot] == LYPHNODE_BEING_DELETED )
+    {
+      e->type = LYPH_DELETED;
+      *bptr++ = e;
+    }
   }
 
+  *bptr = NULL;
+
+  fAnnot = delete_lyphs( buf );
+
+  free( buf );
+
   return fAnnot;
 }
 
@@ -927,12 +957,16 @@ void delete_lyphnode( lyphnode *n )
   free( n->exits );
   n->id->data = NULL;
   free( n );
+
+  lyph_graph_changed();
+  lyph_containment_changed();
 }
 
 HANDLER( do_delete_nodes )
 {
-  lyphnode **n, **nptr, dupe;
+  lyphnode **n, **nptr, **dptr;
   char *nodestr, *err;
+  int fAnnot;
 
   TRY_TWO_PARAMS( nodestr, "nodes", "node", "You did not specify which nodes to delete" );
 
@@ -946,25 +980,30 @@ HANDLER( do_delete_nodes )
       HND_ERR( "One of the indicated nodes was not found in the database." );
   }
 
-  for ( nptr = n; *nptr; nptr++ )
+  for ( nptr = n, dptr = n; *nptr; nptr++ )
   {
-    if ( (*nptr)->flags == LYPHNODE_BEING_DELETED )
-      *nptr = &dupe;
-    else
-      (*nptr)->flags = LYPHNODE_BEING_DELETED;
+    if ( (*nptr)->flags[worker_slot] != LYPHNODE_BEING_DELETED )
+    {
+      (*nptr)->flags[worker_slot] = LYPHNODE_BEING_DELETED;
+      *dptr++ = *nptr;
+    }
   }
 
-  remove_lyphs_with_doomed_nodes( );
+  *dptr = NULL;
+
+  fAnnot = remove_lyphs_with_doomed_nodes( );
 
   if ( remove_doomed_items_from_views() )
     save_lyphviews();
 
   for ( nptr = n; *nptr; nptr++ )
-    if ( *nptr != &dupe )
-      delete_lyphnode( *nptr );
+    delete_lyphnode( *nptr );
 
   save_lyphs();
 
+  if ( fAnnot )
+    save_lyph_annotations();
+
   free( n );
 
   send_ok( req );
@@ -984,15 +1023,16 @@ int remove_doomed_lyphplates_from_lyphs( void )
   {
     lyphplate **c;
 
-    if ( e->lyphplt && e->lyphplt->flags == LYPHPLATE_BEING_DELETED )
+    if ( e->lyphplt && e->lyphplt->flags[worker_slot] == LYPHPLATE_BEING_DELETED )
     {
       e->lyphplt = NULL;
       e->modified = longtime();
       fMatch = 1;
+      lyph_graph_changed();
     }
 
     for ( c = e->constraints; *c; c++ )
-      if ( (*c)->flags == LYPHPLATE_BEING_DELETED )
+      if ( (*c)->flags[worker_slot] == LYPHPLATE_BEING_DELETED )
         break;
 
     if ( *c )
@@ -1001,13 +1041,13 @@ int remove_doomed_lyphplates_from_lyphs( void )
       int size = 0;
 
       for ( c = e->constraints; *c; c++ )
-        if ( (*c)->flags != LYPHPLATE_BEING_DELETED )
+        if ( (*c)->flags[worker_slot] != LYPHPLATE_BEING_DELETED )
           size++;
 
       CREATE( newc, lyphplate *, size + 1 );
 
       for ( c = e->constraints, newcptr = newc; *c; c++ )
-        if ( (*c)->flags != LYPHPLATE_BEING_DELETED )
+        if ( (*c)->flags[worker_slot] != LYPHPLATE_BEING_DELETED )
           *newcptr++ = *c;
 
       *newcptr = NULL;
@@ -1028,7 +1068,7 @@ int spread_lyphplate_doom( void )
 
   for ( L = first_lyphplate; L; L = L->next )
   {
-    if ( L->flags != LYPHPLATE_BEING_DELETED
+    if ( L->flags[worker_slot] != LYPHPLATE_BEING_DELETED
     && ( L->type == LYPHPLATE_MIX || L->type == LYPHPLATE_SHELL ) )
     {
       layer **lyr;
@@ -1036,12 +1076,12 @@ int spread_lyphplate_doom( void )
 
       for ( lyr = L->layers; *lyr; lyr++ )
       for ( materials = (*lyr)->material; *materials; materials++ )
-        if ( (*materials)->flags == LYPHPLATE_BEING_DELETED )
+        if ( (*materials)->flags[worker_slot] == LYPHPLATE_BEING_DELETED )
           break;
 
       if ( *lyr )
       {
-        L->flags = LYPHPLATE_BEING_DELETED;
+        L->flags[worker_slot] = LYPHPLATE_BEING_DELETED;
         fMatch = 1;
       }
     }
@@ -1055,7 +1095,7 @@ int layer_has_doomed_material( layer *lyr )
   lyphplate **materials;
 
   for ( materials = lyr->material; *materials; materials++ )
-    if ( (*materials)->flags == LYPHPLATE_BEING_DELETED )
+    if ( (*materials)->flags[worker_slot] == LYPHPLATE_BEING_DELETED )
       return 1;
 
   return 0;
@@ -1086,7 +1126,7 @@ void delete_doomed_lyphplates( void )
   {
     L_next = L->next;
 
-    if ( L->flags == LYPHPLATE_BEING_DELETED )
+    if ( L->flags[worker_slot] == LYPHPLATE_BEING_DELETED )
     {
       if ( L->id )
         L->id->data = NULL;
@@ -1103,6 +1143,8 @@ void delete_doomed_lyphplates( void )
       free( L );
     }
   }
+
+  lyphplate_graph_changed();
 }
 
 int doomed_lyphplates_already_in_use_by_lyph( char **where )
@@ -1111,7 +1153,7 @@ int doomed_lyphplates_already_in_use_by_lyph( char **where )
 
   for ( e = first_lyph; e; e = e->next )
   {    
-    if ( e->lyphplt && e->lyphplt->flags == LYPHPLATE_BEING_DELETED )
+    if ( e->lyphplt && e->lyphplt->flags[worker_slot] == LYPHPLATE_BEING_DELETED )
     {
       *where = strdupf( "Lyph %s", trie_to_static( e->id ) );
       return 1;
@@ -1127,12 +1169,12 @@ int doomed_lyphplates_already_in_use_by_lyphplate( char **where )
 
   for ( L = first_lyphplate; L; L = L->next )
   {
-    if ( L->flags != LYPHPLATE_BEING_DELETED && L->misc_material )
+    if ( L->flags[worker_slot] != LYPHPLATE_BEING_DELETED && L->misc_material )
     {
       lyphplate **mats;
       
       for ( mats = L->misc_material; *mats; mats++ )
-        if ( (*mats)->flags == LYPHPLATE_BEING_DELETED )
+        if ( (*mats)->flags[worker_slot] == LYPHPLATE_BEING_DELETED )
         {
           *where = strdupf( "Template %s", trie_to_static( L->id ) );
           return 1;
@@ -1149,7 +1191,7 @@ int layer_used_by_non_doomed_lyphplate( layer *lyr )
 
   for ( L = first_lyphplate; L; L = L->next )
   {
-    if ( L->flags != LYPHPLATE_BEING_DELETED && L->layers )
+    if ( L->flags[worker_slot] != LYPHPLATE_BEING_DELETED && L->layers )
     {
       layer **lyrs;
 
@@ -1170,7 +1212,7 @@ int doomed_lyphplates_already_in_use_by_layer( char **where, trie *t, layer_wrap
     lyphplate **mats;
     
     for ( mats = lyr->material; *mats; mats++ )
-      if ( (*mats)->flags == LYPHPLATE_BEING_DELETED )
+      if ( (*mats)->flags[worker_slot] == LYPHPLATE_BEING_DELETED )
       {
         if ( !layer_used_by_non_doomed_lyphplate( lyr ) )
         {
@@ -1249,10 +1291,10 @@ HANDLER( do_delete_templates )
 
   for ( Lptr = L; *Lptr; Lptr++ )
   {
-    if ( (*Lptr)->flags == LYPHPLATE_BEING_DELETED )
+    if ( (*Lptr)->flags[worker_slot] == LYPHPLATE_BEING_DELETED )
       *Lptr = &dupe;
     else
-      (*Lptr)->flags = LYPHPLATE_BEING_DELETED;
+      (*Lptr)->flags[worker_slot] = LYPHPLATE_BEING_DELETED;
   }
 
   free( L );
@@ -1378,7 +1420,7 @@ void spread_lyphplate_doom_from_layers( void )
 
   for ( L = first_lyphplate; L; L = L->next )
   {
-    if ( L->flags != LYPHPLATE_BEING_DELETED
+    if ( L->flags[worker_slot] != LYPHPLATE_BEING_DELETED
     && ( L->type == LYPHPLATE_MIX || L->type == LYPHPLATE_SHELL ) )
     {
       layer **lyr;
@@ -1388,7 +1430,7 @@ void spread_lyphplate_doom_from_layers( void )
           break;
 
       if ( *lyr )
-        L->flags = LYPHPLATE_BEING_DELETED;
+        L->flags[worker_slot] = LYPHPLATE_BEING_DELETED;
     }
   }
 }
@@ -1489,10 +1531,10 @@ HANDLER( do_lyphs_from_view )
   #define LYPH_TO_BE_REMOVED 1
 
   for ( lptr = lyphs; *lptr; lptr++ )
-    SET_BIT( (*lptr)->flags, LYPH_TO_BE_REMOVED );
+    SET_BIT( (*lptr)->flags[worker_slot], LYPH_TO_BE_REMOVED );
 
   for ( rptr = v->rects, size = 0; *rptr; rptr++ )
-    if ( !((*rptr)->L) || !IS_SET( (*rptr)->L->flags, LYPH_TO_BE_REMOVED ) )
+    if ( !((*rptr)->L) || !IS_SET( (*rptr)->L->flags[worker_slot], LYPH_TO_BE_REMOVED ) )
       size++;
 
   CREATE( buf, lv_rect *, size + 1 );
@@ -1500,7 +1542,7 @@ HANDLER( do_lyphs_from_view )
 
   for ( rptr = v->rects, size = 0; *rptr; rptr++ )
   {
-    if ( (*rptr)->L && IS_SET( (*rptr)->L->flags, LYPH_TO_BE_REMOVED ) )
+    if ( (*rptr)->L && IS_SET( (*rptr)->L->flags[worker_slot], LYPH_TO_BE_REMOVED ) )
       free( *rptr );
     else
       *bptr++ = *rptr;
@@ -1512,7 +1554,7 @@ HANDLER( do_lyphs_from_view )
   v->modified = longtime();
 
   for ( lptr = lyphs; *lptr; lptr++ )
-    REMOVE_BIT( (*lptr)->flags, LYPH_TO_BE_REMOVED );
+    REMOVE_BIT( (*lptr)->flags[worker_slot], LYPH_TO_BE_REMOVED );
 
   save_lyphviews();
 
@@ -1521,92 +1563,26 @@ HANDLER( do_lyphs_from_view )
   send_response( req, lyphview_to_json( v ) );
 }
 
-int template_involves_any_of( lyphplate *L, lyphplate **parts )
-{
-  if ( IS_SET( L->flags, LYPHPLATE_DOES_INVOLVE ) )
-    return 1;
-  else
-  if ( IS_SET( L->flags, LYPHPLATE_DOES_NOT_INVOLVE ) )
-    return 0;
-  else
-  {
-    lyphplate **misc_mats, **partptr;
-    int answer;
-
-    for ( partptr = parts; *partptr; partptr++ )
-    {
-      lyphplate *part = *partptr;
-
-      if ( L == part )
-      {
-        SET_BIT( L->flags, LYPHPLATE_DOES_INVOLVE );
-        return 1;
-      }
-
-      for ( misc_mats = L->misc_material; *misc_mats; misc_mats++ )
-        if ( template_involves_any_of( *misc_mats, parts ) )
-          break;
-
-      if ( *misc_mats )
-      {
-        answer = 1;
-        goto template_involves_outer_escape_tag;
-      }
-      else
-      switch( L->type )
-      {
-        case LYPHPLATE_BASIC:
-          /*
-           * answer will be set to 0 after break
-           */
-          break;
-        case LYPHPLATE_SHELL:
-        case LYPHPLATE_MIX:
-        {
-          layer **lyr;
-          lyphplate **materials;
-
-          for ( lyr = L->layers; *lyr; lyr++ )
-          for ( materials = (*lyr)->material; *materials; materials++ )
-            if ( template_involves_any_of( *materials, parts ) )
-              goto template_involves_escape_tag;
-
-          template_involves_escape_tag:
-
-          if ( *lyr )
-          {
-            answer = 1;
-            goto template_involves_outer_escape_tag;
-          }
-        }
-      }
-    }
-    answer = 0;
-
-    template_involves_outer_escape_tag:
-
-    if ( answer )
-      SET_BIT( L->flags, LYPHPLATE_DOES_INVOLVE );
-    else
-      SET_BIT( L->flags, LYPHPLATE_DOES_NOT_INVOLVE );
-
-    return answer;
-  }
-}
-
 void calc_involves_template( lyphplate *L, lyph_wrapper **head, lyph_wrapper **tail, int *cnt )
 {
+  lyphplate_graph *g = current_lyphplate_graph();
+  lyphplate *parts[2];
+  unsigned long *involved;
   lyph *e;
 
+  parts[0] = L;
+  parts[1] = NULL;
+
+  involved = lyphplates_involving( g, parts );
+
   for ( e = first_lyph; e; e = e->next )
   {
-    lyphplate **parts;
+    int i;
 
-    CREATE( parts, lyphplate *, 2 );
-    parts[0] = L;
-    parts[1] = NULL;
+    if ( !e->lyphplt || (i = lyphplate_graph_index( g, e->lyphplt )) == -1 )
+      continue;
 
-    if ( e->lyphplt && template_involves_any_of( e->lyphplt, parts ) )
+    if ( LYPH_GRAPH_IS_SET( involved, i ) )
     {
       lyph_wrapper *w;
 
@@ -1615,9 +1591,9 @@ void calc_involves_template( lyphplate *L, lyph_wrapper **head, lyph_wrapper **t
       LINK( w, *head, *tail, next );
       (*cnt)++;
     }
-
-    free( parts );
   }
+
+  free( involved );
 }
 
 HANDLER( do_involves_template )
@@ -1639,8 +1615,6 @@ HANDLER( do_involves_template )
 
   calc_involves_template( L, &head, &tail, &cnt );
 
-  lyphplates_unset_bits( LYPHPLATE_DOES_INVOLVE | LYPHPLATE_DOES_NOT_INVOLVE );
-
   CREATE( buf, lyph *, cnt + 1 );
   bptr = buf;
 
@@ -1695,11 +1669,11 @@ HANDLER( do_nodes_from_view )
   #define LYPHNODE_TO_BE_REMOVED 1
 
   for ( nptr = n; *nptr; nptr++ )
-    SET_BIT( (*nptr)->flags, LYPHNODE_TO_BE_REMOVED );
+    SET_BIT( (*nptr)->flags[worker_slot], LYPHNODE_TO_BE_REMOVED );
 
   for ( nptr = v->nodes, size = 0, fMatch = 0; *nptr; nptr++ )
   {
-    if ( IS_SET( (*nptr)->flags, LYPHNODE_TO_BE_REMOVED ) )
+    if ( IS_SET( (*nptr)->flags[worker_slot], LYPHNODE_TO_BE_REMOVED ) )
       fMatch = 1;
     else
       size++;
@@ -1724,7 +1698,7 @@ HANDLER( do_nodes_from_view )
 
   for ( nptr = v->nodes, cptr = v->coords; *nptr; nptr++ )
   {
-    if ( IS_SET( (*nptr)->flags, LYPHNODE_TO_BE_REMOVED ) )
+    if ( IS_SET( (*nptr)->flags[worker_slot], LYPHNODE_TO_BE_REMOVED ) )
     {
       free( *cptr++ );
       free( *cptr++ );
@@ -1749,19 +1723,18 @@ HANDLER( do_nodes_from_view )
   nodes_from_view_cleanup:
 
   for ( nptr = n; *nptr; nptr++ )
-    REMOVE_BIT( (*nptr)->flags, LYPHNODE_TO_BE_REMOVED );
+    REMOVE_BIT( (*nptr)->flags[worker_slot], LYPHNODE_TO_BE_REMOVED );
 
   free( n );
 
   #undef LYPHNODE_TO_BE_REMOVED
 }
 
-void **get_numbered_args_( url_param **params, char *base, char * (*non_reentrant) (void *), char * (*reentrant) (void *, void *), void *data, char **err, int *size )
+void **get_numbered_args_( url_params *params, char *base, char * (*non_reentrant) (void *), char * (*reentrant) (void *, void *), void *data, char **err, int *size )
 {
-  static void **buf, **vals;
+  static __thread void **buf, **vals;
   void **bptr, **retval;
-  url_param **p;
-  int baselen = strlen( base );
+  char key[MAX_URL_PARAM_LEN + 16];
   int i, cnt;
 
   if ( !buf )
@@ -1769,22 +1742,21 @@ void **get_numbered_args_( url_param **params, char *base, char * (*non_reentran
     CREATE( buf, void *, MAX_URL_PARAMS + 1 );
     CREATE( vals, void *, MAX_URL_PARAMS + 1 );
   }
-  else
-    memset( vals, 0, (MAX_URL_PARAMS+1) * sizeof(void*) );
 
-  for ( p = params; *p; p++ )
+  /*
+   * base1, base2, ... up to the first one missing
+   */
+  for ( i = 1; i < MAX_URL_PARAMS; i++ )
   {
-    if ( str_begins( (*p)->key, base ) )
-    {
-      int n = strtoul( (*p)->key + baselen, NULL, 10 );
-
-      if ( n < 1 || n >= MAX_URL_PARAMS )
-        continue;
+    if ( snprintf( key, sizeof(key), "%s%d", base, i ) >= sizeof(key) )
+      break;
 
-      vals[n] = (*p)->val;
-    }
+    if ( !(vals[i] = get_param( params, key )) )
+      break;
   }
 
+  vals[i] = NULL;
+
   bptr = buf;
 
   if ( non_reentrant || reentrant )
@@ -1826,12 +1798,12 @@ void **get_numbered_args_( url_param **params, char *base, char * (*non_reentran
   return retval;
 }
 
-void **get_numbered_args( url_param **params, char *base, char * (*fnc) (void *), char **err, int *size )
+void **get_numbered_args( url_params *params, char *base, char * (*fnc) (void *), char **err, int *size )
 {
   return get_numbered_args_( params, base, fnc, NULL, NULL, err, size );
 }
 
-void **get_numbered_args_r( url_param **params, char *base, char * (*fnc) (void *, void *), void *data, char **err, int *size )
+void **get_numbered_args_r( url_params *params, char *base, char * (*fnc) (void *, void *), void *data, char **err, int *size )
 {
   return get_numbered_args_( params, base, NULL, fnc, data, err, size );
 }
@@ -1982,6 +1954,7 @@ HANDLER( do_layer_from_template )
 
   free( L->layers );
   L->layers = buf;
+  lyphplate_graph_changed();
 
   L->modified = longtime();
   save_lyphplates();
@@ -2056,6 +2029,7 @@ HANDLER( do_layer_to_template )
 
   free( L->layers );
   L->layers = buf;
+  lyphplate_graph_changed();
 
   L->modified = longtime();
   save_lyphplates();
@@ -2083,7 +2057,7 @@ HANDLER( do_material_to_layer )
   if ( !material )
     HND_ERR( "The indicated material was not recognized" );
 
-  if ( is_X_built_from_Y( material, lyr ) )
+  if ( is_X_built_from_layer( material, lyr ) )
     HND_ERR( "The layer in question already occurs in the construction of the material in question" );
 
   repeatstr = get_param( params, "repeat" );
@@ -2109,6 +2083,7 @@ HANDLER( do_material_to_layer )
 
   free( lyr->material );
   lyr->material = buf;
+  lyphplate_graph_changed();
 
   save_lyphplates();
 
@@ -2162,6 +2137,7 @@ HANDLER( do_material_from_layer )
 
   free( lyr->material );
   lyr->material = buf;
+  lyphplate_graph_changed();
 
   save_lyphplates();
 
@@ -298,7 +298,7 @@ http_request *tmp_http_req( char *cmd )
   conn->req = req;
   conn->sock = -1;
   conn->state = -1;
-  conn->idle = 0;
+  conn->wheel_slot = -1;
 
   CREATE( conn->buf, char, HTTP_INITIAL_INBUF_SIZE + 1 );
   *conn->buf = '\0';
@@ -24,12 +24,49 @@ trie *fmacheck;
 fma *brain;
 fma *seg_of_brain;
 
+/*
+ * The partonomy and class hierarchy don't change once the FMA has been
+ * loaded, so they are also laid out densely: every term gets an index
+ * into fmas, and the terms related to term i by relation r are
+ * edges[r][start[r][i]] through edges[r][start[r][i+1]-1].  Walks over
+ * this mark bitmaps of their own instead of the terms' flags, so any
+ * number of workers can run them at once.
+ */
+#define FMA_PARENTS 0
+#define FMA_CHILDREN 1
+#define FMA_SUPERCLASSES 2
+#define FMA_SUBCLASSES 3
+#define FMA_RELATIONS 4
+
+typedef struct FMA_GRAPH
+{
+  fma **fmas;
+  int cnt;
+  int *start[FMA_RELATIONS];
+  int *edges[FMA_RELATIONS];
+} fma_graph;
+
+/*
+ * Everything above, below, or equal to a term in the partonomy, along
+ * with the niflings leading out of it, in the order they were reached
+ */
+typedef struct FMA_CLOSURE
+{
+  unsigned long *bits;
+  nifling **niflings;
+  int nifcnt;
+  int nifsize;
+} fma_closure;
+
+fma_graph fmagraph;
+
 void parse_fma_file_for_raw_terms( char *file );
 void parse_fma_file_for_parts( char *file );
 char **parse_csv( const char *line, int *cnt );
 void generate_inferred_dotfile( fma **seeds, int skip_lat, int raw_nodes, int tabdelim );
 char *fma_to_json( const fma *f );
 char *fma_to_json_brief( const fma *f );
+int count_fmas( void );
 
 char *label_by_fma( const fma *f )
 {
@@ -149,8 +186,7 @@ void add_raw_fma_term( unsigned long id )
   f->subclasses = (fma**)blank_void_array();
   f->inferred_parts = (fma**)blank_void_array();
   f->inferred_parents = (fma**)blank_void_array();
-  f->flags = 0;
-  f->is_up = 0;
+  f->flags[worker_slot] = 0;
   f->lyph = NULL;
 
   LINK( f, first_fma[hash], last_fma[hash], next );
@@ -207,6 +243,7 @@ void parse_fma_file( void )
 
   parse_fma_file_for_raw_terms( file );
   parse_fma_file_for_parts( file );
+  build_fma_graph();
 
   free( file );
 
@@ -358,6 +395,105 @@ void parse_fma_file_for_parts( char *file )
   }
 }
 
+fma **fma_relation( const fma *f, int rel )
+{
+  switch( rel )
+  {
+    case FMA_PARENTS:
+      return f->parents;
+    case FMA_CHILDREN:
+      return f->children;
+    case FMA_SUPERCLASSES:
+      return f->superclasses;
+    default:
+      return f->subclasses;
+  }
+}
+
+/*
+ * Called once the FMA is loaded (from the text file or the image),
+ * and again by flatten_fmas, which rewrites the parents
+ */
+void build_fma_graph( void )
+{
+  fma_graph *g = &fmagraph;
+  fma *f;
+  int hash, i, rel;
+
+  free( g->fmas );
+
+  for ( rel = 0; rel < FMA_RELATIONS; rel++ )
+    MULTIFREE( g->start[rel], g->edges[rel] );
+
+  g->cnt = count_fmas();
+  CREATE( g->fmas, fma *, g->cnt + 1 );
+  i = 0;
+
+  ITERATE_FMAS
+  (
+    f->index = i;
+    g->fmas[i++] = f;
+  );
+
+  for ( rel = 0; rel < FMA_RELATIONS; rel++ )
+  {
+    int *eptr;
+
+    CREATE( g->start[rel], int, g->cnt + 1 );
+
+    for ( i = 0; i < g->cnt; i++ )
+      g->start[rel][i+1] = g->start[rel][i] + VOIDLEN( fma_relation( g->fmas[i], rel ) );
+
+    CREATE( g->edges[rel], int, g->start[rel][g->cnt] + 1 );
+    eptr = g->edges[rel];
+
+    for ( i = 0; i < g->cnt; i++ )
+    {
+      fma **fs;
+
+      for ( fs = fma_relation( g->fmas[i], rel ); *fs; fs++ )
+        *eptr++ = (*fs)->index;
+    }
+  }
+}
+
+/*
+ * Marks in bits every term reachable from term i by any mix of
+ * the relations in rels (a mask of 1 << FMA_PARENTS and so on)
+ */
+void fma_graph_reach( const fma_graph *g, int i, int rels, unsigned long *bits )
+{
+  int *queue, head = 0, tail = 0;
+
+  CREATE( queue, int, g->cnt + 1 );
+  queue[tail++] = i;
+  LYPH_GRAPH_SET( bits, i );
+
+  while ( head < tail )
+  {
+    int rel, j = queue[head++];
+
+    for ( rel = 0; rel < FMA_RELATIONS; rel++ )
+    {
+      int *e, *end;
+
+      if ( !( rels & (1 << rel) ) )
+        continue;
+
+      for ( e = g->edges[rel] + g->start[rel][j], end = g->edges[rel] + g->start[rel][j+1]; e < end; e++ )
+      {
+        if ( LYPH_GRAPH_IS_SET( bits, *e ) )
+          continue;
+
+        LYPH_GRAPH_SET( bits, *e );
+        queue[tail++] = *e;
+      }
+    }
+  }
+
+  free( queue );
+}
+
 lyph *lyph_by_fma( const fma *f )
 {
   lyph *e;
@@ -523,122 +659,104 @@ char *displayed_niflings_to_json( const displayed_niflings *dn )
   );
 }
 
-void mark_fma_tree_single( fma *f, int bit, fma **head, fma **tail, int offset, int is_up )
+void fma_closure_add( const fma_graph *g, int i, fma_closure *c )
 {
-  f->flags |= bit;
+  fma *f = g->fmas[i];
+  nifling **nptr;
 
-  if ( is_up )
-    f->is_up = 1;
-  else
-    f->is_up = 0;
+  LYPH_GRAPH_SET( c->bits, i );
 
-  if ( !offset )
-    LINK( f, *head, *tail, next_by_x );
-  else
-    LINK( f, *head, *tail, next_by_y );
-}
-
-void mark_fma_tree_upward( fma *f, int bit, fma **head, fma **tail, int offset )
-{
-  fma **parents;
-
-  for ( parents = f->parents; *parents; parents++ )
+  /*
+   * From fma2's side, a nifling leads back to fma2 itself, which is
+   * always in the closure, so only fma1's side is worth keeping
+   */
+  for ( nptr = f->niflings; *nptr; nptr++ )
   {
-    if ( (*parents)->flags & bit )
+    if ( (*nptr)->fma1 != f )
       continue;
 
-    mark_fma_tree_single( *parents, bit, head, tail, offset, 1 );
-    mark_fma_tree_upward( *parents, bit, head, tail, offset );
+    if ( c->nifcnt == c->nifsize )
+    {
+      c->nifsize = c->nifsize ? c->nifsize * 2 : 16;
+
+      if ( !(c->niflings = realloc( c->niflings, c->nifsize * sizeof(nifling *) )) )
+      {
+        fprintf( stderr, "Malloc failure at %s:%d\n", __FILE__, __LINE__ );
+        abort();
+      }
+    }
+
+    c->niflings[c->nifcnt++] = *nptr;
   }
 }
 
-void mark_fma_tree_downward( fma *f, int bit, fma **head, fma **tail, int offset )
+void fma_closure_walk( const fma_graph *g, int i, int rel, fma_closure *c )
 {
-  fma **children;
+  int *e, *end;
 
-  for ( children = f->children; *children; children++ )
+  for ( e = g->edges[rel] + g->start[rel][i], end = g->edges[rel] + g->start[rel][i+1]; e < end; e++ )
   {
-    if ( (*children)->flags & bit )
+    if ( LYPH_GRAPH_IS_SET( c->bits, *e ) )
       continue;
 
-    mark_fma_tree_single( *children, bit, head, tail, offset, 0 );
-    mark_fma_tree_downward( *children, bit, head, tail, offset );
+    fma_closure_add( g, *e, c );
+    fma_closure_walk( g, *e, rel, c );
   }
 }
 
-void mark_fma_tree( fma *f, int bit, fma **head, fma **tail, int offset )
+void compute_fma_closure( const fma_graph *g, fma *f, fma_closure *c )
 {
-  mark_fma_tree_single( f, bit, head, tail, offset, 0 );
-  mark_fma_tree_upward( f, bit, head, tail, offset );
-  mark_fma_tree_downward( f, bit, head, tail, offset );
+  CREATE( c->bits, unsigned long, g->cnt / LYPH_GRAPH_WORD_BITS + 1 );
+  c->niflings = NULL;
+  c->nifcnt = 0;
+  c->nifsize = 0;
+
+  fma_closure_add( g, f->index, c );
+  fma_closure_walk( g, f->index, FMA_PARENTS, c );
+  fma_closure_walk( g, f->index, FMA_CHILDREN, c );
 }
 
-displayed_niflings *compute_niflings_by_fma( fma *x, fma *y )
+displayed_niflings *compute_niflings_by_fma( fma *x, fma *y, const fma_closure *cx, const fma_closure *cy )
 {
   displayed_niflings *dn;
-  fma *xhead = NULL, *xtail = NULL, *yhead = NULL, *ytail = NULL, *f, *f_next;
+  nifling **nptr, **end;
   int finds = 0;
 
-  mark_fma_tree( x, 1, &xhead, &xtail, 0 );
-  mark_fma_tree( y, 2, &yhead, &ytail, 1 );
-
-  for ( f = xhead; f; f = f->next_by_x )  // Iterate over fma's in x's tree but not in y's
+  /*
+   * Niflings from x's tree but not y's, to y's tree but not x's
+   */
+  for ( nptr = cx->niflings, end = nptr + cx->nifcnt; nptr < end; nptr++ )
   {
-    nifling **nptr;
+    nifling *n = *nptr;
 
-    if ( f->flags & 2 )
+    if ( LYPH_GRAPH_IS_SET( cy->bits, n->fma1->index ) )
       continue;
 
-    for ( nptr = f->niflings; *nptr; nptr++ )
-    {
-      nifling *n = *nptr;
-      fma *y_rep;
-
-      if ( n->fma1 == f )
-        y_rep = n->fma2;
-      else
-        y_rep = f;
-
-      if ( (y_rep->flags & 1) || !(y_rep->flags & 2) )  // Find connections in y's tree but not in x's
-        continue;
-
-      if ( !finds )
-      {
-        CREATE( dn, displayed_niflings, 1 );
-        dn->f1 = x;
-        dn->f2 = y;
-        CREATE( dn->niflings, nifling *, 2 );
-        dn->niflings[0] = n;
-        dn->niflings[1] = NULL;
-      }
-      else
-      {
-        nifling **newbuf;
-
-        CREATE( newbuf, nifling *, finds + 2 );
-        memcpy( newbuf, dn->niflings, finds * sizeof(nifling*) );
-        newbuf[finds] = n;
-        newbuf[finds+1] = NULL;
-        free( dn->niflings );
-        dn->niflings = newbuf;
-      }
+    if ( LYPH_GRAPH_IS_SET( cx->bits, n->fma2->index ) || !LYPH_GRAPH_IS_SET( cy->bits, n->fma2->index ) )
+      continue;
 
-      finds++;
+    if ( !finds )
+    {
+      CREATE( dn, displayed_niflings, 1 );
+      dn->f1 = x;
+      dn->f2 = y;
+      CREATE( dn->niflings, nifling *, 2 );
+      dn->niflings[0] = n;
+      dn->niflings[1] = NULL;
+    }
+    else
+    {
+      nifling **newbuf;
+
+      CREATE( newbuf, nifling *, finds + 2 );
+      memcpy( newbuf, dn->niflings, finds * sizeof(nifling*) );
+      newbuf[finds] = n;
+      newbuf[finds+1] = NULL;
+      free( dn->niflings );
+      dn->niflings = newbuf;
     }
-  }
 
-  for ( f = xhead; f; f = f_next )
-  {
-    f_next = f->next_by_x;
-    f->next_by_x = NULL;
-    f->flags = 0;
-  }
-
-  for ( f = yhead; f; f = f_next )
-  {
-    f_next = f->next_by_y;
-    f->next_by_y = NULL;
-    f->flags = 0;
+    finds++;
   }
 
   if ( finds )
@@ -677,7 +795,7 @@ fma **get_fmas_from_fmasstr_and_lyphsstr( char *fmasstr, char *lyphsstr )
     lyphs = (lyph**)blank_void_array();
 
   for ( fs = by_fmas; *fs; fs++ )
-    (*fs)->flags = 1;
+    (*fs)->flags[worker_slot] = 1;
 
   CREATE( by_lyphs, fma *, VOIDLEN( lyphs ) + 1 );
 
@@ -690,11 +808,11 @@ fma **get_fmas_from_fmasstr_and_lyphsstr( char *fmasstr, char *lyphsstr )
 
     f = fma_by_trie( (*lyphsptr)->fma );
 
-    if ( !f || f->flags == 1 )
+    if ( !f || f->flags[worker_slot] == 1 )
       continue;
 
     *by_lyphs_ptr++ = f;
-    f->flags = 1;
+    f->flags[worker_slot] = 1;
   }
 
   *by_lyphs_ptr = NULL;
@@ -712,7 +830,7 @@ fma **get_fmas_from_fmasstr_and_lyphsstr( char *fmasstr, char *lyphsstr )
   free( by_lyphs );
 
   for ( fs = buf; *fs; fs++ )
-    (*fs)->flags = 0;
+    (*fs)->flags[worker_slot] = 0;
 
   return buf;
 }
@@ -721,8 +839,9 @@ HANDLER( do_nifs )
 {
   fma **buf, **bptr1, **bptr2;
   displayed_niflings **dns, **dnsptr;
+  fma_closure *closures;
   char *fmasstr, *lyphsstr;
-  int cnt;
+  int cnt, i;
 
   fmasstr = get_param( params, "fmas" );
   lyphsstr = get_param( params, "lyphs" );
@@ -743,6 +862,11 @@ HANDLER( do_nifs )
     HND_ERR( "The nifs command is restricted to 100 fmas at once" );
   }
 
+  CREATE( closures, fma_closure, cnt + 1 );
+
+  for ( i = 0; i < cnt; i++ )
+    compute_fma_closure( &fmagraph, buf[i], &closures[i] );
+
   CREATE( dns, displayed_niflings *, (cnt * (cnt+1))/2 + 1 );
   dnsptr = dns;
 
@@ -751,7 +875,9 @@ HANDLER( do_nifs )
   {
     displayed_niflings *computed;
 
-    if ( (computed = compute_niflings_by_fma( *bptr1, *bptr2 )) != NULL )
+    computed = compute_niflings_by_fma( *bptr1, *bptr2, &closures[bptr1 - buf], &closures[bptr2 - buf] );
+
+    if ( computed )
       *dnsptr++ = computed;
   }
 
@@ -760,55 +886,47 @@ HANDLER( do_nifs )
   send_response( req, JS_ARRAY( displayed_niflings_to_json, dns ) );
 
   for ( dnsptr = dns; *dnsptr; dnsptr++ )
+  {
+    free( (*dnsptr)->niflings );
     free( *dnsptr );
+  }
+
+  for ( i = 0; i < cnt; i++ )
+  {
+    free( closures[i].bits );
+    free( closures[i].niflings );
+  }
 
+  free( closures );
   free( dns );
+  free( buf );
 }
 
-int is_bdbpart_brain( fma *f )
+/*
+ * Marks the brain and everything that's a part or subclass of it,
+ * or of one of those, and so on
+ */
+unsigned long *brain_parts_bitmap( void )
 {
-  fma **fs;
-
-  if ( f == brain )
-    return 1;
-
-  if ( f->flags & 2 )
-    return 0;
+  unsigned long *bits;
 
-  f->flags |= 2;
-
-  for ( fs = f->parents; *fs; fs++ )
-  {
-    if ( is_bdbpart_brain( *fs ) )
-    {
-      f->flags &= ~2;
-      return 1;
-    }
-  }
-
-  for ( fs = f->superclasses; *fs; fs++ )
-  {
-    if ( is_bdbpart_brain( *fs ) )
-    {
-      f->flags &= ~2;
-      return 1;
-    }
-  }
+  CREATE( bits, unsigned long, fmagraph.cnt / LYPH_GRAPH_WORD_BITS + 1 );
+  fma_graph_reach( &fmagraph, brain->index, (1 << FMA_CHILDREN) | (1 << FMA_SUBCLASSES), bits );
 
-  return 0;
+  return bits;
 }
 
 void dotfile_handle( fma *f, FILE *fp )
 {
   fma **fs;
 
-  f->flags |= 1;
+  f->flags[worker_slot] |= 1;
 
   if ( f != brain )
   {
     for ( fs = f->parents; *fs; fs++ )
     {
-      if ( (*fs)->flags & 1 )
+      if ( (*fs)->flags[worker_slot] & 1 )
         continue;
 
       dotfile_handle( *fs, fp );
@@ -819,22 +937,25 @@ void dotfile_handle( fma *f, FILE *fp )
   {
     fprintf( fp, "    \"%lu\" -> \"%lu\";\n", f->id, (*fs)->id );
 
-    if ( !( (*fs)->flags & 1 ) )
+    if ( !( (*fs)->flags[worker_slot] & 1 ) )
       dotfile_handle( *fs, fp );
   }
 }
 
 fma *common_ancestor( fma **arr )
 {
-  fma *anc, **ptr, *retval;
+  fma *anc, **ptr, *retval = NULL;
+  unsigned long *marks;
+
+  CREATE( marks, unsigned long, fmagraph.cnt / LYPH_GRAPH_WORD_BITS + 1 );
 
   for ( anc = arr[0]->parents[0]; anc; anc = anc->parents[0] )
-    SET_BIT( anc->flags, 2 );
+    LYPH_GRAPH_SET( marks, anc->index );
 
   for ( ptr = arr + 1; *ptr; ptr++ )
   {
     for ( anc = ptr[0]->parents[0]; anc; anc = anc->parents[0] )
-      if ( IS_SET( anc->flags, 2 ) )
+      if ( LYPH_GRAPH_IS_SET( marks, anc->index ) )
         break;
 
     retval = anc;
@@ -843,11 +964,10 @@ fma *common_ancestor( fma **arr )
       break;
 
     for ( anc = ptr[0]->parents[0]; anc != retval; anc = anc->parents[0] )
-      REMOVE_BIT( anc->flags, 2 );
+      LYPH_GRAPH_CLEAR( marks, anc->index );
   }
 
-  for ( anc = arr[0]->parents[0]; anc; anc = anc->parents[0] )
-    REMOVE_BIT( anc->flags, 2 );
+  free( marks );
 
   return retval;  
 }
@@ -856,10 +976,10 @@ void flatten_fma( fma *f )
 {
   fma **p, **buf, *anc;
 
-  if ( IS_SET( f->flags, 1 ) )
+  if ( IS_SET( f->flags[worker_slot], 1 ) )
     return;
 
-  SET_BIT( f->flags, 1 );
+  SET_BIT( f->flags[worker_slot], 1 );
 
   if ( !f->parents[0] || !f->parents[1] )
     return;
@@ -894,10 +1014,12 @@ void flatten_fmas( void )
 
   ITERATE_FMAS( flatten_fma( f ) );
 
-  ITERATE_FMAS( f->flags = 0 );
+  ITERATE_FMAS( f->flags[worker_slot] = 0 );
+
+  build_fma_graph();
 }
 
-void create_fma_lyph( fma *f, int recursive, int brain_only )
+void create_fma_lyph( fma *f, int recursive, const unsigned long *brain_parts )
 {
   fma *parent;
   lyph *e;
@@ -905,14 +1027,14 @@ void create_fma_lyph( fma *f, int recursive, int brain_only )
 
   if ( recursive )
   {
-    if ( IS_SET( f->flags, 1 ) )
+    if ( IS_SET( f->flags[worker_slot], 1 ) )
       return;
 
-    SET_BIT( f->flags, 1 );
+    SET_BIT( f->flags[worker_slot], 1 );
 
     if ( !f->parents[0] )
       parent = NULL;
-    else if ( brain_only && !is_bdbpart_brain( f->parents[0] ) )
+    else if ( brain_parts && !LYPH_GRAPH_IS_SET( brain_parts, f->parents[0]->index ) )
       parent = NULL;
     else
       parent = f->parents[0];
@@ -926,7 +1048,7 @@ void create_fma_lyph( fma *f, int recursive, int brain_only )
    */
   if ( recursive && parent && 0 )
   {
-    create_fma_lyph( parent, 1, brain_only );
+    create_fma_lyph( parent, 1, brain_parts );
     from->location = parent->lyph;
     from->loctype = LOCTYPE_INTERIOR;
     to->location = parent->lyph;
@@ -962,17 +1084,20 @@ void create_fma_lyph( fma *f, int recursive, int brain_only )
 void create_fma_lyphs( int brain_only )
 {
   fma *f;
+  unsigned long *brain_parts = brain_only ? brain_parts_bitmap() : NULL;
   int hash;
 
   ITERATE_FMAS
   (
-    if ( brain_only && !is_bdbpart_brain( f ) )
+    if ( brain_parts && !LYPH_GRAPH_IS_SET( brain_parts, f->index ) )
       continue;
 
-    create_fma_lyph( f, 1, brain_only );
+    create_fma_lyph( f, 1, brain_parts );
   );
 
-  ITERATE_FMAS( f->flags = 0 );
+  ITERATE_FMAS( f->flags[worker_slot] = 0 );
+
+  free( brain_parts );
 }
 
 HANDLER( do_create_fmalyphs )
@@ -993,12 +1118,12 @@ HANDLER( do_create_fmalyphs )
 
 void mark_brain_part( fma *f, fma ***bptr )
 {
-  if ( f->flags == 1 )
+  if ( f->flags[worker_slot] == 1 )
     return;
 
   **bptr = f;
   (*bptr)++;
-  f->flags = 1;
+  f->flags[worker_slot] = 1;
 }
 
 void close_brain_markings_upward( fma **buf, fma ***bptr )
@@ -1011,7 +1136,7 @@ void close_brain_markings_upward( fma **buf, fma ***bptr )
 
     for ( parents = (*ptr)->parents; *parents; parents++ )
     {
-      if ( (*parents)->flags == 1 )
+      if ( (*parents)->flags[worker_slot] == 1 )
         continue;
 
       mark_brain_part( *parents, bptr );
@@ -1019,7 +1144,7 @@ void close_brain_markings_upward( fma **buf, fma ***bptr )
 
     for ( parents = (*ptr)->superclasses; *parents; parents++ )
     {
-      if ( (*parents)->flags == 1 )
+      if ( (*parents)->flags[worker_slot] == 1 )
         continue;
 
       mark_brain_part( *parents, bptr );
@@ -1037,7 +1162,7 @@ void close_brain_markings_downward( fma **buf, fma ***bptr )
 
     for ( children = (*ptr)->children; *children; children++ )
     {
-      if ( (*children)->flags == 1 )
+      if ( (*children)->flags[worker_slot] == 1 )
         continue;
 
       mark_brain_part( *children, bptr );
@@ -1045,7 +1170,7 @@ void close_brain_markings_downward( fma **buf, fma ***bptr )
 
     for ( children = (*ptr)->subclasses; *children; children++ )
     {
-      if ( (*children)->flags == 1 )
+      if ( (*children)->flags[worker_slot] == 1 )
         continue;
 
       mark_brain_part( *children, bptr );
@@ -1092,7 +1217,7 @@ void unmark_brain_stuff( void )
   fma *f;
   int hash;
 
-  ITERATE_FMAS( f->flags = 0 );
+  ITERATE_FMAS( f->flags[worker_slot] = 0 );
 }
 
 void fprintf_dotfile_vertex( fma *f, FILE *fp )
@@ -1136,6 +1261,8 @@ HANDLER( do_dotfile )
   char *seedstr, *file, *lateralized, *tabdelimitedstr, *raw_nodes_str;
   int hash, skip_lat, tabdelimited, raw_nodes;
 
+  REQUIRE_EXCLUSIVE_ACCESS();
+
   seedstr = get_param( params, "seeds" );
   lateralized = get_param( params, "lateralized" );
   tabdelimitedstr = get_param( params, "tabdelimited" );
@@ -1191,7 +1318,7 @@ HANDLER( do_dotfile )
 
   ITERATE_FMAS
   (
-    if ( f->flags != 1 )
+    if ( f->flags[worker_slot] != 1 )
       continue;
 
     fprintf( csv, "%lu,%s\n", f->id, label_by_fma(f) );
@@ -1203,7 +1330,7 @@ HANDLER( do_dotfile )
 
   ITERATE_FMAS
   (
-    if ( f->flags != 1 )
+    if ( f->flags[worker_slot] != 1 )
       continue;
 
     fprintf_dotfile_vertex( f, fp );
@@ -1216,14 +1343,14 @@ HANDLER( do_dotfile )
     fma **ptr;
     char *label;
 
-    if ( f->flags != 1 )
+    if ( f->flags[worker_slot] != 1 )
       continue;
 
     label = label_by_fma( f );
 
     for ( ptr = f->children; *ptr; ptr++ )
     {
-      if ( (*ptr)->flags != 1 )
+      if ( (*ptr)->flags[worker_slot] != 1 )
         continue;
 
       fprintf( fp, "    %s -> ", label );
@@ -1232,7 +1359,7 @@ HANDLER( do_dotfile )
 
     for ( ptr = f->subclasses; *ptr; ptr++ )
     {
-      if ( (*ptr)->flags != 1 )
+      if ( (*ptr)->flags[worker_slot] != 1 )
         continue;
 
       fprintf( fp, "    %s -> ", label );
@@ -1342,7 +1469,7 @@ void compute_inferred_parts( fma **seeds, int skip_lat )
 
   ITERATE_FMAS
   (
-    if ( f->flags != 1 )
+    if ( f->flags[worker_slot] != 1 )
       continue;
 
     if ( !skip_lat && !is_oriented( f, &side ) )
@@ -1385,7 +1512,7 @@ void generate_inferred_dotfile( fma **seeds, int skip_lat, int raw_nodes, int ta
     if ( !*f->inferred_parents
     &&   !*f->inferred_parts )
     {
-      if ( f->flags != 1 )
+      if ( f->flags[worker_slot] != 1 )
         continue;
 
       if ( !skip_lat && !is_oriented( f, NULL ) )
@@ -1489,7 +1616,7 @@ HANDLER( do_import_lateralized_brain )
 
   ITERATE_FMAS
   (
-    if ( f->flags != 1 )
+    if ( f->flags[worker_slot] != 1 )
       continue;
 
     if ( !is_oriented( f, NULL ) && !*f->inferred_parents && !*f->inferred_parts )
@@ -1508,7 +1635,7 @@ HANDLER( do_import_lateralized_brain )
     if ( lyph_by_fma( f ) )
       continue;
 
-    create_fma_lyph( f, 0, 1 );
+    create_fma_lyph( f, 0, NULL );
   );
 
   *bptr = NULL;
@@ -1573,7 +1700,7 @@ lyph *nearest_fmad_parent( lyph *e, int *dist )
   lyph *parent;
   int d = 1;
 
-  for ( parent = get_relative_lyph_loc_buf( e, NULL ); parent; parent = get_relative_lyph_loc_buf( parent, NULL ) )
+  for ( parent = get_lyph_location( e ); parent; parent = get_lyph_location( parent ) )
   {
     if ( parent->fma )
     {
@@ -1588,11 +1715,15 @@ lyph *nearest_fmad_parent( lyph *e, int *dist )
 
 HANDLER( do_fmamap )
 {
-  FILE *fp = fopen( FMAMAP_FILE, "w" );
+  FILE *fp;
   lyph *e, *parent;
   char *txt, *suppress_str;
   int dist, suppress;
 
+  REQUIRE_EXCLUSIVE_ACCESS();
+
+  fp = fopen( FMAMAP_FILE, "w" );
+
   if ( !fp )
     HND_ERR( "Could not open " FMAMAP_FILE " to write" );
 
@@ -1649,11 +1780,20 @@ HANDLER( do_fmamap )
   free( txt );
 }
 
-lyph *lyph_by_fma_scai( const fma *f, char direction, int *dist, lyph ***siblings )
+/*
+ * A term seen before either came up empty or is still being searched
+ * (the hierarchy loops back on itself), so either way it is skipped
+ */
+lyph *lyph_by_fma_scai( const fma *f, char direction, int *dist, lyph ***siblings, unsigned long *seen )
 {
   lyph *e;
   fma **fptr, **list;
 
+  if ( LYPH_GRAPH_IS_SET( seen, f->index ) )
+    return NULL;
+
+  LYPH_GRAPH_SET( seen, f->index );
+
   e = lyph_by_fma( f );
 
   if ( e )
@@ -1663,7 +1803,7 @@ lyph *lyph_by_fma_scai( const fma *f, char direction, int *dist, lyph ***sibling
   {
     for ( fptr = f->parents; *fptr; fptr++ )
     {
-      e = lyph_by_fma_scai( *fptr, direction, dist, siblings );
+      e = lyph_by_fma_scai( *fptr, direction, dist, siblings, seen );
 
       if ( e )
       {
@@ -1679,7 +1819,7 @@ lyph *lyph_by_fma_scai( const fma *f, char direction, int *dist, lyph ***sibling
   {
     for ( fptr = list; *fptr; fptr++ )
     {
-      e = lyph_by_fma_scai( *fptr, direction, dist, siblings );
+      e = lyph_by_fma_scai( *fptr, direction, dist, siblings, seen );
 
       if ( e )
       {
@@ -1725,16 +1865,22 @@ char *fma_to_scaijson( const fma *f, lyph ***bptr )
   lyph *e, **siblings = NULL;
   const char *direction = "down";
   char *retval;
-  int distance = 0;
+  unsigned long *seen;
+  int distance = 0, words = fmagraph.cnt / LYPH_GRAPH_WORD_BITS + 1;
 
-  e = lyph_by_fma_scai( f, direction[0], &distance, &siblings );
+  CREATE( seen, unsigned long, words );
+
+  e = lyph_by_fma_scai( f, direction[0], &distance, &siblings, seen );
 
   if ( !e )
   {
     direction = "up";
-    e = lyph_by_fma_scai( f, direction[0], &distance, &siblings );
+    memset( seen, 0, words * sizeof(unsigned long) );
+    e = lyph_by_fma_scai( f, direction[0], &distance, &siblings, seen );
   }
 
+  free( seen );
+
   if ( e )
   {
     if ( !siblings )
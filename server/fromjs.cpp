@@ -58,7 +58,7 @@ void clinical_index_from_js( clinical_index *ci, Value &v )
 
   ci->index = trie_strdup( v["index"].GetString(), metadata );
   ci->label = trie_strdup( v["label"].GetString(), metadata );
-  ci->flags = 0;
+  ci->flags[worker_slot] = 0;
   ci->pubmeds = (pubmed**)array_from_doc( v, "pubmeds", CST(pubmed_by_id_or_create) );
 
   if ( v.HasMember("claimed") && v["claimed"].IsString() )
@@ -243,6 +243,7 @@ void correlation_from_js( Value &v )
   c->comment = comment;
 
   LINK2( c, first_correlation, last_correlation, next, prev );
+  index_correlation( c );
 }
 
 void bop_from_js( Value &v )
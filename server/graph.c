@@ -0,0 +1,1033 @@
+/*
+ *  graph.c
+ *  A compact copy of the lyph graph for path searches.  The lyphnodes
+ *  are numbered, and the edges out of (and into) each node are kept
+ *  together in one flat array (compressed sparse rows), along with each
+ *  edge's type and template, so that a search walks integers through
+ *  contiguous memory instead of chasing exit_data pointers, and keeps
+ *  track of where it has been in a bitmap of its own.
+ *
+ *  Anything that changes the topology just marks the copy stale (see
+ *  lyph_graph_changed); the next search rebuilds it, once, however many
+ *  changes there were in between.
+ *
+ *  compute_lyphpaths finds the nearest way to each of the goals in one
+ *  sweep; compute_k_lyphpaths finds the k shortest distinct paths, each
+ *  by a search from both ends at once.  The connections command searches
+ *  from each of its lyphs on a thread pool of its own.
+ */
+#include "lyph.h"
+
+lyph_graph *lyph_graph_now;
+int lyph_graph_stale = 1;
+pthread_mutex_t lyph_graph_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+lyph_graph *build_lyph_graph( void );
+void free_lyph_graph( lyph_graph *g );
+int count_graph_lyphnodes( trie *t );
+void populate_graph_lyphnodes( lyphnode ***nptr, trie *t );
+void fill_graph_edges( lyph_graph *g, int incoming, int *start, lyph_edge *edges );
+int search_lyph_route( lyph_search *s, lyph_route *r );
+void expand_lyph_search( lyph_search *s, int backward, int *head, int *tail, int *best, int *meet );
+int lyph_search_can_use( lyph_search *s, lyph_edge *edge );
+int routes_agree( lyph_route *x, lyph_route *y, int len );
+int route_listed( lyph_route *r, lyph_route *list, int cnt );
+void alloc_lyph_route( lyph_route *r, int len );
+void free_lyph_route( lyph_route *r );
+void init_lyph_search( lyph_search *s, lyph_graph *g, lyph_filter *filter, int dont_see_initials, int include_reverses, int include_nif );
+void set_lyph_search_ends( lyph_search *s, int *from, int from_cnt, int *to, int to_cnt );
+int *lyphnode_wrappers_to_graph( lyph_graph *g, lyphnode_wrapper *head, int *cnt );
+lyph ***k_shortest_lyphpaths( lyph_search *s, int numpaths );
+void free_lyph_search( lyph_search *s );
+void *lyph_connections_thread( void *arg );
+lyph ****nearest_lyph_connections( lyph_connections *c, lyph_search *s, int *per, int i );
+lyph ****k_shortest_lyph_connections( lyph_connections *c, lyph_search *s, int i );
+
+/*
+ * Called (with exclusive access) whenever lyphs are connected differently,
+ * or change in type or template
+ */
+void lyph_graph_changed( void )
+{
+  lyph_graph_stale = 1;
+}
+
+/*
+ * The graph as it stands.  Only writers (who have exclusive access) mark
+ * it stale, so while readers are about, whichever comes first rebuilds it
+ * and nobody can still be using the old one.
+ */
+lyph_graph *current_lyph_graph( void )
+{
+  if ( lyph_graph_stale )
+  {
+    pthread_mutex_lock( &lyph_graph_mutex );
+
+    if ( lyph_graph_stale )
+    {
+      lyph_graph *g = build_lyph_graph();
+
+      if ( lyph_graph_now )
+        free_lyph_graph( lyph_graph_now );
+
+      lyph_graph_now = g;
+      __sync_synchronize();
+      lyph_graph_stale = 0;
+    }
+
+    pthread_mutex_unlock( &lyph_graph_mutex );
+  }
+
+  return lyph_graph_now;
+}
+
+/*
+ * A node's number in g, or -1 if it was made since g was built (in which
+ * case it has no edges yet)
+ */
+int lyph_graph_index( lyph_graph *g, lyphnode *n )
+{
+  if ( n->graph_index < g->node_cnt && g->nodes[n->graph_index] == n )
+    return n->graph_index;
+
+  return -1;
+}
+
+lyph_graph *build_lyph_graph( void )
+{
+  lyph_graph *g;
+  lyphnode **nptr;
+  int i;
+
+  CREATE( g, lyph_graph, 1 );
+
+  g->node_cnt = count_graph_lyphnodes( lyphnode_ids );
+  CREATE( g->nodes, lyphnode *, g->node_cnt + 1 );
+  nptr = g->nodes;
+  populate_graph_lyphnodes( &nptr, lyphnode_ids );
+
+  for ( i = 0; i < g->node_cnt; i++ )
+    g->nodes[i]->graph_index = i;
+
+  CREATE( g->out_start, int, g->node_cnt + 1 );
+  CREATE( g->in_start, int, g->node_cnt + 1 );
+
+  for ( i = 0; i < g->node_cnt; i++ )
+  {
+    g->out_start[i+1] = g->out_start[i] + ( g->nodes[i]->exits ? VOIDLEN( g->nodes[i]->exits ) : 0 );
+    g->in_start[i+1] = g->in_start[i] + ( g->nodes[i]->incoming ? VOIDLEN( g->nodes[i]->incoming ) : 0 );
+  }
+
+  g->edge_cnt = g->out_start[g->node_cnt];
+
+  CREATE( g->out, lyph_edge, g->out_start[g->node_cnt] + 1 );
+  CREATE( g->in, lyph_edge, g->in_start[g->node_cnt] + 1 );
+
+  fill_graph_edges( g, 0, g->out_start, g->out );
+  fill_graph_edges( g, 1, g->in_start, g->in );
+
+  return g;
+}
+
+/*
+ * Copy each node's exits (or incoming edges) into its row, in order.  The
+ * rows were sized for every edge, so if any edge leads somewhere not in
+ * the graph, the remainder of its row is marked unused with to = -1.
+ * Incoming edges take their ids from the exits, which are copied first.
+ */
+void fill_graph_edges( lyph_graph *g, int incoming, int *start, lyph_edge *edges )
+{
+  int i;
+
+  for ( i = 0; i < g->node_cnt; i++ )
+  {
+    exit_data **x = incoming ? g->nodes[i]->incoming : g->nodes[i]->exits;
+    lyph_edge *edge = &edges[start[i]];
+
+    for ( ; x && *x; x++ )
+    {
+      int to = lyph_graph_index( g, (*x)->to );
+
+      if ( to == -1 )
+        continue;
+
+      edge->to = to;
+
+      if ( incoming )
+      {
+        lyph_edge *exit = &g->out[g->out_start[to]], *end = &g->out[g->out_start[to+1]];
+
+        while ( exit < end && exit->via != (*x)->via )
+          exit++;
+
+        if ( exit == end )
+          continue;
+
+        edge->id = exit - g->out;
+      }
+      else
+        edge->id = edge - g->out;
+
+      edge->type = (*x)->via->type;
+      edge->via = (*x)->via;
+      edge->lyphplt = (*x)->via->lyphplt;
+      edge++;
+    }
+
+    for ( ; edge < &edges[start[i+1]]; edge++ )
+      edge->to = -1;
+  }
+}
+
+void free_lyph_graph( lyph_graph *g )
+{
+  MULTIFREE( g->nodes, g->out_start, g->in_start, g->out, g->in, g );
+}
+
+int count_graph_lyphnodes( trie *t )
+{
+  int cnt = t->data ? 1 : 0;
+
+  TRIE_RECURSE( cnt += count_graph_lyphnodes( *child ) );
+
+  return cnt;
+}
+
+void populate_graph_lyphnodes( lyphnode ***nptr, trie *t )
+{
+  if ( t->data )
+  {
+    **nptr = (lyphnode *) t->data;
+    (*nptr)++;
+  }
+
+  TRIE_RECURSE( populate_graph_lyphnodes( nptr, *child ) );
+}
+
+/*
+ * Breadth-first search from the from-nodes, collecting up to numpaths
+ * paths (as NULL-terminated lists of lyphs) to the to-nodes.  Goals are
+ * not searched past, and each other node is only reached once.
+ */
+lyph ***compute_lyphpaths( lyphnode_wrapper *from_head, lyphnode_wrapper *to_head, lyph_filter *filter, int numpaths, int dont_see_initials, int include_reverses, int include_nif )
+{
+  lyph_graph *g = current_lyph_graph();
+  lyphnode_wrapper *w;
+  lyphstep *queue;
+  unsigned long *seen, *goal;
+  lyph ***paths, ***pathsptr;
+  int words = g->node_cnt / LYPH_GRAPH_WORD_BITS + 1;
+  int qlen = 0, curr, initials = 0, pathcnt = 0;
+
+  CREATE( paths, lyph **, numpaths + 1 );
+  pathsptr = paths;
+
+  CREATE( seen, unsigned long, words );
+  CREATE( goal, unsigned long, words );
+
+  for ( w = to_head; w; w = w->next )
+  {
+    int n = lyph_graph_index( g, w->n );
+
+    if ( n != -1 )
+      LYPH_GRAPH_SET( goal, n );
+  }
+
+  for ( w = from_head; w; w = w->next )
+    initials++;
+
+  CREATE( queue, lyphstep, g->node_cnt + initials + 1 );
+
+  for ( w = from_head; w; w = w->next )
+  {
+    int n = lyph_graph_index( g, w->n );
+
+    if ( n == -1 )
+      continue;
+
+    queue[qlen].node = n;
+    queue[qlen].back = -1;
+    queue[qlen].depth = 0;
+    queue[qlen].via = NULL;
+    qlen++;
+
+    if ( !dont_see_initials )
+      LYPH_GRAPH_SET( seen, n );
+  }
+
+  for ( curr = 0; curr < qlen; curr++ )
+  {
+    lyphstep *step = &queue[curr];
+    int reversed;
+
+    if ( LYPH_GRAPH_IS_SET( goal, step->node ) && step->depth )
+    {
+      lyph **path, **pptr;
+      int back;
+
+      CREATE( path, lyph *, step->depth + 1 );
+      pptr = &path[step->depth-1];
+      path[step->depth] = NULL;
+
+      for ( back = curr; queue[back].back != -1; back = queue[back].back )
+        *pptr-- = queue[back].via;
+
+      *pathsptr++ = path;
+
+      if ( ++pathcnt == numpaths )
+        break;
+
+      continue;
+    }
+
+    /*
+     * First traverse the node's exits, then (maybe) its incoming edges
+     */
+    for ( reversed = 0; reversed <= ( include_reverses ? 1 : 0 ); reversed++ )
+    {
+      lyph_edge *edge = reversed ? &g->in[g->in_start[step->node]] : &g->out[g->out_start[step->node]];
+      lyph_edge *end = reversed ? &g->in[g->in_start[step->node+1]] : &g->out[g->out_start[step->node+1]];
+
+      for ( ; edge < end; edge++ )
+      {
+        if ( edge->to == -1 || LYPH_GRAPH_IS_SET( seen, edge->to ) )
+          continue;
+
+        if ( edge->type == LYPH_NIF && !include_nif )
+          continue;
+
+        if ( filter && !lyph_passes_filter( edge->via, filter ) )
+          continue;
+
+        queue[qlen].node = edge->to;
+        queue[qlen].back = curr;
+        queue[qlen].depth = step->depth + 1;
+        queue[qlen].via = edge->via;
+        qlen++;
+
+        LYPH_GRAPH_SET( seen, edge->to );
+      }
+    }
+  }
+
+  *pathsptr = NULL;
+
+  MULTIFREE( queue, seen, goal );
+
+  return paths;
+}
+
+/*
+ * Up to numpaths shortest simple paths (fewest lyphs first) from the
+ * from-nodes to the to-nodes, by Yen's algorithm: each path after the
+ * first is the shortest of the detours off the paths found so far, a
+ * detour following one of them to some node and then taking the shortest
+ * way on from there which avoids the nodes before it, and the lyphs which
+ * paths already found with the same beginning take out of it.  (Starting
+ * from a different from-node counts as a detour at the very start.)  As
+ * with compute_lyphpaths, to-nodes end the paths reaching them, and unless
+ * dont_see_initials, paths do not run through from-nodes; if they may, a
+ * path may also end where it started, if that is a to-node.
+ */
+lyph ***compute_k_lyphpaths( lyphnode_wrapper *from_head, lyphnode_wrapper *to_head, lyph_filter *filter, int numpaths, int dont_see_initials, int include_reverses, int include_nif )
+{
+  lyph_search s;
+  lyph ***paths;
+  int *from, *to, from_cnt, to_cnt;
+
+  init_lyph_search( &s, current_lyph_graph(), filter, dont_see_initials, include_reverses, include_nif );
+
+  from = lyphnode_wrappers_to_graph( s.g, from_head, &from_cnt );
+  to = lyphnode_wrappers_to_graph( s.g, to_head, &to_cnt );
+  set_lyph_search_ends( &s, from, from_cnt, to, to_cnt );
+
+  paths = k_shortest_lyphpaths( &s, numpaths );
+
+  MULTIFREE( from, to );
+  free_lyph_search( &s );
+
+  return paths;
+}
+
+/*
+ * The numpaths shortest paths between the ends s was last given
+ */
+lyph ***k_shortest_lyphpaths( lyph_search *s, int numpaths )
+{
+  lyph_route *found, *cands;
+  lyph ***paths;
+  int found_cnt = 0, cand_cnt = 0, cand_size = 16, i, j;
+
+  CREATE( found, lyph_route, numpaths );
+  CREATE( cands, lyph_route, cand_size );
+
+  memcpy( s->starts, s->sources, s->source_cnt * sizeof(int) );
+  s->start_cnt = s->source_cnt;
+
+  if ( search_lyph_route( s, &found[0] ) )
+    found_cnt = 1;
+
+  while ( found_cnt && found_cnt < numpaths )
+  {
+    lyph_route *prev = &found[found_cnt-1];
+    int best;
+
+    for ( i = -1; i < prev->len; i++ )
+    {
+      lyph_route spur, detour;
+
+      if ( i == -1 )
+      {
+        for ( s->start_cnt = 0, j = 0; j < s->source_cnt; j++ )
+        {
+          lyph_route *r;
+
+          for ( r = found; r < &found[found_cnt]; r++ )
+            if ( r->nodes[0] == s->sources[j] )
+              break;
+
+          if ( r == &found[found_cnt] )
+            s->starts[s->start_cnt++] = s->sources[j];
+        }
+      }
+      else
+      {
+        s->starts[0] = prev->nodes[i];
+        s->start_cnt = 1;
+        s->cycle_node = s->dont_see_initials ? prev->nodes[0] : -1;
+
+        for ( j = 0; j < i; j++ )
+          LYPH_GRAPH_SET( s->banned_node, prev->nodes[j] );
+
+        for ( j = 0; j < found_cnt; j++ )
+          if ( found[j].len > i && routes_agree( &found[j], prev, i ) )
+            LYPH_GRAPH_SET( s->banned_edge, found[j].ids[i] );
+      }
+
+      if ( s->start_cnt && search_lyph_route( s, &spur ) )
+      {
+        int root = i == -1 ? 0 : i;
+
+        alloc_lyph_route( &detour, root + spur.len );
+        memcpy( detour.nodes, prev->nodes, root * sizeof(int) );
+        memcpy( detour.ids, prev->ids, root * sizeof(int) );
+        memcpy( detour.via, prev->via, root * sizeof(lyph *) );
+        memcpy( &detour.nodes[root], spur.nodes, (spur.len + 1) * sizeof(int) );
+        memcpy( &detour.ids[root], spur.ids, spur.len * sizeof(int) );
+        memcpy( &detour.via[root], spur.via, spur.len * sizeof(lyph *) );
+        free_lyph_route( &spur );
+
+        if ( route_listed( &detour, found, found_cnt ) || route_listed( &detour, cands, cand_cnt ) )
+          free_lyph_route( &detour );
+        else
+        {
+          if ( cand_cnt == cand_size )
+          {
+            lyph_route *tmp;
+
+            CREATE( tmp, lyph_route, cand_size * 2 );
+            memcpy( tmp, cands, cand_cnt * sizeof(lyph_route) );
+            free( cands );
+            cands = tmp;
+            cand_size *= 2;
+          }
+
+          cands[cand_cnt++] = detour;
+        }
+      }
+
+      if ( i != -1 )
+      {
+        for ( j = 0; j < i; j++ )
+          LYPH_GRAPH_CLEAR( s->banned_node, prev->nodes[j] );
+
+        for ( j = 0; j < found_cnt; j++ )
+          if ( found[j].len > i && routes_agree( &found[j], prev, i ) )
+            LYPH_GRAPH_CLEAR( s->banned_edge, found[j].ids[i] );
+      }
+    }
+
+    if ( !cand_cnt )
+      break;
+
+    for ( best = 0, j = 1; j < cand_cnt; j++ )
+      if ( cands[j].len < cands[best].len )
+        best = j;
+
+    found[found_cnt++] = cands[best];
+    memmove( &cands[best], &cands[best+1], (cand_cnt - best - 1) * sizeof(lyph_route) );
+    cand_cnt--;
+  }
+
+  CREATE( paths, lyph **, found_cnt + 1 );
+
+  for ( j = 0; j < found_cnt; j++ )
+  {
+    CREATE( paths[j], lyph *, found[j].len + 1 );
+    memcpy( paths[j], found[j].via, found[j].len * sizeof(lyph *) );
+    free_lyph_route( &found[j] );
+  }
+
+  for ( j = 0; j < cand_cnt; j++ )
+    free_lyph_route( &cands[j] );
+
+  MULTIFREE( found, cands );
+
+  return paths;
+}
+
+/*
+ * The shortest path from any of s->starts to any of s->goals, searching
+ * forward from the one and backward from the other, a level at a time,
+ * from whichever side has fewer nodes waiting.  The first level in which
+ * the two searches meet yields a shortest path.
+ */
+int search_lyph_route( lyph_search *s, lyph_route *r )
+{
+  int fhead = 0, ftail = 0, bhead = 0, btail = 0;
+  int best = -1, meet[3], pos, i;
+
+  s->gen++;
+
+  for ( i = 0; i < s->start_cnt; i++ )
+  {
+    int n = s->starts[i];
+
+    s->fmark[n] = s->gen;
+    s->fdist[n] = 0;
+    s->fnode[n] = -1;
+    s->fq[ftail++] = n;
+  }
+
+  for ( i = 0; i < s->goal_cnt; i++ )
+  {
+    int n = s->goals[i];
+
+    if ( LYPH_GRAPH_IS_SET( s->banned_node, n ) && n != s->cycle_node )
+      continue;
+
+    if ( !s->dont_see_initials && LYPH_GRAPH_IS_SET( s->is_source, n ) )
+      continue;
+
+    s->bmark[n] = s->gen;
+    s->bdist[n] = 0;
+    s->bnode[n] = -1;
+    s->bq[btail++] = n;
+  }
+
+  while ( best == -1 && fhead < ftail && bhead < btail )
+  {
+    if ( ftail - fhead <= btail - bhead )
+      expand_lyph_search( s, 0, &fhead, &ftail, &best, meet );
+    else
+      expand_lyph_search( s, 1, &bhead, &btail, &best, meet );
+  }
+
+  if ( best == -1 )
+    return 0;
+
+  alloc_lyph_route( r, best );
+
+  pos = s->fdist[meet[0]];
+  r->nodes[pos] = meet[0];
+  r->ids[pos] = meet[2];
+  r->nodes[pos+1] = meet[1];
+
+  for ( i = meet[0]; s->fnode[i] != -1; i = s->fnode[i] )
+  {
+    pos--;
+    r->nodes[pos] = s->fnode[i];
+    r->ids[pos] = s->fedge[i];
+  }
+
+  for ( pos = s->fdist[meet[0]] + 1, i = meet[1]; s->bnode[i] != -1; i = s->bnode[i], pos++ )
+  {
+    r->ids[pos] = s->bedge[i];
+    r->nodes[pos+1] = s->bnode[i];
+  }
+
+  for ( i = 0; i < r->len; i++ )
+    r->via[i] = s->g->out[r->ids[i]].via;
+
+  return 1;
+}
+
+/*
+ * Take one level of the forward (or backward) half of a search.  Where it
+ * reaches a node the other half has reached, note the meeting (in meet:
+ * the node on the forward side, the node on the backward side, and the
+ * edge between) if the path through it is the shortest yet.
+ */
+void expand_lyph_search( lyph_search *s, int backward, int *head, int *tail, int *best, int *meet )
+{
+  lyph_graph *g = s->g;
+  int *mark = backward ? s->bmark : s->fmark;
+  int *dist = backward ? s->bdist : s->fdist;
+  int *prev = backward ? s->bnode : s->fnode;
+  int *prev_edge = backward ? s->bedge : s->fedge;
+  int *q = backward ? s->bq : s->fq;
+  int *other_mark = backward ? s->fmark : s->bmark;
+  int *other_dist = backward ? s->fdist : s->bdist;
+  int end = *tail;
+
+  for ( ; *head < end; (*head)++ )
+  {
+    int u = q[*head], reversed;
+
+    /*
+     * Forward, an edge leads from u along its exits (and maybe back along
+     * its incoming edges); backward, the other way round
+     */
+    for ( reversed = 0; reversed <= ( s->include_reverses ? 1 : 0 ); reversed++ )
+    {
+      int incoming = ( reversed != backward );
+      lyph_edge *edge = incoming ? &g->in[g->in_start[u]] : &g->out[g->out_start[u]];
+      lyph_edge *stop = incoming ? &g->in[g->in_start[u+1]] : &g->out[g->out_start[u+1]];
+
+      for ( ; edge < stop; edge++ )
+      {
+        int v = edge->to;
+
+        if ( v == -1 || !lyph_search_can_use( s, edge ) )
+          continue;
+
+        /*
+         * A node this half has reached is passed over, unless it is both
+         * a start and an end (so neither half set out to reach it)
+         */
+        if ( mark[v] == s->gen && ( other_mark[v] != s->gen || dist[v] || other_dist[v] ) )
+          continue;
+
+        if ( other_mark[v] == s->gen )
+        {
+          int len = dist[u] + 1 + other_dist[v];
+
+          if ( *best == -1 || len < *best )
+          {
+            *best = len;
+            meet[0] = backward ? v : u;
+            meet[1] = backward ? u : v;
+            meet[2] = edge->id;
+          }
+
+          continue;
+        }
+
+        if ( LYPH_GRAPH_IS_SET( s->banned_node, v ) || LYPH_GRAPH_IS_SET( s->is_goal, v ) )
+          continue;
+
+        if ( !s->dont_see_initials && LYPH_GRAPH_IS_SET( s->is_source, v ) )
+          continue;
+
+        mark[v] = s->gen;
+        dist[v] = dist[u] + 1;
+        prev[v] = u;
+        prev_edge[v] = edge->id;
+        q[(*tail)++] = v;
+      }
+    }
+  }
+}
+
+int lyph_search_can_use( lyph_search *s, lyph_edge *edge )
+{
+  if ( LYPH_GRAPH_IS_SET( s->banned_edge, edge->id ) )
+    return 0;
+
+  if ( edge->type == LYPH_NIF && !s->include_nif )
+    return 0;
+
+  if ( s->filter && !lyph_passes_filter( edge->via, s->filter ) )
+    return 0;
+
+  return 1;
+}
+
+/*
+ * Whether two routes start at the same node and take the same first len
+ * lyphs
+ */
+int routes_agree( lyph_route *x, lyph_route *y, int len )
+{
+  return x->nodes[0] == y->nodes[0] && !memcmp( x->ids, y->ids, len * sizeof(int) );
+}
+
+int route_listed( lyph_route *r, lyph_route *list, int cnt )
+{
+  int i;
+
+  for ( i = 0; i < cnt; i++ )
+    if ( list[i].len == r->len && routes_agree( &list[i], r, r->len ) )
+      return 1;
+
+  return 0;
+}
+
+void alloc_lyph_route( lyph_route *r, int len )
+{
+  r->len = len;
+  CREATE( r->nodes, int, len + 1 );
+  CREATE( r->ids, int, len + 1 );
+  CREATE( r->via, lyph *, len + 1 );
+}
+
+void free_lyph_route( lyph_route *r )
+{
+  MULTIFREE( r->nodes, r->ids, r->via );
+}
+
+void init_lyph_search( lyph_search *s, lyph_graph *g, lyph_filter *filter, int dont_see_initials, int include_reverses, int include_nif )
+{
+  int words = g->node_cnt / LYPH_GRAPH_WORD_BITS + 1;
+
+  memset( s, 0, sizeof(lyph_search) );
+
+  s->g = g;
+  s->filter = filter;
+  s->dont_see_initials = dont_see_initials;
+  s->include_reverses = include_reverses;
+  s->include_nif = include_nif;
+  s->cycle_node = -1;
+
+  CREATE( s->is_source, unsigned long, words );
+  CREATE( s->is_goal, unsigned long, words );
+  CREATE( s->banned_node, unsigned long, words );
+  CREATE( s->banned_edge, unsigned long, g->edge_cnt / LYPH_GRAPH_WORD_BITS + 1 );
+
+  CREATE( s->fmark, int, g->node_cnt + 1 );
+  CREATE( s->bmark, int, g->node_cnt + 1 );
+  CREATE( s->fdist, int, g->node_cnt + 1 );
+  CREATE( s->bdist, int, g->node_cnt + 1 );
+  CREATE( s->fnode, int, g->node_cnt + 1 );
+  CREATE( s->bnode, int, g->node_cnt + 1 );
+  CREATE( s->fedge, int, g->node_cnt + 1 );
+  CREATE( s->bedge, int, g->node_cnt + 1 );
+  CREATE( s->fq, int, g->node_cnt + 1 );
+  CREATE( s->bq, int, g->node_cnt + 1 );
+}
+
+/*
+ * Search from the given nodes to the given nodes (by their numbers in
+ * s->g, duplicates allowed) from now on
+ */
+void set_lyph_search_ends( lyph_search *s, int *from, int from_cnt, int *to, int to_cnt )
+{
+  int i;
+
+  for ( i = 0; i < s->source_cnt; i++ )
+    LYPH_GRAPH_CLEAR( s->is_source, s->sources[i] );
+
+  for ( i = 0; i < s->goal_cnt; i++ )
+    LYPH_GRAPH_CLEAR( s->is_goal, s->goals[i] );
+
+  if ( s->sources )
+    MULTIFREE( s->sources, s->starts, s->goals );
+
+  CREATE( s->sources, int, from_cnt + 1 );
+  CREATE( s->starts, int, from_cnt + 1 );
+  CREATE( s->goals, int, to_cnt + 1 );
+  s->source_cnt = 0;
+  s->goal_cnt = 0;
+
+  for ( i = 0; i < from_cnt; i++ )
+  {
+    if ( !LYPH_GRAPH_IS_SET( s->is_source, from[i] ) )
+    {
+      LYPH_GRAPH_SET( s->is_source, from[i] );
+      s->sources[s->source_cnt++] = from[i];
+    }
+  }
+
+  for ( i = 0; i < to_cnt; i++ )
+  {
+    if ( !LYPH_GRAPH_IS_SET( s->is_goal, to[i] ) )
+    {
+      LYPH_GRAPH_SET( s->is_goal, to[i] );
+      s->goals[s->goal_cnt++] = to[i];
+    }
+  }
+}
+
+/*
+ * The numbers in g of the nodes in a list (leaving out any made since g
+ * was built)
+ */
+int *lyphnode_wrappers_to_graph( lyph_graph *g, lyphnode_wrapper *head, int *cnt )
+{
+  lyphnode_wrapper *w;
+  int *buf;
+
+  for ( *cnt = 0, w = head; w; w = w->next )
+    (*cnt)++;
+
+  CREATE( buf, int, *cnt + 1 );
+
+  for ( *cnt = 0, w = head; w; w = w->next )
+    if ( (buf[*cnt] = lyph_graph_index( g, w->n )) != -1 )
+      (*cnt)++;
+
+  return buf;
+}
+
+void free_lyph_search( lyph_search *s )
+{
+  if ( s->sources )
+    MULTIFREE( s->sources, s->starts, s->goals );
+
+  MULTIFREE( s->is_source, s->is_goal, s->banned_node, s->banned_edge );
+  MULTIFREE( s->fmark, s->bmark, s->fdist, s->bdist, s->fnode, s->bnode, s->fedge, s->bedge, s->fq, s->bq );
+}
+
+/*
+ * Find the connections from each of c's lyphs, on as many threads as
+ * there are cores (within reason).  The caller (who keeps its hold on the
+ * database all the while) picks up each lyph's paths with
+ * wait_lyph_connections, in order, as they come in.
+ */
+void start_lyph_connections( lyph_connections *c )
+{
+  int threads = sysconf( _SC_NPROCESSORS_ONLN ), i;
+
+  if ( threads < 1 )
+    threads = 1;
+  else if ( threads > MAX_CONNECTIONS_THREADS )
+    threads = MAX_CONNECTIONS_THREADS;
+
+  if ( threads > c->cnt )
+    threads = c->cnt;
+
+  CREATE( c->results, lyph ****, c->cnt + 1 );
+  CREATE( c->done, int, c->cnt + 1 );
+  CREATE( c->thread, pthread_t, threads + 1 );
+  c->next = 0;
+  c->threads = 0;
+  pthread_mutex_init( &c->mutex, NULL );
+  pthread_cond_init( &c->cond, NULL );
+
+  for ( i = 0; i < threads; i++ )
+  {
+    if ( pthread_create( &c->thread[c->threads], NULL, lyph_connections_thread, c ) )
+    {
+      log_string( "Could not start a connections thread" );
+      break;
+    }
+
+    c->threads++;
+  }
+
+  /*
+   * Do without, if need be
+   */
+  if ( !c->threads )
+    lyph_connections_thread( c );
+}
+
+lyph ****wait_lyph_connections( lyph_connections *c, int i )
+{
+  pthread_mutex_lock( &c->mutex );
+
+  while ( !c->done[i] )
+    pthread_cond_wait( &c->cond, &c->mutex );
+
+  pthread_mutex_unlock( &c->mutex );
+
+  return c->results[i];
+}
+
+void finish_lyph_connections( lyph_connections *c )
+{
+  int i;
+
+  for ( i = 0; i < c->threads; i++ )
+    pthread_join( c->thread[i], NULL );
+
+  pthread_mutex_destroy( &c->mutex );
+  pthread_cond_destroy( &c->cond );
+
+  MULTIFREE( c->results, c->done, c->thread );
+}
+
+/*
+ * Each thread takes the next lyph nobody has taken yet, until there are
+ * none left, keeping its search state from one to the next
+ */
+void *lyph_connections_thread( void *arg )
+{
+  lyph_connections *c = (lyph_connections *) arg;
+  lyph_search s;
+  int *per;
+
+  init_lyph_search( &s, c->g, NULL, 1, 0, c->include_nif );
+  CREATE( per, int, c->cnt + 1 );
+
+  for ( ; ; )
+  {
+    lyph ****row;
+    int i;
+
+    pthread_mutex_lock( &c->mutex );
+    i = c->next++;
+    pthread_mutex_unlock( &c->mutex );
+
+    if ( i >= c->cnt )
+      break;
+
+    if ( c->numpaths )
+      row = k_shortest_lyph_connections( c, &s, i );
+    else
+      row = nearest_lyph_connections( c, &s, per, i );
+
+    pthread_mutex_lock( &c->mutex );
+    c->results[i] = row;
+    c->done[i] = 1;
+    pthread_cond_broadcast( &c->cond );
+    pthread_mutex_unlock( &c->mutex );
+  }
+
+  free( per );
+  free_lyph_search( &s );
+
+  return NULL;
+}
+
+/*
+ * One breadth-first search from the nodes in the ith lyph serves for all
+ * the lyphs: each node in another lyph is reached by a shortest path, in
+ * the order the search reaches them (up to MAX_CONNECTIONS_PATHS of them
+ * per lyph), unless that path has already passed through the same lyph.
+ * The lyph's own nodes are where the search starts, so one is counted as
+ * reached (the first time an edge leads back to it) for the lyph itself.
+ */
+lyph ****nearest_lyph_connections( lyph_connections *c, lyph_search *s, int *per, int i )
+{
+  lyph_graph *g = c->g;
+  lyph ****row;
+  int *hit_to, *hit_last, *hit_edge;
+  int src = c->canon[i], head = 0, tail = 0, hits = 0, max_hits, n, k;
+
+  CREATE( row, lyph ***, c->cnt + 1 );
+
+  max_hits = c->node_start[c->cnt] + c->node_start[src+1] - c->node_start[src] + 1;
+  CREATE( hit_to, int, max_hits );
+  CREATE( hit_last, int, max_hits );
+  CREATE( hit_edge, int, max_hits );
+  memset( per, 0, c->cnt * sizeof(int) );
+
+  s->gen++;
+
+  for ( k = c->node_start[src]; k < c->node_start[src+1]; k++ )
+  {
+    n = c->nodes[k];
+    s->fmark[n] = s->gen;
+    s->fdist[n] = 0;
+    s->fnode[n] = -1;
+    s->fq[tail++] = n;
+  }
+
+  while ( head < tail )
+  {
+    int u = s->fq[head++];
+    lyph_edge *edge = &g->out[g->out_start[u]], *stop = &g->out[g->out_start[u+1]];
+
+    for ( ; edge < stop; edge++ )
+    {
+      int v = edge->to, t;
+
+      if ( v == -1 || !lyph_search_can_use( s, edge ) )
+        continue;
+
+      if ( s->fmark[v] == s->gen )
+      {
+        if ( s->fdist[v] || s->bmark[v] == s->gen )
+          continue;
+
+        s->bmark[v] = s->gen;
+        t = src;
+      }
+      else
+      {
+        s->fmark[v] = s->gen;
+        s->fdist[v] = s->fdist[u] + 1;
+        s->fnode[v] = u;
+        s->fedge[v] = edge->id;
+        s->fq[tail++] = v;
+
+        if ( (t = c->owner[v]) == -1 )
+          continue;
+
+        for ( n = u; s->fnode[n] != -1; n = s->fnode[n] )
+          if ( c->owner[n] == t )
+            break;
+
+        if ( s->fnode[n] != -1 )
+          continue;
+      }
+
+      if ( per[t] == MAX_CONNECTIONS_PATHS )
+        continue;
+
+      per[t]++;
+      hit_to[hits] = t;
+      hit_last[hits] = u;
+      hit_edge[hits] = edge->id;
+      hits++;
+    }
+  }
+
+  for ( k = 0; k < c->cnt; k++ )
+  {
+    if ( per[k] )
+    {
+      CREATE( row[k], lyph **, per[k] + 1 );
+      per[k] = 0;
+    }
+  }
+
+  for ( k = 0; k < hits; k++ )
+  {
+    int len = s->fdist[hit_last[k]] + 1, pos = len - 1;
+    lyph **path;
+
+    CREATE( path, lyph *, len + 1 );
+    path[pos] = g->out[hit_edge[k]].via;
+
+    for ( n = hit_last[k]; s->fnode[n] != -1; n = s->fnode[n] )
+      path[--pos] = g->out[s->fedge[n]].via;
+
+    row[hit_to[k]][per[hit_to[k]]++] = path;
+  }
+
+  MULTIFREE( hit_to, hit_last, hit_edge );
+
+  return row;
+}
+
+/*
+ * The numpaths shortest paths from the ith lyph to each lyph
+ */
+lyph ****k_shortest_lyph_connections( lyph_connections *c, lyph_search *s, int i )
+{
+  lyph ****row;
+  int src = c->canon[i], t;
+
+  CREATE( row, lyph ***, c->cnt + 1 );
+
+  for ( t = 0; t < c->cnt; t++ )
+  {
+    if ( c->canon[t] != t )
+      continue;
+
+    set_lyph_search_ends( s, &c->nodes[c->node_start[src]], c->node_start[src+1] - c->node_start[src],
+                             &c->nodes[c->node_start[t]], c->node_start[t+1] - c->node_start[t] );
+
+    row[t] = k_shortest_lyphpaths( s, c->numpaths );
+
+    if ( !*row[t] )
+    {
+      free( row[t] );
+      row[t] = NULL;
+    }
+  }
+
+  return row;
+}
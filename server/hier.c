@@ -6,6 +6,9 @@
 #include "lyph.h"
 #include "srv.h"
 
+lyphplate_graph *build_lyphplate_graph( void );
+void free_lyphplate_graph( lyphplate_graph *g );
+
 int can_node_fit_in_lyph( lyphnode *n, lyph *e )
 {
   lyph *d;
@@ -62,7 +65,7 @@ void maybe_node_is_in( lyphnode *n, lyph *L, lyphnode_wrapper **head, lyphnode_w
 
   if ( !n->location )
   {
-    SET_BIT( n->flags, LYPHNODE_DEFINITELY_OUT_LYPH );
+    SET_BIT( n->flags[worker_slot], LYPHNODE_DEFINITELY_OUT_LYPH );
     return;
   }
 
@@ -70,8 +73,8 @@ void maybe_node_is_in( lyphnode *n, lyph *L, lyphnode_wrapper **head, lyphnode_w
   {
     maybe_node_is_in_add:
 
-    REMOVE_BIT( n->flags, LYPHNODE_CURRENTLY_CALCULATING );
-    SET_BIT( n->flags, LYPHNODE_DEFINITELY_IN_LYPH );
+    REMOVE_BIT( n->flags[worker_slot], LYPHNODE_CURRENTLY_CALCULATING );
+    SET_BIT( n->flags[worker_slot], LYPHNODE_DEFINITELY_IN_LYPH );
 
     CREATE( w, lyphnode_wrapper, 1 );
     w->n = n;
@@ -79,29 +82,29 @@ void maybe_node_is_in( lyphnode *n, lyph *L, lyphnode_wrapper **head, lyphnode_w
     return;
   }
 
-  if ( IS_SET( n->location->flags, LYPH_DEFINITELY_IN_LYPH ) )
+  if ( IS_SET( n->location->flags[worker_slot], LYPH_DEFINITELY_IN_LYPH ) )
     goto maybe_node_is_in_add;
 
-  if ( IS_SET( n->location->flags, LYPH_DEFINITELY_OUT_LYPH )
-  ||   IS_SET( n->location->flags, LYPH_CURRENTLY_CALCULATING ) )
+  if ( IS_SET( n->location->flags[worker_slot], LYPH_DEFINITELY_OUT_LYPH )
+  ||   IS_SET( n->location->flags[worker_slot], LYPH_CURRENTLY_CALCULATING ) )
     return;
 
-  SET_BIT( n->flags, LYPHNODE_CURRENTLY_CALCULATING );
+  SET_BIT( n->flags[worker_slot], LYPHNODE_CURRENTLY_CALCULATING );
 
   maybe_node_is_in( n->location->from, L, head, tail );
 
-  if ( !IS_SET( n->location->from->flags, LYPHNODE_DEFINITELY_IN_LYPH ) )
+  if ( !IS_SET( n->location->from->flags[worker_slot], LYPHNODE_DEFINITELY_IN_LYPH ) )
   {
     maybe_node_is_in_dontadd:
 
-    REMOVE_BIT( n->flags, LYPHNODE_CURRENTLY_CALCULATING );
-    SET_BIT( n->flags, LYPHNODE_DEFINITELY_OUT_LYPH );
+    REMOVE_BIT( n->flags[worker_slot], LYPHNODE_CURRENTLY_CALCULATING );
+    SET_BIT( n->flags[worker_slot], LYPHNODE_DEFINITELY_OUT_LYPH );
     return;
   }
 
   maybe_node_is_in( n->location->to, L, head, tail );
 
-  if ( !IS_SET( n->location->to->flags, LYPHNODE_DEFINITELY_IN_LYPH ) )
+  if ( !IS_SET( n->location->to->flags[worker_slot], LYPHNODE_DEFINITELY_IN_LYPH ) )
     goto maybe_node_is_in_dontadd;
 
   goto maybe_node_is_in_add;
@@ -113,9 +116,9 @@ void calc_nodes_in_lyph_recurse( lyph *L, lyphnode_wrapper **head, lyphnode_wrap
   {
     lyphnode *n = (lyphnode *)t->data;
 
-    if (!IS_SET( n->flags, LYPHNODE_DEFINITELY_IN_LYPH )
-    &&  !IS_SET( n->flags, LYPHNODE_DEFINITELY_OUT_LYPH )
-    &&  !IS_SET( n->flags, LYPHNODE_CURRENTLY_CALCULATING ) )
+    if (!IS_SET( n->flags[worker_slot], LYPHNODE_DEFINITELY_IN_LYPH )
+    &&  !IS_SET( n->flags[worker_slot], LYPHNODE_DEFINITELY_OUT_LYPH )
+    &&  !IS_SET( n->flags[worker_slot], LYPHNODE_CURRENTLY_CALCULATING ) )
       maybe_node_is_in( n, L, head, tail );
   }
 
@@ -169,20 +172,21 @@ void populate_with_basic_lyphplates_subclass_of( trie **supers, lyphplate ***bpt
   TRIE_RECURSE( populate_with_basic_lyphplates_subclass_of( supers, bptr, *child ) );
 }
 
-void populate_with_lyphplates_involving_any_of( lyphplate **basics, lyphplate ***bptr, trie *t )
+void populate_with_involved_lyphplates( lyphplate_graph *g, unsigned long *involved, lyphplate ***bptr, trie *t )
 {
   if ( t->data )
   {
     lyphplate *L = (lyphplate *)t->data;
+    int i = lyphplate_graph_index( g, L );
 
-    if ( template_involves_any_of( L, basics ) )
+    if ( i != -1 && LYPH_GRAPH_IS_SET( involved, i ) )
     {
       **bptr = L;
       (*bptr)++;
     }
   }
 
-  TRIE_RECURSE( populate_with_lyphplates_involving_any_of( basics, bptr, *child ) );
+  TRIE_RECURSE( populate_with_involved_lyphplates( g, involved, bptr, *child ) );
 }
 
 HANDLER( do_templates_involving )
@@ -210,18 +214,28 @@ HANDLER( do_templates_involving )
 
 lyphplate **lyphplates_by_term( const char *ontstr )
 {
+  lyphplate_graph *g;
   lyphplate *L, **basics, **bscptr, **buf, **bptr;
-  trie **onts;
+  trie **onts, **src, **dest;
+  unsigned long *involved;
   char *lower;
   int cnt;
 
   lower = lowercaserize( ontstr );
 
-  cnt = count_nontrivial_members( label_to_iris_lowercase );
+  onts = autocomplete_all( lowercase_autocomplete, lower );
 
-  CREATE( onts, trie *, cnt + 1 );
+  /*
+   * Replace each label with the class of its (first) IRI
+   */
+  for ( src = dest = onts; *src; src++ )
+  {
+    char *short_iri = get_url_shortform( trie_to_static( (*src)->data[0] ) );
 
-  trie_search_autocomplete( lower, onts, label_to_iris_lowercase, 1, 1 );
+    if ( short_iri && (*dest = trie_search( short_iri, superclasses )) != NULL )
+      dest++;
+  }
+  *dest = NULL;
 
   L = lyphplate_by_id( ontstr );
 
@@ -258,11 +272,12 @@ lyphplate **lyphplates_by_term( const char *ontstr )
   CREATE( buf, lyphplate *, cnt + 1 );
   bptr = buf;
 
-  populate_with_lyphplates_involving_any_of( basics, &bptr, lyphplate_ids );
-  lyphplates_unset_bits( LYPHPLATE_DOES_INVOLVE | LYPHPLATE_DOES_NOT_INVOLVE );
+  g = current_lyphplate_graph();
+  involved = lyphplates_involving( g, basics );
+  populate_with_involved_lyphplates( g, involved, &bptr, lyphplate_ids );
   *bptr = NULL;
 
-  MULTIFREE( basics, onts );
+  MULTIFREE( basics, onts, involved );
 
   return buf;
 }
@@ -308,72 +323,314 @@ lyphplate **common_materials_of_layers( lyphplate *L )
   return buf;
 }
 
-#define LYPHPLATE_NOT_BUILT_FROM_Y 1
+/*
+ * What is built from what.  As with the lyph graph (see graph.c), the
+ * templates are copied into a compact graph (a lyphplate_graph) which is
+ * only rebuilt, once, after something has marked it stale: anything that
+ * creates or deletes templates, or changes their misc materials, their
+ * layers, or their layers' materials, calls lyphplate_graph_changed.
+ * Questions of what is built from what are then a single walk through the
+ * graph, with a bitmap of its own, touching only what it finds.
+ */
+lyphplate_graph *lyphplate_graph_now;
+int lyphplate_graph_stale = 1;
+pthread_mutex_t lyphplate_graph_mutex = PTHREAD_MUTEX_INITIALIZER;
 
-int is_X_built_from_Y_core( lyphplate *x, void *y )
+void lyphplate_graph_changed( void )
 {
-  lyphplate **mats;
-  layer **lyrs;
+  lyphplate_graph_stale = 1;
+}
 
-  if ( x == y )
-    return 1;
+lyphplate_graph *current_lyphplate_graph( void )
+{
+  if ( lyphplate_graph_stale )
+  {
+    pthread_mutex_lock( &lyphplate_graph_mutex );
 
-  if ( IS_SET( x->flags, LYPHPLATE_NOT_BUILT_FROM_Y ) )
-    return 0;
+    if ( lyphplate_graph_stale )
+    {
+      lyphplate_graph *g = build_lyphplate_graph();
+
+      if ( lyphplate_graph_now )
+        free_lyphplate_graph( lyphplate_graph_now );
+
+      lyphplate_graph_now = g;
+      __sync_synchronize();
+      lyphplate_graph_stale = 0;
+    }
+
+    pthread_mutex_unlock( &lyphplate_graph_mutex );
+  }
 
-  for ( mats = x->misc_material; *mats; mats++ )
-    if ( *mats == y )
-      return 1;
+  return lyphplate_graph_now;
+}
+
+int lyphplate_graph_index( lyphplate_graph *g, lyphplate *L )
+{
+  if ( L->graph_index < g->plate_cnt && g->plates[L->graph_index] == L )
+    return L->graph_index;
+
+  return -1;
+}
 
-  if ( x->layers )
+int layer_graph_index( lyphplate_graph *g, layer *lyr )
+{
+  int i = lyr->graph_index - g->plate_cnt;
+
+  if ( i >= 0 && i < g->layer_cnt && g->layers[i] == lyr )
+    return lyr->graph_index;
+
+  return -1;
+}
+
+/*
+ * Node i's materials, written to out (if it isn't NULL); returns how many
+ */
+int lyphplate_graph_materials( lyphplate_graph *g, int i, int *out )
+{
+  lyphplate **mats;
+  int cnt = 0, j;
+
+  if ( i < g->plate_cnt )
   {
-    for ( lyrs = x->layers; *lyrs; lyrs++ )
+    lyphplate *L = g->plates[i];
+    layer **lyrs;
+
+    for ( mats = L->misc_material; mats && *mats; mats++ )
     {
-      if ( *lyrs == y )
-        return 1;
+      if ( (j = lyphplate_graph_index( g, *mats )) == -1 )
+        continue;
+
+      if ( out )
+        out[cnt] = j;
+      cnt++;
+    }
 
-      for ( mats = (*lyrs)->material; *mats; mats++ )
-        if ( *mats == y )
-          return 1;
+    for ( lyrs = L->layers; lyrs && *lyrs; lyrs++ )
+    {
+      if ( out )
+        out[cnt] = layer_graph_index( g, *lyrs );
+      cnt++;
     }
+
+    return cnt;
+  }
+
+  for ( mats = g->layers[i - g->plate_cnt]->material; mats && *mats; mats++ )
+  {
+    if ( (j = lyphplate_graph_index( g, *mats )) == -1 )
+      continue;
+
+    if ( out )
+      out[cnt] = j;
+    cnt++;
+  }
+
+  return cnt;
+}
+
+lyphplate_graph *build_lyphplate_graph( void )
+{
+  lyphplate_graph *g;
+  lyphplate *L;
+  layer **lyrs;
+  int i, j, layer_max = 0, *fill;
+
+  CREATE( g, lyphplate_graph, 1 );
+
+  for ( L = first_lyphplate; L; L = L->next )
+  {
+    g->plate_cnt++;
+
+    if ( L->layers )
+      layer_max += VOIDLEN( L->layers );
   }
 
-  for ( mats = x->misc_material; *mats; mats++ )
-    if ( is_X_built_from_Y_core( *mats, y ) )
-      return 1;
+  CREATE( g->plates, lyphplate *, g->plate_cnt + 1 );
+  CREATE( g->layers, layer *, layer_max + 1 );
 
-  if ( x->layers )
+  for ( L = first_lyphplate, i = 0; L; L = L->next, i++ )
   {
-    for ( lyrs = x->layers; *lyrs; lyrs++ )
-    for ( mats = (*lyrs)->material; *mats; mats++ )
-      if ( is_X_built_from_Y_core( *mats, y ) )
-        return 1;
+    g->plates[i] = L;
+    L->graph_index = i;
   }
 
-  SET_BIT( x->flags, LYPHPLATE_NOT_BUILT_FROM_Y );
-  return 0;
+  /*
+   * Each layer is numbered once, however many templates it is in
+   */
+  for ( L = first_lyphplate; L; L = L->next )
+  for ( lyrs = L->layers; lyrs && *lyrs; lyrs++ )
+  {
+    if ( layer_graph_index( g, *lyrs ) == -1 )
+    {
+      (*lyrs)->graph_index = g->plate_cnt + g->layer_cnt;
+      g->layers[g->layer_cnt++] = *lyrs;
+    }
+  }
+
+  g->node_cnt = g->plate_cnt + g->layer_cnt;
+
+  CREATE( g->made_of_start, int, g->node_cnt + 1 );
+  CREATE( g->used_in_start, int, g->node_cnt + 1 );
+
+  for ( i = 0; i < g->node_cnt; i++ )
+    g->made_of_start[i+1] = g->made_of_start[i] + lyphplate_graph_materials( g, i, NULL );
+
+  CREATE( g->made_of, int, g->made_of_start[g->node_cnt] + 1 );
+
+  for ( i = 0; i < g->node_cnt; i++ )
+    lyphplate_graph_materials( g, i, &g->made_of[g->made_of_start[i]] );
+
+  for ( j = 0; j < g->made_of_start[g->node_cnt]; j++ )
+    g->used_in_start[g->made_of[j]+1]++;
+
+  for ( i = 0; i < g->node_cnt; i++ )
+    g->used_in_start[i+1] += g->used_in_start[i];
+
+  CREATE( g->used_in, int, g->used_in_start[g->node_cnt] + 1 );
+  CREATE( fill, int, g->node_cnt + 1 );
+  memcpy( fill, g->used_in_start, g->node_cnt * sizeof(int) );
+
+  for ( i = 0; i < g->node_cnt; i++ )
+  for ( j = g->made_of_start[i]; j < g->made_of_start[i+1]; j++ )
+    g->used_in[fill[g->made_of[j]]++] = i;
+
+  free( fill );
+
+  return g;
+}
+
+void free_lyphplate_graph( lyphplate_graph *g )
+{
+  MULTIFREE( g->plates, g->layers, g->made_of_start, g->made_of, g->used_in_start, g->used_in, g );
 }
 
-int is_X_built_from_Y( lyphplate *x, void *y )
+/*
+ * Mark, in a new bitmap, the from-nodes and everything they are built
+ * from (or, going up, everything built from them).  Stops as soon as goal
+ * is marked, if it is one of the nodes.  Going up, a layer only counts
+ * towards the templates it is in if they are shells or mixes.
+ */
+unsigned long *walk_lyphplate_graph( lyphplate_graph *g, int *from, int from_cnt, int up, int goal )
 {
-  int result = is_X_built_from_Y_core( x, y );
+  unsigned long *seen;
+  int *q, head = 0, tail = 0, i;
 
-  lyphplates_unset_bits( LYPHPLATE_NOT_BUILT_FROM_Y );
+  CREATE( seen, unsigned long, g->node_cnt / LYPH_GRAPH_WORD_BITS + 1 );
+  CREATE( q, int, g->node_cnt + 1 );
 
-  return result;
+  for ( i = 0; i < from_cnt; i++ )
+  {
+    if ( !LYPH_GRAPH_IS_SET( seen, from[i] ) )
+    {
+      LYPH_GRAPH_SET( seen, from[i] );
+      q[tail++] = from[i];
+    }
+  }
+
+  while ( head < tail && ( goal == -1 || !LYPH_GRAPH_IS_SET( seen, goal ) ) )
+  {
+    int n = q[head++], *x, *end;
+
+    if ( up )
+    {
+      x = &g->used_in[g->used_in_start[n]];
+      end = &g->used_in[g->used_in_start[n+1]];
+    }
+    else
+    {
+      x = &g->made_of[g->made_of_start[n]];
+      end = &g->made_of[g->made_of_start[n+1]];
+    }
+
+    for ( ; x < end; x++ )
+    {
+      if ( LYPH_GRAPH_IS_SET( seen, *x ) )
+        continue;
+
+      if ( up && n >= g->plate_cnt
+      &&   g->plates[*x]->type != LYPHPLATE_SHELL && g->plates[*x]->type != LYPHPLATE_MIX )
+        continue;
+
+      LYPH_GRAPH_SET( seen, *x );
+      q[tail++] = *x;
+    }
+  }
+
+  free( q );
+
+  return seen;
 }
 
-int is_Xs_built_from_Y( lyphplate **xs, void *y )
+int is_Xs_built_from_node( lyphplate_graph *g, lyphplate **xs, int y )
 {
+  unsigned long *seen;
   lyphplate **x;
+  int *from, cnt = 0, result;
+
+  if ( y == -1 )
+    return 0;
+
+  CREATE( from, int, VOIDLEN( xs ) + 1 );
 
   for ( x = xs; *x; x++ )
-    if ( is_X_built_from_Y_core( *x, y ) )
-      break;
+    if ( (from[cnt] = lyphplate_graph_index( g, *x )) != -1 )
+      cnt++;
+
+  seen = walk_lyphplate_graph( g, from, cnt, 0, y );
+  result = LYPH_GRAPH_IS_SET( seen, y ) ? 1 : 0;
+
+  MULTIFREE( from, seen );
+
+  return result;
+}
+
+int is_Xs_built_from_Y( lyphplate **xs, lyphplate *y )
+{
+  lyphplate_graph *g = current_lyphplate_graph();
+
+  return is_Xs_built_from_node( g, xs, lyphplate_graph_index( g, y ) );
+}
+
+int is_Xs_built_from_layer( lyphplate **xs, layer *lyr )
+{
+  lyphplate_graph *g = current_lyphplate_graph();
+
+  return is_Xs_built_from_node( g, xs, layer_graph_index( g, lyr ) );
+}
+
+int is_X_built_from_layer( lyphplate *x, layer *lyr )
+{
+  lyphplate *xs[2];
+
+  xs[0] = x;
+  xs[1] = NULL;
+
+  return is_Xs_built_from_layer( xs, lyr );
+}
+
+/*
+ * A bitmap of the templates (by their numbers in g) which involve any of
+ * the parts: are one of them, or have one among their misc materials, or
+ * (for shells and mixes) among their layers' materials, recursively
+ */
+unsigned long *lyphplates_involving( lyphplate_graph *g, lyphplate **parts )
+{
+  unsigned long *seen;
+  lyphplate **p;
+  int *from, cnt = 0;
+
+  CREATE( from, int, VOIDLEN( parts ) + 1 );
 
-  lyphplates_unset_bits( LYPHPLATE_NOT_BUILT_FROM_Y );
+  for ( p = parts; *p; p++ )
+    if ( (from[cnt] = lyphplate_graph_index( g, *p )) != -1 )
+      cnt++;
 
-  return *x ? 1 : 0;
+  seen = walk_lyphplate_graph( g, from, cnt, 1, -1 );
+
+  free( from );
+
+  return seen;
 }
 
 HANDLER( do_is_built_from_template )
@@ -426,14 +683,6 @@ HANDLER( do_is_built_from_template )
   send_response( req, JSON1( "response": result ? "yes" : "no" ) );  
 }
 
-void calc_parents_tmp( void )
-{
-  lyph *e;
-
-  for ( e = first_lyph; e; e = e->next )
-    e->parent_tmp = get_relative_lyph_loc_buf( e, NULL );
-}
-
 HANDLER( do_between )
 {
   lyph *root, **ends;
@@ -457,32 +706,45 @@ HANDLER( do_between )
 
 void between_worker( lyph *root, lyph **ends, http_request *req, int verbose )
 {
-  lyph *e, **eptr, **retval, **rptr;
+  lyph **eptr, **retval, **rptr;
+  int cnt = 0;
 
-  calc_parents_tmp();
+  /*
+   * Only the lyphs on the way up from the ends to the root can be in the
+   * answer, so that is all that needs looking at
+   */
+  for ( eptr = ends; *eptr; eptr++ )
+  {
+    lyph *up;
 
-  CREATE( retval, lyph *, lyphcnt + 1);
+    for ( up = *eptr; up; up = get_lyph_location( up ) )
+    {
+      cnt++;
 
-  rptr = retval;
+      if ( up == root )
+        break;
+    }
+  }
 
-  for ( e = first_lyph; e; e = e->next )
-    e->flags = 0;
+  CREATE( retval, lyph *, cnt + 1 );
+
+  rptr = retval;
 
   for ( eptr = ends; *eptr; eptr++ )
   {
     lyph *up;
 
-    for ( up = *eptr; up; up = up->parent_tmp )
+    for ( up = *eptr; up; up = get_lyph_location( up ) )
       if ( up == root )
         break;
 
     if ( up )
     {
-      for ( up = *eptr; up; up = up->parent_tmp )
+      for ( up = *eptr; up; up = get_lyph_location( up ) )
       {
-        if ( !up->flags )
+        if ( !IS_SET( up->flags[worker_slot], 2 ) )
         {
-          up->flags = 1;
+          SET_BIT( up->flags[worker_slot], 2 );
           *rptr++ = up;
         }
 
@@ -495,8 +757,8 @@ void between_worker( lyph *root, lyph **ends, http_request *req, int verbose )
   *rptr = NULL;
   free( ends );
 
-  for ( e = first_lyph; e; e = e->next )
-    e->flags = 0;
+  for ( rptr = retval; *rptr; rptr++ )
+    REMOVE_BIT( (*rptr)->flags[worker_slot], 2 );
 
   if ( verbose )
     send_response( req, JS_ARRAY( lyph_to_json, retval ) );
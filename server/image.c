@@ -0,0 +1,1579 @@
+/*
+ *  image.c
+ *  Binary image of the fully linked database, for fast restarts.
+ *
+ *  The text files (lyphs.dat, corr.json, etc.) remain the database of
+ *  record, and the format for interchange.  On a clean shutdown, or when
+ *  asked to (save_image), the whole in-memory state -- tries, templates,
+ *  layers, nodes, lyphs, views, metadata, correlations, the FMA graph --
+ *  is also written out as one file, with every pointer replaced by a
+ *  reference (see image_internal.h).  At startup, if the image is newer
+ *  than all the text files, it is memory-mapped and relinked instead of
+ *  parsing everything.  Any journaled changes are replayed afterward as
+ *  usual.
+ *
+ *  The image's objects are copied into ordinary heap blocks as they are
+ *  relinked, rather than used where they lie in the map, because the rest
+ *  of the code frees and reallocates individual objects and arrays.
+ */
+#include "lyph.h"
+#include "srv.h"
+#include "image_internal.h"
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+extern lyphview **views;
+extern lyphview obsolete_lyphview;
+extern int top_view;
+extern int top_layer_id;
+extern int top_lyphplate_id;
+extern int top_lyph_id;
+extern int top_lyphnode_id;
+extern trie *fmacheck;
+
+static const char *image_sources[] = IMAGE_SOURCES;
+static image_trie_root image_trie_roots[] = IMAGE_TRIE_ROOTS;
+
+static const size_t image_obj_sizes[IMG_TYPES] =
+{
+  sizeof(trie), sizeof(lyphplate), sizeof(layer), sizeof(lyphnode), sizeof(exit_data),
+  sizeof(lyph), sizeof(lyph_annot), sizeof(pubmed), sizeof(clinical_index),
+  sizeof(variable), sizeof(correlation), sizeof(located_measure), sizeof(added_edge),
+  sizeof(bop), sizeof(lyphview), sizeof(lv_rect), sizeof(fma), sizeof(nifling)
+};
+
+static const size_t image_rec_sizes[IMG_TYPES] =
+{
+  sizeof(img_trie), sizeof(img_lyphplate), sizeof(img_layer), sizeof(img_lyphnode), sizeof(img_exit),
+  sizeof(img_lyph), sizeof(img_annot), sizeof(img_pubmed), sizeof(img_clindex),
+  sizeof(img_variable), sizeof(img_correlation), sizeof(img_locmeas), sizeof(img_added_edge),
+  sizeof(img_bop), sizeof(img_view), sizeof(img_rect), sizeof(img_fma), sizeof(img_nifling)
+};
+
+void image_write_record( image_writer *w, int type, const void *obj );
+
+/*
+ * The static objects which certain pointers may point to
+ */
+const void *image_sentinel( int type )
+{
+  if ( type == IMG_LYPH )
+    return null_rect;
+
+  if ( type == IMG_VIEW )
+    return &obsolete_lyphview;
+
+  return NULL;
+}
+
+void image_stamp_file( const char *filename, image_stamp *s )
+{
+  struct stat st;
+
+  if ( stat( filename, &st ) == -1 )
+  {
+    s->size = -1;
+    s->mtime_sec = 0;
+    s->mtime_nsec = 0;
+    return;
+  }
+
+  s->size = st.st_size;
+  s->mtime_sec = st.st_mtim.tv_sec;
+  s->mtime_nsec = st.st_mtim.tv_nsec;
+}
+
+int image_stamp_matches( const char *filename, const image_stamp *s )
+{
+  image_stamp now;
+
+  image_stamp_file( filename, &now );
+
+  return now.size == s->size
+  &&     now.mtime_sec == s->mtime_sec
+  &&     now.mtime_nsec == s->mtime_nsec;
+}
+
+/*
+ * Writing
+ */
+void image_buf_add( image_buf *b, const void *data, size_t len )
+{
+  if ( b->len + len > b->size )
+  {
+    size_t size = b->size ? b->size * 2 : 65536;
+
+    while ( size < b->len + len )
+      size *= 2;
+
+    if ( !(b->data = realloc( b->data, size )) )
+    {
+      fprintf( stderr, "Malloc failure at %s:%d\n", __FILE__, __LINE__ );
+      to_logfile( "Malloc failure at %s:%d\n", __FILE__, __LINE__ );
+      abort();
+    }
+
+    b->size = size;
+  }
+
+  memcpy( b->data + b->len, data, len );
+  b->len += len;
+}
+
+size_t image_map_slot( const image_writer *w, const void *p )
+{
+  size_t slot = ( (uintptr_t) p >> 4 ) * 2654435761u;
+
+  for ( slot &= w->map_size - 1; w->map_keys[slot]; slot = (slot + 1) & (w->map_size - 1) )
+    if ( w->map_keys[slot] == p )
+      break;
+
+  return slot;
+}
+
+void image_map_grow( image_writer *w )
+{
+  const void **keys = w->map_keys;
+  uint32_t *vals = w->map_vals;
+  size_t i, size = w->map_size;
+
+  w->map_size = size ? size * 2 : IMAGE_INITIAL_MAP_SIZE;
+  CREATE( w->map_keys, const void *, w->map_size );
+  CREATE( w->map_vals, uint32_t, w->map_size );
+
+  for ( i = 0; i < size; i++ )
+  {
+    if ( keys[i] )
+    {
+      size_t slot = image_map_slot( w, keys[i] );
+
+      w->map_keys[slot] = keys[i];
+      w->map_vals[slot] = vals[i];
+    }
+  }
+
+  if ( keys )
+    MULTIFREE( keys, vals );
+}
+
+/*
+ * Returns the object's index, giving it the next one if it's new.
+ * For tries, data_type says what the node's data points to.
+ */
+uint32_t image_register( image_writer *w, int type, const void *p, int data_type )
+{
+  size_t slot;
+  uint32_t index;
+
+  if ( (w->map_cnt + 1) * 2 > w->map_size )
+    image_map_grow( w );
+
+  slot = image_map_slot( w, p );
+
+  if ( w->map_keys[slot] )
+    return w->map_vals[slot];
+
+  index = w->cnt[type]++;
+
+  if ( index >= w->size[type] )
+  {
+    w->size[type] = w->size[type] ? w->size[type] * 2 : 1024;
+
+    if ( !(w->objs[type] = realloc( w->objs[type], w->size[type] * sizeof(void *) )) )
+    {
+      fprintf( stderr, "Malloc failure at %s:%d\n", __FILE__, __LINE__ );
+      abort();
+    }
+
+    if ( type == IMG_TRIE
+    &&  !(w->trie_data_types = realloc( w->trie_data_types, w->size[type] * sizeof(int) )) )
+    {
+      fprintf( stderr, "Malloc failure at %s:%d\n", __FILE__, __LINE__ );
+      abort();
+    }
+  }
+
+  w->objs[type][index] = (void *) p;
+
+  if ( type == IMG_TRIE )
+    w->trie_data_types[index] = data_type;
+
+  w->map_keys[slot] = p;
+  w->map_vals[slot] = index;
+  w->map_cnt++;
+
+  return index;
+}
+
+uint32_t image_ref( image_writer *w, int type, const void *p )
+{
+  if ( !p )
+    return IMAGE_REF_NULL;
+
+  if ( p == image_sentinel( type ) )
+    return IMAGE_REF_SENTINEL;
+
+  return IMAGE_REF( image_register( w, type, p, IMG_TYPES ) );
+}
+
+/*
+ * A NULL-terminated array of pointers
+ */
+uint32_t image_refs( image_writer *w, int type, void **arr )
+{
+  uint32_t offset, cnt;
+  void **ptr;
+
+  if ( !arr )
+    return 0;
+
+  offset = w->refs.len / sizeof(uint32_t);
+  cnt = VOIDLEN( arr );
+
+  image_buf_add( &w->refs, &cnt, sizeof(cnt) );
+
+  for ( ptr = arr; *ptr; ptr++ )
+  {
+    uint32_t ref = image_ref( w, type, *ptr );
+
+    image_buf_add( &w->refs, &ref, sizeof(ref) );
+  }
+
+  return offset;
+}
+
+uint32_t image_str( image_writer *w, const char *str )
+{
+  uint32_t offset;
+
+  if ( !str )
+    return 0;
+
+  offset = w->strings.len;
+  image_buf_add( &w->strings, str, strlen( str ) + 1 );
+
+  return offset;
+}
+
+uint32_t image_strs( image_writer *w, char **arr )
+{
+  uint32_t offset, cnt;
+  char **ptr;
+
+  if ( !arr )
+    return 0;
+
+  offset = w->refs.len / sizeof(uint32_t);
+  cnt = VOIDLEN( arr );
+
+  image_buf_add( &w->refs, &cnt, sizeof(cnt) );
+
+  for ( ptr = arr; *ptr; ptr++ )
+  {
+    uint32_t str = image_str( w, *ptr );
+
+    image_buf_add( &w->refs, &str, sizeof(str) );
+  }
+
+  return offset;
+}
+
+void image_register_trie_tree( image_writer *w, trie *t, int data_type )
+{
+  image_register( w, IMG_TRIE, t, data_type );
+
+  TRIE_RECURSE( image_register_trie_tree( w, *child, data_type ) );
+}
+
+/*
+ * Find everything reachable from the globals, writing each object's
+ * record as we go.  The global tries are registered first, whole, so
+ * that their nodes are known to belong to them however they are first
+ * reached; then the objects on the global lists, so that those have the
+ * first indices of their types.
+ */
+void image_gather( image_writer *w, image_header *hdr )
+{
+  lyphplate *L;
+  lyph *e;
+  pubmed *p;
+  clinical_index *ci;
+  correlation *c;
+  located_measure *m;
+  bop *b;
+  fma *f;
+  int i, hash, progress;
+
+  for ( i = 0; i < IMAGE_TRIE_ROOT_CNT; i++ )
+    image_register_trie_tree( w, *image_trie_roots[i].root, image_trie_roots[i].data_type );
+
+  for ( L = first_lyphplate; L; L = L->next )
+    image_register( w, IMG_LYPHPLATE, L, IMG_TYPES );
+  for ( e = first_lyph; e; e = e->next )
+    image_register( w, IMG_LYPH, e, IMG_TYPES );
+  for ( p = first_pubmed; p; p = p->next )
+    image_register( w, IMG_PUBMED, p, IMG_TYPES );
+  for ( ci = first_clinical_index; ci; ci = ci->next )
+    image_register( w, IMG_CLINDEX, ci, IMG_TYPES );
+  for ( c = first_correlation; c; c = c->next )
+    image_register( w, IMG_CORRELATION, c, IMG_TYPES );
+  for ( m = first_located_measure; m; m = m->next )
+    image_register( w, IMG_LOCMEAS, m, IMG_TYPES );
+  for ( b = first_bop; b; b = b->next )
+    image_register( w, IMG_BOP, b, IMG_TYPES );
+  ITERATE_FMAS( image_register( w, IMG_FMA, f, IMG_TYPES ) );
+
+  memcpy( w->listed, w->cnt, sizeof(w->listed) );
+
+  for ( i = 0; i < IMAGE_TRIE_ROOT_CNT; i++ )
+    hdr->trie_roots[i] = image_ref( w, IMG_TRIE, *image_trie_roots[i].root );
+
+  hdr->human_species_lowercase = image_ref( w, IMG_TRIE, human_species_lowercase );
+  hdr->human_species_uppercase = image_ref( w, IMG_TRIE, human_species_uppercase );
+
+  /*
+   * views[0..top_view] may include NULLs, so it isn't written with image_refs
+   */
+  hdr->views = w->refs.len / sizeof(uint32_t);
+  hdr->top_view = top_view;
+
+  {
+    uint32_t cnt = top_view + 1;
+
+    image_buf_add( &w->refs, &cnt, sizeof(cnt) );
+
+    for ( i = 0; i <= top_view; i++ )
+    {
+      uint32_t ref = image_ref( w, IMG_VIEW, views[i] );
+
+      image_buf_add( &w->refs, &ref, sizeof(ref) );
+    }
+  }
+
+  do
+  {
+    progress = 0;
+
+    for ( i = 0; i < IMG_TYPES; i++ )
+    {
+      while ( w->done[i] < w->cnt[i] )
+      {
+        image_write_record( w, i, w->objs[i][w->done[i]] );
+        w->done[i]++;
+        progress = 1;
+      }
+    }
+  }
+  while ( progress );
+}
+
+void image_write_record( image_writer *w, int type, const void *obj )
+{
+  image_buf *rec = &w->recs[type];
+
+  switch( type )
+  {
+    case IMG_TRIE:
+    {
+      const trie *t = obj;
+      img_trie r;
+      int data_type = w->trie_data_types[w->done[IMG_TRIE]];
+
+      memset( &r, 0, sizeof(r) );
+      r.parent = image_ref( w, IMG_TRIE, t->parent );
+      r.label = image_str( w, t->label );
+      r.children = image_refs( w, IMG_TRIE, (void **) t->children );
+
+      if ( !t->data || data_type == IMG_TYPES )
+        r.data_type = IMG_TYPES;
+      else
+      {
+        r.data_type = data_type;
+
+        if ( data_type == IMG_TRIE )
+          r.data = image_refs( w, IMG_TRIE, (void **) t->data );
+        else
+          r.data = image_ref( w, data_type, t->data );
+      }
+
+      image_buf_add( rec, &r, sizeof(r) );
+      break;
+    }
+
+    case IMG_LYPHPLATE:
+    {
+      const lyphplate *L = obj;
+      img_lyphplate r;
+
+      memset( &r, 0, sizeof(r) );
+      r.modified = L->modified;
+      r.misc_material = image_refs( w, IMG_LYPHPLATE, (void **) L->misc_material );
+      r.supers = image_refs( w, IMG_LYPHPLATE, (void **) L->supers );
+      r.subs = image_refs( w, IMG_LYPHPLATE, (void **) L->subs );
+      r.layers = image_refs( w, IMG_LAYER, (void **) L->layers );
+      r.ont_term = image_ref( w, IMG_TRIE, L->ont_term );
+      r.name = image_ref( w, IMG_TRIE, L->name );
+      r.id = image_ref( w, IMG_TRIE, L->id );
+      r.length = image_str( w, L->length );
+      r.type = L->type;
+
+      image_buf_add( rec, &r, sizeof(r) );
+      break;
+    }
+
+    case IMG_LAYER:
+    {
+      const layer *lyr = obj;
+      img_layer r;
+
+      memset( &r, 0, sizeof(r) );
+      r.material = image_refs( w, IMG_LYPHPLATE, (void **) lyr->material );
+      r.id = image_ref( w, IMG_TRIE, lyr->id );
+      r.name = image_str( w, lyr->name );
+      r.thickness = lyr->thickness;
+
+      image_buf_add( rec, &r, sizeof(r) );
+      break;
+    }
+
+    case IMG_LYPHNODE:
+    {
+      const lyphnode *n = obj;
+      img_lyphnode r;
+
+      memset( &r, 0, sizeof(r) );
+      r.id = image_ref( w, IMG_TRIE, n->id );
+      r.exits = image_refs( w, IMG_EXIT, (void **) n->exits );
+      r.incoming = image_refs( w, IMG_EXIT, (void **) n->incoming );
+      r.location = image_ref( w, IMG_LYPH, n->location );
+      r.loctype = n->loctype;
+      r.layer = n->layer;
+
+      image_buf_add( rec, &r, sizeof(r) );
+      break;
+    }
+
+    case IMG_EXIT:
+    {
+      const exit_data *x = obj;
+      img_exit r;
+
+      r.to = image_ref( w, IMG_LYPHNODE, x->to );
+      r.via = image_ref( w, IMG_LYPH, x->via );
+
+      image_buf_add( rec, &r, sizeof(r) );
+      break;
+    }
+
+    case IMG_LYPH:
+    {
+      const lyph *e = obj;
+      img_lyph r;
+
+      memset( &r, 0, sizeof(r) );
+      r.modified = e->modified;
+      r.id = image_ref( w, IMG_TRIE, e->id );
+      r.name = image_ref( w, IMG_TRIE, e->name );
+      r.species = image_ref( w, IMG_TRIE, e->species );
+      r.type = e->type;
+      r.from = image_ref( w, IMG_LYPHNODE, e->from );
+      r.to = image_ref( w, IMG_LYPHNODE, e->to );
+      r.lyphplt = image_ref( w, IMG_LYPHPLATE, e->lyphplt );
+      r.constraints = image_refs( w, IMG_LYPHPLATE, (void **) e->constraints );
+      r.annots = image_refs( w, IMG_ANNOT, (void **) e->annots );
+      r.fma = image_ref( w, IMG_TRIE, e->fma );
+      r.pubmed = image_str( w, e->pubmed );
+      r.projection_strength = image_str( w, e->projection_strength );
+
+      image_buf_add( rec, &r, sizeof(r) );
+      break;
+    }
+
+    case IMG_ANNOT:
+    {
+      const lyph_annot *a = obj;
+      img_annot r;
+
+      r.pred = image_ref( w, IMG_TRIE, a->pred );
+      r.obj = image_ref( w, IMG_TRIE, a->obj );
+      r.pubmed = image_ref( w, IMG_PUBMED, a->pubmed );
+
+      image_buf_add( rec, &r, sizeof(r) );
+      break;
+    }
+
+    case IMG_PUBMED:
+    {
+      const pubmed *p = obj;
+      img_pubmed r;
+
+      r.id = image_str( w, p->id );
+      r.title = image_str( w, p->title );
+
+      image_buf_add( rec, &r, sizeof(r) );
+      break;
+    }
+
+    case IMG_CLINDEX:
+    {
+      const clinical_index *ci = obj;
+      img_clindex r;
+
+      r.index = image_ref( w, IMG_TRIE, ci->index );
+      r.label = image_ref( w, IMG_TRIE, ci->label );
+      r.pubmeds = image_refs( w, IMG_PUBMED, (void **) ci->pubmeds );
+      r.claimed = image_str( w, ci->claimed );
+      r.parents = image_refs( w, IMG_CLINDEX, (void **) ci->parents );
+      r.children = image_refs( w, IMG_CLINDEX, (void **) ci->children );
+
+      image_buf_add( rec, &r, sizeof(r) );
+      break;
+    }
+
+    case IMG_VARIABLE:
+    {
+      const variable *v = obj;
+      img_variable r;
+
+      r.type = v->type;
+      r.ci = image_ref( w, IMG_CLINDEX, v->ci );
+      r.quality = image_str( w, v->quality );
+      r.loc = image_ref( w, IMG_LYPH, v->loc );
+
+      image_buf_add( rec, &r, sizeof(r) );
+      break;
+    }
+
+    case IMG_CORRELATION:
+    {
+      const correlation *c = obj;
+      img_correlation r;
+
+      r.vars = image_refs( w, IMG_VARIABLE, (void **) c->vars );
+      r.pbmd = image_ref( w, IMG_PUBMED, c->pbmd );
+      r.comment = image_str( w, c->comment );
+      r.id = c->id;
+
+      image_buf_add( rec, &r, sizeof(r) );
+      break;
+    }
+
+    case IMG_LOCMEAS:
+    {
+      const located_measure *m = obj;
+      img_locmeas r;
+
+      r.quality = image_str( w, m->quality );
+      r.loc = image_ref( w, IMG_LYPH, m->loc );
+      r.id = m->id;
+
+      image_buf_add( rec, &r, sizeof(r) );
+      break;
+    }
+
+    case IMG_ADDED_EDGE:
+    {
+      const added_edge *a = obj;
+      img_added_edge r;
+
+      r.from = image_ref( w, IMG_LYPHNODE, a->from );
+      r.to = image_ref( w, IMG_LYPHNODE, a->to );
+
+      image_buf_add( rec, &r, sizeof(r) );
+      break;
+    }
+
+    case IMG_BOP:
+    {
+      const bop *b = obj;
+      img_bop r;
+
+      r.id = b->id;
+      r.excluded = image_refs( w, IMG_LYPH, (void **) b->excluded );
+      r.added = image_refs( w, IMG_ADDED_EDGE, (void **) b->added );
+      r.measures = image_refs( w, IMG_LOCMEAS, (void **) b->measures );
+
+      image_buf_add( rec, &r, sizeof(r) );
+      break;
+    }
+
+    case IMG_VIEW:
+    {
+      const lyphview *v = obj;
+      img_view r;
+
+      memset( &r, 0, sizeof(r) );
+      r.modified = v->modified;
+      r.id = v->id;
+      r.name = image_str( w, v->name );
+      r.nodes = image_refs( w, IMG_LYPHNODE, (void **) v->nodes );
+      r.coords = image_strs( w, v->coords );
+      r.rects = image_refs( w, IMG_RECT, (void **) v->rects );
+
+      image_buf_add( rec, &r, sizeof(r) );
+      break;
+    }
+
+    case IMG_RECT:
+    {
+      const lv_rect *rect = obj;
+      img_rect r;
+
+      r.L = image_ref( w, IMG_LYPH, rect->L );
+      r.x = image_str( w, rect->x );
+      r.y = image_str( w, rect->y );
+      r.width = image_str( w, rect->width );
+      r.height = image_str( w, rect->height );
+
+      image_buf_add( rec, &r, sizeof(r) );
+      break;
+    }
+
+    case IMG_FMA:
+    {
+      const fma *f = obj;
+      img_fma r;
+
+      r.id = f->id;
+      r.parents = image_refs( w, IMG_FMA, (void **) f->parents );
+      r.children = image_refs( w, IMG_FMA, (void **) f->children );
+      r.superclasses = image_refs( w, IMG_FMA, (void **) f->superclasses );
+      r.subclasses = image_refs( w, IMG_FMA, (void **) f->subclasses );
+      r.inferred_parts = image_refs( w, IMG_FMA, (void **) f->inferred_parts );
+      r.inferred_parents = image_refs( w, IMG_FMA, (void **) f->inferred_parents );
+      r.niflings = image_refs( w, IMG_NIFLING, (void **) f->niflings );
+      r.lyph = image_ref( w, IMG_LYPH, f->lyph );
+
+      image_buf_add( rec, &r, sizeof(r) );
+      break;
+    }
+
+    case IMG_NIFLING:
+    {
+      const nifling *n = obj;
+      img_nifling r;
+
+      r.fma1 = image_ref( w, IMG_FMA, n->fma1 );
+      r.fma2 = image_ref( w, IMG_FMA, n->fma2 );
+      r.pubmed = image_str( w, n->pubmed );
+      r.proj = image_str( w, n->proj );
+      r.species = image_ref( w, IMG_TRIE, n->species );
+
+      image_buf_add( rec, &r, sizeof(r) );
+      break;
+    }
+  }
+}
+
+int image_fwrite_section( FILE *fp, image_section *sec, const image_buf *b, uint64_t *offset )
+{
+  static const char zeros[8];
+  size_t pad = (8 - (*offset % 8)) % 8;
+
+  if ( pad && fwrite( zeros, 1, pad, fp ) != pad )
+    return 0;
+
+  *offset += pad;
+  sec->offset = *offset;
+
+  if ( b->len && fwrite( b->data, 1, b->len, fp ) != b->len )
+    return 0;
+
+  *offset += b->len;
+
+  return 1;
+}
+
+void image_free_writer( image_writer *w )
+{
+  int i;
+
+  for ( i = 0; i < IMG_TYPES; i++ )
+  {
+    if ( w->recs[i].data )
+      free( w->recs[i].data );
+
+    if ( w->objs[i] )
+      free( w->objs[i] );
+  }
+
+  if ( w->strings.data )
+    free( w->strings.data );
+
+  if ( w->refs.data )
+    free( w->refs.data );
+
+  if ( w->trie_data_types )
+    free( w->trie_data_types );
+
+  if ( w->map_keys )
+    MULTIFREE( w->map_keys, w->map_vals );
+}
+
+/*
+ * The caller must hold db_lock, and should have compacted the journal
+ * first: the image only counts as current while the text files are
+ * exactly as they were when it was written.
+ */
+int save_image( void )
+{
+  image_writer w;
+  image_header hdr;
+  FILE *fp;
+  uint64_t offset;
+  uint32_t zero = 0;
+  int i, success;
+  TIMING_VARS;
+
+  if ( !configs.ontology_file )
+    return 0;
+
+  BEGIN_TIMING;
+
+  memset( &w, 0, sizeof(w) );
+  memset( &hdr, 0, sizeof(hdr) );
+
+  memcpy( hdr.magic, IMAGE_MAGIC, sizeof(hdr.magic) );
+  hdr.version = IMAGE_VERSION;
+  hdr.byte_order = IMAGE_BYTE_ORDER;
+
+  image_stamp_file( configs.ontology_file, &hdr.ontology );
+
+  for ( i = 0; i < IMAGE_SOURCE_CNT; i++ )
+    image_stamp_file( image_sources[i], &hdr.sources[i] );
+
+  /*
+   * Offset 0 in either heap stands for NULL
+   */
+  image_buf_add( &w.strings, &zero, 1 );
+  image_buf_add( &w.refs, &zero, sizeof(zero) );
+
+  hdr.ontology_file = image_str( &w, configs.ontology_file );
+
+  image_gather( &w, &hdr );
+
+  hdr.top_layer_id = top_layer_id;
+  hdr.top_lyphplate_id = top_lyphplate_id;
+  hdr.top_lyph_id = top_lyph_id;
+  hdr.top_lyphnode_id = top_lyphnode_id;
+  hdr.lyphcnt = lyphcnt;
+
+  for ( i = 0; i < IMG_TYPES; i++ )
+  {
+    hdr.sections[i].cnt = w.cnt[i];
+    hdr.sections[i].listed = w.listed[i];
+  }
+
+  hdr.strings.cnt = w.strings.len;
+  hdr.refs.cnt = w.refs.len / sizeof(uint32_t);
+
+  if ( !(fp = fopen( IMAGE_FILE ".tmp", "w" )) )
+  {
+    error_messagef( "Could not open %s for writing: %s", IMAGE_FILE ".tmp", strerror( errno ) );
+    image_free_writer( &w );
+    return 0;
+  }
+
+  /*
+   * Write the header last, once the section offsets are known
+   */
+  offset = sizeof(hdr);
+  success = !fseek( fp, offset, SEEK_SET );
+
+  for ( i = 0; i < IMG_TYPES && success; i++ )
+    success = image_fwrite_section( fp, &hdr.sections[i], &w.recs[i], &offset );
+
+  success = success
+  &&        image_fwrite_section( fp, &hdr.strings, &w.strings, &offset )
+  &&        image_fwrite_section( fp, &hdr.refs, &w.refs, &offset );
+
+  hdr.file_size = offset;
+
+  success = success
+  &&       !fseek( fp, 0, SEEK_SET )
+  &&        fwrite( &hdr, sizeof(hdr), 1, fp ) == 1
+  &&       !fflush( fp )
+  &&       !fsync( fileno( fp ) );
+
+  success = !fclose( fp ) && success;
+
+  image_free_writer( &w );
+
+  if ( !success || rename( IMAGE_FILE ".tmp", IMAGE_FILE ) == -1 )
+  {
+    error_messagef( "Could not write %s: %s", IMAGE_FILE, strerror( errno ) );
+    unlink( IMAGE_FILE ".tmp" );
+    return 0;
+  }
+
+  END_TIMING;
+
+  log_stringf( "Saved %s (%llu bytes) in %f seconds", IMAGE_FILE, (unsigned long long) hdr.file_size, TIMING_RESULT );
+
+  return 1;
+}
+
+/*
+ * Loading
+ */
+int image_section_ok( const image_loader *ld, const image_section *sec, size_t recsize )
+{
+  return sec->offset % 8 == 0
+  &&     sec->offset <= ld->size
+  &&     (uint64_t) sec->cnt * recsize <= ld->size - sec->offset;
+}
+
+void *image_obj( image_loader *ld, int type, uint32_t ref )
+{
+  if ( ref == IMAGE_REF_NULL )
+    return NULL;
+
+  if ( ref == IMAGE_REF_SENTINEL )
+  {
+    if ( !image_sentinel( type ) )
+      ld->corrupt = 1;
+
+    return (void *) image_sentinel( type );
+  }
+
+  if ( ref - 2 >= ld->hdr->sections[type].cnt )
+  {
+    ld->corrupt = 1;
+    return NULL;
+  }
+
+  return ld->objs[type][ref - 2];
+}
+
+/*
+ * Returns the count and (via elems) the elements of the array
+ * at the given offset in the reference heap
+ */
+uint32_t image_array( image_loader *ld, uint32_t offset, const uint32_t **elems )
+{
+  uint32_t cnt;
+
+  if ( offset >= ld->hdr->refs.cnt )
+  {
+    ld->corrupt = 1;
+    return 0;
+  }
+
+  cnt = ld->refs[offset];
+
+  if ( cnt > ld->hdr->refs.cnt - offset - 1 )
+  {
+    ld->corrupt = 1;
+    return 0;
+  }
+
+  *elems = &ld->refs[offset + 1];
+
+  return cnt;
+}
+
+void **image_objs( image_loader *ld, int type, uint32_t offset )
+{
+  const uint32_t *elems;
+  void **arr;
+  uint32_t i, cnt;
+
+  if ( !offset )
+    return NULL;
+
+  cnt = image_array( ld, offset, &elems );
+
+  CREATE( arr, void *, cnt + 1 );
+
+  for ( i = 0; i < cnt; i++ )
+    arr[i] = image_obj( ld, type, elems[i] );
+
+  arr[cnt] = NULL;
+
+  return arr;
+}
+
+char *image_strdup( image_loader *ld, uint32_t offset )
+{
+  if ( !offset )
+    return NULL;
+
+  if ( offset >= ld->hdr->strings.cnt )
+  {
+    ld->corrupt = 1;
+    return NULL;
+  }
+
+  return strdup( ld->strings + offset );
+}
+
+char **image_strdups( image_loader *ld, uint32_t offset )
+{
+  const uint32_t *elems;
+  char **arr;
+  uint32_t i, cnt;
+
+  if ( !offset )
+    return NULL;
+
+  cnt = image_array( ld, offset, &elems );
+
+  CREATE( arr, char *, cnt + 1 );
+
+  for ( i = 0; i < cnt; i++ )
+    arr[i] = image_strdup( ld, elems[i] );
+
+  arr[cnt] = NULL;
+
+  return arr;
+}
+
+/*
+ * Whether any of these would-be children of a trie node lacks a label
+ */
+int image_unlabeled( trie **children )
+{
+  for ( ; *children; children++ )
+    if ( !(*children)->label || !*(*children)->label )
+      return 1;
+
+  return 0;
+}
+
+#define IMG_OBJ( type, ref ) image_obj( ld, (type), (ref) )
+#define IMG_OBJS( cast, type, offset ) ( (cast) image_objs( ld, (type), (offset) ) )
+#define IMG_STR( offset ) image_strdup( ld, (offset) )
+
+/*
+ * Fill in the fields of every object (all of which have been allocated)
+ */
+void image_link_objects( image_loader *ld )
+{
+  const image_header *hdr = ld->hdr;
+  uint32_t i;
+
+  {
+    const img_trie *r = IMAGE_RECORDS( ld, IMG_TRIE, img_trie );
+
+    for ( i = 0; i < hdr->sections[IMG_TRIE].cnt; i++, r++ )
+    {
+      trie *t = ld->objs[IMG_TRIE][i];
+
+      t->parent = IMG_OBJ( IMG_TRIE, r->parent );
+
+      if ( r->label )
+      {
+        if ( r->label >= hdr->strings.cnt )
+          ld->corrupt = 1;
+        else
+          trie_set_label( t, ld->strings + r->label, strlen( ld->strings + r->label ) );
+      }
+
+      if ( r->data_type == IMG_TRIE )
+        t->data = IMG_OBJS( trie **, IMG_TRIE, r->data );
+      else if ( r->data_type < IMG_TYPES )
+        t->data = IMG_OBJ( r->data_type, r->data );
+      else if ( r->data_type == IMG_TYPES )
+        t->data = NULL;
+      else
+        ld->corrupt = 1;
+    }
+
+    /*
+     * Children are sorted by label, so all the labels must be in first
+     */
+    r = IMAGE_RECORDS( ld, IMG_TRIE, img_trie );
+
+    for ( i = 0; i < hdr->sections[IMG_TRIE].cnt; i++, r++ )
+    {
+      trie *t = ld->objs[IMG_TRIE][i], **children;
+
+      if ( !r->children )
+        continue;
+
+      children = IMG_OBJS( trie **, IMG_TRIE, r->children );
+
+      if ( ld->corrupt || image_unlabeled( children ) )
+      {
+        ld->corrupt = 1;
+        free( children );
+        continue;
+      }
+
+      trie_set_children( t, children );
+    }
+
+    /*
+     * Spell out the keys of the nodes which stand for something
+     */
+    for ( i = 0; i < hdr->sections[IMG_TRIE].cnt && !ld->corrupt; i++ )
+    {
+      trie *t = ld->objs[IMG_TRIE][i];
+
+      if ( t->data )
+        trie_set_key( t );
+    }
+  }
+
+  {
+    const img_lyphplate *r = IMAGE_RECORDS( ld, IMG_LYPHPLATE, img_lyphplate );
+
+    for ( i = 0; i < hdr->sections[IMG_LYPHPLATE].cnt; i++, r++ )
+    {
+      lyphplate *L = ld->objs[IMG_LYPHPLATE][i];
+
+      L->misc_material = IMG_OBJS( lyphplate **, IMG_LYPHPLATE, r->misc_material );
+      L->supers = IMG_OBJS( lyphplate **, IMG_LYPHPLATE, r->supers );
+      L->subs = IMG_OBJS( lyphplate **, IMG_LYPHPLATE, r->subs );
+      L->layers = IMG_OBJS( layer **, IMG_LAYER, r->layers );
+      L->ont_term = IMG_OBJ( IMG_TRIE, r->ont_term );
+      L->name = IMG_OBJ( IMG_TRIE, r->name );
+      L->id = IMG_OBJ( IMG_TRIE, r->id );
+      L->length = IMG_STR( r->length );
+      L->type = r->type;
+      L->modified = r->modified;
+    }
+  }
+
+  {
+    const img_layer *r = IMAGE_RECORDS( ld, IMG_LAYER, img_layer );
+
+    for ( i = 0; i < hdr->sections[IMG_LAYER].cnt; i++, r++ )
+    {
+      layer *lyr = ld->objs[IMG_LAYER][i];
+
+      lyr->material = IMG_OBJS( lyphplate **, IMG_LYPHPLATE, r->material );
+      lyr->id = IMG_OBJ( IMG_TRIE, r->id );
+      lyr->name = IMG_STR( r->name );
+      lyr->thickness = r->thickness;
+    }
+  }
+
+  {
+    const img_lyphnode *r = IMAGE_RECORDS( ld, IMG_LYPHNODE, img_lyphnode );
+
+    for ( i = 0; i < hdr->sections[IMG_LYPHNODE].cnt; i++, r++ )
+    {
+      lyphnode *n = ld->objs[IMG_LYPHNODE][i];
+
+      n->id = IMG_OBJ( IMG_TRIE, r->id );
+      n->exits = IMG_OBJS( exit_data **, IMG_EXIT, r->exits );
+      n->incoming = IMG_OBJS( exit_data **, IMG_EXIT, r->incoming );
+      n->location = IMG_OBJ( IMG_LYPH, r->location );
+      n->loctype = r->loctype;
+      n->layer = r->layer;
+    }
+  }
+
+  {
+    const img_exit *r = IMAGE_RECORDS( ld, IMG_EXIT, img_exit );
+
+    for ( i = 0; i < hdr->sections[IMG_EXIT].cnt; i++, r++ )
+    {
+      exit_data *x = ld->objs[IMG_EXIT][i];
+
+      x->to = IMG_OBJ( IMG_LYPHNODE, r->to );
+      x->via = IMG_OBJ( IMG_LYPH, r->via );
+    }
+  }
+
+  {
+    const img_lyph *r = IMAGE_RECORDS( ld, IMG_LYPH, img_lyph );
+
+    for ( i = 0; i < hdr->sections[IMG_LYPH].cnt; i++, r++ )
+    {
+      lyph *e = ld->objs[IMG_LYPH][i];
+
+      e->id = IMG_OBJ( IMG_TRIE, r->id );
+      e->name = IMG_OBJ( IMG_TRIE, r->name );
+      e->species = IMG_OBJ( IMG_TRIE, r->species );
+      e->type = r->type;
+      e->from = IMG_OBJ( IMG_LYPHNODE, r->from );
+      e->to = IMG_OBJ( IMG_LYPHNODE, r->to );
+      e->lyphplt = IMG_OBJ( IMG_LYPHPLATE, r->lyphplt );
+      e->constraints = IMG_OBJS( lyphplate **, IMG_LYPHPLATE, r->constraints );
+      e->annots = IMG_OBJS( lyph_annot **, IMG_ANNOT, r->annots );
+      e->fma = IMG_OBJ( IMG_TRIE, r->fma );
+      e->pubmed = IMG_STR( r->pubmed );
+      e->projection_strength = IMG_STR( r->projection_strength );
+      e->modified = r->modified;
+    }
+  }
+
+  {
+    const img_annot *r = IMAGE_RECORDS( ld, IMG_ANNOT, img_annot );
+
+    for ( i = 0; i < hdr->sections[IMG_ANNOT].cnt; i++, r++ )
+    {
+      lyph_annot *a = ld->objs[IMG_ANNOT][i];
+
+      a->pred = IMG_OBJ( IMG_TRIE, r->pred );
+      a->obj = IMG_OBJ( IMG_TRIE, r->obj );
+      a->pubmed = IMG_OBJ( IMG_PUBMED, r->pubmed );
+    }
+  }
+
+  {
+    const img_pubmed *r = IMAGE_RECORDS( ld, IMG_PUBMED, img_pubmed );
+
+    for ( i = 0; i < hdr->sections[IMG_PUBMED].cnt; i++, r++ )
+    {
+      pubmed *p = ld->objs[IMG_PUBMED][i];
+
+      p->id = IMG_STR( r->id );
+      p->title = IMG_STR( r->title );
+    }
+  }
+
+  {
+    const img_clindex *r = IMAGE_RECORDS( ld, IMG_CLINDEX, img_clindex );
+
+    for ( i = 0; i < hdr->sections[IMG_CLINDEX].cnt; i++, r++ )
+    {
+      clinical_index *ci = ld->objs[IMG_CLINDEX][i];
+
+      ci->index = IMG_OBJ( IMG_TRIE, r->index );
+      ci->label = IMG_OBJ( IMG_TRIE, r->label );
+      ci->pubmeds = IMG_OBJS( pubmed **, IMG_PUBMED, r->pubmeds );
+      ci->claimed = IMG_STR( r->claimed );
+      ci->parents = IMG_OBJS( clinical_index **, IMG_CLINDEX, r->parents );
+      ci->children = IMG_OBJS( clinical_index **, IMG_CLINDEX, r->children );
+    }
+  }
+
+  {
+    const img_variable *r = IMAGE_RECORDS( ld, IMG_VARIABLE, img_variable );
+
+    for ( i = 0; i < hdr->sections[IMG_VARIABLE].cnt; i++, r++ )
+    {
+      variable *v = ld->objs[IMG_VARIABLE][i];
+
+      v->type = r->type;
+      v->ci = IMG_OBJ( IMG_CLINDEX, r->ci );
+      v->quality = IMG_STR( r->quality );
+      v->loc = IMG_OBJ( IMG_LYPH, r->loc );
+    }
+  }
+
+  {
+    const img_correlation *r = IMAGE_RECORDS( ld, IMG_CORRELATION, img_correlation );
+
+    for ( i = 0; i < hdr->sections[IMG_CORRELATION].cnt; i++, r++ )
+    {
+      correlation *c = ld->objs[IMG_CORRELATION][i];
+
+      c->vars = IMG_OBJS( variable **, IMG_VARIABLE, r->vars );
+      c->pbmd = IMG_OBJ( IMG_PUBMED, r->pbmd );
+      c->comment = IMG_STR( r->comment );
+      c->id = r->id;
+    }
+  }
+
+  {
+    const img_locmeas *r = IMAGE_RECORDS( ld, IMG_LOCMEAS, img_locmeas );
+
+    for ( i = 0; i < hdr->sections[IMG_LOCMEAS].cnt; i++, r++ )
+    {
+      located_measure *m = ld->objs[IMG_LOCMEAS][i];
+
+      m->quality = IMG_STR( r->quality );
+      m->loc = IMG_OBJ( IMG_LYPH, r->loc );
+      m->id = r->id;
+    }
+  }
+
+  {
+    const img_added_edge *r = IMAGE_RECORDS( ld, IMG_ADDED_EDGE, img_added_edge );
+
+    for ( i = 0; i < hdr->sections[IMG_ADDED_EDGE].cnt; i++, r++ )
+    {
+      added_edge *a = ld->objs[IMG_ADDED_EDGE][i];
+
+      a->from = IMG_OBJ( IMG_LYPHNODE, r->from );
+      a->to = IMG_OBJ( IMG_LYPHNODE, r->to );
+    }
+  }
+
+  {
+    const img_bop *r = IMAGE_RECORDS( ld, IMG_BOP, img_bop );
+
+    for ( i = 0; i < hdr->sections[IMG_BOP].cnt; i++, r++ )
+    {
+      bop *b = ld->objs[IMG_BOP][i];
+
+      b->id = r->id;
+      b->excluded = IMG_OBJS( lyph **, IMG_LYPH, r->excluded );
+      b->added = IMG_OBJS( added_edge **, IMG_ADDED_EDGE, r->added );
+      b->measures = IMG_OBJS( located_measure **, IMG_LOCMEAS, r->measures );
+    }
+  }
+
+  {
+    const img_view *r = IMAGE_RECORDS( ld, IMG_VIEW, img_view );
+
+    for ( i = 0; i < hdr->sections[IMG_VIEW].cnt; i++, r++ )
+    {
+      lyphview *v = ld->objs[IMG_VIEW][i];
+
+      v->id = r->id;
+      v->name = IMG_STR( r->name );
+      v->nodes = IMG_OBJS( lyphnode **, IMG_LYPHNODE, r->nodes );
+      v->coords = image_strdups( ld, r->coords );
+      v->rects = IMG_OBJS( lv_rect **, IMG_RECT, r->rects );
+      v->modified = r->modified;
+    }
+  }
+
+  {
+    const img_rect *r = IMAGE_RECORDS( ld, IMG_RECT, img_rect );
+
+    for ( i = 0; i < hdr->sections[IMG_RECT].cnt; i++, r++ )
+    {
+      lv_rect *rect = ld->objs[IMG_RECT][i];
+
+      rect->L = IMG_OBJ( IMG_LYPH, r->L );
+      rect->x = IMG_STR( r->x );
+      rect->y = IMG_STR( r->y );
+      rect->width = IMG_STR( r->width );
+      rect->height = IMG_STR( r->height );
+    }
+  }
+
+  {
+    const img_fma *r = IMAGE_RECORDS( ld, IMG_FMA, img_fma );
+
+    for ( i = 0; i < hdr->sections[IMG_FMA].cnt; i++, r++ )
+    {
+      fma *f = ld->objs[IMG_FMA][i];
+
+      f->id = r->id;
+      f->parents = IMG_OBJS( fma **, IMG_FMA, r->parents );
+      f->children = IMG_OBJS( fma **, IMG_FMA, r->children );
+      f->superclasses = IMG_OBJS( fma **, IMG_FMA, r->superclasses );
+      f->subclasses = IMG_OBJS( fma **, IMG_FMA, r->subclasses );
+      f->inferred_parts = IMG_OBJS( fma **, IMG_FMA, r->inferred_parts );
+      f->inferred_parents = IMG_OBJS( fma **, IMG_FMA, r->inferred_parents );
+      f->niflings = IMG_OBJS( nifling **, IMG_NIFLING, r->niflings );
+      f->lyph = IMG_OBJ( IMG_LYPH, r->lyph );
+    }
+  }
+
+  {
+    const img_nifling *r = IMAGE_RECORDS( ld, IMG_NIFLING, img_nifling );
+
+    for ( i = 0; i < hdr->sections[IMG_NIFLING].cnt; i++, r++ )
+    {
+      nifling *n = ld->objs[IMG_NIFLING][i];
+
+      n->fma1 = IMG_OBJ( IMG_FMA, r->fma1 );
+      n->fma2 = IMG_OBJ( IMG_FMA, r->fma2 );
+      n->pubmed = IMG_STR( r->pubmed );
+      n->proj = IMG_STR( r->proj );
+      n->species = IMG_OBJ( IMG_TRIE, r->species );
+    }
+  }
+}
+
+/*
+ * Resolve the references held in the header
+ */
+void image_link_globals( image_loader *ld )
+{
+  const image_header *hdr = ld->hdr;
+  const uint32_t *elems;
+  uint32_t i, cnt;
+
+  for ( i = 0; i < IMAGE_TRIE_ROOT_CNT; i++ )
+  {
+    ld->trie_roots[i] = IMG_OBJ( IMG_TRIE, hdr->trie_roots[i] );
+
+    if ( !ld->trie_roots[i] )
+      ld->corrupt = 1;
+  }
+
+  ld->human_species_lowercase = IMG_OBJ( IMG_TRIE, hdr->human_species_lowercase );
+  ld->human_species_uppercase = IMG_OBJ( IMG_TRIE, hdr->human_species_uppercase );
+
+  cnt = image_array( ld, hdr->views, &elems );
+
+  if ( !cnt || cnt - 1 != (uint32_t) hdr->top_view )
+  {
+    ld->corrupt = 1;
+    return;
+  }
+
+  CREATE( ld->views, lyphview *, cnt + 1 );
+
+  for ( i = 0; i < cnt; i++ )
+    ld->views[i] = IMG_OBJ( IMG_VIEW, elems[i] );
+
+  ld->views[cnt] = NULL;
+}
+
+/*
+ * Point the globals at the loaded objects
+ */
+void image_install( image_loader *ld )
+{
+  const image_header *hdr = ld->hdr;
+  uint32_t i;
+  int hash;
+
+  for ( i = 0; i < IMAGE_TRIE_ROOT_CNT; i++ )
+    *image_trie_roots[i].root = ld->trie_roots[i];
+
+  human_species_lowercase = ld->human_species_lowercase;
+  human_species_uppercase = ld->human_species_uppercase;
+
+  first_lyphplate = last_lyphplate = NULL;
+  for ( i = 0; i < hdr->sections[IMG_LYPHPLATE].listed; i++ )
+  {
+    lyphplate *L = ld->objs[IMG_LYPHPLATE][i];
+    LINK2( L, first_lyphplate, last_lyphplate, next, prev );
+  }
+  lyphplate_graph_changed();
+
+  first_lyph = last_lyph = NULL;
+  for ( i = 0; i < hdr->sections[IMG_LYPH].listed; i++ )
+  {
+    lyph *e = ld->objs[IMG_LYPH][i];
+    LINK2( e, first_lyph, last_lyph, next, prev );
+  }
+  lyph_containment_changed();
+
+  first_pubmed = last_pubmed = NULL;
+  for ( i = 0; i < hdr->sections[IMG_PUBMED].listed; i++ )
+  {
+    pubmed *p = ld->objs[IMG_PUBMED][i];
+    LINK( p, first_pubmed, last_pubmed, next );
+  }
+
+  first_clinical_index = last_clinical_index = NULL;
+  for ( i = 0; i < hdr->sections[IMG_CLINDEX].listed; i++ )
+  {
+    clinical_index *ci = ld->objs[IMG_CLINDEX][i];
+    LINK( ci, first_clinical_index, last_clinical_index, next );
+  }
+
+  first_correlation = last_correlation = NULL;
+  for ( i = 0; i < hdr->sections[IMG_CORRELATION].listed; i++ )
+  {
+    correlation *c = ld->objs[IMG_CORRELATION][i];
+    LINK2( c, first_correlation, last_correlation, next, prev );
+    index_correlation( c );
+  }
+
+  first_located_measure = last_located_measure = NULL;
+  for ( i = 0; i < hdr->sections[IMG_LOCMEAS].listed; i++ )
+  {
+    located_measure *m = ld->objs[IMG_LOCMEAS][i];
+    LINK2( m, first_located_measure, last_located_measure, next, prev );
+  }
+
+  first_bop = last_bop = NULL;
+  for ( i = 0; i < hdr->sections[IMG_BOP].listed; i++ )
+  {
+    bop *b = ld->objs[IMG_BOP][i];
+    LINK2( b, first_bop, last_bop, next, prev );
+  }
+
+  for ( hash = 0; hash < FMA_HASH; hash++ )
+  {
+    first_fma[hash] = NULL;
+    last_fma[hash] = NULL;
+  }
+
+  for ( i = 0; i < hdr->sections[IMG_FMA].listed; i++ )
+  {
+    fma *f = ld->objs[IMG_FMA][i];
+
+    hash = f->id % FMA_HASH;
+    LINK( f, first_fma[hash], last_fma[hash], next );
+  }
+
+  views = ld->views;
+  top_view = hdr->top_view;
+
+  top_layer_id = hdr->top_layer_id;
+  top_lyphplate_id = hdr->top_lyphplate_id;
+  top_lyph_id = hdr->top_lyph_id;
+  top_lyphnode_id = hdr->top_lyphnode_id;
+  lyphcnt = hdr->lyphcnt;
+
+  fmacheck = blank_trie();
+}
+
+/*
+ * Check that the image is intact and describes the current text files
+ */
+int image_validate( image_loader *ld, const char *ontology_file )
+{
+  const image_header *hdr = ld->hdr;
+  int i;
+
+  if ( ld->size < sizeof(image_header)
+  ||   memcmp( hdr->magic, IMAGE_MAGIC, sizeof(hdr->magic) )
+  ||   hdr->version != IMAGE_VERSION
+  ||   hdr->byte_order != IMAGE_BYTE_ORDER )
+  {
+    log_string( IMAGE_FILE " is from an incompatible version -- ignoring it" );
+    return 0;
+  }
+
+  if ( hdr->file_size != ld->size )
+  {
+    error_message( IMAGE_FILE " is truncated -- ignoring it" );
+    return 0;
+  }
+
+  for ( i = 0; i < IMG_TYPES; i++ )
+  {
+    if ( !image_section_ok( ld, &hdr->sections[i], image_rec_sizes[i] )
+    ||   hdr->sections[i].listed > hdr->sections[i].cnt )
+    {
+      error_message( IMAGE_FILE " is corrupt -- ignoring it" );
+      return 0;
+    }
+  }
+
+  if ( !image_section_ok( ld, &hdr->strings, 1 )
+  ||   !image_section_ok( ld, &hdr->refs, sizeof(uint32_t) )
+  ||   !hdr->strings.cnt
+  ||   !hdr->refs.cnt
+  ||   ld->base[hdr->strings.offset + hdr->strings.cnt - 1] != '\0'
+  ||   hdr->ontology_file >= hdr->strings.cnt )
+  {
+    error_message( IMAGE_FILE " is corrupt -- ignoring it" );
+    return 0;
+  }
+
+  ld->strings = ld->base + hdr->strings.offset;
+  ld->refs = (const uint32_t *) ( ld->base + hdr->refs.offset );
+
+  if ( strcmp( ld->strings + hdr->ontology_file, ontology_file )
+  ||  !image_stamp_matches( ontology_file, &hdr->ontology ) )
+  {
+    log_string( IMAGE_FILE " was made from a different ontology file -- ignoring it" );
+    return 0;
+  }
+
+  for ( i = 0; i < IMAGE_SOURCE_CNT; i++ )
+  {
+    if ( !image_stamp_matches( image_sources[i], &hdr->sources[i] ) )
+    {
+      log_stringf( "%s has changed since %s was saved -- ignoring it", image_sources[i], IMAGE_FILE );
+      return 0;
+    }
+  }
+
+  return 1;
+}
+
+/*
+ * Returns 1 if the database was loaded from the image; otherwise, nothing
+ * has been changed and the caller should load the text files instead
+ */
+int load_image( const char *ontology_file )
+{
+  image_loader ld;
+  struct stat st;
+  void *map;
+  uint32_t i;
+  int fd, type;
+  TIMING_VARS;
+
+  BEGIN_TIMING;
+
+  if ( (fd = open( IMAGE_FILE, O_RDONLY )) == -1 )
+  {
+    log_string( "No " IMAGE_FILE " -- loading the text files" );
+    return 0;
+  }
+
+  if ( fstat( fd, &st ) == -1 || st.st_size < (off_t) sizeof(image_header) )
+  {
+    close( fd );
+    log_string( IMAGE_FILE " is unusable -- loading the text files" );
+    return 0;
+  }
+
+  map = mmap( NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0 );
+  close( fd );
+
+  if ( map == MAP_FAILED )
+  {
+    error_messagef( "Could not map %s: %s", IMAGE_FILE, strerror( errno ) );
+    return 0;
+  }
+
+  memset( &ld, 0, sizeof(ld) );
+  ld.base = map;
+  ld.size = st.st_size;
+  ld.hdr = map;
+
+  if ( !image_validate( &ld, ontology_file ) )
+  {
+    munmap( map, st.st_size );
+    return 0;
+  }
+
+  for ( type = 0; type < IMG_TYPES; type++ )
+  {
+    uint32_t cnt = ld.hdr->sections[type].cnt;
+
+    CREATE( ld.objs[type], void *, cnt + 1 );
+
+    for ( i = 0; i < cnt; i++ )
+    {
+      if ( type == IMG_TRIE )
+        ld.objs[type][i] = blank_trie();
+      else
+        CREATE( ld.objs[type][i], char, image_obj_sizes[type] );
+    }
+  }
+
+  image_link_objects( &ld );
+  image_link_globals( &ld );
+
+  /*
+   * The objects built so far are abandoned, but nothing
+   * global has been touched yet
+   */
+  if ( ld.corrupt )
+  {
+    error_message( IMAGE_FILE " contains bad references -- loading the text files" );
+    munmap( map, st.st_size );
+    return 0;
+  }
+
+  image_install( &ld );
+
+  for ( type = 0; type < IMG_TYPES; type++ )
+    free( ld.objs[type] );
+
+  munmap( map, st.st_size );
+
+  init_html_codes();
+  init_brain();
+  build_fma_graph();
+
+  END_TIMING;
+
+  log_stringf( "Loaded the database from %s in %f seconds", IMAGE_FILE, TIMING_RESULT );
+
+  return 1;
+}
+
+/*
+ * Bring the text files up to date, then save an image of them
+ */
+HANDLER( do_save_image )
+{
+  journal_compact();
+
+  if ( !save_image() )
+    HND_ERR( "Could not save " IMAGE_FILE );
+
+  send_ok( req );
+}
@@ -0,0 +1,368 @@
+/*
+ *  image_internal.h
+ *  On-disk layout of the binary image of the database (see image.c).
+ *
+ *  Every pointer is stored as a reference: 0 for NULL, 1 for the type's
+ *  static sentinel (null_rect, obsolete_lyphview), otherwise 2 plus the
+ *  object's index in its type's section.  Strings are offsets into the
+ *  string heap (0 for NULL), and NULL-terminated arrays are offsets into
+ *  the reference heap, where a count precedes the elements (0 for NULL).
+ */
+#ifndef LYPH_IMAGE_INTERNAL_INCLUDE_GUARD
+#define LYPH_IMAGE_INTERNAL_INCLUDE_GUARD
+
+#include <stdint.h>
+
+#define IMAGE_MAGIC "LYPHIMG"
+#define IMAGE_BYTE_ORDER 0x01020304
+
+/*
+ * Bump this whenever any of the structures below (or the in-memory
+ * structures they mirror) change
+ */
+#define IMAGE_VERSION 1
+
+#define IMAGE_REF_NULL 0
+#define IMAGE_REF_SENTINEL 1
+#define IMAGE_REF( index ) ( (uint32_t) (index) + 2 )
+
+/*
+ * The text files the image was made from.  If any has changed since
+ * (e.g. because the journal was compacted), the image is out of date.
+ */
+#define IMAGE_SOURCES \
+{\
+  LYPHS_FILE, LYPHVIEWS_FILE, TEMPLATES_FILE, LAYERNAMES_FILE, LYPH_ANNOTS_FILE,\
+  PUBMED_FILE, PUBMED_FILE_DEPRECATED, CLINICAL_INDEX_FILE, CLINICAL_INDEX_FILE_DEPRECATED,\
+  LOCATED_MEASURE_FILE, CORRELATION_FILE, BOPS_FILE, FMA_FILE, NIFLING_FILE\
+}
+#define IMAGE_SOURCE_CNT 14
+
+typedef enum
+{
+  IMG_TRIE, IMG_LYPHPLATE, IMG_LAYER, IMG_LYPHNODE, IMG_EXIT, IMG_LYPH,
+  IMG_ANNOT, IMG_PUBMED, IMG_CLINDEX, IMG_VARIABLE, IMG_CORRELATION,
+  IMG_LOCMEAS, IMG_ADDED_EDGE, IMG_BOP, IMG_VIEW, IMG_RECT, IMG_FMA,
+  IMG_NIFLING, IMG_TYPES
+} image_types;
+
+/*
+ * The tries rooted at the globals of the same names, in this order.  The
+ * second column says what the data field of their nodes points to.
+ */
+#define IMAGE_TRIE_ROOTS \
+{\
+  { &iri_to_labels, IMG_TRIE }, { &label_to_iris, IMG_TRIE },\
+  { &label_to_iris_lowercase, IMG_TRIE }, { &superclasses, IMG_TRIE },\
+  { &lyphplate_names, IMG_LYPHPLATE }, { &lyphplate_ids, IMG_LYPHPLATE },\
+  { &layer_ids, IMG_LAYER }, { &lyphnode_ids, IMG_LYPHNODE },\
+  { &lyph_ids, IMG_LYPH }, { &lyph_names, IMG_LYPH },\
+  { &lyph_fmas, IMG_TYPES }, { &metadata, IMG_TYPES }\
+}
+#define IMAGE_TRIE_ROOT_CNT 12
+
+typedef struct IMAGE_STAMP image_stamp;
+typedef struct IMAGE_SECTION image_section;
+typedef struct IMAGE_HEADER image_header;
+typedef struct IMAGE_TRIE_ROOT image_trie_root;
+typedef struct IMG_TRIE_REC img_trie;
+typedef struct IMG_LYPHPLATE_REC img_lyphplate;
+typedef struct IMG_LAYER_REC img_layer;
+typedef struct IMG_LYPHNODE_REC img_lyphnode;
+typedef struct IMG_EXIT_REC img_exit;
+typedef struct IMG_LYPH_REC img_lyph;
+typedef struct IMG_ANNOT_REC img_annot;
+typedef struct IMG_PUBMED_REC img_pubmed;
+typedef struct IMG_CLINDEX_REC img_clindex;
+typedef struct IMG_VARIABLE_REC img_variable;
+typedef struct IMG_CORRELATION_REC img_correlation;
+typedef struct IMG_LOCMEAS_REC img_locmeas;
+typedef struct IMG_ADDED_EDGE_REC img_added_edge;
+typedef struct IMG_BOP_REC img_bop;
+typedef struct IMG_VIEW_REC img_view;
+typedef struct IMG_RECT_REC img_rect;
+typedef struct IMG_FMA_REC img_fma;
+typedef struct IMG_NIFLING_REC img_nifling;
+
+struct IMAGE_STAMP
+{
+  int64_t size;
+  int64_t mtime_sec;
+  int64_t mtime_nsec;
+};
+
+/*
+ * For object sections, the first "listed" records are the members, in
+ * order, of the type's global linked list (if it has one)
+ */
+struct IMAGE_SECTION
+{
+  uint64_t offset;
+  uint32_t cnt;
+  uint32_t listed;
+};
+
+struct IMAGE_HEADER
+{
+  char magic[8];
+  uint32_t version;
+  uint32_t byte_order;
+  uint64_t file_size;
+  image_stamp ontology;
+  image_stamp sources[IMAGE_SOURCE_CNT];
+  image_section sections[IMG_TYPES];
+  image_section strings;
+  image_section refs;
+  uint32_t ontology_file;
+  uint32_t trie_roots[IMAGE_TRIE_ROOT_CNT];
+  uint32_t human_species_lowercase;
+  uint32_t human_species_uppercase;
+  uint32_t views;
+  int32_t top_view;
+  int32_t top_layer_id;
+  int32_t top_lyphplate_id;
+  int32_t top_lyph_id;
+  int32_t top_lyphnode_id;
+  int32_t lyphcnt;
+};
+
+struct IMAGE_TRIE_ROOT
+{
+  trie **root;
+  int data_type;
+};
+
+/*
+ * data_type is an image_types value (IMG_TRIE meaning data is an array of
+ * tries), or IMG_TYPES if the node's data isn't kept
+ */
+struct IMG_TRIE_REC
+{
+  uint32_t parent;
+  uint32_t label;
+  uint32_t children;
+  uint32_t data_type;
+  uint32_t data;
+};
+
+struct IMG_LYPHPLATE_REC
+{
+  int64_t modified;
+  uint32_t misc_material;
+  uint32_t supers;
+  uint32_t subs;
+  uint32_t layers;
+  uint32_t ont_term;
+  uint32_t name;
+  uint32_t id;
+  uint32_t length;
+  int32_t type;
+  uint32_t padding;
+};
+
+struct IMG_LAYER_REC
+{
+  uint32_t material;
+  uint32_t id;
+  uint32_t name;
+  int32_t thickness;
+};
+
+struct IMG_LYPHNODE_REC
+{
+  uint32_t id;
+  uint32_t exits;
+  uint32_t incoming;
+  uint32_t location;
+  int32_t loctype;
+  int32_t layer;
+};
+
+struct IMG_EXIT_REC
+{
+  uint32_t to;
+  uint32_t via;
+};
+
+struct IMG_LYPH_REC
+{
+  int64_t modified;
+  uint32_t id;
+  uint32_t name;
+  uint32_t species;
+  int32_t type;
+  uint32_t from;
+  uint32_t to;
+  uint32_t lyphplt;
+  uint32_t constraints;
+  uint32_t annots;
+  uint32_t fma;
+  uint32_t pubmed;
+  uint32_t projection_strength;
+};
+
+struct IMG_ANNOT_REC
+{
+  uint32_t pred;
+  uint32_t obj;
+  uint32_t pubmed;
+};
+
+struct IMG_PUBMED_REC
+{
+  uint32_t id;
+  uint32_t title;
+};
+
+struct IMG_CLINDEX_REC
+{
+  uint32_t index;
+  uint32_t label;
+  uint32_t pubmeds;
+  uint32_t claimed;
+  uint32_t parents;
+  uint32_t children;
+};
+
+struct IMG_VARIABLE_REC
+{
+  int32_t type;
+  uint32_t ci;
+  uint32_t quality;
+  uint32_t loc;
+};
+
+struct IMG_CORRELATION_REC
+{
+  uint32_t vars;
+  uint32_t pbmd;
+  uint32_t comment;
+  int32_t id;
+};
+
+struct IMG_LOCMEAS_REC
+{
+  uint32_t quality;
+  uint32_t loc;
+  int32_t id;
+};
+
+struct IMG_ADDED_EDGE_REC
+{
+  uint32_t from;
+  uint32_t to;
+};
+
+struct IMG_BOP_REC
+{
+  int32_t id;
+  uint32_t excluded;
+  uint32_t added;
+  uint32_t measures;
+};
+
+struct IMG_VIEW_REC
+{
+  int64_t modified;
+  int32_t id;
+  uint32_t name;
+  uint32_t nodes;
+  uint32_t coords;
+  uint32_t rects;
+  uint32_t padding;
+};
+
+struct IMG_RECT_REC
+{
+  uint32_t L;
+  uint32_t x;
+  uint32_t y;
+  uint32_t width;
+  uint32_t height;
+};
+
+struct IMG_FMA_REC
+{
+  uint64_t id;
+  uint32_t parents;
+  uint32_t children;
+  uint32_t superclasses;
+  uint32_t subclasses;
+  uint32_t inferred_parts;
+  uint32_t inferred_parents;
+  uint32_t niflings;
+  uint32_t lyph;
+};
+
+struct IMG_NIFLING_REC
+{
+  uint32_t fma1;
+  uint32_t fma2;
+  uint32_t pubmed;
+  uint32_t proj;
+  uint32_t species;
+};
+
+/*
+ * While writing, records and heaps are built up in memory
+ */
+typedef struct IMAGE_BUF image_buf;
+typedef struct IMAGE_WRITER image_writer;
+typedef struct IMAGE_LOADER image_loader;
+
+struct IMAGE_BUF
+{
+  char *data;
+  size_t len;
+  size_t size;
+};
+
+struct IMAGE_WRITER
+{
+  image_buf recs[IMG_TYPES];
+  image_buf strings;
+  image_buf refs;
+
+  /*
+   * Objects found so far, by type, in index order; "done" counts those
+   * already written out as records
+   */
+  void **objs[IMG_TYPES];
+  uint32_t cnt[IMG_TYPES];
+  uint32_t size[IMG_TYPES];
+  uint32_t done[IMG_TYPES];
+  uint32_t listed[IMG_TYPES];
+  int *trie_data_types;
+
+  /*
+   * Open-addressed hash table from object address to index
+   */
+  const void **map_keys;
+  uint32_t *map_vals;
+  size_t map_size;
+  size_t map_cnt;
+};
+
+struct IMAGE_LOADER
+{
+  const char *base;
+  size_t size;
+  const image_header *hdr;
+  const char *strings;
+  const uint32_t *refs;
+  void **objs[IMG_TYPES];
+  trie *trie_roots[IMAGE_TRIE_ROOT_CNT];
+  trie *human_species_lowercase;
+  trie *human_species_uppercase;
+  lyphview **views;
+  int corrupt;
+};
+
+#define IMAGE_RECORDS( ld, type, rectype ) ( (const rectype *) ( (ld)->base + (ld)->hdr->sections[type].offset ) )
+
+#define IMAGE_INITIAL_MAP_SIZE 65536
+
+/*
+ * LYPH_IMAGE_INTERNAL_INCLUDE_GUARD
+ */
+#endif
@@ -0,0 +1,642 @@
+/*
+ *  journal.c
+ *  Write-ahead journal of changes to the database.
+ *
+ *  Rather than rewrite entire snapshot files (lyphs.dat, corr.json, etc.)
+ *  whenever anything changes, every request which may change the database
+ *  appends one line to the journal: the time, and the API command itself.
+ *  While it runs, the save_* functions it calls merely note which snapshots
+ *  are now out of date.  At startup, once the snapshots are loaded, the
+ *  journal is replayed by running its commands again.  Requests are
+ *  journaled even if they fail, since a failed request may still have
+ *  used up ids, and replay must hand out the same ids as the original run.
+ *
+ *  A background thread fsyncs the journal, each fsync covering every record
+ *  written since the last one, and a request isn't answered until its
+ *  record is on disk.  Every so often, the same thread compacts the journal:
+ *  it brings the out-of-date snapshots up to date, using the usual save_*
+ *  functions, and empties the journal.
+ *
+ *  The journal's records all belong to one generation, named on its first
+ *  line.  A compaction writes the new snapshots beside the old ones, then
+ *  commits them by rewriting SNAPSHOTS_FILE, which names the generation
+ *  they cover, the snapshots to be moved into place, and the id counters.
+ *  Only then are the new snapshots renamed over the old and the journal
+ *  started over at the next generation.  Whatever step a crash interrupts,
+ *  startup either finishes the renames (recover_snapshots) or ignores the
+ *  half-written snapshots, and replays exactly the records they don't cover.
+ */
+#include "lyph.h"
+#include "srv.h"
+#include <pthread.h>
+
+typedef struct JOURNAL_COUNTER
+{
+  const char *name;
+  int *value;
+  int saved;
+} journal_counter;
+
+extern int top_view;
+extern int top_layer_id;
+extern int top_lyphplate_id;
+extern int top_lyph_id;
+extern int top_lyphnode_id;
+
+/*
+ * The id counters can't be rebuilt from the snapshots (the highest ids may
+ * have been deleted), so they're recorded along with each compaction
+ */
+journal_counter journal_counters[] =
+{
+  { "top_view", &top_view, 0 },
+  { "top_layer_id", &top_layer_id, 0 },
+  { "top_lyphplate_id", &top_lyphplate_id, 0 },
+  { "top_lyph_id", &top_lyph_id, 0 },
+  { "top_lyphnode_id", &top_lyphnode_id, 0 },
+  { NULL, NULL, 0 }
+};
+
+/*
+ * Set while the calling thread runs a request whose saves are to be
+ * journaled rather than done on the spot
+ */
+__thread int journal_deferring;
+__thread int journal_deferred_cnt;
+
+/*
+ * While replaying, longtime() reports when the change was originally made
+ */
+__thread long long journal_replay_time;
+int journal_replaying;
+
+int journal_fd = -1;
+long journal_bytes;
+long journal_last_compaction;
+long long journal_written;
+long long journal_synced;
+
+/*
+ * The generation the journal's records belong to, and the last one whose
+ * records made it into the snapshots
+ */
+long long journal_generation = 1;
+long long snapshot_generation;
+
+/*
+ * Set while a compaction runs the save_* functions, so that open_snapshot
+ * writes the files beside the real ones, which are listed in journal_staged
+ */
+int journal_staging;
+char *journal_staged[JOURNAL_MAX_SNAPSHOTS * 2 + 1];
+int journal_staged_cnt;
+
+pthread_mutex_t journal_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t journal_cond = PTHREAD_COND_INITIALIZER;
+pthread_cond_t journal_synced_cond = PTHREAD_COND_INITIALIZER;
+
+/*
+ * The save functions whose snapshots are out of date (protected by db_lock:
+ * only changed under the exclusive lock)
+ */
+void (*journal_dirty[JOURNAL_MAX_SNAPSHOTS+1]) ( void );
+
+extern pthread_rwlock_t db_lock;
+
+void sync_data_dir( void );
+int commit_snapshots( void );
+void journal_restart( void );
+
+/*
+ * Called before anything is loaded: if the last compaction was interrupted
+ * after its commit, move the rest of its snapshots into place
+ */
+void recover_snapshots( void )
+{
+  FILE *fp;
+  char buf[MAX_STRING_LEN], *nl;
+  int renamed = 0;
+
+  if ( configs.readonly )
+    return;
+
+  if ( !(fp = fopen( SNAPSHOTS_FILE, "r" )) )
+    return;
+
+  while ( fgets( buf, sizeof(buf), fp ) )
+  {
+    journal_counter *c;
+
+    if ( (nl = strchr( buf, '\n' )) != NULL )
+      *nl = '\0';
+
+    if ( str_begins( buf, "generation " ) )
+    {
+      snapshot_generation = strtoll( buf + strlen( "generation " ), NULL, 10 );
+      continue;
+    }
+
+    if ( str_begins( buf, "staged " ) )
+    {
+      char *file = buf + strlen( "staged " );
+      char *staged = strdupf( "%s.%lld", file, snapshot_generation );
+
+      if ( !access( staged, F_OK ) )
+      {
+        if ( rename( staged, file ) == -1 )
+          error_messagef( "Could not rename %s to %s: %s", staged, file, strerror( errno ) );
+        else
+          renamed = 1;
+      }
+
+      free( staged );
+      continue;
+    }
+
+    for ( c = journal_counters; c->name; c++ )
+    {
+      if ( str_begins( buf, c->name ) && buf[strlen( c->name )] == ' ' )
+      {
+        c->saved = strtol( buf + strlen( c->name ) + 1, NULL, 10 );
+        break;
+      }
+    }
+  }
+
+  fclose( fp );
+
+  if ( renamed )
+  {
+    sync_data_dir();
+    log_string( "Finished moving the last compaction's snapshots into place" );
+  }
+
+  journal_generation = snapshot_generation + 1;
+}
+
+void init_journal( void )
+{
+  journal_counter *c;
+  pthread_t thread;
+
+  if ( configs.readonly )
+    return;
+
+  /*
+   * Whatever was loaded, the counters mustn't go back to ids already used
+   */
+  for ( c = journal_counters; c->name; c++ )
+    if ( c->saved > *c->value )
+      *c->value = c->saved;
+
+  if ( (journal_fd = open( JOURNAL_FILE, O_WRONLY | O_APPEND | O_CREAT, 0644 )) == -1 )
+  {
+    error_messagef( "Could not open %s for writing -- changes will be saved without journaling", JOURNAL_FILE );
+    return;
+  }
+
+  if ( replay_journal() )
+    journal_compact();
+  else
+    journal_restart();
+
+  journal_last_compaction = longtime_monotonic();
+
+  if ( pthread_create( &thread, NULL, journal_thread, NULL ) )
+  {
+    fprintf( stderr, "Fatal: Couldn't start journal thread\n" );
+    abort();
+  }
+
+  pthread_detach( thread );
+}
+
+/*
+ * Returns the number of commands replayed
+ */
+int replay_journal( void )
+{
+  char *file = load_file( JOURNAL_FILE ), *line, *end;
+  long long generation;
+  int cnt = 0;
+
+  if ( !file )
+    return 0;
+
+  /*
+   * A journal without a generation line predates generations, so its
+   * records can't have been compacted yet
+   */
+  if ( str_begins( file, "generation " ) && (end = strchr( file, '\n' )) != NULL )
+  {
+    generation = strtoll( file + strlen( "generation " ), NULL, 10 );
+    line = end + 1;
+  }
+  else
+  {
+    generation = snapshot_generation + 1;
+    line = file;
+  }
+
+  if ( generation <= snapshot_generation )
+  {
+    log_stringf( "Skipping %s: its changes are already in the snapshots", JOURNAL_FILE );
+    free( file );
+    return 0;
+  }
+
+  journal_generation = generation;
+  journal_replaying = 1;
+
+  for ( ; *line; line = end + 1 )
+  {
+    char *query;
+
+    /*
+     * A record cut off by a crash was never acknowledged, so skip it
+     */
+    if ( !(end = strchr( line, '\n' )) )
+      break;
+
+    *end = '\0';
+
+    journal_replay_time = strtoll( line, &query, 10 );
+
+    if ( *query != ' ' )
+    {
+      error_messagef( "Skipping malformed journal record: %s", line );
+      continue;
+    }
+
+    journal_begin();
+    run_one_api_cmd( query + 1 );
+    journal_end( NULL, 0 );
+    json_gc();
+
+    cnt++;
+  }
+
+  journal_replaying = 0;
+  journal_replay_time = 0;
+
+  free( file );
+
+  if ( cnt )
+    log_stringf( "Replayed %d journaled changes", cnt );
+
+  return cnt;
+}
+
+/*
+ * Called, with the exclusive lock held, before running a request
+ */
+void journal_begin( void )
+{
+  if ( journal_fd == -1 && !journal_replaying )
+    return;
+
+  journal_deferring = 1;
+  journal_deferred_cnt = 0;
+}
+
+/*
+ * Called by the save_* functions: returns 1 if the save should be skipped,
+ * because the change is to be journaled instead
+ */
+int journal_defer( void (*save_fnc) ( void ) )
+{
+  int i;
+
+  if ( !journal_deferring )
+    return 0;
+
+  for ( i = 0; journal_dirty[i]; i++ )
+    if ( journal_dirty[i] == save_fnc )
+      break;
+
+  if ( !journal_dirty[i] )
+  {
+    if ( i >= JOURNAL_MAX_SNAPSHOTS )
+      return 0;
+
+    journal_dirty[i] = save_fnc;
+  }
+
+  journal_deferred_cnt++;
+
+  return 1;
+}
+
+/*
+ * Called, with the exclusive lock still held, after running a request.
+ * If the request changed anything, or always is set (the request is one
+ * which may change the database, whether or not it succeeded), append it
+ * to the journal (unless query is NULL) and return a number to pass to
+ * journal_wait.
+ */
+long long journal_end( const char *query, int always )
+{
+  char *record;
+  long long seq;
+  int len, written;
+
+  if ( !journal_deferring )
+    return 0;
+
+  journal_deferring = 0;
+
+  if ( ( !journal_deferred_cnt && !always ) || !query || journal_replaying )
+    return 0;
+
+  record = strdupf( "%lld %s\n", longtime(), query );
+  len = strlen( record );
+
+  pthread_mutex_lock( &journal_mutex );
+
+  written = write( journal_fd, record, len );
+
+  if ( written == len )
+  {
+    journal_bytes += len;
+    seq = ++journal_written;
+    pthread_cond_signal( &journal_cond );
+  }
+  else
+    seq = 0;
+
+  pthread_mutex_unlock( &journal_mutex );
+
+  free( record );
+
+  /*
+   * Couldn't journal it, so fall back on saving everything right away
+   */
+  if ( !seq )
+  {
+    error_messagef( "Could not write to %s: %s", JOURNAL_FILE, strerror( errno ) );
+    journal_compact();
+  }
+
+  return seq;
+}
+
+/*
+ * Wait until the given journal record is safely on disk
+ */
+void journal_wait( long long seq )
+{
+  pthread_mutex_lock( &journal_mutex );
+
+  while ( journal_synced < seq )
+    pthread_cond_wait( &journal_synced_cond, &journal_mutex );
+
+  pthread_mutex_unlock( &journal_mutex );
+}
+
+/*
+ * The save_* functions open and close their snapshots with these.  During
+ * a compaction, the snapshot is written beside the real file (with the
+ * generation appended to its name) and synced, to be moved into place
+ * once the compaction is committed.
+ */
+FILE *open_snapshot( const char *file )
+{
+  char *staged;
+  FILE *fp;
+
+  if ( !journal_staging )
+    return fopen( file, "w" );
+
+  if ( journal_staged_cnt >= JOURNAL_MAX_SNAPSHOTS * 2 )
+  {
+    error_messagef( "Too many snapshots in one compaction -- writing %s in place", file );
+    return fopen( file, "w" );
+  }
+
+  staged = strdupf( "%s.%lld", file, journal_generation );
+  fp = fopen( staged, "w" );
+  free( staged );
+
+  if ( fp )
+    journal_staged[journal_staged_cnt++] = strdup( file );
+
+  return fp;
+}
+
+void close_snapshot( FILE *fp )
+{
+  if ( journal_staging )
+  {
+    fflush( fp );
+
+    if ( fsync( fileno( fp ) ) == -1 )
+      error_messagef( "Could not sync a snapshot: %s", strerror( errno ) );
+  }
+
+  fclose( fp );
+}
+
+/*
+ * Make renames and newly created files in the data directory durable
+ */
+void sync_data_dir( void )
+{
+  int fd = open( DATA_DIR, O_RDONLY | O_DIRECTORY );
+
+  if ( fd == -1 )
+  {
+    error_messagef( "Could not open %s to sync it: %s", DATA_DIR, strerror( errno ) );
+    return;
+  }
+
+  if ( fsync( fd ) == -1 )
+    error_messagef( "Could not sync %s: %s", DATA_DIR, strerror( errno ) );
+
+  close( fd );
+}
+
+/*
+ * Atomically replace SNAPSHOTS_FILE: from here on, the staged snapshots
+ * count as current, and the journal's generation as compacted
+ */
+int commit_snapshots( void )
+{
+  journal_counter *c;
+  FILE *fp;
+  int i, ok;
+
+  if ( !(fp = fopen( SNAPSHOTS_FILE ".tmp", "w" )) )
+  {
+    error_messagef( "Could not open %s for writing: %s", SNAPSHOTS_FILE ".tmp", strerror( errno ) );
+    return 0;
+  }
+
+  fprintf( fp, "generation %lld\n", journal_generation );
+
+  for ( c = journal_counters; c->name; c++ )
+    fprintf( fp, "%s %d\n", c->name, *c->value );
+
+  for ( i = 0; i < journal_staged_cnt; i++ )
+    fprintf( fp, "staged %s\n", journal_staged[i] );
+
+  ok = !fflush( fp ) && !fsync( fileno( fp ) );
+  ok = !fclose( fp ) && ok;
+
+  if ( !ok || rename( SNAPSHOTS_FILE ".tmp", SNAPSHOTS_FILE ) == -1 )
+  {
+    error_messagef( "Could not write %s: %s", SNAPSHOTS_FILE, strerror( errno ) );
+    return 0;
+  }
+
+  sync_data_dir();
+
+  return 1;
+}
+
+/*
+ * Empty the journal and start it over at the current generation.  Every
+ * record written so far is thereby done with.
+ */
+void journal_restart( void )
+{
+  char *header = strdupf( "generation %lld\n", journal_generation );
+  int len = strlen( header );
+
+  pthread_mutex_lock( &journal_mutex );
+
+  if ( journal_fd != -1 )
+  {
+    if ( ftruncate( journal_fd, 0 ) == -1 )
+      error_messagef( "Could not truncate %s: %s", JOURNAL_FILE, strerror( errno ) );
+    else if ( write( journal_fd, header, len ) != len )
+      error_messagef( "Could not write to %s: %s", JOURNAL_FILE, strerror( errno ) );
+  }
+
+  journal_bytes = 0;
+  journal_synced = journal_written;
+  journal_last_compaction = longtime_monotonic();
+  pthread_cond_broadcast( &journal_synced_cond );
+
+  pthread_mutex_unlock( &journal_mutex );
+
+  free( header );
+}
+
+/*
+ * Bring all snapshots up to date, then empty the journal.  The caller
+ * must hold db_lock (either side of it) so nothing changes meanwhile.
+ */
+void journal_compact( void )
+{
+  void (*dirty[JOURNAL_MAX_SNAPSHOTS+1]) ( void );
+  int i, deferring = journal_deferring;
+
+  if ( configs.readonly )
+    return;
+
+  memcpy( dirty, journal_dirty, sizeof(dirty) );
+  memset( journal_dirty, 0, sizeof(journal_dirty) );
+
+  journal_deferring = 0;
+  journal_staging = 1;
+  journal_staged_cnt = 0;
+
+  for ( i = 0; dirty[i]; i++ )
+    (*dirty[i]) ();
+
+  journal_staging = 0;
+  journal_deferring = deferring;
+
+  /*
+   * The staged snapshots must be on disk before the commit names them
+   */
+  sync_data_dir();
+
+  if ( !commit_snapshots() )
+  {
+    /*
+     * The old snapshots and the journal still hold everything, so
+     * just try again next time
+     */
+    memcpy( journal_dirty, dirty, sizeof(dirty) );
+
+    for ( i = 0; i < journal_staged_cnt; i++ )
+      free( journal_staged[i] );
+
+    return;
+  }
+
+  for ( i = 0; i < journal_staged_cnt; i++ )
+  {
+    char *staged = strdupf( "%s.%lld", journal_staged[i], journal_generation );
+
+    if ( rename( staged, journal_staged[i] ) == -1 )
+      error_messagef( "Could not rename %s to %s: %s", staged, journal_staged[i], strerror( errno ) );
+
+    free( staged );
+    free( journal_staged[i] );
+  }
+
+  if ( journal_staged_cnt )
+    sync_data_dir();
+
+  snapshot_generation = journal_generation++;
+
+  journal_restart();
+}
+
+void *journal_thread( void *arg )
+{
+  for ( ; ; )
+  {
+    long long target, synced;
+    int compact;
+
+    pthread_mutex_lock( &journal_mutex );
+
+    if ( journal_written == journal_synced )
+    {
+      struct timespec ts;
+
+      clock_gettime( CLOCK_REALTIME, &ts );
+      ts.tv_sec++;
+      pthread_cond_timedwait( &journal_cond, &journal_mutex, &ts );
+    }
+
+    target = journal_written;
+    synced = journal_synced;
+
+    compact = journal_bytes >= JOURNAL_COMPACT_BYTES
+    ||      ( journal_bytes && longtime_monotonic() - journal_last_compaction >= JOURNAL_COMPACT_SECS );
+
+    pthread_mutex_unlock( &journal_mutex );
+
+    /*
+     * Records keep arriving while we fsync; the next fsync covers them all
+     */
+    if ( target > synced )
+    {
+      if ( fdatasync( journal_fd ) == -1 )
+        error_messagef( "Could not sync %s: %s", JOURNAL_FILE, strerror( errno ) );
+
+      pthread_mutex_lock( &journal_mutex );
+
+      if ( journal_synced < target )
+        journal_synced = target;
+
+      pthread_cond_broadcast( &journal_synced_cond );
+      pthread_mutex_unlock( &journal_mutex );
+    }
+
+    if ( compact )
+    {
+      pthread_rwlock_rdlock( &db_lock );
+      journal_compact();
+      pthread_rwlock_unlock( &db_lock );
+
+      json_gc();
+    }
+  }
+
+  return NULL;
+}
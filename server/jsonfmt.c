@@ -12,6 +12,7 @@
 #include <string.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <sys/mman.h>
 #include "jsonfmt_internal.h"
 
 /*
@@ -184,16 +185,12 @@ char *json_format( const char *json, int indents, char **errptr )
     JSONFMT_ERR( "Non-terminated brace or bracket detected" );
 
   if ( !fContent )
-  {
-    buf = malloc( sizeof(char) );
-    *buf = '\0';
-    return buf;
-  }
+    return json_arena_strdup( "" );
 
   /*
    * Now that we know how much space is needed for the prettified json, allocate it.
    */
-  buf = malloc( (len+1) * sizeof(char) );
+  buf = json_arena_alloc( (len+1) * sizeof(char) );
 
   if ( !buf )
     JSONFMT_ERR( "Could not allocate enough memory" );
@@ -354,7 +351,7 @@ char *json_format( const char *json, int indents, char **errptr )
    * Nul-terminate our buffer and return it.
    */
   *bptr = '\0';
-  return prep_for_json_gc(buf);
+  return buf;
 }
 
 char *json_escape( const char *txt )
@@ -412,7 +409,7 @@ char *json_escape( const char *txt )
  */
 void add_spaces( char **ptr, int count )
 {
-  static char *spaces;
+  static __thread char *spaces;
 
   if ( !count )
   {
@@ -498,74 +495,133 @@ int last_nonspace_was_newline( char *ptr, char *buf )
 /*
  * Experimental material follows
  */
-json_str *first_js_str[JSON_HASH];
-json_str *last_js_str[JSON_HASH];
+/*
+ * Every string built by the functions below lives in a per-thread arena:
+ * one big region of address space, reserved up front and only backed by
+ * memory as it gets used.  Allocating bumps a pointer, json_gc() rewinds
+ * it, and "is this already JSON?" is a range check.
+ */
+__thread char *json_arena;
+__thread char *json_arena_top;
+__thread size_t json_arena_size;
 
-int is_json( const char *str )
+void json_arena_init( void )
 {
-  json_str *x;
-  int hash = get_js_hash( str );
+  size_t size;
+  void *p = MAP_FAILED;
 
-  for ( x = first_js_str[hash]; x; x = x->next )
-    if ( x->str == str )
-      return 1;
+  /*
+   * Under strict overcommit, a large reservation might be refused,
+   * so settle for less if necessary
+   */
+  for ( size = JSON_ARENA_RESERVE; size >= JSON_ARENA_MIN_RESERVE; size /= 2 )
+  {
+    p = mmap( NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0 );
 
-  return 0;
-}
+    if ( p != MAP_FAILED )
+      break;
+  }
 
-unsigned int get_js_hash( char const *str )
-{
-  return ((uintptr_t)str) % JSON_HASH;
+  if ( p == MAP_FAILED )
+  {
+    fprintf( stderr, "Fatal: Could not reserve memory for JSON arena\n" );
+    abort();
+  }
+
+  json_arena = json_arena_top = p;
+  json_arena_size = size;
 }
 
-char *prep_for_json_gc( char *str )
+char *json_arena_alloc( size_t len )
 {
-  json_str *x;
-  int hash;
+  char *retval;
 
-  x = malloc( sizeof( json_str ) );
+  if ( !json_arena )
+    json_arena_init();
 
-  if ( !x )
+  if ( len > json_arena_size - (json_arena_top - json_arena) )
     return NULL;
 
-  x->str = str;
+  retval = json_arena_top;
+  json_arena_top += len;
 
-  hash = get_js_hash( str );
+  return retval;
+}
 
-  JSONFMT_LINK( x, first_js_str[hash], last_js_str[hash], next );
+char *json_arena_strdup( const char *str )
+{
+  size_t len = strlen( str ) + 1;
+  char *buf = json_arena_alloc( len );
 
-  return str;
+  if ( buf )
+    memcpy( buf, str, len );
+
+  return buf;
+}
+
+int is_json( const char *str )
+{
+  return str >= json_arena && str < json_arena_top;
 }
 
 void json_gc( void )
 {
-  json_str *x, *x_next;
-  int hash;
+  if ( !json_arena )
+    return;
 
-  for ( hash = 0; hash < JSON_HASH; hash++ )
-  {
-    for ( x = first_js_str[hash]; x; x = x_next )
-    {
-      x_next = x->next;
+  /*
+   * Give back the memory used by an unusually large response,
+   * but keep the start of the arena warm for the next one
+   */
+  if ( json_arena_top - json_arena > JSON_ARENA_KEEP )
+    madvise( json_arena + JSON_ARENA_KEEP, json_arena_top - json_arena - JSON_ARENA_KEEP, MADV_DONTNEED );
 
-      free( x->str );
-      free( x );
-    }
-    first_js_str[hash] = NULL;
-    last_js_str[hash] = NULL;
-  }
+  json_arena_top = json_arena;
+}
+
+/*
+ * For discarding just the strings built since a certain point,
+ * rather than all of them
+ */
+char *json_arena_mark( void )
+{
+  if ( !json_arena )
+    json_arena_init();
+
+  return json_arena_top;
+}
+
+void json_arena_rewind( char *mark )
+{
+  if ( mark >= json_arena && mark <= json_arena_top )
+    json_arena_top = mark;
 }
 
 char *json_c_adapter( int paircnt, ... )
 {
   va_list vargs;
-  char **args, **argspt, *ch, *buf, *bptr;
-  int i, len, rawcnt;
+  char *local_args[JSON_LOCAL_ARGS], **args, **argspt, *ch, *buf, *bptr;
+  size_t local_lens[JSON_LOCAL_ARGS], *lens, *lenspt, len;
+  int i, rawcnt;
 
   rawcnt = paircnt * 2;
 
-  if ( (args = malloc(sizeof(char*) * (1+rawcnt))) == NULL )
-    return NULL;
+  if ( rawcnt < JSON_LOCAL_ARGS )
+  {
+    args = local_args;
+    lens = local_lens;
+  }
+  else
+  {
+    if ( (args = malloc(sizeof(char*) * (1+rawcnt))) == NULL )
+      return NULL;
+
+    if ( (lens = malloc(sizeof(size_t) * rawcnt)) == NULL )
+    {
+      free( args );
+      return NULL;
+    }
+  }
 
   va_start( vargs, paircnt );
 
@@ -574,56 +630,55 @@ char *json_c_adapter( int paircnt, ... )
     ch = va_arg( vargs, char * );
 
     if ( !ch )
-    {
-      args[i] = prep_for_json_gc( strdup( "null" ) );
-      len += strlen( "null" );
-      continue;
-    }
-
-    if ( ch == js_suppress )
-      args[i] = ch;
+      args[i] = "null";
     else
-    if ( is_json( ch ) )
-    {
+    if ( ch == js_suppress || is_json( ch ) )
       args[i] = ch;
-      len += strlen( ch );
-    }
     else
-    {
-      char *escaped = json_escape( ch );
-      args[i] = json_enquote( escaped );
-      free( escaped );
-      len += strlen( args[i] );
-    }
+      args[i] = json_quote_escaped( ch );
+
+    if ( !args[i] )
+      break;
+
+    lens[i] = strlen( args[i] );
+    len += lens[i];
   }
-  args[rawcnt] = NULL;
+  args[i] = NULL;
 
   va_end( vargs );
 
-  len += strlen("{}") + ( strlen(":,") * paircnt ) - strlen(",");
+  /*
+   * Room for braces, colons and commas (one comma too many, when there are
+   * pairs at all, which pays for the terminating nul)
+   */
+  len += strlen("{}") + ( strlen(":,") * paircnt ) + 1;
 
-  if ( (buf = malloc(len+1)) == NULL )
+  if ( i < rawcnt || (buf = json_arena_alloc( len )) == NULL )
   {
-    free( args );
+    if ( args != local_args )
+    {
+      free( args );
+      free( lens );
+    }
     return NULL;
   }
 
   bptr = buf;
   *bptr = '{';
 
-  for ( argspt = args; *argspt; argspt += 2 )
+  for ( argspt = args, lenspt = lens; *argspt; argspt += 2, lenspt += 2 )
   {
     if ( argspt[1] == js_suppress )
       continue;
 
     ++bptr;
-    strcpy( bptr, *argspt );
-    bptr = &bptr[strlen(bptr)];
+    memcpy( bptr, *argspt, lenspt[0] );
+    bptr += lenspt[0];
 
     *bptr++ = ':';
 
-    strcpy( bptr, argspt[1] );
-    bptr = &bptr[strlen(bptr)];
+    memcpy( bptr, argspt[1], lenspt[1] );
+    bptr += lenspt[1];
     *bptr = ',';
   }
 
@@ -633,18 +688,82 @@ char *json_c_adapter( int paircnt, ... )
   *bptr = '}';
   bptr[1] = '\0';
 
-  free( args );
+  if ( args != local_args )
+  {
+    free( args );
+    free( lens );
+  }
 
-  return prep_for_json_gc( buf );
+  return buf;
 }
 
 char *json_enquote( const char *str )
 {
-  char *buf = malloc( strlen(str) + strlen("\"\"") + 1 );
+  size_t len = strlen( str );
+  char *buf = json_arena_alloc( len + strlen("\"\"") + 1 );
+
+  if ( !buf )
+    return NULL;
+
+  buf[0] = '"';
+  memcpy( &buf[1], str, len );
+  buf[len+1] = '"';
+  buf[len+2] = '\0';
+
+  return buf;
+}
+
+/*
+ * Equivalent to json_enquote( json_escape( txt ) ), but writes
+ * straight into the arena
+ */
+char *json_quote_escaped( const char *txt )
+{
+  const char *ptr;
+  char *buf, *bptr;
+  size_t len;
+
+  for ( len = 0, ptr = txt; *ptr; ptr++ )
+  {
+    switch( *ptr )
+    {
+      case '"':
+      case '\\':
+      case '\n':
+        len++;
+      default:
+        continue;
+    }
+  }
+
+  len += (ptr - txt);
+
+  if ( (buf = json_arena_alloc( len + strlen("\"\"") + 1 )) == NULL )
+    return NULL;
+
+  bptr = buf;
+  *bptr++ = '"';
+
+  for ( ptr = txt; *ptr; ptr++ )
+  {
+    switch( *ptr )
+    {
+      case '\n':
+        *bptr++ = '\\';
+        *bptr++ = 'n';
+        break;
+      case '"':
+      case '\\':
+        *bptr++ = '\\';
+      default:
+        *bptr++ = *ptr;
+    }
+  }
 
-  sprintf( buf, "\"%s\"", str );
+  *bptr++ = '"';
+  *bptr = '\0';
 
-  return prep_for_json_gc( buf );
+  return buf;
 }
 
 char *json_array_worker( char * (*fnc) (void *), void **array )
@@ -660,11 +779,12 @@ char *json_array_worker_r( char * (*fnc) (void *, void *), void **array, void *d
 char *json_array_worker_( char * (*non_reentrant) (void *), char * (*reentrant) (void *, void *), void **array, void *data )
 {
   char **results, **rptr, *buf, *bptr;
+  size_t *lens, *lptr, len;
   void **ptr;
-  int cnt, len;
+  int cnt;
 
   if ( !array )
-    return prep_for_json_gc( strdup( "[]" ) );
+    return json_arena_strdup( "[]" );
 
   for ( ptr = array; *ptr; ptr++ )
     ;
@@ -672,85 +792,79 @@ char *json_array_worker_( char * (*non_reentrant) (void *), char * (*reentrant)
   cnt = ptr - array;
 
   if ( !cnt )
-    return prep_for_json_gc( strdup( "[]" ) );
+    return json_arena_strdup( "[]" );
 
   if ( (results = malloc( sizeof( char *) * (cnt+1) )) == NULL )
     return NULL;
 
+  if ( (lens = malloc( sizeof( size_t ) * cnt )) == NULL )
+  {
+    free( results );
+    return NULL;
+  }
+
   rptr = results;
+  lptr = lens;
 
-  if ( non_reentrant )
+  for ( ptr = array, len = 0; *ptr; ptr++ )
   {
-    for ( ptr = array, len = 0; *ptr; ptr++ )
-    {
-      if ( (*rptr = (*non_reentrant) (*ptr) ) == NULL )
-      {
-        free( results );
-        return NULL;
-      }
+    if ( non_reentrant )
+      *rptr = (*non_reentrant) (*ptr);
+    else
+      *rptr = (*reentrant) (*ptr,data);
 
-      len += strlen( *rptr );
-      rptr++;
-    }
-  }
-  else
-  {
-    for ( ptr = array, len = 0; *ptr; ptr++ )
+    if ( !*rptr )
     {
-      if ( (*rptr = (*reentrant) (*ptr,data) ) == NULL )
-      {
-        free( results );
-        return NULL;
-      }
-
-      len += strlen( *rptr );
-      rptr++;
+      free( results );
+      free( lens );
+      return NULL;
     }
+
+    *lptr = strlen( *rptr );
+    len += *lptr++;
+    rptr++;
   }
 
   *rptr = NULL;
 
   len += strlen("[]") + ( strlen(",") * (cnt-1) );
 
-  if ( (buf = malloc( len + 1 )) == NULL )
+  if ( (buf = json_arena_alloc( len + 1 )) == NULL )
   {
     free( results );
+    free( lens );
     return NULL;
   }
 
   bptr = buf;
   *bptr = '[';
 
-  for (rptr = results; *rptr; rptr++)
+  for ( rptr = results, lptr = lens; *rptr; rptr++, lptr++ )
   {
     bptr++;
-    strcpy( bptr, *rptr );
-    bptr = &bptr[strlen(bptr)];
+    memcpy( bptr, *rptr, *lptr );
+    bptr += *lptr;
     *bptr = ',';
   }
 
   free( results );
+  free( lens );
 
   bptr[0] = ']';
   bptr[1] = '\0';
 
-  return prep_for_json_gc(buf);
+  return buf;
 }
 
 char *str_to_json( char *x )
 {
   if ( !x )
-    return prep_for_json_gc( strdup( "null" ) );
+    return json_arena_strdup( "null" );
 
   if ( is_json( x ) )
     return x;
   else
-  {
-    char *escaped = json_escape( x );
-    char *retval = json_enquote( escaped );
-    free( escaped );
-    return retval;
-  }
+    return json_quote_escaped( x );
 }
 
 char *int_to_json( int x )
@@ -22,6 +22,8 @@ char *json_escape( const char *txt );
  */
 char *json_c_adapter( int paircnt, ... );
 void json_gc( void );
+char *json_arena_mark( void );
+void json_arena_rewind( char *mark );
 char *json_array_worker( char * (*fnc) (void *), void **array );
 char *json_array_worker_r( char * (*fnc) (void *, void *), void **array, void *data );
 char *str_to_json( char *x );
@@ -14,7 +14,20 @@
 #include <stdarg.h>
 #include <stdio.h>
 
-#define JSON_HASH 1048576
+/*
+ * Address space reserved for each thread's JSON arena.  Only the pages
+ * actually written to use memory.  After a response, anything beyond
+ * JSON_ARENA_KEEP bytes is handed back to the OS.
+ */
+#define JSON_ARENA_RESERVE ( sizeof(void*) > 4 ? (size_t)1 << 32 : (size_t)1 << 28 )
+#define JSON_ARENA_MIN_RESERVE ( (size_t)1 << 26 )
+#define JSON_ARENA_KEEP ( 1 << 20 )
+
+/*
+ * JSON objects with up to this many keys and values are built
+ * without any malloc
+ */
+#define JSON_LOCAL_ARGS 64
 
 #define JSONFMT_ERR( txt )\
   do\
@@ -25,36 +38,19 @@
   }\
   while(0)
 
-#define JSONFMT_LINK( link, first, last, next )\
-do\
-{\
-  (link)->next = NULL;\
-  if ( last )\
-    (last)->next = (link);\
-  else\
-    (first) = (link);\
-  (last) = (link);\
-} while(0)
-
 #define MAX_LEVEL 128
 #define MAX_INDENT_SIZE 32
 
-typedef struct JSON_STR json_str;
-
-struct JSON_STR
-{
-  json_str *next;
-  char *str;
-};
-
 void add_spaces( char **ptr, int count );
 int next_nonwhitespace_is( const char *ptr, char c, const char **where );
 int last_nonspace_was_newline( char *ptr, char *buf );
+void json_arena_init( void );
+char *json_arena_alloc( size_t len );
+char *json_arena_strdup( const char *str );
 int is_json( const char *str );
-unsigned int get_js_hash( char const *str );
 char *json_c_adapter( int paircnt, ... );
 char *json_enquote( const char *str );
-char *prep_for_json_gc( char *str );
+char *json_quote_escaped( const char *txt );
 char *json_array_worker_( char * (*non_reentrant) (void *), char * (*reentrant) (void *, void *), void **array, void *data );
 
 /*
@@ -4,16 +4,18 @@
  *  and some miscelaneous ontology-term logic.
  */
 #include "lyph.h"
+#include "srv.h"
 #include "nt_parse.h"
+#include <pthread.h>
 
-void init_labels(FILE *fp)
+void init_labels(const char *filename)
 {
   iri_to_labels = blank_trie();
   label_to_iris = blank_trie();
   label_to_iris_lowercase = blank_trie();
   superclasses = blank_trie();
 
-  parse_ontology_file( fp );
+  parse_ontology_file( filename );
 
   lyphplate_names = blank_trie();
   lyphplate_ids = blank_trie();
@@ -51,41 +53,172 @@ void init_labels(FILE *fp)
   return;
 }
 
-void got_triple( char *subj, char *pred, char *obj )
+/*
+ * Runs on the parser's threads, so it mustn't touch the tries
+ */
+int classify_triple( const char *subj, const char *pred, const char *obj )
 {
   if ( !strcmp( pred, "<http://www.w3.org/2000/01/rdf-schema#label>" )
   ||   !strcmp( pred, "<rdfs:label>" ) )
   {
     if ( *obj == '"' && *subj == '<' )
-    {
-      obj[strlen(obj)-1] = '\0';
-      subj[strlen(subj)-1] = '\0';
+      return ONT_TRIPLE_LABEL;
 
-      add_labels_entry( &subj[1], &obj[1] );
-    }
-    goto got_triple_cleanup;
+    return 0;
   }
 
   if ( !strcmp( pred, "<http://www.w3.org/2000/01/rdf-schema#subClassOf>" )
   ||   !strcmp( pred, "<rdfs:subClassOf>" ) )
+    return ONT_TRIPLE_SUBCLASS;
+
+  return 0;
+}
+
+/*
+ * Build the ontology tries from all the label and subclass triples at once.
+ * Each of the four tries is laid out by trie_build on a thread of its own;
+ * then the nodes are linked to one another in file order, which gives the
+ * same data arrays as adding the triples one at a time would.
+ */
+void got_triples( nt_triple *triples, int cnt )
+{
+  ontology_trie_job jobs[ONTOLOGY_TRIE_JOBS];
+  pthread_t threads[ONTOLOGY_TRIE_JOBS];
+  int threaded[ONTOLOGY_TRIE_JOBS];
+  const char **iris, **labels, **lowercases, **classes;
+  trie **iri_nodes, **label_nodes, **lowercase_nodes, **class_nodes;
+  char *lowercase_buf, *lptr;
+  size_t lowercase_len;
+  nt_triple *t;
+  int i;
+
+  for ( i = 0, lowercase_len = 0; i < cnt; i++ )
+  {
+    t = &triples[i];
+
+    t->obj[strlen(t->obj)-1] = '\0';
+    t->subj[strlen(t->subj)-1] = '\0';
+    t->obj++;
+    t->subj++;
+
+    if ( t->kind == ONT_TRIPLE_LABEL )
+      lowercase_len += strlen( t->obj ) + 1;
+  }
+
+  CREATE( iris, const char *, 2 * cnt + 1 );
+  CREATE( labels, const char *, cnt + 1 );
+  CREATE( lowercases, const char *, cnt + 1 );
+  CREATE( classes, const char *, 2 * cnt + 1 );
+  CREATE( lowercase_buf, char, lowercase_len + 1 );
+
+  /*
+   * iris and classes have two keys per triple: for a label, the IRI and
+   * its shortform (the latter also going in superclasses); for a subclass,
+   * the child and the parent
+   */
+  for ( i = 0, lptr = lowercase_buf; i < cnt; i++ )
   {
-    obj[strlen(obj)-1] = '\0';
-    subj[strlen(subj)-1] = '\0';
+    char *iri_ch, *label_ch, *shortform;
 
-    add_subclass_entry( &subj[1], &obj[1] );
+    t = &triples[i];
+    iri_ch = t->subj;
+    label_ch = t->obj;
+
+    if ( t->kind == ONT_TRIPLE_LABEL )
+    {
+      shortform = get_url_shortform( iri_ch );
+
+      iris[2*i] = iri_ch;
+      iris[2*i+1] = shortform;
+      labels[i] = label_ch;
+      classes[2*i] = shortform;
+
+      lowercases[i] = lptr;
+      strcpy( lptr, lowercaserize( label_ch ) );
+      lptr += strlen( lptr ) + 1;
+    }
+    else
+    {
+      classes[2*i] = get_url_shortform( iri_ch );
+      if ( !classes[2*i] )
+        classes[2*i] = iri_ch;
+
+      classes[2*i+1] = get_url_shortform( label_ch );
+      if ( !classes[2*i+1] )
+        classes[2*i+1] = label_ch;
+    }
+  }
+
+  CREATE( iri_nodes, trie *, 2 * cnt + 1 );
+  CREATE( label_nodes, trie *, cnt + 1 );
+  CREATE( lowercase_nodes, trie *, cnt + 1 );
+  CREATE( class_nodes, trie *, 2 * cnt + 1 );
+
+  jobs[0] = (ontology_trie_job) { iri_to_labels, iris, iri_nodes, 2 * cnt };
+  jobs[1] = (ontology_trie_job) { label_to_iris, labels, label_nodes, cnt };
+  jobs[2] = (ontology_trie_job) { label_to_iris_lowercase, lowercases, lowercase_nodes, cnt };
+  jobs[3] = (ontology_trie_job) { superclasses, classes, class_nodes, 2 * cnt };
+
+  for ( i = 1; i < ONTOLOGY_TRIE_JOBS; i++ )
+    threaded[i] = !pthread_create( &threads[i], NULL, build_ontology_trie, &jobs[i] );
+
+  build_ontology_trie( &jobs[0] );
+
+  for ( i = 1; i < ONTOLOGY_TRIE_JOBS; i++ )
+  {
+    if ( threaded[i] )
+      pthread_join( threads[i], NULL );
+    else
+      build_ontology_trie( &jobs[i] );
   }
 
-  got_triple_cleanup:
-  free( subj );
-  free( pred );
-  free( obj );
+  for ( i = 0; i < cnt; i++ )
+  {
+    if ( triples[i].kind == ONT_TRIPLE_LABEL )
+    {
+      trie *iri = iri_nodes[2*i], *label = label_nodes[i];
+
+      add_to_data( &iri->data, label );
+      add_to_data( &label->data, iri );
+
+      if ( iri_nodes[2*i+1] )
+      {
+        add_to_data( &iri_nodes[2*i+1]->data, label );
+
+        if ( !class_nodes[2*i]->data )
+          class_nodes[2*i]->data = (trie**)blank_void_array();
+      }
+
+      add_to_data( &lowercase_nodes[i]->data, iri );
+    }
+    else
+      add_to_data( &class_nodes[2*i]->data, class_nodes[2*i+1] );
+  }
+
+  MULTIFREE( iris, labels, lowercases, classes, lowercase_buf );
+  MULTIFREE( iri_nodes, label_nodes, lowercase_nodes, class_nodes );
+}
+
+void *build_ontology_trie( void *arg )
+{
+  ontology_trie_job *job = (ontology_trie_job *) arg;
+
+  trie_build( job->base, job->keys, job->nodes, job->cnt );
+
+  return NULL;
 }
 
-void parse_ontology_file(FILE *fp)
+void parse_ontology_file( const char *filename )
 {
   char *err = NULL;
+  int threads = sysconf( _SC_NPROCESSORS_ONLN );
+
+  if ( threads < 1 )
+    threads = 1;
+  else if ( threads > MAX_ONTOLOGY_THREADS )
+    threads = MAX_ONTOLOGY_THREADS;
 
-  if ( !parse_ntriples( fp, &err, MAX_IRI_LEN, got_triple ) )
+  if ( !parse_ntriples_parallel( filename, &err, MAX_IRI_LEN, threads, classify_triple, got_triples ) )
   {
     char *buf = malloc(strlen(err) + 1024);
 
@@ -119,50 +252,33 @@ void add_to_data( trie ***dest, trie *datum )
   }
 }
 
-void add_subclass_entry( char *child_ch, char *parent_ch )
+/*
+ * Take one occurrence of datum out of a data array, freeing the array
+ * if that empties it
+ */
+void remove_from_data( trie ***dest, trie *datum )
 {
-  char *child_shortform = get_url_shortform( child_ch );
-  char *parent_shortform = get_url_shortform( parent_ch );
-  trie *child, *parent;
+  trie **ptr;
 
-  if ( !child_shortform )
-    child_shortform = child_ch;
-  if ( !parent_shortform )
-    parent_shortform = parent_ch;
-
-  child = trie_strdup( child_shortform, superclasses );
-  parent = trie_strdup( parent_shortform, superclasses );
+  if ( !*dest )
+    return;
 
-  add_to_data( &child->data, parent );
-}
+  for ( ptr = *dest; *ptr; ptr++ )
+    if ( *ptr == datum )
+      break;
 
-void add_labels_entry( char *iri_ch, char *label_ch )
-{
-  char *iri_shortform_ch, *label_lowercase_ch;
-  trie *iri = trie_strdup(iri_ch, iri_to_labels);
-  trie *label = trie_strdup(label_ch, label_to_iris);
-  trie *label_lowercase;
-  trie *in_superclasses;
+  if ( !*ptr )
+    return;
 
-  add_to_data( &iri->data, label );
-  add_to_data( &label->data, iri );
+  do
+    ptr[0] = ptr[1];
+  while ( *ptr++ );
 
-  if ( (iri_shortform_ch = get_url_shortform(iri_ch)) != NULL )
+  if ( !**dest )
   {
-    trie *iri_shortform = trie_strdup( iri_shortform_ch, iri_to_labels );
-    add_to_data( &iri_shortform->data, label );
-
-    in_superclasses = trie_strdup( iri_shortform_ch, superclasses );
-
-    if ( !in_superclasses->data )
-      in_superclasses->data = (trie**)blank_void_array();
+    free( *dest );
+    *dest = NULL;
   }
-
-  label_lowercase_ch = lowercaserize(label_ch);
-  label_lowercase = trie_strdup( label_lowercase_ch, label_to_iris_lowercase );
-  add_to_data( &label_lowercase->data, iri );
-
-  return;
 }
 
 trie **get_labels_by_iri( char *iri_ch )
@@ -198,28 +314,25 @@ trie **get_iris_by_label_case_insensitive( char *label_ch )
 
 trie **get_autocomplete_labels( char *label_ch, int case_insens )
 {
-  static trie **buf;
+  static __thread trie *buf[MAX_AUTOCOMPLETE_RESULTS + 1];
 
   if ( case_insens )
     label_ch = lowercaserize( label_ch );
 
-  if ( !buf )
-    CREATE( buf, trie *, MAX_AUTOCOMPLETE_RESULTS_PRESORT + 1 );
-
-  trie_search_autocomplete( label_ch, buf, case_insens ? label_to_iris_lowercase : label_to_iris, 0, 0 );
+  autocomplete( case_insens ? lowercase_autocomplete : label_autocomplete, label_ch, buf, MAX_AUTOCOMPLETE_RESULTS );
 
   return buf;
 }
 
-void all_ont_terms_as_json_populator( trie ***bptr, trie *t )
+/*
+ * Once the label tries are complete (whether parsed or loaded from the
+ * image), index them for searching
+ */
+void index_labels( void )
 {
-  if ( t->data )
-  {
-    **bptr = t;
-    (*bptr)++;
-  }
-
-  TRIE_RECURSE( all_ont_terms_as_json_populator( bptr, *child ) );
+  label_autocomplete = build_autocomplete_index( label_to_iris );
+  lowercase_autocomplete = build_autocomplete_index( label_to_iris_lowercase );
+  label_word_index = build_word_index( label_to_iris );
 }
 
 char *ont_term_to_json( trie *t )
@@ -233,20 +346,10 @@ char *ont_term_to_json( trie *t )
   );
 }
 
-char *all_ont_terms_as_json( void )
+void all_ont_terms_to_stream( json_stream *s, trie *t )
 {
-  trie **buf, **bptr;
-  char *retval;
-  int cnt = count_nontrivial_members( iri_to_labels );
-
-  CREATE( buf, trie *, cnt + 1 );
-  bptr = buf;
-
-  all_ont_terms_as_json_populator( &bptr, iri_to_labels );
-  *bptr = NULL;
-
-  retval = JS_ARRAY( ont_term_to_json, buf );
-  free( buf );
+  if ( t->data )
+    json_stream_value( s, NULL, ont_term_to_json( t ) );
 
-  return retval;
+  TRIE_RECURSE( all_ont_terms_to_stream( s, *child ) );
 }
@@ -19,13 +19,19 @@ lyph *find_duplicate_lyph( int type, lyphnode *from, lyphnode *to, lyphplate *L,
 lyph *find_duplicate_lyph_worker( int type, lyphnode *from, lyphnode *to, lyphplate *L, trie *fma, trie *name, char *pubmedstr, char *projstr, trie *species_tr );
 trie *new_lyphnode_id(lyphnode *n);
 lyphplate **parse_lyph_constraints( char *str );
-int lyph_passes_filter( lyph *e, lyph_filter *f );
 void load_lyphplate_length( char *subj_full, char *length_str );
 void load_lyphplate_modified( char *subj_full, char *modifiedstr );
 char *lyphnode_to_json_brief( lyphnode *n );
-void calc_nodes_directly_in_lyph_buf_recurse( lyph *e, lyphnode_wrapper **head, lyphnode_wrapper **tail, lyph **buf, trie *t );
+void locate_connections_nodes( lyph_connections *c );
 void save_one_lyph( lyph *e, FILE *fp );
 void save_one_lyphplate( lyphplate *L, FILE *fp, trie *avoid_dupes );
+void index_lyph_( lyph *e, int add );
+void index_lyph_text( const char *text, lyph *e, int add );
+int count_lyph_postings( trie *t );
+void populate_lyphs_by_prefix( trie *t, lyph ***bptr, trie *species, int include_null_species, int include_any_species );
+void compute_lyph_containment( void );
+lyph *compute_lyph_location( lyph *e );
+lyph *find_lyph_location( lyph *e );
 
 int top_layer_id;
 int top_lyphplate_id;
@@ -38,6 +44,8 @@ lyph *null_rect = &null_rect_ptr;
 lyph *first_lyph;
 lyph *last_lyph;
 int lyphcnt;
+int lyph_containment_stale = 1;
+pthread_mutex_t lyph_containment_mutex = PTHREAD_MUTEX_INITIALIZER;
 
 lyphplate *first_lyphplate;
 lyphplate *last_lyphplate;
@@ -46,8 +54,8 @@ lyphview **views;
 lyphview obsolete_lyphview;
 int top_view;
 
-int lyphnode_to_json_flags;
-int exit_to_json_flags;
+__thread int lyphnode_to_json_flags;
+__thread int exit_to_json_flags;
 
 lyphview *create_new_view( lyphnode **nodes, char **xs, char **ys, lyph **lyphs, char **lxs, char **lys, char **widths, char **heights, char *name )
 {
@@ -144,6 +152,7 @@ void free_all_lyphs( void )
 
   first_lyph = NULL;
   last_lyph = NULL;
+  lyph_containment_changed();
 
   free_all_views();
   free_all_located_measures();
@@ -162,6 +171,7 @@ void free_all_lyphplates( void )
   lyphplate_names = blank_trie();
   first_lyphplate = NULL;
   last_lyphplate = NULL;
+  lyphplate_graph_changed();
   layer_ids = blank_trie();
   save_lyphplates();
 
@@ -218,18 +228,18 @@ lyphview *lyphview_by_id( char *idstr )
 
 int marked_as_house( lyph *e )
 {
-  return IS_SET( e->flags, 1 );
+  return IS_SET( e->flags[worker_slot], 1 );
 }
 
 void mark_houses( lyph *e, lyph_wrapper **head, lyph_wrapper **tail )
 {
-  lyph *house = get_lyph_location( e );
+  lyph *house = compute_lyph_location( e );
 
   if ( house && !marked_as_house( house ) )
   {
     lyph_wrapper *w;
 
-    SET_BIT( house->flags, 1 );
+    SET_BIT( house->flags[worker_slot], 1 );
     CREATE( w, lyph_wrapper, 1 );
     w->e = house;
     LINK( w, *head, *tail, next );
@@ -244,7 +254,7 @@ void unmark_houses( lyph_wrapper **head, lyph_wrapper **tail )
   for ( w = *head; w; w = w_next )
   {
     w_next = w->next;
-    REMOVE_BIT( w->e->flags, 1 );
+    REMOVE_BIT( w->e->flags[worker_slot], 1 );
     free( w );
   }
 
@@ -325,7 +335,87 @@ lyph **get_lyphs_partly_located_in( lyph **ebuf )
   return buf;
 }
 
-lyph *get_lyph_location( lyph *e )
+/*
+ * Which lyph houses which.  Like the lyph graph (see graph.c), this is
+ * worked out from scratch when needed: anything that moves a lyphnode, or
+ * creates, deletes or reconnects a lyph, calls lyph_containment_changed,
+ * and the next query recomputes every lyph's house, and every lyph's
+ * children (the lyphs both of whose ends are located in it), once.
+ * After that, walking up or down the tree costs only what it finds.
+ */
+void lyph_containment_changed( void )
+{
+  lyph_containment_stale = 1;
+}
+
+void current_lyph_containment( void )
+{
+  if ( lyph_containment_stale )
+  {
+    pthread_mutex_lock( &lyph_containment_mutex );
+
+    if ( lyph_containment_stale )
+    {
+      compute_lyph_containment();
+      __sync_synchronize();
+      lyph_containment_stale = 0;
+    }
+
+    pthread_mutex_unlock( &lyph_containment_mutex );
+  }
+}
+
+void compute_lyph_containment( void )
+{
+  lyph *e;
+
+  for ( e = first_lyph; e; e = e->next )
+    e->first_child = NULL;
+
+  for ( e = first_lyph; e; e = e->next )
+    compute_lyph_location( e );
+
+  /*
+   * Going backwards, so that each lyph's children end up in the same
+   * order as the lyphs themselves
+   */
+  for ( e = last_lyph; e; e = e->prev )
+  {
+    lyph *parent = e->from->location;
+
+    REMOVE_BIT( e->flags[worker_slot], 4 );
+
+    if ( parent && parent == e->to->location )
+    {
+      e->next_sibling = parent->first_child;
+      parent->first_child = e;
+    }
+    else
+      e->next_sibling = NULL;
+  }
+}
+
+/*
+ * Bit 4 marks a lyph whose house is already known, bit 8 one whose house
+ * is being worked out (so a loop of locations cannot recurse forever)
+ */
+lyph *compute_lyph_location( lyph *e )
+{
+  if ( IS_SET( e->flags[worker_slot], 4 ) )
+    return e->house;
+
+  if ( IS_SET( e->flags[worker_slot], 8 ) )
+    return NULL;
+
+  SET_BIT( e->flags[worker_slot], 8 );
+  e->house = find_lyph_location( e );
+  REMOVE_BIT( e->flags[worker_slot], 8 );
+  SET_BIT( e->flags[worker_slot], 4 );
+
+  return e->house;
+}
+
+lyph *find_lyph_location( lyph *e )
 {
   lyph *to = e->to->location, *from = e->from->location;
 
@@ -361,32 +451,36 @@ lyph *get_lyph_location( lyph *e )
 
     unmark_houses( &head, &tail );
 
-    to = get_lyph_location( to );
-    from = get_lyph_location( from );
+    to = compute_lyph_location( to );
+    from = compute_lyph_location( from );
   }
 }
 
+lyph *get_lyph_location( lyph *e )
+{
+  current_lyph_containment();
+  return e->house;
+}
+
 lyph *get_relative_lyph_loc_buf( lyph *e, lyph **buf )
 {
-  lyph *house, **bptr, *ptr;
+  lyph *house, **bptr;
 
-  if ( buf )
-    for ( bptr = buf; *bptr; bptr++ )
-      SET_BIT( (*bptr)->flags, 2 );
-  else
-    for ( ptr = first_lyph; ptr; ptr = ptr->next )
-      SET_BIT( ptr->flags, 2 );
+  /*
+   * Relative to all lyphs, the answer is just the house
+   */
+  if ( !buf )
+    return get_lyph_location( e );
+
+  for ( bptr = buf; *bptr; bptr++ )
+    SET_BIT( (*bptr)->flags[worker_slot], 2 );
 
   for ( house = get_lyph_location( e ); house; house = get_lyph_location( house ) )
-    if ( IS_SET( house->flags, 2 ) )
+    if ( IS_SET( house->flags[worker_slot], 2 ) )
       break;
 
-  if ( buf )
-    for ( bptr = buf; *bptr; bptr++ )
-      REMOVE_BIT( (*bptr)->flags, 2 );
-  else
-    for ( ptr = first_lyph; ptr; ptr = ptr->next )
-      REMOVE_BIT( ptr->flags, 2 );
+  for ( bptr = buf; *bptr; bptr++ )
+    REMOVE_BIT( (*bptr)->flags[worker_slot], 2 );
 
   return house;
 }
@@ -417,15 +511,15 @@ lyph *get_relative_lyph_loc_v( lyph *e, lyphview *v )
 
   for ( rects = v->rects; *rects; rects++ )
     if ( (*rects)->L )
-      SET_BIT( (*rects)->L->flags, 2 );
+      SET_BIT( (*rects)->L->flags[worker_slot], 2 );
 
   for ( house = get_lyph_location( e ); house; house = get_lyph_location(house) )
-    if ( IS_SET( house->flags, 2 ) )
+    if ( IS_SET( house->flags[worker_slot], 2 ) )
       break;
 
   for ( rects = v->rects; *rects; rects++ )
     if ( (*rects)->L )
-      REMOVE_BIT( (*rects)->L->flags, 2 );
+      REMOVE_BIT( (*rects)->L->flags[worker_slot], 2 );
 
   return house;
 }
@@ -501,7 +595,7 @@ char *lyphview_to_json( lyphview *v )
   *vnptr = NULL;
 
   for ( n = v->nodes; *n; n++ )
-    SET_BIT( (*n)->flags, LYPHNODE_SELECTED );
+    SET_BIT( (*n)->flags[worker_slot], LYPHNODE_SELECTED );
 
   lyphnode_to_json_flags = LTJ_EXITS | LTJ_SELECTIVE | LTJ_FULL_EXIT_DATA;
 
@@ -522,7 +616,7 @@ char *lyphview_to_json( lyphview *v )
   lyphnode_to_json_flags = 0;
 
   for ( n = v->nodes; *n; n++ )
-    REMOVE_BIT( (*n)->flags, LYPHNODE_SELECTED );
+    REMOVE_BIT( (*n)->flags[worker_slot], LYPHNODE_SELECTED );
 
   return result;
 }
@@ -535,10 +629,13 @@ void save_lyphviews( void )
   if ( configs.readonly )
     return;
 
+  if ( journal_defer( save_lyphviews ) )
+    return;
+
   if ( !views )
     return;
 
-  fp = fopen( LYPHVIEWS_FILE, "w" );
+  fp = open_snapshot( LYPHVIEWS_FILE );
 
   if ( !fp )
   {
@@ -554,7 +651,7 @@ void save_lyphviews( void )
       save_one_lyphview( *ptr, fp );
   }
 
-  fclose( fp );
+  close_snapshot( fp );
 }
 
 void save_one_lyphview( lyphview *v, FILE *fp )
@@ -848,15 +945,16 @@ void load_lyphviews( void )
                 CREATE( e, lyph, 1 );
                 e->id = lyphtr;
                 lyphtr->data = (trie **)e;
-                e->flags = 0;
+                e->flags[worker_slot] = 0;
                 e->species = NULL;
                 e->constraints = (lyphplate**)blank_void_array();
                 e->annots = (lyph_annot**)blank_void_array();
                 e->pubmed = strdup("");
                 e->projection_strength = strdup("");
                 e->modified = 0;
-                LINK( e, first_lyph, last_lyph, next );
+                LINK2( e, first_lyph, last_lyph, next, prev );
                 lyphcnt++;
+                lyph_containment_changed();
 
                 maybe_update_top_id( &top_lyph_id, left );
               }
@@ -1079,7 +1177,10 @@ void save_lyphs( void )
   if ( configs.readonly )
     return;
 
-  fp = fopen( LYPHS_FILE, "w" );
+  if ( journal_defer( save_lyphs ) )
+    return;
+
+  fp = open_snapshot( LYPHS_FILE );
 
   if ( !fp )
   {
@@ -1094,7 +1195,7 @@ void save_lyphs( void )
 
   save_lyphnode_locs( lyphnode_ids, fp );
 
-  fclose( fp );
+  close_snapshot( fp );
 }
 
 void save_one_lyph( lyph *e, FILE *fp )
@@ -1166,6 +1267,14 @@ void save_lyphnode_locs( trie *t, FILE *fp )
       fprintf( fp, "Loc\t%s\t", trie_to_static( n->id ) );
       fprintf( fp, "%s\t%d\n", trie_to_static( n->location->id ), n->loctype );
     }
+    else if ( !*n->exits && !*n->incoming )
+    {
+      /*
+       * A node no lyph mentions would otherwise be lost on reload,
+       * and journaled requests naming it would replay differently
+       */
+      fprintf( fp, "Node\t%s\n", trie_to_static( n->id ) );
+    }
   }
 
   TRIE_RECURSE( save_lyphnode_locs( *child, fp ) );
@@ -1227,6 +1336,29 @@ int load_lyphnode_location( char *line, char **err )
 
   n->location = loc;
   n->loctype = loctype;
+  lyph_containment_changed();
+
+  return 1;
+}
+
+int load_lone_lyphnode( char *line, char **err )
+{
+  char nodeidbuf[MAX_LYPH_LINE_LEN+1];
+  lyphnode *n;
+
+  if ( !word_from_line( &line, nodeidbuf ) )
+  {
+    *err = "Missing node ID on a node line";
+    return 0;
+  }
+
+  if ( lyphnode_by_id( nodeidbuf ) )
+    return 1;
+
+  n = blank_lyphnode();
+  n->id = trie_strdup( nodeidbuf, lyphnode_ids );
+  n->id->data = (trie**)n;
+  maybe_update_top_id( &top_lyphnode_id, nodeidbuf );
 
   return 1;
 }
@@ -1281,6 +1413,9 @@ int load_lyphs_one_line( char *line, char **err )
   if ( str_begins( line, "Loc\t" ) )
     return load_lyphnode_location( line + strlen("Loc\t"), err );
 
+  if ( str_begins( line, "Node\t" ) )
+    return load_lone_lyphnode( line + strlen("Node\t"), err );
+
   KEY( lyphidbuf, "Missing edge ID" );
   KEY( typebuf, "Missing edge type" );
   KEY( fmabuf, "Missing FMA ID" );
@@ -1294,14 +1429,15 @@ int load_lyphs_one_line( char *line, char **err )
   {
     CREATE( e, lyph, 1 );
     e->id = etr;
-    e->flags = 0;
+    e->flags[worker_slot] = 0;
     e->species = NULL;
     etr->data = (trie **)e;
     e->pubmed = strdup("");
     e->projection_strength = strdup("");
     e->modified = 0;
-    LINK( e, first_lyph, last_lyph, next );
+    LINK2( e, first_lyph, last_lyph, next, prev );
     lyphcnt++;
+    lyph_containment_changed();
 
     maybe_update_top_id( &top_lyph_id, lyphidbuf );
 
@@ -1345,7 +1481,9 @@ int load_lyphs_one_line( char *line, char **err )
     to = (lyphnode *)totr->data;
 
   e->lyphplt = NULL;
+  unindex_lyph( e );
   e->name = parse_lyph_name_field( namebuf, e );
+  index_lyph( e );
 
   e->from = from;
   e->to = to;
@@ -1648,6 +1786,7 @@ void load_lyphplate_label( char *subj_full, char *label )
       L->ont_term = NULL;
       iri->data = (void *)L;
       LINK2( L, first_lyphplate, last_lyphplate, next, prev );
+      lyphplate_graph_changed();
     }
     else
       L = (lyphplate *)iri->data;
@@ -1736,6 +1875,7 @@ lyphplate *create_or_find_lyphplate( char *id )
   L->ont_term = NULL;
   L->name = NULL;
   LINK2( L, first_lyphplate, last_lyphplate, next, prev );
+  lyphplate_graph_changed();
 
   return L;
 }
@@ -1866,13 +2006,7 @@ void handle_loaded_layers( trie *t )
 
   TRIE_RECURSE( handle_loaded_layers( *child ) );
 
-  if ( t->children )
-    free( t->children );
-
-  if ( t->label )
-    free( t->label );
-
-  free( t );
+  trie_free_node( t );
 }
 
 void save_lyphplates(void)
@@ -1884,7 +2018,10 @@ void save_lyphplates(void)
   if ( configs.readonly )
     return;
 
-  fp = fopen( TEMPLATES_FILE, "w" );
+  if ( journal_defer( save_lyphplates ) )
+    return;
+
+  fp = open_snapshot( TEMPLATES_FILE );
 
   if ( !fp )
   {
@@ -1897,7 +2034,7 @@ void save_lyphplates(void)
   for ( L = first_lyphplate; L; L = L->next )
     save_one_lyphplate( L, fp, avoid_dupe_layers );
 
-  fclose(fp);
+  close_snapshot( fp );
 
   free_lyphplate_dupe_trie( avoid_dupe_layers );
 
@@ -2038,6 +2175,7 @@ lyphplate *lyphplate_by_layers( int type, layer **layers, lyphplate **misc_mater
   L->ont_term = NULL;
   L->supers = NULL;
   LINK2( L, first_lyphplate, last_lyphplate, next, prev );
+  lyphplate_graph_changed();
 
   if ( misc_material )
     L->misc_material = misc_material;
@@ -2184,11 +2322,17 @@ lyphplate *lyphplate_by_id( const char *id )
       label = trie_search( id, iri_to_labels );
     }
 
+    /*
+     * Creating the template changes the database, which a request
+     * running alongside other readers must not do
+     */
+    if ( !have_exclusive_access() )
+      return NULL;
+
     CREATE( L, lyphplate, 1 );
 
     L->type = LYPHPLATE_BASIC;
     L->modified = longtime();
-    LINK2( L, first_lyphplate, last_lyphplate, next, prev );
 
     if ( !strcmp( trieloc, "terms" ) )
     {
@@ -2207,11 +2351,12 @@ lyphplate *lyphplate_by_id( const char *id )
     
     if ( (L2 = lyphplate_by_ont_term( L->ont_term )) != NULL )
     {
-      UNLINK2( L, first_lyphplate, last_lyphplate, next, prev );
       free( L );
       return L2;
     }
-    
+
+    LINK2( L, first_lyphplate, last_lyphplate, next, prev );
+    lyphplate_graph_changed();
     L->length = strdup( "unspecified" );
     L->id = assign_new_lyphplate_id( L );
     L->layers = NULL;
@@ -2405,7 +2550,7 @@ char *lyphnode_to_json_wrappee( lyphnode *n, char *x, char *y )
 
       CREATE( exits, exit_data *, VOIDLEN( n->exits ) + 1 );
       for ( eptr = exits, nptr = n->exits; *nptr; nptr++ )
-        if ( IS_SET( (*nptr)->to->flags, LYPHNODE_SELECTED ) )
+        if ( IS_SET( (*nptr)->to->flags[worker_slot], LYPHNODE_SELECTED ) )
           *eptr++ = *nptr;
       *eptr = NULL;
     }
@@ -2600,16 +2745,10 @@ layer **copy_layers( layer **src )
   return dest;
 }
 
-/*
- * cmp_layers could be optimized; right now we'll
- * operate under the assumption that an AU doesn't have
- * hundreds+ of layers, so optimizing this is deprioritized
- */
 int cmp_layers(const void * a, const void * b)
 {
   const layer *x;
   const layer *y;
-  char buf[MAX_STRING_LEN+1];
 
   if ( a == b )
     return 0;
@@ -2617,9 +2756,7 @@ int cmp_layers(const void * a, const void * b)
   x = *((const layer **) a);
   y = *((const layer **) b);
 
-  sprintf( buf, "%s", trie_to_static( x->id ) );
-
-  return strcmp( buf, trie_to_static( y->id ) );
+  return strcmp( trie_to_static( x->id ), trie_to_static( y->id ) );
 }
 
 void sort_layers( layer **layers )
@@ -2631,13 +2768,7 @@ void free_lyphplate_dupe_trie( trie *t )
 {
   TRIE_RECURSE( free_lyphplate_dupe_trie( *child ) );
 
-  if ( t->children )
-    free( t->children );
-
-  if ( t->label )
-    free( t->label );
-
-  free( t );
+  trie_free_node( t );
 }
 
 int parse_lyphplate_type( char *str )
@@ -2654,154 +2785,6 @@ int parse_lyphplate_type( char *str )
   return -1;
 }
 
-lyph ***compute_lyphpaths( lyphnode_wrapper *from_head, lyphnode_wrapper *to_head, lyph_filter *filter, int numpaths, int dont_see_initials, int include_reverses, int include_nif )
-{
-  lyphstep *head = NULL, *tail = NULL, *step, *curr;
-  lyphnode_wrapper *w;
-  lyph ***paths, ***pathsptr, **path;
-  int pathcnt = 0;
-
-  CREATE( paths, lyph **, numpaths + 1 );
-  pathsptr = paths;
-
-  /*
-  if ( from_head == to_head )
-  {
-    compute_lyphpath_trivial_path:
-
-    path = (lyph**)blank_void_array();
-    paths[0] = path;
-    paths[1] = NULL;
-
-    return paths;
-  }
-  */
-
-  for ( w = to_head; w; w = w->next )
-    SET_BIT( w->n->flags, LYPHNODE_GOAL );
-
-  for ( w = from_head; w; w = w->next )
-  {
-    /*
-    if ( IS_SET( w->n->flags, LYPHNODE_GOAL ) )
-    {
-      for ( w = to_head; w; w = w->next )
-        REMOVE_BIT( w->n->flags, LYPHNODE_GOAL );
-      free_lyphsteps( head );
-
-      goto compute_lyphpath_trivial_path;
-    }
-    */
-
-    CREATE( step, lyphstep, 1 );
-    step->depth = 0;
-    step->backtrace = NULL;
-    step->location = w->n;
-    step->lyph = NULL;
-
-    if ( !dont_see_initials )
-      SET_BIT( w->n->flags, LYPHNODE_SEEN );
-
-    LINK2( step, head, tail, next, prev );
-  }
-
-  curr = head;
-
-  for ( ; ; curr = curr->next )
-  {
-    exit_data **x;
-    int reversed;
-
-    if ( !curr )
-    {
-      for ( w = to_head; w; w = w->next )
-        REMOVE_BIT( w->n->flags, LYPHNODE_GOAL );
-
-      free_lyphsteps( head );
-      *pathsptr = NULL;
-      return paths;
-    }
-
-    if ( IS_SET( curr->location->flags, LYPHNODE_GOAL ) && curr->depth )
-    {
-      lyph **pptr;
-      lyphstep *back;
-
-      CREATE( path, lyph *, curr->depth + 1 );
-      pptr = &path[curr->depth-1];
-      path[curr->depth] = NULL;
-
-      back = curr;
-      do
-      {
-        *pptr-- = back->lyph;
-        back = back->backtrace;
-      }
-      while( back->backtrace );
-
-      *pathsptr++ = path;
-
-      if ( ++pathcnt == numpaths )
-        goto compute_lyphpaths_escape;
-
-      continue;
-    }
-
-    /*
-     * First traverse curr->location->exits, then traverse curr->location->incoming
-     */
-    reversed = !include_reverses;
-
-    for ( x = curr->location->exits; *x || (!reversed++ && (x=curr->location->incoming)); x++ )
-    {
-      if ( !*x )
-        break;
-      if ( IS_SET( (*x)->to->flags, LYPHNODE_SEEN ) )
-        continue;
-
-      if ( (*x)->via->type == LYPH_NIF && !include_nif )
-        continue;
-
-      if ( filter && !lyph_passes_filter( (*x)->via, filter ) )
-      {
-        SET_BIT( step->location->flags, LYPHNODE_SEEN );
-        continue;
-      }
-
-      CREATE( step, lyphstep, 1 );
-      step->depth = curr->depth + 1;
-      step->backtrace = curr;
-      step->location = (*x)->to;
-      step->lyph = (*x)->via;
-      LINK2( step, head, tail, next, prev );
-      SET_BIT( step->location->flags, LYPHNODE_SEEN );
-    }
-  }
-
-  compute_lyphpaths_escape:
-
-  for ( w = to_head; w; w = w->next )
-    REMOVE_BIT( w->n->flags, LYPHNODE_GOAL );
-
-  free_lyphsteps( head );
-  *pathsptr = NULL;
-
-  return paths;
-}
-
-void free_lyphsteps( lyphstep *head )
-{
-  lyphstep *step, *step_next;
-
-  for ( step = head; step; step = step_next )
-  {
-    step_next = step->next;
-
-    REMOVE_BIT( step->location->flags, LYPHNODE_SEEN );
-    free( step );
-  }
-}
-
 lyphnode *make_lyphnode( void )
 {
   lyphnode *n = blank_lyphnode();
@@ -2851,13 +2834,14 @@ lyph *make_lyph_( int type, lyphnode *from, lyphnode *to, lyphplate *L, char *fm
   e->to = to;
   e->lyphplt = L;
   e->fma = fma;
-  e->flags = 0;
+  e->flags[worker_slot] = 0;
   e->pubmed = pubmedstr ? strdup( pubmedstr ) : strdup("");
   e->projection_strength = projstr ? strdup( projstr ) : strdup("");
   e->modified = longtime();
 
-  LINK( e, first_lyph, last_lyph, next );
+  LINK2( e, first_lyph, last_lyph, next, prev );
   lyphcnt++;
+  lyph_containment_changed();
 
   if ( speciesstr )
     e->species = trie_strdup( speciesstr, metadata );
@@ -2868,6 +2852,7 @@ lyph *make_lyph_( int type, lyphnode *from, lyphnode *to, lyphplate *L, char *fm
   e->annots = (lyph_annot**)blank_void_array();
 
   add_exit( e );
+  index_lyph( e );
 
   if ( save )
     save_lyphs();
@@ -2954,7 +2939,7 @@ void lyphs_unset_bits( int bits )
   lyph *e;
 
   for ( e = first_lyph; e; e = e->next )
-    REMOVE_BIT( e->flags, bits );
+    REMOVE_BIT( e->flags[worker_slot], bits );
 }
 
 void lyphplates_unset_bits( int bits )
@@ -2962,7 +2947,7 @@ void lyphplates_unset_bits( int bits )
   lyphplate *L;
 
   for ( L = first_lyphplate; L; L = L->next )
-    REMOVE_BIT( L->flags, bits );
+    REMOVE_BIT( L->flags[worker_slot], bits );
 }
 
 void lyphnodes_unset_bits( int bits, trie *t )
@@ -2970,7 +2955,7 @@ void lyphnodes_unset_bits( int bits, trie *t )
   if ( t->data )
   {
     lyphnode *n = (lyphnode *)t->data;
-    REMOVE_BIT( n->flags, bits );
+    REMOVE_BIT( n->flags[worker_slot], bits );
   }
 
   TRIE_RECURSE( lyphnodes_unset_bits( bits, *child ) );
@@ -3089,7 +3074,7 @@ int lyph_passes_filter( lyph *e, lyph_filter *f )
 #define LYPHPLATE_ACCOUNTED_FOR 1
 void populate_all_lyphplates_L( lyphplate ***bptr, lyphplate *L )
 {
-  if ( IS_SET( L->flags, LYPHPLATE_ACCOUNTED_FOR ) )
+  if ( IS_SET( L->flags[worker_slot], LYPHPLATE_ACCOUNTED_FOR ) )
     return;
 
   if ( L->type == LYPHPLATE_MIX || L->type == LYPHPLATE_SHELL )
@@ -3105,7 +3090,7 @@ void populate_all_lyphplates_L( lyphplate ***bptr, lyphplate *L )
   **bptr = L;
   (*bptr)++;
 
-  SET_BIT( L->flags, LYPHPLATE_ACCOUNTED_FOR );
+  SET_BIT( L->flags[worker_slot], LYPHPLATE_ACCOUNTED_FOR );
 }
 
 void populate_all_lyphplates( lyphplate ***bptr )
@@ -3164,7 +3149,10 @@ void remove_from_exits( lyph *e, exit_data ***victim )
 
   *xptr = NULL;
   free( *victim );
-  *victim = xptr;
+  *victim = x;
+
+  lyph_graph_changed();
+  lyph_containment_changed();
 }
 
 void add_to_exits( lyph *e, lyphnode *to, exit_data ***victim )
@@ -3172,6 +3160,9 @@ void add_to_exits( lyph *e, lyphnode *to, exit_data ***victim )
   exit_data **x, *newx;
   int len;
 
+  lyph_graph_changed();
+  lyph_containment_changed();
+
   if ( !*victim )
   {
     CREATE( x, exit_data *, 2 );
@@ -3206,6 +3197,9 @@ void change_source_of_exit( lyph *via, lyphnode *new_src, exit_data **exits )
   for ( x = exits; *x; x++ )
     if ( (*x)->via == via )
       (*x)->to = new_src;
+
+  lyph_graph_changed();
+  lyph_containment_changed();
 }
 
 void change_dest_of_exit( lyph *via, lyphnode *new_dest, exit_data **exits )
@@ -3215,6 +3209,9 @@ void change_dest_of_exit( lyph *via, lyphnode *new_dest, exit_data **exits )
   for ( x = exits; *x; x++ )
     if ( (*x)->via == via )
       (*x)->to = new_dest;
+
+  lyph_graph_changed();
+  lyph_containment_changed();
 }
 
 lyphnode *blank_lyphnode( void )
@@ -3238,8 +3235,9 @@ lyph *clone_lyph( lyph *e )
   CREATE( d, lyph, 1 );
   d->id = new_lyph_id(d);
 
-  LINK( d, first_lyph, last_lyph, next );
+  LINK2( d, first_lyph, last_lyph, next, prev );
   lyphcnt++;
+  lyph_containment_changed();
 
   name = strdupf( "Clone of %s", trie_to_static( e->id ) );
   d->name = trie_strdup( name, lyph_names );
@@ -3247,7 +3245,7 @@ lyph *clone_lyph( lyph *e )
   
   d->species = e->species;
   d->type = e->type;
-  d->flags = e->flags;
+  d->flags[worker_slot] = e->flags[worker_slot];
   d->from = e->from;
   d->to = e->to;
   d->lyphplt = e->lyphplt;
@@ -3258,6 +3256,8 @@ lyph *clone_lyph( lyph *e )
   d->projection_strength = strdup( e->projection_strength );
   d->modified = longtime();
 
+  index_lyph( d );
+
   return d;
 }
 
@@ -3298,9 +3298,10 @@ lyphplate *clone_template( lyphplate *L )
   
   M->length = L->length ? strdup( L->length ) : NULL;
   M->type = L->type;
-  M->flags = L->flags;
+  M->flags[worker_slot] = L->flags[worker_slot];
 
   LINK2( M, first_lyphplate, last_lyphplate, next, prev );
+  lyphplate_graph_changed();
 
   return M;    
 }
@@ -3465,7 +3466,7 @@ void save_layer_names_recurse( trie *t, FILE *fp )
 
 void save_layer_names(void)
 {
-  FILE *fp = fopen( LAYERNAMES_FILE, "w" );
+  FILE *fp = open_snapshot( LAYERNAMES_FILE );
 
   if ( !fp )
   {
@@ -3476,71 +3477,38 @@ void save_layer_names(void)
   save_layer_names_recurse( layer_ids, fp );
 
   fprintf( fp, "\n" );
-  fclose( fp );
-}
-
-void calc_nodes_directly_in_lyph_buf_recurse( lyph *e, lyphnode_wrapper **head, lyphnode_wrapper **tail, lyph **buf, trie *t )
-{
-  if ( t->data )
-  {
-    lyph **bptr, *loc;
-    lyphnode *n = (lyphnode *)t->data;
-
-    if ( n->location == e )
-      goto calc_nodes_directly_in_lyph_buf_addnode;
-
-    if ( n->location )
-    {
-      loc = n->location;
-
-      for ( bptr = buf; *bptr; bptr++ )
-        if ( *bptr == loc )
-          break;
-
-      if ( !*bptr && e == get_relative_lyph_loc_buf( n->location, buf ) )
-      {
-        lyphnode_wrapper *w;
-
-        calc_nodes_directly_in_lyph_buf_addnode:
-        CREATE( w, lyphnode_wrapper, 1 );
-        w->n = n;
-        LINK( w, *head, *tail, next );
-      }
-    }
-  }
-
-  TRIE_RECURSE( calc_nodes_directly_in_lyph_buf_recurse( e, head, tail, buf, *child ) );
-}
-
-void calc_nodes_directly_in_lyph_buf( lyph *e, lyphnode_wrapper **head, lyphnode_wrapper **tail, lyph **buf )
-{
-  calc_nodes_directly_in_lyph_buf_recurse( e, head, tail, buf, lyphnode_ids );
+  close_snapshot( fp );
 }
 
 lyph **get_children( lyph *e )
 {
   lyph **buf, **bptr, *child;
+  int cnt = 0;
 
-  CREATE( buf, lyph *, lyphcnt + 1 );
+  current_lyph_containment();
+
+  for ( child = e->first_child; child; child = child->next_sibling )
+    cnt++;
+
+  CREATE( buf, lyph *, cnt + 1 );
   bptr = buf;
 
-  for ( child = first_lyph; child; child = child->next )
-    if ( child->from->location == e && child->to->location == e )
-      *bptr++ = child;
+  for ( child = e->first_child; child; child = child->next_sibling )
+    *bptr++ = child;
 
   *bptr = NULL;
   return buf;
 }
 
-nodepath *lyphpath_to_nodepath( lyph **lyphpath, lyph **e )
+nodepath *lyphpath_to_nodepath( lyph **lyphpath, lyph *start, lyph *end )
 {
   nodepath *np;
   lyphnode **stepsptr;
 
   CREATE( np, nodepath, 1 );
   np->edges = lyphpath;
-
-  np->start = get_relative_lyphnode_loc_buf( (*lyphpath)->from, e );
+  np->start = start;
+  np->end = end;
 
   CREATE( np->steps, lyphnode *, VOIDLEN( lyphpath ) + 3 );
   np->steps[0] = lyphpath[0]->from;
@@ -3553,10 +3521,7 @@ nodepath *lyphpath_to_nodepath( lyph **lyphpath, lyph **e )
     if ( lyphpath[1] )
       lyphpath++;
     else
-    {
-      np->end = get_relative_lyphnode_loc_buf( (*lyphpath)->to, e );
       break;
-    }
   }
 
   *stepsptr = NULL;
@@ -3600,49 +3565,36 @@ char *nodepath_to_json( nodepath *np )
   return retval;
 }
 
-char *nodepathset_to_json( nodepath **nodepaths )
+HANDLER( do_connections )
 {
-  nodepath **vascular, **vptr;
-  nodepath **nif, **nifptr;
-  nodepath **npptr;
-  char *retval;
-
-  CREATE( vascular, nodepath *, VOIDLEN( nodepaths ) + 1 );
-  vptr = vascular;
-  CREATE( nif, nodepath *, VOIDLEN( nodepaths ) + 1 );
-  nifptr = nif;
-
-  for ( npptr = nodepaths; *npptr; npptr++ )
-  {
-    if ( (*npptr)->edges && (*npptr)->edges[0] && (*npptr)->edges[0]->type == LYPH_NIF )
-      *nifptr++ = *npptr;
-    else
-      *vptr++ = *npptr;
-  }
-  *nifptr = NULL;
-  *vptr = NULL;
+  lyph_connections c;
+  lyph **e, ***paths, ***pptr;
+  lyph ****row;
+  nodepath *np, **nif;
+  json_stream s;
+  char *lyphsstr, *numpathsstr, *err;
+  int nlyphs, include_nifs, numpaths, nif_cnt = 0, nif_size = 16, i, j;
 
-  retval = JSON
-  (
-    "vascular": JS_ARRAY( nodepath_to_json, vascular ),
-    "nif": nifptr != nif ? JS_ARRAY( nodepath_to_json, nif ) : js_suppress
-  );
+  TRY_TWO_PARAMS( lyphsstr, "lyph", "lyphs", "You did not specify which lyphs to find connections among" );
 
-  free( nif );
-  free( vascular );
+  /*
+   * Without numpaths, the nearest way to each node of the other lyph;
+   * with it, the numpaths shortest ways, however many nodes they reach
+   */
+  numpathsstr = get_param( params, "numpaths" );
 
-  return retval;
-}
+  if ( numpathsstr )
+  {
+    numpaths = strtoul( numpathsstr, NULL, 10 );
 
-HANDLER( do_connections )
-{
-  lyph **e, **eptr1, **eptr2;
-  lyph ****pathsets, ****pathsetsptr, ***dpathsetsptr;
-  nodepath **nodepaths, **nodepathsptr;
-  char *lyphsstr, *err;
-  int nlyphs, npaths = 0, include_nifs;
+    if ( numpaths < 1 )
+      HND_ERR( "'numpaths' must be a positive integer" );
 
-  TRY_TWO_PARAMS( lyphsstr, "lyph", "lyphs", "You did not specify which lyphs to find connections among" );
+    if ( numpaths > MAX_NUMPATHS )
+      HND_ERRF( "'numpaths' too large, maximum is %d", MAX_NUMPATHS );
+  }
+  else
+    numpaths = 0;
 
   e = (lyph **)PARSE_LIST( lyphsstr, lyph_by_id, "lyph", &err );
 
@@ -3661,68 +3613,169 @@ HANDLER( do_connections )
 
   nlyphs = VOIDLEN( e );
 
-  if ( nlyphs > 100 )
+  if ( nlyphs > MAX_CONNECTIONS_LYPHS )
   {
     free( e );
-    HND_ERR( "The connections command is limited to 100 lyphs." );
+    HND_ERRF( "The connections command is limited to %d lyphs.", MAX_CONNECTIONS_LYPHS );
   }
 
-  CREATE( pathsets, lyph ***, nlyphs*nlyphs + 1 );
-  pathsetsptr = pathsets;
+  memset( &c, 0, sizeof(lyph_connections) );
+  c.g = current_lyph_graph();
+  c.lyphs = e;
+  c.cnt = nlyphs;
+  c.numpaths = numpaths;
+  c.include_nif = include_nifs;
 
-  for ( eptr1 = e; *eptr1; eptr1++ )
-  for ( eptr2 = e; *eptr2; eptr2++ )
+  locate_connections_nodes( &c );
+  start_lyph_connections( &c );
+
+  /*
+   * The vascular paths go out as each lyph's come in; the nif paths (if
+   * any) wait for the end
+   */
+  CREATE( nif, nodepath *, nif_size );
+
+  json_stream_begin( &s, req );
+  json_stream_open( &s, NULL, '{' );
+  json_stream_open( &s, "vascular", '[' );
+
+  for ( i = 0; i < nlyphs; i++ )
   {
-    lyphnode_wrapper *from_head = NULL, *from_tail = NULL, *to_head = NULL, *to_tail = NULL;
-    lyphnode_wrapper *w, *w_next;
+    row = wait_lyph_connections( &c, i );
 
-    calc_nodes_directly_in_lyph_buf( *eptr1, &from_head, &from_tail, e );
-    calc_nodes_directly_in_lyph_buf( *eptr2, &to_head, &to_tail, e );
+    for ( j = 0; j < nlyphs; j++ )
+    {
+      if ( !(paths = row[c.canon[j]]) )
+        continue;
 
-    *pathsetsptr = compute_lyphpaths( from_head, to_head, NULL, 16, 1, 0, include_nifs );
-    npaths += VOIDLEN( *pathsetsptr );
-    pathsetsptr++;
+      for ( pptr = paths; *pptr; pptr++ )
+      {
+        np = lyphpath_to_nodepath( *pptr, e[i], e[j] );
+
+        if ( (*pptr)[0]->type == LYPH_NIF )
+        {
+          int len = VOIDLEN( *pptr );
 
-    for ( w = from_head; w; w = w_next )
+          if ( nif_cnt + 1 == nif_size )
+          {
+            nodepath **tmp;
+
+            CREATE( tmp, nodepath *, nif_size * 2 );
+            memcpy( tmp, nif, nif_cnt * sizeof(nodepath *) );
+            free( nif );
+            nif = tmp;
+            nif_size *= 2;
+          }
+
+          CREATE( np->edges, lyph *, len + 1 );
+          memcpy( np->edges, *pptr, len * sizeof(lyph *) );
+          nif[nif_cnt++] = np;
+        }
+        else
+        {
+          json_stream_value( &s, NULL, nodepath_to_json( np ) );
+          MULTIFREE( np->steps, np );
+        }
+      }
+    }
+
+    for ( j = 0; j < nlyphs; j++ )
     {
-      w_next = w->next;
-      free( w );
+      if ( c.canon[j] != j || !row[j] )
+        continue;
+
+      for ( pptr = row[j]; *pptr; pptr++ )
+        free( *pptr );
+
+      free( row[j] );
     }
 
-    for ( w = to_head; w; w = w_next )
+    free( row );
+  }
+
+  json_stream_close( &s );
+
+  if ( nif_cnt )
+  {
+    json_stream_open( &s, "nif", '[' );
+
+    for ( i = 0; i < nif_cnt; i++ )
     {
-      w_next = w->next;
-      free( w );
+      json_stream_value( &s, NULL, nodepath_to_json( nif[i] ) );
+      MULTIFREE( nif[i]->steps, nif[i]->edges, nif[i] );
     }
+
+    json_stream_close( &s );
   }
 
-  *pathsetsptr = NULL;
+  json_stream_close( &s );
+  json_stream_end( &s );
 
-  CREATE( nodepaths, nodepath *, npaths + 1 );
-  nodepathsptr = nodepaths;
+  finish_lyph_connections( &c );
 
-  for ( pathsetsptr = pathsets; *pathsetsptr; pathsetsptr++ )
+  MULTIFREE( c.canon, c.owner, c.node_start, c.nodes, nif, e );
+}
+
+/*
+ * Work out which of c's lyphs each node is directly in: the lyph it is
+ * located in, if that is one of them, or else the nearest of them which
+ * that lyph is (eventually) located in
+ */
+void locate_connections_nodes( lyph_connections *c )
+{
+  lyph_graph *g = c->g;
+  int *fill, i, j;
+
+  CREATE( c->canon, int, c->cnt + 1 );
+  CREATE( c->owner, int, g->node_cnt + 1 );
+  CREATE( c->node_start, int, c->cnt + 1 );
+
+  for ( i = 0; i < c->cnt; i++ )
   {
-    for ( dpathsetsptr = *pathsetsptr; *dpathsetsptr; dpathsetsptr++ )
-      *nodepathsptr++ = lyphpath_to_nodepath( *dpathsetsptr, e );
+    for ( j = 0; j < i; j++ )
+      if ( c->lyphs[j] == c->lyphs[i] )
+        break;
 
-    free( *pathsetsptr );
+    c->canon[i] = j;
+    SET_BIT( c->lyphs[i]->flags[worker_slot], 2 );
   }
-  free( pathsets );
-  free( e );
 
-  *nodepathsptr = NULL;
+  for ( i = 0; i < g->node_cnt; i++ )
+  {
+    lyph *house = g->nodes[i]->location;
 
-  send_response( req, nodepathset_to_json( nodepaths ) );
+    c->owner[i] = -1;
 
-  for ( nodepathsptr = nodepaths; *nodepathsptr; nodepathsptr++ )
-  {
-    free( (*nodepathsptr)->steps );
-    free( (*nodepathsptr)->edges );
-    free( *nodepathsptr );
+    if ( house && !IS_SET( house->flags[worker_slot], 2 ) )
+      for ( house = get_lyph_location( house ); house; house = get_lyph_location( house ) )
+        if ( IS_SET( house->flags[worker_slot], 2 ) )
+          break;
+
+    if ( !house )
+      continue;
+
+    for ( j = 0; c->lyphs[j] != house; j++ )
+      ;
+
+    c->owner[i] = j;
+    c->node_start[j+1]++;
   }
 
-  free( nodepaths );  
+  for ( i = 0; i < c->cnt; i++ )
+    REMOVE_BIT( c->lyphs[i]->flags[worker_slot], 2 );
+
+  for ( i = 0; i < c->cnt; i++ )
+    c->node_start[i+1] += c->node_start[i];
+
+  CREATE( c->nodes, int, c->node_start[c->cnt] + 1 );
+  CREATE( fill, int, c->cnt + 1 );
+  memcpy( fill, c->node_start, c->cnt * sizeof(int) );
+
+  for ( i = 0; i < g->node_cnt; i++ )
+    if ( c->owner[i] != -1 )
+      c->nodes[fill[c->owner[i]]++] = i;
+
+  free( fill );
 }
 
 lyph *lyph_by_name( const char *name )
@@ -3736,33 +3789,120 @@ lyph *lyph_by_name( const char *name )
   return NULL;
 }
 
-void populate_lyphs_by_prefix( char *prefix, lyph ***bptr, trie *species, int include_null_species, int include_any_species )
+/*
+ * lyph_prefixes files each lyph under its id and under each word of its
+ * name (running on to the end of the name), lowercased, so the lyphs
+ * matching a prefix are the data in a single subtree.  It is built once
+ * the lyphs are loaded, and kept up to date from then on.
+ */
+void index_lyphs( void )
 {
   lyph *e;
 
+  lyph_prefixes = blank_trie();
+
   for ( e = first_lyph; e; e = e->next )
+    index_lyph( e );
+}
+
+void index_lyph( lyph *e )
+{
+  index_lyph_( e, 1 );
+}
+
+void unindex_lyph( lyph *e )
+{
+  index_lyph_( e, 0 );
+}
+
+void index_lyph_( lyph *e, int add )
+{
+  if ( !lyph_prefixes )
+    return;
+
+  index_lyph_text( trie_to_static( e->id ), e, add );
+
+  if ( e->name )
+  {
+    const char *name = trie_to_static( e->name ), *nptr;
+
+    for ( nptr = name; *nptr; nptr++ )
+      if ( nptr == name || nptr[-1] == ' ' )
+        index_lyph_text( nptr, e, add );
+  }
+}
+
+void index_lyph_text( const char *text, lyph *e, int add )
+{
+  trie *t;
+
+  if ( add )
   {
-    if ( include_any_species
-    ||   e->species == species
-    || ( is_null_species(e) && include_null_species ) )
+    t = trie_strdup( lowercaserize( text ), lyph_prefixes );
+    add_to_data( &t->data, (trie *) e );
+  }
+  else if ( (t = trie_search( lowercaserize( text ), lyph_prefixes )) != NULL )
+    remove_from_data( &t->data, (trie *) e );
+}
+
+lyph **lyphs_by_prefix( char *prefix, trie *species, int include_null_species, int include_any_species )
+{
+  lyph **buf, **bptr;
+  trie *t = trie_search_prefix( lowercaserize( prefix ), lyph_prefixes );
+
+  CREATE( buf, lyph *, ( t ? count_lyph_postings( t ) : 0 ) + 1 );
+  bptr = buf;
+
+  if ( t )
+    populate_lyphs_by_prefix( t, &bptr, species, include_null_species, include_any_species );
+
+  *bptr = NULL;
+
+  for ( bptr = buf; *bptr; bptr++ )
+    REMOVE_BIT( (*bptr)->flags[worker_slot], 2 );
+
+  return buf;
+}
+
+int count_lyph_postings( trie *t )
+{
+  int cnt = t->data ? VOIDLEN( t->data ) : 0;
+
+  TRIE_RECURSE( cnt += count_lyph_postings( *child ) );
+
+  return cnt;
+}
+
+void populate_lyphs_by_prefix( trie *t, lyph ***bptr, trie *species, int include_null_species, int include_any_species )
+{
+  if ( t->data )
+  {
+    lyph **eptr;
+
+    for ( eptr = (lyph **) t->data; *eptr; eptr++ )
     {
-      if ( e->name && str_has_substring( trie_to_static( e->name ), prefix ) )
-      {
-        **bptr = e;
-        (*bptr)++;
-      }
-      else if ( str_begins( trie_to_static( e->id ), prefix ) )
+      lyph *e = *eptr;
+
+      if ( IS_SET( e->flags[worker_slot], 2 ) )
+        continue;
+
+      if ( include_any_species
+      || ( species && e->species == species )
+      || ( is_null_species(e) && include_null_species ) )
       {
+        SET_BIT( e->flags[worker_slot], 2 );
         **bptr = e;
         (*bptr)++;
       }
     }
   }
+
+  TRIE_RECURSE( populate_lyphs_by_prefix( *child, bptr, species, include_null_species, include_any_species ) );
 }
 
 HANDLER( do_lyphs_by_prefix )
 {
-  lyph **buf, **bptr;
+  lyph **buf;
   trie *species;
   lyph_to_json_details details;
   char *prefix, *speciesstr;
@@ -3787,14 +3927,9 @@ HANDLER( do_lyphs_by_prefix )
   else
     include_null_species = 0;
 
-  species = trie_strdup( speciesstr, metadata );
+  species = trie_search( speciesstr, metadata );
 
-  CREATE( buf, lyph *, lyphcnt + 1 );
-  bptr = buf;
-
-  populate_lyphs_by_prefix( prefix, &bptr, species, include_null_species, include_any_species );
-
-  *bptr = NULL;
+  buf = lyphs_by_prefix( prefix, species, include_null_species, include_any_species );
 
   details.show_annots = 0;
   details.suppress_correlations = 1;
@@ -6,18 +6,42 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <string.h>
+#include <pthread.h>
 
 #define MAX_STRING_LEN 64000
 #define READ_BLOCK_SIZE 1048576
 #define MAX_IRI_LEN 2048
 #define MAX_API_TEMPLATE_LEN (MAX_IRI_LEN * 2)
-#define MAX_AUTOCOMPLETE_RESULTS_PRESORT 30
-#define MAX_AUTOCOMPLETE_RESULTS_POSTSORT 10
+#define MAX_AUTOCOMPLETE_RESULTS 10
+#define MAX_ONTSEARCH_RESULTS 100
 #define MAX_URL_PARAMS 300
 #define MAX_URL_PARAM_LEN 512
 #define MAX_LYPH_LINE_LEN (MAX_IRI_LEN * 3)
 #define MAX_INT_LEN (strlen("-2147483647"))
-#define MAX_NUMPATHS 16
+#define MAX_NUMPATHS 256
+
+/*
+ * Read-only requests are answered by a pool of worker threads (see workers.c).
+ * Scratch state such as the flags fields below is kept per thread: slot 0
+ * belongs to the main thread and slots 1..MAX_WORKERS to the workers.
+ */
+#define MAX_WORKERS 8
+#define DEFAULT_WORKERS 4
+#define WORKER_SLOTS (MAX_WORKERS + 1)
+
+/*
+ * Most threads used to parse the ontology at startup (see labels.c)
+ */
+#define MAX_ONTOLOGY_THREADS 16
+
+/*
+ * The connections command: most lyphs it takes, most threads it uses
+ * (see graph.c), and most paths it gives between each pair of lyphs
+ * unless asked for the numpaths shortest
+ */
+#define MAX_CONNECTIONS_LYPHS 1000
+#define MAX_CONNECTIONS_THREADS 16
+#define MAX_CONNECTIONS_PATHS 16
 
 #define DATA_DIR "data/"
 
@@ -38,6 +62,18 @@
 #define BOPS_FILE DATA_DIR "bops.dat"
 #define FMAMAP_FILE DATA_DIR "fmamap.tsv"
 #define CORRELATION_LINKS_DOTFILE DATA_DIR "correlink.dot"
+#define JOURNAL_FILE DATA_DIR "journal.log"
+#define SNAPSHOTS_FILE DATA_DIR "snapshots.dat"
+#define IMAGE_FILE DATA_DIR "lyphs.img"
+
+/*
+ * The journal (see journal.c) is compacted into the snapshot files above
+ * once it reaches JOURNAL_COMPACT_BYTES, or JOURNAL_COMPACT_SECS after the
+ * last compaction, whichever comes first
+ */
+#define JOURNAL_COMPACT_BYTES 1048576
+#define JOURNAL_COMPACT_SECS 300
+#define JOURNAL_MAX_SNAPSHOTS 16
 
 #define PARSE_CSV_DIR "/srv/lyph_uploads/"
 
@@ -49,7 +85,11 @@
  */
 typedef struct STR_WRAPPER str_wrapper;
 typedef struct TRIE trie;
-typedef struct TRIE_WRAPPER trie_wrapper;
+typedef struct TRIE_ARENA trie_arena;
+typedef struct TRIE_KEY trie_key;
+typedef struct ONTOLOGY_TRIE_JOB ontology_trie_job;
+typedef struct AUTOCOMPLETE_INDEX autocomplete_index;
+typedef struct AUTOCOMPLETE_SPAN autocomplete_span;
 typedef struct LYPHPLATE lyphplate;
 typedef struct LYPHPLATE_TO_JSON_DETAILS lyphplate_to_json_details;
 typedef struct LAYER layer;
@@ -63,6 +103,12 @@ typedef struct LYPH_WRAPPER lyph_wrapper;
 typedef struct LYPH_TO_JSON_DETAILS lyph_to_json_details;
 typedef struct EXIT_DATA exit_data;
 typedef struct LYPHSTEP lyphstep;
+typedef struct LYPH_EDGE lyph_edge;
+typedef struct LYPH_GRAPH lyph_graph;
+typedef struct LYPHPLATE_GRAPH lyphplate_graph;
+typedef struct LYPH_ROUTE lyph_route;
+typedef struct LYPH_SEARCH lyph_search;
+typedef struct LYPH_CONNECTIONS lyph_connections;
 typedef struct LYPHVIEW lyphview;
 typedef struct LV_RECT lv_rect;
 typedef struct VIEWED_NODE viewed_node;
@@ -95,19 +141,86 @@ struct STR_WRAPPER
   char *str;
 };
 
+/*
+ * A node's children are sorted by the first characters of their labels,
+ * and those characters are also kept in a row right after the children's
+ * terminating NULL (see TRIE_FIRSTS), so trie_child can find the right one
+ * without touching the others.  Labels shorter than TRIE_INLINE_LABEL_LEN
+ * live in the node itself.  Nodes are 64 bytes, handed out from pools.
+ *
+ * A node standing for a key (one returned by trie_strdup, say) also holds
+ * the whole key, preceded by its length (see TRIE_KEY_LEN), so that
+ * trie_to_static needn't climb the tree.
+ */
+#define TRIE_INLINE_LABEL_LEN 20
+#define TRIE_POOL_SIZE 1024
+#define TRIE_FIRSTS( t ) ( (unsigned char *) &(t)->children[(t)->child_cnt + 1] )
+#define TRIE_KEY_LEN( t ) ( ((const unsigned int *) trie_to_static( t ))[-1] )
+
 struct TRIE
 {
   trie *parent;
   char *label;
   trie **children;
   trie **data;
+  char *key;
+  int child_cnt;
+  char inline_label[TRIE_INLINE_LABEL_LEN];
+};
+
+/*
+ * A block of memory from which trie_build carves nodes, labels and
+ * children arrays.  It is never freed (see trie_free).
+ */
+struct TRIE_ARENA
+{
+  trie_arena *next;
+  char *start;
+  char *ptr;
+  char *end;
 };
 
-struct TRIE_WRAPPER
+struct TRIE_KEY
 {
-  trie_wrapper *next;
-  trie_wrapper *prev;
-  trie *t;
+  const char *key;
+  trie *node;
+  int index;
+};
+
+/*
+ * One of the tries built from the ontology at startup (see got_triples)
+ */
+struct ONTOLOGY_TRIE_JOB
+{
+  trie *base;
+  const char **keys;
+  trie **nodes;
+  int cnt;
+};
+
+/*
+ * Keys of a trie, each filed under a text (the key itself, or a word of
+ * it onward), in order of those texts so that the entries with any given
+ * prefix are a run of them.  best[j][i] is the entry with the shortest key
+ * among entries i .. i + 2^j - 1 (the first of them, on a tie); see
+ * autocomplete.c.
+ */
+struct AUTOCOMPLETE_INDEX
+{
+  trie **keys;
+  const char **texts;
+  int *lens;
+  int **best;
+  int cnt;
+  int levels;
+  int fold_case;
+};
+
+struct AUTOCOMPLETE_SPAN
+{
+  int lo;
+  int hi;
+  int best;
 };
 
 struct LYPHPLATE
@@ -123,7 +236,8 @@ struct LYPHPLATE
   trie *id;
   char *length;
   int type;
-  int flags;
+  int flags[WORKER_SLOTS];
+  int graph_index;
   long long modified;
 };
 
@@ -138,9 +252,6 @@ struct LYPHPLATE_TO_JSON_DETAILS
   int full_layers;
 };
 
-#define LYPHPLATE_DOES_INVOLVE 1
-#define LYPHPLATE_DOES_NOT_INVOLVE 2
-
 struct LYPHPLATE_WRAPPER
 {
   lyphplate_wrapper *next;
@@ -159,6 +270,7 @@ struct LAYER
   trie *id;
   char *name;
   int thickness;
+  int graph_index;
 };
 
 struct LAYER_WRAPPER
@@ -170,17 +282,18 @@ struct LAYER_WRAPPER
 struct LYPHNODE
 {
   trie *id;
-  int flags;
+  int flags[WORKER_SLOTS];
   exit_data **exits;
   exit_data **incoming;
   lyph *location;
   int loctype;
   int layer;
+  int graph_index;
 };
 
 typedef enum
 {
-  LYPHNODE_SEEN = 1, LYPHNODE_SELECTED = 2, LYPHNODE_GOAL = 4
+  LYPHNODE_SELECTED = 2
 } lyphnode_flags;
 
 typedef enum
@@ -207,21 +320,25 @@ struct LYPHNODE_WRAPPER
 struct LYPH
 {
   lyph *next;
+  lyph *prev;
   trie *id;
   trie *name;
   trie *species;
   int type;
-  int flags;
+  int flags[WORKER_SLOTS];
   lyphnode *from;
   lyphnode *to;
   lyphplate *lyphplt;
   lyphplate **constraints;
   lyph_annot **annots;
+  correlation **correlations;
   trie *fma;
   char *pubmed;
   char *projection_strength;
   long long modified;
-  lyph *parent_tmp;
+  lyph *house;
+  lyph *first_child;
+  lyph *next_sibling;
 };
 
 typedef enum
@@ -267,7 +384,8 @@ struct CLINICAL_INDEX
   char *claimed;
   clinical_index **parents;
   clinical_index **children;
-  int flags;
+  correlation **correlations;
+  int flags[WORKER_SLOTS];
 };
 
 #define CLINICAL_INDEX_SEARCH_UNION 1
@@ -278,7 +396,7 @@ struct PUBMED
   pubmed *next;
   char *id;
   char *title;
-  int flags;
+  int flags[WORKER_SLOTS];
 };
 
 struct CORRELINK
@@ -304,12 +422,11 @@ struct CORRELATION
 {
   correlation *next;
   correlation *prev;
-  correlink **links;
   variable **vars;
   pubmed *pbmd;
   char *comment;
   int id;
-  int flags;
+  int flags[WORKER_SLOTS];
 };
 
 struct LOCATED_MEASURE
@@ -351,16 +468,147 @@ struct EXIT_DATA
   lyph *via;
 };
 
+/*
+ * An entry in a path search's queue: the node reached (by its number in
+ * the lyph_graph), the lyph it was reached by, and the entry it was
+ * reached from (-1 for a starting node)
+ */
 struct LYPHSTEP
 {
-  lyphstep *next;
-  lyphstep *prev;
+  int node;
+  int back;
   int depth;
-  lyphstep *backtrace;
-  lyphnode *location;
-  lyph *lyph;
+  lyph *via;
+};
+
+/*
+ * Compact copy of the lyph graph (see graph.c).  The edges out of node i
+ * are out[out_start[i] .. out_start[i+1]-1], and likewise for the edges
+ * into it; an edge with to == -1 is unused.  An edge's id is its lyph's
+ * position in out, whichever list it is found in.
+ */
+struct LYPH_EDGE
+{
+  int to;
+  int id;
+  int type;
+  lyph *via;
+  lyphplate *lyphplt;
 };
 
+struct LYPH_GRAPH
+{
+  lyphnode **nodes;
+  int node_cnt;
+  int *out_start;
+  lyph_edge *out;
+  int *in_start;
+  lyph_edge *in;
+  int edge_cnt;
+};
+
+/*
+ * A simple path through the graph: len lyphs (given by their edges' ids
+ * in ids, and as lyphs in via) joining the len+1 nodes in nodes
+ */
+struct LYPH_ROUTE
+{
+  int len;
+  int *nodes;
+  int *ids;
+  lyph **via;
+};
+
+/*
+ * Scratch space for path searches between two sets of nodes (see graph.c).
+ * A node counts as reached by either half of a bidirectional search if its
+ * mark in fmark (or bmark) is the current gen, so nothing is cleared from
+ * one search to the next.
+ */
+struct LYPH_SEARCH
+{
+  lyph_graph *g;
+  lyph_filter *filter;
+  int dont_see_initials;
+  int include_reverses;
+  int include_nif;
+  int *sources;
+  int source_cnt;
+  int *goals;
+  int goal_cnt;
+  int *starts;
+  int start_cnt;
+  int cycle_node;
+  unsigned long *is_source;
+  unsigned long *is_goal;
+  unsigned long *banned_node;
+  unsigned long *banned_edge;
+  int gen;
+  int *fmark;
+  int *bmark;
+  int *fdist;
+  int *bdist;
+  int *fnode;
+  int *bnode;
+  int *fedge;
+  int *bedge;
+  int *fq;
+  int *bq;
+};
+
+/*
+ * A connections request (see graph.c).  Each listed lyph is known by the
+ * first position it is listed at (canon); the nodes directly in it are
+ * nodes[node_start[i] .. node_start[i+1]-1], and owner gives, for each
+ * node of g, the lyph it is directly in (or -1).  results[i] is filled in
+ * (and done[i] set) once the paths from the ith lyph are found: for each
+ * lyph j, results[i][canon[j]] is a NULL-terminated list of paths, or
+ * NULL if there are none.
+ */
+struct LYPH_CONNECTIONS
+{
+  lyph_graph *g;
+  lyph **lyphs;
+  int cnt;
+  int *canon;
+  int *owner;
+  int *node_start;
+  int *nodes;
+  int numpaths;
+  int include_nif;
+  int threads;
+  pthread_t *thread;
+  lyph *****results;
+  int *done;
+  int next;
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+};
+
+/*
+ * What the templates are built from (see hier.c).  The templates, then the
+ * layers in them, are numbered together; each one's materials (for a
+ * template, its misc materials and then its layers) are in made_of, and
+ * what each one is a material of is in used_in, both as compressed rows.
+ */
+struct LYPHPLATE_GRAPH
+{
+  lyphplate **plates;
+  int plate_cnt;
+  layer **layers;
+  int layer_cnt;
+  int node_cnt;
+  int *made_of_start;
+  int *made_of;
+  int *used_in_start;
+  int *used_in;
+};
+
+#define LYPH_GRAPH_WORD_BITS ( 8 * sizeof(unsigned long) )
+#define LYPH_GRAPH_SET( bits, i ) ( (bits)[(i) / LYPH_GRAPH_WORD_BITS] |= 1UL << ((i) % LYPH_GRAPH_WORD_BITS) )
+#define LYPH_GRAPH_CLEAR( bits, i ) ( (bits)[(i) / LYPH_GRAPH_WORD_BITS] &= ~( 1UL << ((i) % LYPH_GRAPH_WORD_BITS) ) )
+#define LYPH_GRAPH_IS_SET( bits, i ) ( (bits)[(i) / LYPH_GRAPH_WORD_BITS] & ( 1UL << ((i) % LYPH_GRAPH_WORD_BITS) ) )
+
 struct LYPH_FILTER
 {
   lyphplate *sup;
@@ -418,8 +666,6 @@ struct FMA
 {
   unsigned long id;
   fma *next;
-  fma *next_by_x;
-  fma *next_by_y;
   fma **parents;
   fma **children;
   fma **superclasses;
@@ -427,8 +673,8 @@ struct FMA
   fma **inferred_parts;
   fma **inferred_parents;
   nifling **niflings;
-  int flags;
-  int is_up;
+  int flags[WORKER_SLOTS];
+  int index;
   lyph *lyph;
 };
 
@@ -451,12 +697,16 @@ struct DISPLAYED_NIFLINGS
 struct SYSTEM_CONFIGS
 {
   int readonly;
+  int workers;
+  int image;
+  const char *ontology_file;
 };
 
 /*
  * Global variables
  */
 extern system_configs configs;
+extern __thread int worker_slot;
 
 extern trie *iri_to_labels;
 extern trie *label_to_iris;
@@ -469,9 +719,14 @@ extern trie *lyphnode_ids;
 extern trie *lyph_ids;
 extern trie *lyph_fmas;
 extern trie *lyph_names;
+extern trie *lyph_prefixes;
 
 extern trie *superclasses;
 
+extern autocomplete_index *label_autocomplete;
+extern autocomplete_index *lowercase_autocomplete;
+extern autocomplete_index *label_word_index;
+
 extern trie *metadata;
 extern clinical_index *first_clinical_index;
 extern clinical_index *last_clinical_index;
@@ -507,30 +762,89 @@ extern fma *last_fma[FMA_HASH];
 /*
  * labels.c
  */
-void init_labels(FILE *fp);
-void parse_ontology_file(FILE *fp);
-void add_labels_entry( char *iri_ch, char *label_ch );
-void add_subclass_entry( char *child_ch, char *parent_ch );
+#define ONT_TRIPLE_LABEL 1
+#define ONT_TRIPLE_SUBCLASS 2
+#define ONTOLOGY_TRIE_JOBS 4
+void init_labels(const char *filename);
+void parse_ontology_file( const char *filename );
+void *build_ontology_trie( void *arg );
+void add_to_data( trie ***dest, trie *datum );
+void remove_from_data( trie ***dest, trie *datum );
 trie **get_labels_by_iri( char *iri_ch );
 trie **get_iris_by_label( char *label_ch );
 trie **get_iris_by_label_case_insensitive( char *label_ch );
 trie **get_autocomplete_labels( char *label_ch, int case_insens );
-char *all_ont_terms_as_json( void );
+void index_labels( void );
+
+/*
+ * graph.c
+ */
+void lyph_graph_changed( void );
+lyph_graph *current_lyph_graph( void );
+int lyph_graph_index( lyph_graph *g, lyphnode *n );
+lyph ***compute_lyphpaths( lyphnode_wrapper *from_head, lyphnode_wrapper *to_head, lyph_filter *filter, int numpaths, int dont_see_initials, int include_reverses, int include_nif );
+lyph ***compute_k_lyphpaths( lyphnode_wrapper *from_head, lyphnode_wrapper *to_head, lyph_filter *filter, int numpaths, int dont_see_initials, int include_reverses, int include_nif );
+void start_lyph_connections( lyph_connections *c );
+lyph ****wait_lyph_connections( lyph_connections *c, int i );
+void finish_lyph_connections( lyph_connections *c );
+
+/*
+ * autocomplete.c
+ */
+autocomplete_index *build_autocomplete_index( trie *base );
+autocomplete_index *build_word_index( trie *base );
+int autocomplete_run( autocomplete_index *idx, const char *prefix, int *lo, int *hi );
+int autocomplete( autocomplete_index *idx, const char *prefix, trie **buf, int max );
+trie **autocomplete_all( autocomplete_index *idx, const char *prefix );
 
 /*
  * srv.c
  */
 void main_loop(void);
 
+/*
+ * workers.c
+ */
+int have_exclusive_access( void );
+
+/*
+ * journal.c
+ */
+extern __thread long long journal_replay_time;
+void recover_snapshots( void );
+void init_journal( void );
+int replay_journal( void );
+void journal_begin( void );
+int journal_defer( void (*save_fnc) ( void ) );
+long long journal_end( const char *query, int always );
+void journal_wait( long long seq );
+void journal_compact( void );
+FILE *open_snapshot( const char *file );
+void close_snapshot( FILE *fp );
+void *journal_thread( void *arg );
+
+/*
+ * image.c
+ */
+int save_image( void );
+int load_image( const char *ontology_file );
+
 /*
  * trie.c
  */
 trie *blank_trie(void);
 trie *trie_strdup( const char *buf, trie *base );
+void trie_build( trie *base, const char **keys, trie **nodes, int cnt );
+trie *trie_child( const trie *t, char c );
+void trie_set_label( trie *t, const char *label, size_t len );
+void trie_set_children( trie *t, trie **children );
+void trie_set_key( trie *t );
+void trie_free( void *ptr );
+void trie_free_node( trie *t );
 trie *trie_search( const char *buf, trie *base );
+trie *trie_search_prefix( const char *buf, trie *base );
 char *trie_to_static( trie *t );
 char *trie_to_json( trie *t );
-void trie_search_autocomplete( char *label_ch, trie **buf, trie *base, int translate_to_superclasses, int unlimited );
 int cmp_trie_data (const void * a, const void * b);
 void **datas_to_array( trie *t );
 int count_nontrivial_members( trie *t );
@@ -539,6 +853,7 @@ int count_nontrivial_members( trie *t );
  * util.c
  */
 long long longtime( void );
+long longtime_monotonic( void );
 char *ul_to_json( unsigned long n );
 char *ll_to_json( long long n );
 void log_string( char *txt );
@@ -550,6 +865,8 @@ void init_html_codes( void );
 char *lowercaserize( const char *x );
 char *get_url_shortform( char *iri );
 char *url_decode(char *str);
+char *url_decode_in_place( char *str );
+unsigned int str_hash( const char *str, size_t len, unsigned int seed );
 char *url_encode(char *str);
 int is_number( const char *arg );
 void error_message( char *err );
@@ -595,6 +912,7 @@ char *lyph_to_json( lyph *e );
 char *lyph_to_json_r( lyph *e, lyph_to_json_details *details );
 char *lyph_to_json_brief( const lyph *e );
 char *lyphpath_to_json( lyph **path );
+int lyph_passes_filter( lyph *e, lyph_filter *f );
 char *exit_to_json( exit_data *x );
 layer *layer_by_id( char *id );
 layer *layer_by_description( char *name, lyphplate **materials, int thickness );
@@ -605,6 +923,10 @@ lyph *lyph_by_id_or_fmastr( const char *id );
 lyph *lyph_by_template_or_id_or_null( char *id, char *species );
 lyph *lyph_by_template_or_id( char *id, char *species );
 lyph *lyph_by_name( const char *name );
+void index_lyphs( void );
+void index_lyph( lyph *e );
+void unindex_lyph( lyph *e );
+lyph **lyphs_by_prefix( char *prefix, trie *species, int include_null_species, int include_any_species );
 trie *assign_new_layer_id( layer *lyr );
 lyphplate *lyphplate_by_layers( int type, layer **layers, lyphplate **misc_material, char *name, char *length );
 int same_layers( layer **x, layer **y );
@@ -639,8 +961,6 @@ void add_to_exits( lyph *e, lyphnode *to, exit_data ***victim );
 void remove_from_exits( lyph *e, exit_data ***victim );
 void change_source_of_exit( lyph *via, lyphnode *new_src, exit_data **exits );
 void change_dest_of_exit( lyph *via, lyphnode *new_dest, exit_data **exits );
-lyph ***compute_lyphpaths( lyphnode_wrapper *from_head, lyphnode_wrapper *to_head, lyph_filter *filter, int numpaths, int dont_see_initials, int include_reverses, int include_nif );
-void free_lyphsteps( lyphstep *head );
 void save_lyphviews( void );
 void load_lyphviews( void );
 char *lyphview_to_json( lyphview *v );
@@ -663,6 +983,8 @@ void save_lyphplates(void);
 lyphplate **get_all_lyphplates( void );
 void free_lyphnode_wrappers( lyphnode_wrapper *head );
 lyph *get_lyph_location( lyph *e );
+void lyph_containment_changed( void );
+void current_lyph_containment( void );
 lyphnode *blank_lyphnode( void );
 layer *clone_layer( layer *lyr );
 char *lyphview_to_json_brief( const lyphview *v );
@@ -675,8 +997,13 @@ lyph *get_relative_lyph_loc_buf( lyph *e, lyph **buf );
 int can_node_fit_in_lyph( lyphnode *n, lyph *e );
 void calc_nodes_in_lyph( lyph *L, lyphnode_wrapper **head, lyphnode_wrapper **tail );
 lyphplate **common_materials_of_layers( lyphplate *L );
-int is_X_built_from_Y( lyphplate *x, void *y );
-int is_Xs_built_from_Y( lyphplate **xs, void *y );
+void lyphplate_graph_changed( void );
+lyphplate_graph *current_lyphplate_graph( void );
+int lyphplate_graph_index( lyphplate_graph *g, lyphplate *L );
+int is_Xs_built_from_Y( lyphplate **xs, lyphplate *y );
+int is_X_built_from_layer( lyphplate *x, layer *lyr );
+int is_Xs_built_from_layer( lyphplate **xs, layer *lyr );
+unsigned long *lyphplates_involving( lyphplate_graph *g, lyphplate **parts );
 
 /*
  * meta.c
@@ -688,7 +1015,10 @@ char *correlation_jsons_by_lyph( const lyph *e );
 void free_all_correlations( void );
 void free_all_located_measures( void );
 void delete_located_measure( located_measure *m );
+void free_located_measure( located_measure *m );
 void delete_correlation( correlation *c );
+void index_correlation( correlation *c );
+void unindex_correlation( correlation *c );
 void load_correlations( void );
 void load_located_measures( void );
 void save_located_measures( void );
@@ -716,7 +1046,7 @@ char *clinical_index_to_json_brief( const clinical_index *ci );
 char *clinical_index_to_json_full( const clinical_index *ci );
 void add_clinical_index_to_array( clinical_index *ci, clinical_index ***arr );
 int remove_lyphnode_from_bops( const lyphnode *n );
-int remove_lyph_from_bops( const lyph *e );
+int remove_deleted_lyphs_from_bops( void );
 added_edge *added_edge_by_notation( const char *notation );
 located_measure *located_measure_by_id( const char *id );
 void save_bops( void );
@@ -729,14 +1059,11 @@ void compute_inferred_parts( fma **seeds, int skip_lat );
 void flatten_fmas( void );
 void parse_nifling_file( void );
 void parse_fma_file( void );
+void build_fma_graph( void );
+void init_brain( void );
 fma *fma_by_trie( trie *id );
 fma *fma_by_ul( unsigned long id );
 
-/*
- * cmds.c
- */
-int template_involves_any_of( lyphplate *L, lyphplate **parts );
-
 /*
  * fromjs.cpp
  */
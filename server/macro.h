@@ -212,7 +212,7 @@ while(0)
 /*
  * Misc. macros
  */
-#define HANDLER(fnc) void fnc( char *request, http_request *req, url_param **params )
+#define HANDLER(fnc) void fnc( char *request, http_request *req, url_params *params )
 
 #define VOIDLEN(x) voidlen((void**)(x))
 
@@ -25,6 +25,8 @@ located_measure *make_located_measure( char *qualstr, lyph *e, int should_save )
 char *correlation_jsons_by_located_measure( const located_measure *m );
 char *next_clindex_index( void );
 void remove_clindex_from_array( clinical_index *ci, clinical_index ***arr );
+void add_to_correlation_list( correlation ***list, correlation *c );
+void remove_from_correlation_list( correlation ***list, correlation *c );
 int remove_located_measure_from_bops( const located_measure *m );
 int clindex_correlation_count( const clinical_index *ci );
 
@@ -247,7 +249,10 @@ void save_lyph_annotations( void )
   if ( configs.readonly )
     return;
 
-  fp = fopen( LYPH_ANNOTS_FILE, "w" );
+  if ( journal_defer( save_lyph_annotations ) )
+    return;
+
+  fp = open_snapshot( LYPH_ANNOTS_FILE );
 
   if ( !fp )
   {
@@ -258,7 +263,7 @@ void save_lyph_annotations( void )
   for ( e = first_lyph; e; e = e->next )
     save_lyph_annotations_one_lyph( fp, e );
 
-  fclose(fp);
+  close_snapshot( fp );
 
   return;
 }
@@ -421,7 +426,10 @@ void save_pubmeds( void )
   if ( configs.readonly )
     return;
 
-  fp = fopen( PUBMED_FILE, "w" );
+  if ( journal_defer( save_pubmeds ) )
+    return;
+
+  fp = open_snapshot( PUBMED_FILE );
 
   if ( !fp )
   {
@@ -442,17 +450,17 @@ void save_pubmeds( void )
   }
 
   fprintf( fp, "]" );
-  fclose( fp );
+  close_snapshot( fp );
 }
 
 void fprintf_one_clinical_index( FILE *fp, clinical_index *ci, int *fFirst )
 {
   clinical_index **pptr;
 
-  if ( ci->flags == 1 )
+  if ( ci->flags[worker_slot] == 1 )
     return;
 
-  ci->flags = 1;
+  ci->flags[worker_slot] = 1;
 
   for ( pptr = ci->parents; *pptr; pptr++ )
     fprintf_one_clinical_index( fp, *pptr, fFirst );
@@ -474,7 +482,10 @@ void save_clinical_indices( void )
   if ( configs.readonly )
     return;
 
-  fp = fopen( CLINICAL_INDEX_FILE, "w" );
+  if ( journal_defer( save_clinical_indices ) )
+    return;
+
+  fp = open_snapshot( CLINICAL_INDEX_FILE );
 
   if ( !fp )
   {
@@ -488,10 +499,10 @@ void save_clinical_indices( void )
     fprintf_one_clinical_index( fp, c, &fFirst );
 
   for ( c = first_clinical_index; c; c = c->next )
-    c->flags = 0;
+    c->flags[worker_slot] = 0;
 
   fprintf( fp, "]" );
-  fclose( fp );
+  close_snapshot( fp );
 }
 
 void save_clinical_indices_deprecated( void )
@@ -591,7 +602,7 @@ void load_clinical_indices_deprecated( void )
     ci->claimed = NULL;
     ci->parents = (clinical_index**)blank_void_array();
     ci->children = (clinical_index**)blank_void_array();
-    ci->flags = 0;
+    ci->flags[worker_slot] = 0;
     LINK( ci, first_clinical_index, last_clinical_index, next );
   }
 
@@ -787,7 +798,7 @@ HANDLER( do_make_clinical_index )
   ci->claimed = NULL;
   ci->children = (clinical_index**)blank_void_array();
   ci->parents = parents;
-  ci->flags = 0;
+  ci->flags[worker_slot] = 0;
   LINK( ci, first_clinical_index, last_clinical_index, next );
 
   for ( pptr = parents; *pptr; pptr++ )
@@ -832,7 +843,7 @@ clinical_index *clinical_index_by_index_or_create( const char *ind )
   ci->claimed = NULL;
   ci->children = (clinical_index**)blank_void_array();
   ci->parents = (clinical_index**)blank_void_array();
-  ci->flags = 0;
+  ci->flags[worker_slot] = 0;
 
   LINK( ci, first_clinical_index, last_clinical_index, next );
 
@@ -865,7 +876,7 @@ clinical_index *clinical_index_by_trie_or_create( trie *ind_tr, pubmed *pbmd )
   ci->label = ind_tr;
   ci->parents = (clinical_index**)blank_void_array();
   ci->children = (clinical_index**)blank_void_array();
-  ci->flags = 0;
+  ci->flags[worker_slot] = 0;
   CREATE( ci->pubmeds, pubmed *, 2 );
   ci->pubmeds[0] = pbmd;
   ci->pubmeds[1] = NULL;
@@ -1634,6 +1645,7 @@ HANDLER( do_makecorrelation )
      */
     INSERT2( c, edit, first_correlation, next, prev );
     UNLINK2( edit, first_correlation, last_correlation, next, prev );
+    unindex_correlation( edit );
     c->id = edit->id;
   }
   else
@@ -1646,6 +1658,7 @@ HANDLER( do_makecorrelation )
     LINK2( c, first_correlation, last_correlation, next, prev );
   }
 
+  index_correlation( c );
   save_correlations();
 
   send_response( req, correlation_to_json( c ) );
@@ -1654,31 +1667,30 @@ HANDLER( do_makecorrelation )
 
 HANDLER( do_all_correlations )
 {
-  correlation **cbuf, **cbufptr, *c;
-  int cnt = 0;
-
-  for ( c = first_correlation; c; c = c->next )
-    cnt++;
+  correlation *c;
+  json_stream s;
 
-  CREATE( cbuf, correlation *, cnt + 1 );
-  cbufptr = cbuf;
+  json_stream_begin( &s, req );
+  json_stream_open( &s, NULL, '[' );
 
   for ( c = first_correlation; c; c = c->next )
-    *cbufptr++ = c;
-
-  *cbufptr = NULL;
+    json_stream_value( &s, NULL, correlation_to_json( c ) );
 
-  send_response( req, JS_ARRAY( correlation_to_json, cbuf ) );
-
-  free( cbuf );
+  json_stream_close( &s );
+  json_stream_end( &s );
 }
 
 void save_correlations( void )
 {
-  FILE *fp = fopen( CORRELATION_FILE, "w" );
+  FILE *fp;
   correlation *c;
   int fFirst = 0;
 
+  if ( journal_defer( save_correlations ) )
+    return;
+
+  fp = open_snapshot( CORRELATION_FILE );
+
   if ( !fp )
   {
     error_messagef( "Could not open %s for writing", CORRELATION_FILE );
@@ -1699,38 +1711,7 @@ void save_correlations( void )
 
   fprintf( fp, "]" );
 
-  fclose(fp);
-}
-
-void populate_ontsearch( char *key, trie ***bptr, int *cnt, trie *t )
-{
-  if ( t->data )
-  {
-    char *label = trie_to_static( t ), *lptr;
-
-    for ( lptr = label; *lptr; )
-    {
-      if ( str_begins( lptr, key ) )
-      {
-        **bptr = t;
-        (*bptr)++;
-        (*cnt)++;
-
-        break;
-      }
-
-      for ( ; *lptr; lptr++ )
-        if ( *lptr == ' ' )
-          break;
-
-      if ( !*lptr )
-        break;
-      else
-        lptr++;
-    }
-  }
-
-  TRIE_RECURSE( populate_ontsearch( key, bptr, cnt, *child ) );
+  close_snapshot( fp );
 }
 
 char *ontsearch_term_to_json( trie *x )
@@ -1744,20 +1725,14 @@ char *ontsearch_term_to_json( trie *x )
 
 HANDLER( do_ontsearch )
 {
-  trie **buf, **bptr;
+  trie **buf;
   char *keystr;
-  int cnt = 0;
 
   TRY_PARAM( keystr, "key", "You did not indicate a 'key' to search for" );
 
-  CREATE( buf, trie *, count_nontrivial_members(label_to_iris)*2 + 1);
-  bptr = buf;
-
-  populate_ontsearch( keystr, &bptr, &cnt, label_to_iris );
-  *bptr = NULL;
+  CREATE( buf, trie *, MAX_ONTSEARCH_RESULTS + 1 );
 
-  qsort( buf, cnt, sizeof(trie*), cmp_trie_data );
-  buf[100] = NULL;
+  autocomplete( label_word_index, keystr, buf, MAX_ONTSEARCH_RESULTS );
 
   send_response( req, JS_ARRAY( ontsearch_term_to_json, buf ) );
 
@@ -1903,10 +1878,15 @@ HANDLER( do_make_located_measure )
 
 void save_located_measures( void )
 {
-  FILE *fp = fopen( LOCATED_MEASURE_FILE, "w" );
+  FILE *fp;
   located_measure *m;
   int fFirst = 0;
 
+  if ( journal_defer( save_located_measures ) )
+    return;
+
+  fp = open_snapshot( LOCATED_MEASURE_FILE );
+
   if ( !fp )
   {
     error_messagef( "Could not open %s for writing", LOCATED_MEASURE_FILE );
@@ -1927,7 +1907,7 @@ void save_located_measures( void )
 
   fprintf( fp, "]" );
 
-  fclose(fp);
+  close_snapshot( fp );
 }
 
 HANDLER( do_delete_correlation )
@@ -1952,6 +1932,7 @@ void delete_correlation( correlation *c )
 {
   variable **v;
 
+  unindex_correlation( c );
   UNLINK2( c, first_correlation, last_correlation, next, prev );
 
   for ( v = c->vars; *v; v++ )
@@ -1966,6 +1947,92 @@ void delete_correlation( correlation *c )
   free( c );
 }
 
+/*
+ * Each lyph, and each clinical index, keeps a list of the correlations
+ * with a variable involving it, in order of id (which is also the order
+ * of the correlation list).  An empty list is NULL.
+ */
+void add_to_correlation_list( correlation ***list, correlation *c )
+{
+  correlation **x;
+  int len, i;
+
+  len = *list ? VOIDLEN( *list ) : 0;
+
+  for ( i = len; i > 0; i-- )
+  {
+    if ( (*list)[i-1] == c )
+      return;
+
+    if ( (*list)[i-1]->id < c->id )
+      break;
+  }
+
+  CREATE( x, correlation *, len + 2 );
+
+  if ( *list )
+  {
+    memcpy( x, *list, i * sizeof(correlation *) );
+    memcpy( &x[i+1], &(*list)[i], (len - i) * sizeof(correlation *) );
+    free( *list );
+  }
+
+  x[i] = c;
+  x[len+1] = NULL;
+  *list = x;
+}
+
+void remove_from_correlation_list( correlation ***list, correlation *c )
+{
+  correlation **ptr;
+
+  if ( !*list )
+    return;
+
+  for ( ptr = *list; *ptr; ptr++ )
+    if ( *ptr == c )
+      break;
+
+  if ( !*ptr )
+    return;
+
+  do
+    ptr[0] = ptr[1];
+  while ( *ptr++ );
+
+  if ( !**list )
+  {
+    free( *list );
+    *list = NULL;
+  }
+}
+
+void index_correlation( correlation *c )
+{
+  variable **v;
+
+  for ( v = c->vars; *v; v++ )
+  {
+    if ( (*v)->type == VARIABLE_LOCATED )
+      add_to_correlation_list( &(*v)->loc->correlations, c );
+    else if ( (*v)->type == VARIABLE_CLINDEX )
+      add_to_correlation_list( &(*v)->ci->correlations, c );
+  }
+}
+
+void unindex_correlation( correlation *c )
+{
+  variable **v;
+
+  for ( v = c->vars; *v; v++ )
+  {
+    if ( (*v)->type == VARIABLE_LOCATED )
+      remove_from_correlation_list( &(*v)->loc->correlations, c );
+    else if ( (*v)->type == VARIABLE_CLINDEX )
+      remove_from_correlation_list( &(*v)->ci->correlations, c );
+  }
+}
+
 HANDLER( do_delete_located_measure )
 {
   located_measure *m;
@@ -1992,6 +2059,14 @@ void delete_located_measure( located_measure *m )
   if ( remove_located_measure_from_bops( m ) )
     save_bops();
 
+  free_located_measure( m );
+}
+
+/*
+ * Unlink and free a located measure which no bop refers to any more
+ */
+void free_located_measure( located_measure *m )
+{
   if ( m->quality )
     free( m->quality );
 
@@ -2014,11 +2089,20 @@ void free_all_located_measures( void )
 
 void free_all_correlations( void )
 {
+  clinical_index *ci;
+  lyph *e;
+
   /*
    * Intentional memory leak here because the complexity of avoiding
    * it would not be worth the anticipated rarity of this function
    * being called
    */
+  for ( e = first_lyph; e; e = e->next )
+    e->correlations = NULL;
+
+  for ( ci = first_clinical_index; ci; ci = ci->next )
+    ci->correlations = NULL;
+
   first_correlation = NULL;
   last_correlation = NULL;
   save_correlations();
@@ -2037,15 +2121,21 @@ int count_correlations( void )
 
 correlation **correlations_by_located_measure( const located_measure *m )
 {
-  correlation *c, **buf, **bptr;
+  correlation **buf, **bptr, **cptr;
   variable **vs, *v;
 
-  CREATE( buf, correlation *, count_correlations() + 1 );
+  if ( !m->loc->correlations )
+  {
+    CREATE( buf, correlation *, 1 );
+    return buf;
+  }
+
+  CREATE( buf, correlation *, VOIDLEN( m->loc->correlations ) + 1 );
   bptr = buf;
 
-  for ( c = first_correlation; c; c = c->next )
+  for ( cptr = m->loc->correlations; *cptr; cptr++ )
   {
-    for ( vs = c->vars; *vs; vs++ )
+    for ( vs = (*cptr)->vars; *vs; vs++ )
     {
       v = *vs;
 
@@ -2053,7 +2143,7 @@ correlation **correlations_by_located_measure( const located_measure *m )
       &&   v->loc == m->loc
       &&  !strcmp( v->quality, m->quality ) )
       {
-        *bptr++ = c;
+        *bptr++ = *cptr;
         break;
       }
     }
@@ -2073,83 +2163,41 @@ char *correlation_jsons_by_located_measure( const located_measure *m )
   return retval;
 }
 
-correlation **correlations_by_lyph( const lyph *e )
-{
-  correlation *c, **buf, **bptr;
-  variable **vs, *v;
-  int cnt = 0;
-
-  for ( c = first_correlation; c; c = c->next )
-    cnt++;
-
-  CREATE( buf, correlation *, cnt + 1 );
-  bptr = buf;
-
-  for ( c = first_correlation; c; c = c->next )
-  {
-    for ( vs = c->vars; *vs; vs++ )
-    {
-      v = *vs;
-
-      if ( v->type == VARIABLE_LOCATED && v->loc == e )
-      {
-        *bptr++ = c;
-        break;
-      }
-    }
-  }
-
-  *bptr = NULL;
-  return buf;
-}
-
 char *correlation_jsons_by_lyph( const lyph *e )
 {
-  correlation **corrs = correlations_by_lyph( e );
-  char *retval = JS_ARRAY( correlation_to_json, corrs );
-
-  free( corrs );
-
-  return retval;
+  return JS_ARRAY( correlation_to_json, e->correlations );
 }
 
 int correlation_count( lyph *e, lyph **children )
 {
   lyph **chptr;
-  correlation *c;
-  variable **vs, *v;
+  correlation **c;
   int cnt = 0;
 
-  for ( chptr = children; *chptr; chptr++ )
-    (*chptr)->flags = 1;
-
-  e->flags = 1;
-
-  for ( c = first_correlation; c; c = c->next )
+  for ( c = e->correlations; c && *c; c++ )
   {
-    if ( c->flags == 1 )
-      continue;
+    (*c)->flags[worker_slot] = 1;
+    cnt++;
+  }
 
-    for ( vs = c->vars; *vs; vs++ )
+  for ( chptr = children; *chptr; chptr++ )
+  {
+    for ( c = (*chptr)->correlations; c && *c; c++ )
     {
-      v = *vs;
-
-      if ( v->type == VARIABLE_LOCATED && v->loc->flags == 1 )
+      if ( (*c)->flags[worker_slot] != 1 )
       {
-        c->flags = 1;
+        (*c)->flags[worker_slot] = 1;
         cnt++;
-        break;
       }
     }
   }
 
-  for ( chptr = children; *chptr; chptr++ )
-    (*chptr)->flags = 0;
-
-  e->flags = 0;
+  for ( c = e->correlations; c && *c; c++ )
+    (*c)->flags[worker_slot] = 0;
 
-  for ( c = first_correlation; c; c = c->next )
-    c->flags = 0;
+  for ( chptr = children; *chptr; chptr++ )
+    for ( c = (*chptr)->correlations; c && *c; c++ )
+      (*c)->flags[worker_slot] = 0;
 
   return cnt;
 }
@@ -2288,6 +2336,7 @@ void generate_random_correlation( void )
     c->id = 1;
 
   LINK( c, first_correlation, last_correlation, next );
+  index_correlation( c );
 }
 
 HANDLER( do_gen_random_correlations )
@@ -2373,13 +2422,13 @@ HANDLER( do_stats )
   fma *fma_by_str( const char *str );
 
   for ( e = first_lyph; e; e = e->next )
-    e->flags = 0;
+    e->flags[worker_slot] = 0;
 
   for ( ci = first_clinical_index; ci; ci = ci->next )
-    ci->flags = 0;
+    ci->flags[worker_slot] = 0;
 
   for ( p = first_pubmed; p; p = p->next )
-    p->flags = 0;
+    p->flags[worker_slot] = 0;
 
   for ( c = first_correlation; c; c = c->next )
   {
@@ -2390,10 +2439,10 @@ HANDLER( do_stats )
       if ( (*v)->type == VARIABLE_CLINDEX )
       {
         fClindex = 1;
-        (*v)->ci->flags = 1;
+        (*v)->ci->flags[worker_slot] = 1;
       }
       else if ( (*v)->type == VARIABLE_LOCATED && (*v)->loc )
-        (*v)->loc->flags = 1;
+        (*v)->loc->flags[worker_slot] = 1;
     }
 
     if ( fClindex )
@@ -2402,32 +2451,32 @@ HANDLER( do_stats )
       correlations_with_no_clindex++;
 
     if ( c->pbmd )
-      c->pbmd->flags = 1;
+      c->pbmd->flags[worker_slot] = 1;
   }
 
   for ( ci = first_clinical_index; ci; ci = ci->next )
   {
-    if ( ci->flags )
+    if ( ci->flags[worker_slot] )
     {
-      ci->flags = 0;
+      ci->flags[worker_slot] = 0;
       clindices_in_correlations++;
     }
   }
 
   for ( e = first_lyph; e; e = e->next )
   {
-    if ( e->flags )
+    if ( e->flags[worker_slot] )
     {
-      e->flags = 0;
+      e->flags[worker_slot] = 0;
       lyphs_in_correlations++;
     }
   }
 
   for ( p = first_pubmed; p; p = p->next )
   {
-    if ( p->flags )
+    if ( p->flags[worker_slot] )
     {
-      p->flags = 0;
+      p->flags[worker_slot] = 0;
       pubmeds_in_correlations++;
     }
   }
@@ -2438,15 +2487,15 @@ HANDLER( do_stats )
     {
       f = fma_by_trie( e->fma );
 
-      if ( f && !f->flags )
+      if ( f && !f->flags[worker_slot] )
       {
-        f->flags = 1;
+        f->flags[worker_slot] = 1;
         distinct_fmas++;
       }
     }
   }
 
-  ITERATE_FMAS( f->flags = 0 );
+  ITERATE_FMAS( f->flags[worker_slot] = 0 );
 
   for ( e = first_lyph; e; e = e->next )
   {
@@ -2455,15 +2504,15 @@ HANDLER( do_stats )
       char *id = trie_to_static( e->fma );
 
       f = fma_by_str( id );
-      if ( f && !f->flags )
+      if ( f && !f->flags[worker_slot] )
       {
-        f->flags++;
+        f->flags[worker_slot]++;
         distinct_fmas_annoting_lyphs++;
       }
     }
   }
 
-  ITERATE_FMAS( f->flags = 0 );
+  ITERATE_FMAS( f->flags[worker_slot] = 0 );
 
   send_response( req, JSON
   (
@@ -2694,10 +2743,15 @@ added_edge *added_edge_by_notation( const char *notation )
 
 void save_bops( void )
 {
-  FILE *fp = fopen( BOPS_FILE, "w" );
+  FILE *fp;
   bop *b;
   int fFirst = 0;
 
+  if ( journal_defer( save_bops ) )
+    return;
+
+  fp = open_snapshot( BOPS_FILE );
+
   if ( !fp )
   {
     error_messagef( "Could not open %s for writing", BOPS_FILE );
@@ -2718,7 +2772,7 @@ void save_bops( void )
 
   fprintf( fp, "]" );
 
-  fclose( fp );
+  close_snapshot( fp );
 }
 
 HANDLER( do_makebop )
@@ -2838,35 +2892,62 @@ int remove_lyphnode_from_bops( const lyphnode *n )
   return fMatch;
 }
 
-int remove_lyph_from_bops( const lyph *e )
+/*
+ * Take the lyphs marked LYPH_DELETED, and the located measures on them,
+ * out of every bop
+ */
+int remove_deleted_lyphs_from_bops( void )
 {
   bop *b;
-  lyph **rem, **new_rem, **nrptr;
   int fMatch = 0;
 
   for ( b = first_bop; b; b = b->next )
   {
+    lyph **rem, **new_rem, **nrptr;
+    located_measure **ptr, **remeasures, **reptr;
     int cnt = 0;
 
     for ( rem = b->excluded; *rem; rem++ )
-      if ( *rem == e )
+      if ( (*rem)->type == LYPH_DELETED )
         cnt++;
 
-    if ( !cnt )
-      continue;
+    if ( cnt )
+    {
+      fMatch = 1;
 
-    fMatch = 1;
+      CREATE( new_rem, lyph *, (rem - b->excluded) - cnt + 1 );
+      nrptr = new_rem;
 
-    CREATE( new_rem, lyph *, (rem - b->excluded) - cnt + 1 );
-    nrptr = new_rem;
+      for ( rem = b->excluded; *rem; rem++ )
+        if ( (*rem)->type != LYPH_DELETED )
+          *nrptr++ = *rem;
 
-    for ( rem = b->excluded; *rem; rem++ )
-      if ( *rem != e )
-        *nrptr++ = *rem;
+      *nrptr = NULL;
+      free( b->excluded );
+      b->excluded = new_rem;
+    }
+
+    cnt = 0;
+
+    for ( ptr = b->measures; *ptr; ptr++ )
+      if ( (*ptr)->loc->type == LYPH_DELETED )
+        cnt++;
 
-    *nrptr = NULL;
-    free( b->excluded );
-    b->excluded = nrptr;
+    if ( cnt )
+    {
+      fMatch = 1;
+
+      CREATE( remeasures, located_measure *, (ptr - b->measures) - cnt + 1 );
+      reptr = remeasures;
+
+      for ( ptr = b->measures; *ptr; ptr++ )
+        if ( (*ptr)->loc->type != LYPH_DELETED )
+          *reptr++ = *ptr;
+
+      *reptr = NULL;
+      free( b->measures );
+      b->measures = remeasures;
+    }
   }
 
   return fMatch;
@@ -2908,60 +2989,107 @@ int remove_located_measure_from_bops( const located_measure *m )
 
 int clindex_correlation_count( const clinical_index *ci )
 {
-  const correlation *c;
-  variable **v;
-  int cnt = 0;
-
-  for ( c = first_correlation; c; c = c->next )
-  {
-    for ( v = c->vars; *v; v++ )
-      if ( (*v)->type == VARIABLE_CLINDEX && (*v)->ci == ci )
-        break;
-
-    if ( *v )
-      cnt++;
-  }
+  return ci->correlations ? VOIDLEN( ci->correlations ) : 0;
+}
 
-  return cnt;
+int compare_correlation_ids( const void *a, const void *b )
+{
+  return (*(const correlation **)a)->id - (*(const correlation **)b)->id;
 }
 
-correlink **correlation_is_linked( correlation *x, correlation *y, int cnt )
+/*
+ * The links from c to the other correlations which share a lyph with it:
+ * one for each located variable of the other correlation whose lyph is
+ * also the location of one of c's variables, ordered by the other
+ * correlation's id.  The candidates are found through the lyphs' lists
+ * of correlations (see index_correlation), so this costs in proportion
+ * to the correlations near c, not to all of them.  The links are carved
+ * out of one block: free them with free_correlation_links.
+ */
+correlink **correlation_links( correlation *c )
 {
+  correlation **cands, **cptr, **x;
+  correlink **buf, **bptr, *links;
   variable **v, **w;
-  correlink **buf, **bptr;
+  int cnt = 0, size = 0;
 
-  CREATE( buf, correlink *, (lyphcnt * cnt) + 1 );
-  bptr = buf;
+  for ( v = c->vars; *v; v++ )
+  {
+    if ( (*v)->type != VARIABLE_LOCATED )
+      continue;
 
-  for ( v = x->vars; *v; v++ )
-    if ( (*v)->type == VARIABLE_LOCATED )
-      (*v)->loc->flags = 1;
+    (*v)->loc->flags[worker_slot] = 1;
+    cnt += VOIDLEN( (*v)->loc->correlations );
+  }
 
-  for ( w = y->vars; *w; w++ )
+  CREATE( cands, correlation *, cnt + 1 );
+  cptr = cands;
+  c->flags[worker_slot] = 1;
+
+  for ( v = c->vars; *v; v++ )
   {
-    if ( (*w)->type == VARIABLE_LOCATED && (*w)->loc->flags )
+    if ( (*v)->type != VARIABLE_LOCATED )
+      continue;
+
+    for ( x = (*v)->loc->correlations; *x; x++ )
     {
-      CREATE( *bptr, correlink, 1 );
-      (*bptr)->c = y;
-      (*bptr)->e = (*w)->loc;
-      bptr++;
+      if ( (*x)->flags[worker_slot] )
+        continue;
+
+      (*x)->flags[worker_slot] = 1;
+      *cptr++ = *x;
+      size += VOIDLEN( (*x)->vars );
     }
   }
 
-  for ( v = x->vars; *v; v++ )
-    if ( (*v)->type == VARIABLE_LOCATED )
-      (*v)->loc->flags = 0;
+  *cptr = NULL;
+  c->flags[worker_slot] = 0;
 
-  if ( bptr == buf )
+  for ( cptr = cands; *cptr; cptr++ )
+    (*cptr)->flags[worker_slot] = 0;
+
+  qsort( cands, cptr - cands, sizeof(correlation *), compare_correlation_ids );
+
+  CREATE( buf, correlink *, size + 1 );
+  bptr = buf;
+
+  if ( size )
   {
-    free( buf );
-    return NULL;
+    CREATE( links, correlink, size );
+
+    for ( cptr = cands; *cptr; cptr++ )
+    {
+      for ( w = (*cptr)->vars; *w; w++ )
+      {
+        if ( (*w)->type == VARIABLE_LOCATED && (*w)->loc->flags[worker_slot] )
+        {
+          links->c = *cptr;
+          links->e = (*w)->loc;
+          *bptr++ = links++;
+        }
+      }
+    }
   }
 
   *bptr = NULL;
+
+  for ( v = c->vars; *v; v++ )
+    if ( (*v)->type == VARIABLE_LOCATED )
+      (*v)->loc->flags[worker_slot] = 0;
+
+  free( cands );
+
   return buf;
 }
 
+void free_correlation_links( correlink **links )
+{
+  if ( *links )
+    free( *links );
+
+  free( links );
+}
+
 char *correlink_to_json( const correlink *cl )
 {
   return JSON
@@ -2978,49 +3106,62 @@ int count_distinct_correlation_links( correlink **buf )
 
   for ( ptr = buf; *ptr; ptr++ )
   {
-    if ( !(*ptr)->c->flags )
+    if ( !(*ptr)->c->flags[worker_slot] )
     {
-      (*ptr)->c->flags = 1;
+      (*ptr)->c->flags[worker_slot] = 1;
       cnt++;
     }
   }
 
   for ( ptr = buf; *ptr; ptr++ )
-    (*ptr)->c->flags = 0;
+    (*ptr)->c->flags[worker_slot] = 0;
 
   return cnt;
 }
 
-char *correlation_links_to_json( const correlation *c )
+char *correlation_links_to_json( correlation *c )
 {
-  return JSON
+  correlink **links = correlation_links( c );
+  char *retval;
+
+  retval = JSON
   (
     "id": int_to_json( c->id ),
-    "linkcount": int_to_json( count_distinct_correlation_links( c->links ) ),
-    "edgecount": int_to_json( VOIDLEN( c->links ) ),
-    "links": JS_ARRAY( correlink_to_json, c->links )
+    "linkcount": int_to_json( count_distinct_correlation_links( links ) ),
+    "edgecount": int_to_json( VOIDLEN( links ) ),
+    "links": JS_ARRAY( correlink_to_json, links )
   );
+
+  free_correlation_links( links );
+
+  return retval;
 }
 
-int generate_correlation_links_dotfile( correlation **cbuf )
+int generate_correlation_links_dotfile( void )
 {
   FILE *fp = fopen( CORRELATION_LINKS_DOTFILE, "w" );
-  correlation **c;
-  correlink **cl;
+  correlation *c;
+  correlink **links, **cl;
 
   if ( !fp )
     return 0;
 
   fprintf( fp, "digraph\n{\n" );
 
-  for ( c = cbuf; *c; c++ )
-    fprintf( fp, "  %d;\n", (*c)->id );
+  for ( c = first_correlation; c; c = c->next )
+    fprintf( fp, "  %d;\n", c->id );
 
   fprintf( fp, "  subgraph cluster_0\n  {\n" );
 
-  for ( c = cbuf; *c; c++ )
-  for ( cl = (*c)->links; *cl; cl++ )
-    fprintf( fp, "    %d -> %d[label=\"%s\"];\n", (*c)->id, (*cl)->c->id, trie_to_static((*cl)->e->id) );
+  for ( c = first_correlation; c; c = c->next )
+  {
+    links = correlation_links( c );
+
+    for ( cl = links; *cl; cl++ )
+      fprintf( fp, "    %d -> %d[label=\"%s\"];\n", c->id, (*cl)->c->id, trie_to_static((*cl)->e->id) );
+
+    free_correlation_links( links );
+  }
 
   fprintf( fp, "  }\n}\n" );
 
@@ -3031,167 +3172,92 @@ int generate_correlation_links_dotfile( correlation **cbuf )
 
 HANDLER( do_correlation_links )
 {
-  correlation *c, *lnk, **cbuf, **cbptr;
-  correlink **buf, **bptr, **cl, **clptr;
-  lyph *e;
-  int cnt = 0;
-
-  for ( e = first_lyph; e; e = e->next )
-    e->flags = 0;
-
-  for ( c = first_correlation; c; c = c->next )
-  {
-    c->links = NULL;
-    cnt++;
-  }
-
-  for ( c = first_correlation; c; c = c->next )
-  {
-    CREATE( buf, correlink *, (cnt*lyphcnt) + 1 );
-    bptr = buf;
-
-    for ( lnk = first_correlation; lnk; lnk = lnk->next )
-    {
-      if ( lnk == c )
-        continue;
-
-      if ( (cl=correlation_is_linked( c, lnk, cnt )) != NULL )
-      {
-        for ( clptr = cl; *clptr; clptr++ )
-          *bptr++ = *clptr;
-
-        free( cl );
-      }
-    }
-
-    *bptr = NULL;
-    c->links = buf;
-  }
-
-  CREATE( cbuf, correlation *, cnt + 1 );
-  cbptr = cbuf;
-
-  for ( c = first_correlation; c; c = c->next )
-    *cbptr++ = c;
-
-  *cbptr = NULL;
+  correlation *c;
+  json_stream s;
+  char *dotfile;
 
   if ( !get_param( params, "dotfile" ) )
-    send_response( req, JS_ARRAY( correlation_links_to_json, cbuf ) );
-  else
   {
-    char *dotfile;
+    json_stream_begin( &s, req );
+    json_stream_open( &s, NULL, '[' );
 
-    if ( !generate_correlation_links_dotfile( cbuf )
-    ||   !(dotfile = load_file( CORRELATION_LINKS_DOTFILE )) )
-    {
-      free( cbuf );
-      HND_ERR( "Could not open " CORRELATION_LINKS_DOTFILE );
-    }
+    for ( c = first_correlation; c; c = c->next )
+      json_stream_value( &s, NULL, correlation_links_to_json( c ) );
 
-    send_response_with_type( req, "200", dotfile, "text/plain" );
-    free( dotfile );
+    json_stream_close( &s );
+    json_stream_end( &s );
+    return;
   }
 
-  free( cbuf );
+  /*
+   * Two readers must not write the dotfile at once
+   */
+  REQUIRE_EXCLUSIVE_ACCESS();
 
-  for ( c = first_correlation; c; c = c->next )
-  {
-    for ( clptr = c->links; *clptr; clptr++ )
-      free( *clptr );
+  if ( !generate_correlation_links_dotfile()
+  ||   !(dotfile = load_file( CORRELATION_LINKS_DOTFILE )) )
+    HND_ERR( "Could not open " CORRELATION_LINKS_DOTFILE );
 
-    free( c->links );
-    c->links = NULL;
-  }
+  send_response_with_type( req, "200", dotfile, "text/plain" );
+  free( dotfile );
 }
 
 HANDLER( do_dump )
 {
-  lyphplate **lpbuf = (lyphplate**)datas_to_array( lyphplate_ids );
-  layer **lyrbuf = (layer**)datas_to_array( layer_ids );
-  lyphnode **lyphnodebuf = (lyphnode**)datas_to_array( lyphnode_ids );
-  lyph **lyphbuf = (lyph**)datas_to_array( lyph_ids );
-  lyphview **v, **vptr, **viewsptr;
+  lyphview **viewsptr;
   extern lyphview **views;
-  clinical_index **cibuf, **cibufptr, *ci;
-  pubmed **pubmedbuf, **pubmedbptr, *pbmd;
-  correlation **cbuf, **cbufptr, *c;
-  bop **bopbuf, **bopbptr, *bp;
   extern lyphview obsolete_lyphview;
-  int cnt = 0;
-
-  cnt = 0;
-  for ( bp = first_bop; bp; bp = bp->next )
-    cnt++;
-
-  CREATE( bopbuf, bop *, cnt + 1 );
-  bopbptr = bopbuf;
-
-  for ( bp = first_bop; bp; bp = bp->next )
-    *bopbptr++ = bp;
-
-  *bopbptr = NULL;
+  clinical_index *ci;
+  pubmed *pbmd;
+  correlation *c;
+  bop *bp;
+  json_stream s;
 
-  cnt = 0;
-  for ( pbmd = first_pubmed; pbmd; pbmd = pbmd->next )
-    cnt++;
+  json_stream_begin( &s, req );
+  json_stream_open( &s, NULL, '{' );
 
-  cnt = 0;
-  for ( c = first_correlation; c; c = c->next )
-    cnt++;
+  json_stream_open( &s, "lyphplates", '[' );
+  json_stream_trie( &s, lyphplate_ids, (char * (*) (void *)) lyphplate_to_json );
+  json_stream_close( &s );
 
-  CREATE( cbuf, correlation *, cnt + 1 );
-  cbufptr = cbuf;
+  json_stream_open( &s, "layers", '[' );
+  json_stream_trie( &s, layer_ids, (char * (*) (void *)) layer_to_json );
+  json_stream_close( &s );
 
-  for ( c = first_correlation; c; c = c->next )
-    *cbufptr++ = c;
+  json_stream_open( &s, "lyphnodes", '[' );
+  json_stream_trie( &s, lyphnode_ids, (char * (*) (void *)) lyphnode_to_json );
+  json_stream_close( &s );
 
-  *cbufptr = NULL;
+  json_stream_open( &s, "lyphs", '[' );
+  json_stream_trie( &s, lyph_ids, (char * (*) (void *)) lyph_to_json );
+  json_stream_close( &s );
 
-  CREATE( pubmedbuf, pubmed *, cnt + 1 );
-  pubmedbptr = pubmedbuf;
-  for ( pbmd = first_pubmed; pbmd; pbmd = pbmd->next )
-    *pubmedbptr++ = pbmd;
-  *pubmedbptr = NULL;
+  json_stream_open( &s, "views", '[' );
+  for ( viewsptr = &views[1]; *viewsptr; viewsptr++ )
+    if ( *viewsptr != &obsolete_lyphview )
+      json_stream_value( &s, NULL, lyphview_to_json( *viewsptr ) );
+  json_stream_close( &s );
 
-  cnt = 0;
+  json_stream_open( &s, "clinical indices", '[' );
   for ( ci = first_clinical_index; ci; ci = ci->next )
-    cnt++;
-
-  CREATE( cibuf, clinical_index *, cnt + 1 );
-
-  for ( cibufptr = cibuf, ci = first_clinical_index; ci; ci = ci->next )
-    *cibufptr++ = ci;
-
-  *cibufptr = NULL;
-
-  CREATE( v, lyphview *, VOIDLEN( &views[1] ) + 1 );
-  vptr = v;
+    json_stream_value( &s, NULL, clinical_index_to_json_full( ci ) );
+  json_stream_close( &s );
 
-  for ( viewsptr = &views[1]; *viewsptr; viewsptr++ )
-    if ( *viewsptr != &obsolete_lyphview )
-      *vptr++ = *viewsptr;
+  json_stream_open( &s, "pubmeds", '[' );
+  for ( pbmd = first_pubmed; pbmd; pbmd = pbmd->next )
+    json_stream_value( &s, NULL, pubmed_to_json_full( pbmd ) );
+  json_stream_close( &s );
 
-  *vptr = NULL;
+  json_stream_open( &s, "correlations", '[' );
+  for ( c = first_correlation; c; c = c->next )
+    json_stream_value( &s, NULL, correlation_to_json( c ) );
+  json_stream_close( &s );
 
-  send_response( req, JSON
-  (
-    "lyphplates": JS_ARRAY( lyphplate_to_json, lpbuf ),
-    "layers": JS_ARRAY( layer_to_json, lyrbuf ),
-    "lyphnodes": JS_ARRAY( lyphnode_to_json, lyphnodebuf ),
-    "lyphs": JS_ARRAY( lyph_to_json, lyphbuf ),
-    "views": JS_ARRAY( lyphview_to_json, v ),
-    "clinical indices": JS_ARRAY( clinical_index_to_json_full, cibuf ),
-    "pubmeds": JS_ARRAY( pubmed_to_json_full, pubmedbuf ),
-    "correlations": JS_ARRAY( correlation_to_json, cbuf ),
-    "bops": JS_ARRAY( bop_to_json, bopbuf )
-  ) );
+  json_stream_open( &s, "bops", '[' );
+  for ( bp = first_bop; bp; bp = bp->next )
+    json_stream_value( &s, NULL, bop_to_json( bp ) );
+  json_stream_close( &s );
 
-  free( lpbuf );
-  free( lyrbuf );
-  free( lyphnodebuf );
-  free( v );
-  free( cibuf );
-  free( cbuf );
-  free( bopbuf );
+  json_stream_close( &s );
+  json_stream_end( &s );
 }
@@ -2,55 +2,306 @@
  *  nt_parse.c
  *  Code for parsing N-Triples files
  */
-#include "nt_parse_internal.h"
 #include "nt_parse.h"
+#include "nt_parse_internal.h"
 
 int parse_ntriples( FILE *fp, char **err, int max_iri_len, ADD_TRIPLE_FUNCTION *fnc )
 {
-  char c, *end, *bptr;
-  char *subj, *pred, *obj;
-  int line = 1, fQuote = 0, fBrace = 0, fUnderscore = 0, fSubj = 0, fPred = 0, fObj = 0, fresh_line = 1, whitespaceable = 1, fAnything = 0;
+  nt_source src;
+  char read_buf[READ_BLOCK_SIZE];
   static char *buf;
   static int bufsize;
 
-  #ifndef WIN32
-    /*
-     * Variables for QUICK_GETC
-     */
-    char read_buf[READ_BLOCK_SIZE], *read_end = &read_buf[READ_BLOCK_SIZE], *read_ptr = read_end;
-    int fread_len;
-  #endif
-
-  if ( bufsize < max_iri_len + 1 )
+  /*
+   * Room for subject, predicate and object, each up to max_iri_len long
+   */
+  if ( bufsize < 3 * ( max_iri_len + 1 ) )
   {
     if ( buf )
       free( buf );
 
-    buf = malloc( max_iri_len + 1 );
-    bufsize = max_iri_len + 1;
+    bufsize = 3 * ( max_iri_len + 1 );
+    buf = malloc( bufsize );
+  }
+
+  src.fp = fp;
+  src.read_buf = read_buf;
+  src.ptr = src.end = read_buf;
+  src.fnc = fnc;
+  src.chunk = NULL;
+
+  if ( !nt_parse_source( &src, buf, max_iri_len ) )
+  {
+    if ( err )
+    {
+      static char errbuf[1024];
+
+      sprintf( errbuf, "(Line %d) %s", src.line, src.error );
+      *err = errbuf;
+    }
+
+    return 0;
+  }
+
+  return 1;
+}
+
+/*
+ * Parse a whole N-Triples file using several threads: the file is mapped
+ * into memory and cut at line boundaries, and each piece is tokenized by a
+ * thread of its own.  The threads only run the classifier; the triples it
+ * keeps are passed to fnc afterwards, in the order they appear in the file,
+ * so the result is the same as if the file were parsed from start to end.
+ */
+int parse_ntriples_parallel( const char *filename, char **err, int max_iri_len, int threads, CLASSIFY_TRIPLE_FUNCTION *classify, ADD_CLASSIFIED_TRIPLES_FUNCTION *fnc )
+{
+  static char errbuf[1024];
+  nt_chunk *chunks, *c;
+  struct stat st;
+  const char *map, *start, *stop, *mapend;
+  nt_triple *triples, *tptr;
+  int fd, cnt, i, line, ok, total;
+
+  fd = open( filename, O_RDONLY );
+
+  if ( fd == -1 || fstat( fd, &st ) == -1 )
+  {
+    if ( fd != -1 )
+      close( fd );
+
+    sprintf( errbuf, "Could not open %.900s for reading", filename );
+    *err = errbuf;
+    return 0;
+  }
+
+  if ( !st.st_size )
+  {
+    close( fd );
+    return 1;
+  }
+
+  map = mmap( NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0 );
+  close( fd );
+
+  if ( map == MAP_FAILED )
+  {
+    sprintf( errbuf, "Could not map %.900s into memory", filename );
+    *err = errbuf;
+    return 0;
+  }
+
+  madvise( (void *) map, st.st_size, MADV_SEQUENTIAL );
+
+  mapend = &map[st.st_size];
+
+  cnt = st.st_size / NT_MIN_CHUNK_SIZE + 1;
+
+  if ( cnt > threads )
+    cnt = threads;
+  if ( cnt > NT_MAX_CHUNKS )
+    cnt = NT_MAX_CHUNKS;
+  if ( cnt < 1 )
+    cnt = 1;
+
+  chunks = calloc( cnt, sizeof(nt_chunk) );
+
+  /*
+   * Cut the file into roughly equal pieces, moving each cut forward to the
+   * start of the next line (but not to one continuing an escaped newline)
+   */
+  for ( i = 0, start = map; i < cnt; i++ )
+  {
+    c = &chunks[i];
+
+    if ( i == cnt - 1 )
+      stop = mapend;
+    else
+    {
+      stop = &map[st.st_size / cnt * (i+1)];
+
+      if ( stop < start )
+        stop = start;
+
+      while ( stop < mapend && ( stop == start || stop[-1] != '\n' || ( stop - start >= 2 && stop[-2] == '\\' ) ) )
+        stop++;
+    }
+
+    c->src.ptr = start;
+    c->src.end = stop;
+    c->src.chunk = c;
+    c->max_iri_len = max_iri_len;
+    c->classify = classify;
+
+    start = stop;
+  }
+
+  for ( i = 1; i < cnt; i++ )
+  {
+    if ( !pthread_create( &chunks[i].thread, NULL, nt_parse_chunk, &chunks[i] ) )
+      chunks[i].threaded = 1;
+    else
+      nt_parse_chunk( &chunks[i] );
+  }
+
+  nt_parse_chunk( &chunks[0] );
+
+  for ( i = 1; i < cnt; i++ )
+  {
+    if ( chunks[i].threaded )
+      pthread_join( chunks[i].thread, NULL );
+  }
+
+  munmap( (void *) map, st.st_size );
+
+  /*
+   * Report the first error in the file, if any, counting its line from the
+   * lines of all the pieces before it
+   */
+  for ( i = 0, line = 0, ok = 1; i < cnt; i++ )
+  {
+    c = &chunks[i];
+
+    if ( !c->ok )
+    {
+      sprintf( errbuf, "(Line %d) %s", line + c->src.line, c->src.error );
+      *err = errbuf;
+      ok = 0;
+      break;
+    }
+
+    line += c->src.line - 1;
+  }
+
+  if ( ok )
+  {
+    for ( i = 0, total = 0; i < cnt; i++ )
+      total += chunks[i].kept_cnt;
+
+    triples = malloc( ( total + 1 ) * sizeof(nt_triple) );
+    tptr = triples;
+
+    for ( i = 0; i < cnt; i++ )
+    {
+      nt_kept *k, *kend;
+
+      c = &chunks[i];
+
+      for ( k = c->kept, kend = &c->kept[c->kept_cnt]; k < kend; k++ )
+      {
+        tptr->kind = k->kind;
+        tptr->subj = &c->heap[k->subj];
+        tptr->obj = &c->heap[k->obj];
+        tptr++;
+      }
+    }
+
+    (fnc)( triples, total );
+
+    free( triples );
+  }
+
+  for ( i = 0; i < cnt; i++ )
+  {
+    free( chunks[i].kept );
+    free( chunks[i].heap );
   }
-  bptr = buf;
-  end = &buf[max_iri_len];
 
-  if ( !fnc )
-    fnc = do_nothing_function;
+  free( chunks );
+
+  return ok;
+}
+
+void *nt_parse_chunk( void *arg )
+{
+  nt_chunk *c = (nt_chunk *) arg;
+  char *buf = malloc( 3 * ( c->max_iri_len + 1 ) );
+
+  c->ok = nt_parse_source( &c->src, buf, c->max_iri_len );
+
+  free( buf );
+
+  return NULL;
+}
+
+int nt_refill( nt_source *src )
+{
+  size_t len;
+
+  if ( !src->fp )
+    return 0;
+
+  len = fread( src->read_buf, sizeof(char), READ_BLOCK_SIZE, src->fp );
+
+  if ( !len )
+    return 0;
+
+  src->ptr = src->read_buf;
+  src->end = &src->read_buf[len];
+
+  return 1;
+}
+
+void nt_keep_triple( nt_chunk *c, int kind, const char *subj, const char *obj )
+{
+  size_t subjlen = strlen( subj ) + 1, objlen = strlen( obj ) + 1;
+  nt_kept *k;
+
+  if ( c->kept_cnt == c->kept_size )
+  {
+    c->kept_size = c->kept_size ? c->kept_size * 2 : 1024;
+    c->kept = realloc( c->kept, c->kept_size * sizeof(nt_kept) );
+  }
+
+  if ( c->heap_len + subjlen + objlen > c->heap_size )
+  {
+    do
+      c->heap_size = c->heap_size ? c->heap_size * 2 : 65536;
+    while ( c->heap_len + subjlen + objlen > c->heap_size );
+
+    c->heap = realloc( c->heap, c->heap_size );
+  }
+
+  k = &c->kept[c->kept_cnt++];
+  k->kind = kind;
+
+  k->subj = c->heap_len;
+  memcpy( &c->heap[c->heap_len], subj, subjlen );
+  c->heap_len += subjlen;
+
+  k->obj = c->heap_len;
+  memcpy( &c->heap[c->heap_len], obj, objlen );
+  c->heap_len += objlen;
+}
+
+/*
+ * buf must have room for subject, predicate and object, each up to
+ * max_iri_len long (plus terminators)
+ */
+int nt_parse_source( nt_source *src, char *buf, int max_iri_len )
+{
+  char c, *tok, *end, *bptr;
+  char *subj, *pred, *obj;
+  int line = 1, fQuote = 0, fBrace = 0, fUnderscore = 0, fSubj = 0, fPred = 0, fObj = 0, fresh_line = 1, whitespaceable = 1, fAnything = 0;
+
+  subj = pred = obj = NULL;
+  tok = bptr = buf;
+  end = &tok[max_iri_len];
 
   for ( ; ; )
   {
-    QUICK_GETC( c, fp );
+    NT_GETC( c, src );
     main_parse_ntriples_loop:
 
     if ( c == '\\' )
     {
       char next;
 
-      QUICK_GETC( next, fp );
+      NT_GETC( next, src );
       if ( !next )
         PARSE_NTRIPS_ERROR( "File ended with a backslash" );
 
-      if ( !add_char( '\\', bptr++, end, line, err )
-      ||   !add_char( next, bptr++, end, line, err ) )
-        return 0;
+      NT_ADD_CHAR( '\\' );
+      NT_ADD_CHAR( next );
 
       fAnything = 1;
 
@@ -65,8 +316,7 @@ int parse_ntriples( FILE *fp, char **err, int max_iri_len, ADD_TRIPLE_FUNCTION *
       if ( c == '\n' )
         PARSE_NTRIPS_ERROR( "Line ends with unterminated quote" );
 
-      if ( !add_char( c, bptr++, end, line, err ) )
-        return 0;
+      NT_ADD_CHAR( c );
 
       if ( c == '"' )
         fQuote = 0;
@@ -79,8 +329,7 @@ int parse_ntriples( FILE *fp, char **err, int max_iri_len, ADD_TRIPLE_FUNCTION *
       if ( c == '\n' )
         PARSE_NTRIPS_ERROR( "Line ends with unmatched opening-brace, <" );
 
-      if ( !add_char( c, bptr++, end, line, err ) )
-        return 0;
+      NT_ADD_CHAR( c );
 
       if ( c == '>' )
         fBrace = 0;
@@ -95,9 +344,7 @@ int parse_ntriples( FILE *fp, char **err, int max_iri_len, ADD_TRIPLE_FUNCTION *
 
       if ( c != ' ' )
       {
-        if ( !add_char( c, bptr++, end, line, err ) )
-          return 0;
-
+        NT_ADD_CHAR( c );
         continue;
       }
 
@@ -110,14 +357,14 @@ int parse_ntriples( FILE *fp, char **err, int max_iri_len, ADD_TRIPLE_FUNCTION *
       /*
        * Ignore ^^<IRI>
        */
-      QUICK_GETC( c, fp );
+      NT_GETC( c, src );
 
       if ( c != '^' )
         PARSE_NTRIPS_ERROR( "Line has stray caret (^)" );
 
       do
       {
-        QUICK_GETC( c, fp );
+        NT_GETC( c, src );
         if ( !c )
           PARSE_NTRIPS_ERROR( "Line has stray caret (^)?" );
       }
@@ -134,7 +381,7 @@ int parse_ntriples( FILE *fp, char **err, int max_iri_len, ADD_TRIPLE_FUNCTION *
       if ( c == '#' && fresh_line )
       {
         do
-          QUICK_GETC( c, fp );
+          NT_GETC( c, src );
         while ( c && c != '\n' );
 
         line++;
@@ -148,20 +395,28 @@ int parse_ntriples( FILE *fp, char **err, int max_iri_len, ADD_TRIPLE_FUNCTION *
     if ( c == ' ' || c == '\t' || ( c == '.' && fPred ) )
     {
       whitespaceable = 1;
+      *bptr = '\0';
 
       if ( !fSubj )
-        set_iri( &subj, &fSubj, buf, bptr );
+      {
+        subj = tok;
+        fSubj = 1;
+      }
       else if ( !fPred )
-        set_iri( &pred, &fPred, buf, bptr );
+      {
+        pred = tok;
+        fPred = 1;
+      }
       else if ( !fObj )
       {
         int fPeriod = (c=='.');
 
-        set_iri( &obj, &fObj, buf, bptr );
+        obj = tok;
+        fObj = 1;
 
         for( ; ; )
         {
-          QUICK_GETC( c, fp );
+          NT_GETC( c, src );
 
           if ( !c || c == '\n' )
           {
@@ -190,21 +445,32 @@ int parse_ntriples( FILE *fp, char **err, int max_iri_len, ADD_TRIPLE_FUNCTION *
 
         line++;
 
-        (fnc)( subj, pred, obj );
+        if ( src->chunk )
+        {
+          int kind = (src->chunk->classify)( subj, pred, obj );
+
+          if ( kind )
+            nt_keep_triple( src->chunk, kind, subj, obj );
+        }
+        else if ( src->fnc )
+          (src->fnc)( strdup( subj ), strdup( pred ), strdup( obj ) );
 
         fSubj = fPred = fObj = 0;
         fresh_line = 1;
         fAnything = 0;
+        tok = bptr = buf;
+        end = &tok[max_iri_len];
+        continue;
       }
 
-      bptr = buf;
+      tok = bptr = &tok[max_iri_len + 1];
+      end = &tok[max_iri_len];
       continue;
     }
 
     if ( c == '"' )
     {
-      if ( !add_char( c, bptr++, end, line, err ) )
-        return 0;
+      NT_ADD_CHAR( c );
 
       fQuote = 1;
       fAnything = 1;
@@ -213,8 +479,7 @@ int parse_ntriples( FILE *fp, char **err, int max_iri_len, ADD_TRIPLE_FUNCTION *
 
     if ( c == '<' )
     {
-      if ( !add_char( c, bptr++, end, line, err ) )
-        return 0;
+      NT_ADD_CHAR( c );
 
       fBrace = 1;
       fAnything = 1;
@@ -223,8 +488,7 @@ int parse_ntriples( FILE *fp, char **err, int max_iri_len, ADD_TRIPLE_FUNCTION *
 
     if ( c == '_' )
     {
-      if ( !add_char( c, bptr++, end, line, err ) )
-        return 0;
+      NT_ADD_CHAR( c );
 
       fUnderscore = 1;
       fAnything = 1;
@@ -246,32 +510,7 @@ int parse_ntriples( FILE *fp, char **err, int max_iri_len, ADD_TRIPLE_FUNCTION *
     PARSE_NTRIPS_ERROR( "Line appears to contain an unexpected character not enclosed in quotes or in <>" );
   }
 
-  return 1;
-}
-
-int add_char( char c, char *bptr, char *end, int line, char **err )
-{
-  if ( bptr >= end )
-    PARSE_NTRIPS_ERROR( "An IRI exceeded the maximum IRI length" );
-
-  *bptr = c;
+  src->line = line;
 
   return 1;
 }
-
-void set_iri( char **which, int *f, char *buf, char *bptr )
-{
-  *bptr = '\0';
-  *which = strdup( buf );
-  *f = 1;
-}
-
-void do_nothing_function( char *subj, char *pred, char *obj )
-{
-  free( subj );
-  free( pred );
-  free( obj );
-
-  return;
-}
-
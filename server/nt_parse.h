@@ -4,4 +4,23 @@
 
 typedef void ADD_TRIPLE_FUNCTION ( char *subj, char *pred, char *obj );
 
+typedef struct NT_TRIPLE nt_triple;
+
+/*
+ * For parse_ntriples_parallel: says (from any thread) what kind of triple
+ * this is, or 0 to drop it; the kept triples are then handed over all at
+ * once, in file order, on the calling thread.  Their strings only last
+ * until that function returns.
+ */
+typedef int CLASSIFY_TRIPLE_FUNCTION ( const char *subj, const char *pred, const char *obj );
+typedef void ADD_CLASSIFIED_TRIPLES_FUNCTION ( nt_triple *triples, int cnt );
+
+struct NT_TRIPLE
+{
+  int kind;
+  char *subj;
+  char *obj;
+};
+
 int parse_ntriples( FILE *fp, char **err, int max_iri_len, ADD_TRIPLE_FUNCTION *fnc );
+int parse_ntriples_parallel( const char *filename, char **err, int max_iri_len, int threads, CLASSIFY_TRIPLE_FUNCTION *classify, ADD_CLASSIFIED_TRIPLES_FUNCTION *fnc );
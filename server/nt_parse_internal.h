@@ -1,56 +1,100 @@
-int add_char( char c, char *bptr, char *end, int line, char **err );
-void set_iri( char **which, int *f, char *buf, char *bptr );
-void do_nothing_function( char *subj, char *pred, char *obj );
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 #define READ_BLOCK_SIZE 65536
 
+/*
+ * Files smaller than this many bytes per thread are parsed with fewer threads
+ */
+#define NT_MIN_CHUNK_SIZE (1024 * 1024)
+#define NT_MAX_CHUNKS 64
+
+typedef struct NT_SOURCE nt_source;
+typedef struct NT_CHUNK nt_chunk;
+typedef struct NT_KEPT nt_kept;
+
+/*
+ * Where the parser gets its characters: either a block at a time from a
+ * file (fp), or straight out of memory (fp is NULL and ptr..end is all
+ * there is).  Each completed triple goes to fnc (as strdup'd strings), or,
+ * when parsing part of a file in parallel, to the chunk.
+ */
+struct NT_SOURCE
+{
+  FILE *fp;
+  char *read_buf;
+  const char *ptr;
+  const char *end;
+  ADD_TRIPLE_FUNCTION *fnc;
+  nt_chunk *chunk;
+  const char *error;
+  int line;
+};
+
+/*
+ * A triple which the classifier kept; subj and obj are offsets into the
+ * chunk's heap (which may move while the chunk is being parsed)
+ */
+struct NT_KEPT
+{
+  int kind;
+  size_t subj;
+  size_t obj;
+};
+
+struct NT_CHUNK
+{
+  nt_source src;
+  pthread_t thread;
+  int threaded;
+  int max_iri_len;
+  int ok;
+  CLASSIFY_TRIPLE_FUNCTION *classify;
+  nt_kept *kept;
+  int kept_cnt;
+  int kept_size;
+  char *heap;
+  size_t heap_len;
+  size_t heap_size;
+};
+
+int nt_parse_source( nt_source *src, char *buf, int max_iri_len );
+int nt_refill( nt_source *src );
+void nt_keep_triple( nt_chunk *chunk, int kind, const char *subj, const char *obj );
+void *nt_parse_chunk( void *arg );
+
 #define PARSE_NTRIPS_ERROR( txt )\
   do\
   {\
-    if ( err )\
-    {\
-      static char errbuf[1024];\
-      \
-      sprintf( errbuf, "(Line %d) %s", \
-        line, txt );\
-      *err = errbuf;\
-    }\
+    src->error = (txt);\
+    src->line = line;\
     \
     return 0;\
   }\
   while(0)
 
-#ifndef QUICK_GETC
-  #ifdef WIN32
-
-    #define QUICK_GETC( ch, fp )\
-    do\
-    {\
-      if ( feof(fp) )\
-        ch = '\0';\
-      else\
-        ch = getc(fp);\
-    }\
-    while(0)
-
-  #else
-    /*
-     * Quickly read char from file
-     */
-    #define QUICK_GETC( ch, fp )\
-    do\
-    {\
-      if ( read_ptr == read_end )\
-      {\
-        fread_len = fread( read_buf, sizeof(char), READ_BLOCK_SIZE, fp );\
-        if ( fread_len < READ_BLOCK_SIZE )\
-          read_buf[fread_len] = '\0';\
-        read_ptr = read_buf;\
-      }\
-      ch = *read_ptr++;\
-    }\
-    while(0)
-
-  #endif
-
-#endif
+/*
+ * Quickly read char from the source
+ */
+#define NT_GETC( ch, src )\
+do\
+{\
+  if ( (src)->ptr == (src)->end && !nt_refill( src ) )\
+    ch = '\0';\
+  else\
+    ch = *(src)->ptr++;\
+}\
+while(0)
+
+#define NT_ADD_CHAR( ch )\
+do\
+{\
+  if ( bptr >= end )\
+    PARSE_NTRIPS_ERROR( "An IRI exceeded the maximum IRI length" );\
+  \
+  *bptr++ = (ch);\
+}\
+while(0)
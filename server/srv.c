@@ -13,12 +13,24 @@ char *html;
 char *js;
 char *bulk;
 
-extern int lyphnode_to_json_flags;
+int http_epoll_fd;
+int http_signal_fd;
+int shutdown_requested;
+
+/*
+ * Timer wheel for kicking idle connections: slot i holds the connections whose
+ * deadline (in seconds) is congruent to i modulo HTTP_TIMER_WHEEL_SLOTS.
+ */
+http_conn *first_wheel_conn[HTTP_TIMER_WHEEL_SLOTS];
+http_conn *last_wheel_conn[HTTP_TIMER_WHEEL_SLOTS];
+long http_wheel_tick;
+long http_now;
+
+extern __thread int lyphnode_to_json_flags;
 
 int main( int argc, const char* argv[] )
 {
-  FILE *fp;
-  int i = 1, port=5052;
+  int port=5052;
   const char *filename;
 
   default_config_values();
@@ -26,38 +38,47 @@ int main( int argc, const char* argv[] )
   if ( !parse_commandline_args( argc, argv, &filename, &port ) )
     return 0;
 
-  fp = fopen( filename, "r" );
+  configs.ontology_file = filename;
 
   to_logfile( "Lyph started up at %s", current_date() );
 
-  if ( !fp )
+  recover_snapshots();
+
+  if ( !configs.image || !load_image( filename ) )
   {
-    fprintf( stderr, "Could not open file %s for reading\n\n", argv[i] );
-    return 0;
+    if ( access( filename, R_OK ) )
+    {
+      fprintf( stderr, "Could not open file %s for reading\n\n", filename );
+      return 0;
+    }
+
+    init_labels( filename );
   }
 
-  init_labels(fp);
-  fclose(fp);
+  index_labels();
+  index_lyphs();
 
   init_lyph_http_server(port);
+  init_shutdown_signals();
   init_command_table();
+  init_journal();
+  init_workers();
 
   printf( "Ready.\n" );
 
-  while(1)
-  {
-    /*
-     * To do: make this commandline-configurable
-     */
-    usleep(100000);
+  while( !shutdown_requested )
     main_loop();
-  }
+
+  shutdown_lyph_server();
+
+  return 0;
 }
 
 void init_lyph_http_server( int port )
 {
   int status, yes=1;
   struct addrinfo hints, *servinfo;
+  struct epoll_event ev;
   char portstr[128];
 
   html = load_file( "lyphgui.html" );
@@ -110,29 +131,95 @@ void init_lyph_http_server( int port )
 
   freeaddrinfo( servinfo );
 
+  if ( fcntl( srvsock, F_SETFL, FNDELAY ) == -1 )
+  {
+    fprintf( stderr, "Fatal: Couldn't open server port (fcntl failed)\n" );
+    abort();
+  }
+
+  if ( (http_epoll_fd = epoll_create1( 0 )) == -1 )
+  {
+    fprintf( stderr, "Fatal: Couldn't create epoll instance\n" );
+    abort();
+  }
+
+  /*
+   * The listening socket is the only one registered with a NULL data pointer
+   */
+  memset( &ev, 0, sizeof(ev) );
+  ev.events = EPOLLIN | EPOLLET;
+  ev.data.ptr = NULL;
+
+  if ( epoll_ctl( http_epoll_fd, EPOLL_CTL_ADD, srvsock, &ev ) == -1 )
+  {
+    fprintf( stderr, "Fatal: Couldn't register server port with epoll\n" );
+    abort();
+  }
+
+  http_now = longtime_monotonic();
+  http_wheel_tick = http_now;
+
   return;
 }
 
-void main_loop( void )
+/*
+ * SIGINT and SIGTERM are blocked (in every thread, since this runs before
+ * any are started) and instead arrive through a signalfd, so that the
+ * main loop can finish what it's doing and shut down cleanly
+ */
+void init_shutdown_signals( void )
 {
-  http_request *req;
-  int count=0;
+  struct epoll_event ev;
+  sigset_t mask;
 
-  while ( count < 10 )
-  {
-    req = http_recv();
+  sigemptyset( &mask );
+  sigaddset( &mask, SIGINT );
+  sigaddset( &mask, SIGTERM );
 
-    if ( req )
-    {
-      count++;
+  if ( sigprocmask( SIG_BLOCK, &mask, NULL ) == -1
+  ||  (http_signal_fd = signalfd( -1, &mask, SFD_NONBLOCK )) == -1 )
+  {
+    fprintf( stderr, "Fatal: Couldn't create signalfd\n" );
+    abort();
+  }
 
-      to_logfile( "Got request:\n%s", req->query );
+  memset( &ev, 0, sizeof(ev) );
+  ev.events = EPOLLIN;
+  ev.data.ptr = &http_signal_fd;
 
-      handle_request( req, req->query );
-    }
-    else
-      break;
+  if ( epoll_ctl( http_epoll_fd, EPOLL_CTL_ADD, http_signal_fd, &ev ) == -1 )
+  {
+    fprintf( stderr, "Fatal: Couldn't register signalfd with epoll\n" );
+    abort();
   }
+}
+
+/*
+ * Wait for the requests in progress, bring the text files up to date,
+ * and save the image for the next startup
+ */
+void shutdown_lyph_server( void )
+{
+  log_string( "Shutting down" );
+
+  close( srvsock );
+  stop_workers();
+
+  journal_compact();
+
+  if ( configs.image )
+    save_image();
+
+  exit( EXIT_SUCCESS );
+}
+
+/*
+ * Wait (for at most one second, so the idle timer wheel keeps turning) for
+ * socket activity, and answer each request as soon as it has been parsed.
+ */
+void main_loop( void )
+{
+  http_update_connections();
 
   json_gc();
 }
@@ -142,7 +229,7 @@ void handle_request( http_request *req, char *query )
   char *reqptr, *reqtype, *request;
   const char *parse_params_err;
   command_entry *entry;
-  url_param *params[MAX_URL_PARAMS+1];
+  url_params params;
 
   if ( req_cmp( query, "gui" )
   ||   req_cmp( query, "lyphgui" ) )
@@ -171,118 +258,275 @@ void handle_request( http_request *req, char *query )
   *reqptr = '\0';
   reqtype = (*query == '/') ? query + 1 : query;
 
-  parse_params_err = parse_params( &reqptr[1], req, params );
+  parse_params_err = parse_params( &reqptr[1], req, &params );
 
   if ( parse_params_err )
   {
     HND_ERR_NORETURN( parse_params_err );
-
-    free_url_params( params );
     return;
   }
 
-  request = url_decode(&reqptr[1]);
+  request = url_decode_in_place( &reqptr[1] );
 
-  entry = lookup_command( reqtype );
+  entry = lookup_command( reqtype, reqptr - reqtype );
 
   if ( entry )
   {
-    if ( entry->read_write_state == CMD_READWRITE && configs.readonly )
+    if ( entry->read_write_state != CMD_READONLY && configs.readonly )
       send_response( req, "{\"error\": \"This instance of the LYPH system is read-only\"}" );
     else
-      (*(entry->f))( request, req, params );
+      (*(entry->f))( request, req, &params );
 
-    free( request );
-    free_url_params( params );
     return;
   }
 
-  free_url_params( params );
   *reqptr = '/';
-  free( request );
   send_400_response( req );
 }
 
+/*
+ * Whether the command named in a query may run alongside other readers
+ */
+int request_read_write_state( const char *query )
+{
+  const char *cmd, *qptr;
+  command_entry *entry;
+
+  cmd = (*query == '/') ? query + 1 : query;
+
+  for ( qptr = cmd; *qptr && *qptr != '/'; qptr++ )
+    ;
+
+  if ( *qptr != '/' )
+    return CMD_READONLY;
+
+  entry = lookup_command( cmd, qptr - cmd );
+
+  return entry ? entry->read_write_state : CMD_READONLY;
+}
+
 void http_update_connections( void )
 {
-  static struct timeval zero_time;
-  http_conn *c, *c_next;
-  int top_desc;
+  struct epoll_event events[HTTP_MAX_EVENTS];
+  int i, n, workers_done = 0;
 
-  FD_ZERO( &http_inset );
-  FD_ZERO( &http_outset );
-  FD_ZERO( &http_excset );
-  FD_SET( srvsock, &http_inset );
-  top_desc = srvsock;
+  n = epoll_wait( http_epoll_fd, events, HTTP_MAX_EVENTS, first_http_conn ? 1000 : -1 );
 
-  for ( c = first_http_conn; c; c = c->next )
+  if ( n < 0 )
   {
-    if ( c->sock > top_desc )
-      top_desc = c->sock;
+    if ( errno != EINTR )
+    {
+      fprintf( stderr, "Fatal: epoll_wait failed to poll the sockets\n" );
+      abort();
+    }
 
-    if ( c->state == HTTP_SOCKSTATE_READING_REQUEST )
-      FD_SET( c->sock, &http_inset );
-    else
-      FD_SET( c->sock, &http_outset );
+    n = 0;
+  }
 
-    FD_SET( c->sock, &http_excset );
+  http_now = longtime_monotonic();
+
+  for ( i = 0; i < n; i++ )
+  {
+    if ( !events[i].data.ptr )
+      http_answer_the_phone( srvsock );
+    else
+    if ( events[i].data.ptr == &worker_eventfd )
+      workers_done = 1;
+    else
+    if ( events[i].data.ptr == &http_signal_fd )
+      shutdown_requested = 1;
+    else
+      http_conn_event( (http_conn *) events[i].data.ptr, events[i].events );
   }
 
   /*
-   * Poll sockets
+   * Only after the loop, since finishing a response may free a
+   * connection with an event still pending above
    */
-  if ( select( top_desc+1, &http_inset, &http_outset, &http_excset, &zero_time ) < 0 )
-  {
-    fprintf( stderr, "Fatal: select failed to poll the sockets\n" );
-    abort();
-  }
+  if ( workers_done )
+    collect_finished_requests();
 
-  if ( !FD_ISSET( srvsock, &http_excset ) && FD_ISSET( srvsock, &http_inset ) )
-    http_answer_the_phone( srvsock );
+  http_expire_idle_connections();
+}
 
-  for ( c = first_http_conn; c; c = c_next )
+/*
+ * Sockets are edge-triggered, so each handler below runs until the socket
+ * would block (or until the connection is killed).
+ */
+void http_conn_event( http_conn *c, uint32_t events )
+{
+  if ( IS_SET( events, EPOLLERR | EPOLLHUP ) )
   {
-    c_next = c->next;
+    http_kill_socket( c );
+    return;
+  }
 
-    c->idle++;
+  http_touch_connection( c );
 
-    if ( FD_ISSET( c->sock, &http_excset )
-    ||   c->idle > HTTP_KICK_IDLE_AFTER_X_SECS * HTTP_PULSES_PER_SEC )
-    {
-      FD_CLR( c->sock, &http_inset );
-      FD_CLR( c->sock, &http_outset );
+  if ( IS_SET( events, EPOLLIN )
+  &&  !http_listen_to_request( c ) )
+    return;
 
-      http_kill_socket( c );
-      continue;
-    }
+  http_process_connection( c );
+}
 
-    if ( c->state == HTTP_SOCKSTATE_AWAITING_INSTRUCTIONS )
-      continue;
+/*
+ * Answer a connection's pipelined requests, in order, until the socket
+ * would block, the queue is empty, or the connection is killed
+ */
+void http_process_connection( http_conn *c )
+{
+  for ( ; ; )
+  {
+    if ( c->busy )
+      return;
 
-    if ( c->state == HTTP_SOCKSTATE_READING_REQUEST
-    &&   FD_ISSET( c->sock, &http_inset ) )
+    if ( c->state == HTTP_SOCKSTATE_AWAITING_INSTRUCTIONS )
     {
-      c->idle = 0;
-      http_listen_to_request( c );
+      http_serve_request( c );
+      return;
     }
-    else
-    if ( c->state == HTTP_SOCKSTATE_WRITING_RESPONSE
-    &&   c->outbuflen > 0
-    &&   FD_ISSET( c->sock, &http_outset ) )
+
+    if ( c->state != HTTP_SOCKSTATE_WRITING_RESPONSE )
+      return;
+
+    if ( !http_flush_response( c ) )
+      return;
+
+    if ( !http_finish_response( c ) )
+      return;
+  }
+}
+
+void http_serve_request( http_conn *c )
+{
+  http_request *req = c->first_req;
+
+  c->first_req = req->next_in_conn;
+
+  if ( !c->first_req )
+    c->last_req = NULL;
+
+  c->reqcnt--;
+  c->req = req;
+  c->state = HTTP_SOCKSTATE_WRITING_RESPONSE;
+  c->outbuflen = 0;
+  c->writehead = NULL;
+
+  dispatch_request( req );
+}
+
+/*
+ * Called once a response has been fully sent.  Either close the connection,
+ * or get ready for the next request on it.  Returns 0 if the connection was killed.
+ */
+int http_finish_response( http_conn *c )
+{
+  if ( !c->req->keepalive )
+  {
+    http_kill_socket( c );
+    return 0;
+  }
+
+  free_http_request( c->req );
+  c->req = NULL;
+  c->writehead = NULL;
+  c->state = HTTP_SOCKSTATE_READING_REQUEST;
+
+  return http_listen_to_request( c );
+}
+
+/*
+ * Push back a connection's idle deadline, moving it to the appropriate
+ * slot of the timer wheel
+ */
+void http_touch_connection( http_conn *c )
+{
+  int slot;
+
+  if ( c->wheel_slot != -1 )
+    UNLINK2( c, first_wheel_conn[c->wheel_slot], last_wheel_conn[c->wheel_slot], wheel_next, wheel_prev );
+
+  c->deadline = http_now + HTTP_KICK_IDLE_AFTER_X_SECS;
+  slot = c->deadline % HTTP_TIMER_WHEEL_SLOTS;
+  c->wheel_slot = slot;
+
+  LINK2( c, first_wheel_conn[slot], last_wheel_conn[slot], wheel_next, wheel_prev );
+}
+
+/*
+ * Advance the timer wheel to the current second, kicking every connection
+ * whose deadline has passed.  If the server was busy for longer than a full
+ * revolution, each slot is visited once.
+ */
+void http_expire_idle_connections( void )
+{
+  int ticks;
+
+  for ( ticks = 0; http_wheel_tick < http_now && ticks < HTTP_TIMER_WHEEL_SLOTS; ticks++ )
+  {
+    http_conn *c, *c_next;
+    int slot;
+
+    http_wheel_tick++;
+    slot = http_wheel_tick % HTTP_TIMER_WHEEL_SLOTS;
+
+    for ( c = first_wheel_conn[slot]; c; c = c_next )
     {
-      c->idle = 0;
-      http_flush_response( c );
+      c_next = c->wheel_next;
+
+      if ( c->deadline > http_now )
+        continue;
+
+      /*
+       * Not idle, just waiting on a worker (e.g. streaming a big response)
+       */
+      if ( c->busy )
+        http_touch_connection( c );
+      else
+        http_kill_socket( c );
     }
   }
+
+  http_wheel_tick = http_now;
 }
 
 void http_kill_socket( http_conn *c )
 {
+  http_request *req, *req_next;
+
+  if ( c->wheel_slot != -1 )
+  {
+    UNLINK2( c, first_wheel_conn[c->wheel_slot], last_wheel_conn[c->wheel_slot], wheel_next, wheel_prev );
+    c->wheel_slot = -1;
+  }
+
+  /*
+   * A worker is still writing the response: stop listening to the
+   * socket now, and finish the job once the worker is done
+   */
+  if ( c->busy )
+  {
+    if ( !c->doomed )
+    {
+      c->doomed = 1;
+      epoll_ctl( http_epoll_fd, EPOLL_CTL_DEL, c->sock, NULL );
+    }
+
+    return;
+  }
+
   UNLINK2( c, first_http_conn, last_http_conn, next, prev );
 
   MULTIFREE( c->buf, c->outbuf );
   free_http_request( c->req );
 
+  for ( req = c->first_req; req; req = req_next )
+  {
+    req_next = req->next_in_conn;
+    free_http_request( req );
+  }
+
   close( c->sock );
 
   free( c );
@@ -310,46 +554,65 @@ void free_http_request( http_request *r )
 void http_answer_the_phone( int srvsock )
 {
   struct sockaddr_storage their_addr;
-  socklen_t addr_size = sizeof(their_addr);
+  struct epoll_event ev;
+  socklen_t addr_size;
   int caller;
   http_conn *c;
-  http_request *req;
 
-  if ( ( caller = accept( srvsock, (struct sockaddr *) &their_addr, &addr_size ) ) < 0 )
-    return;
-
-  if ( ( fcntl( caller, F_SETFL, FNDELAY ) ) == -1 )
+  /*
+   * The listening socket is edge-triggered, so accept until the backlog is empty
+   */
+  for ( ; ; )
   {
-    close( caller );
-    return;
-  }
+    addr_size = sizeof(their_addr);
 
-  CREATE( c, http_conn, 1 );
-  c->next = NULL;
-  c->sock = caller;
-  c->idle = 0;
-  c->state = HTTP_SOCKSTATE_READING_REQUEST;
-  c->writehead = NULL;
+    if ( ( caller = accept( srvsock, (struct sockaddr *) &their_addr, &addr_size ) ) < 0 )
+      return;
 
-  CREATE( c->buf, char, HTTP_INITIAL_INBUF_SIZE + 1 );
-  c->bufsize = HTTP_INITIAL_INBUF_SIZE;
-  c->buflen = 0;
-  *c->buf = '\0';
+    if ( ( fcntl( caller, F_SETFL, FNDELAY ) ) == -1 )
+    {
+      close( caller );
+      continue;
+    }
 
-  CREATE( c->outbuf, char, HTTP_INITIAL_OUTBUF_SIZE + 1 );
-  c->outbufsize = HTTP_INITIAL_OUTBUF_SIZE + 1;
-  c->outbuflen = 0;
-  *c->outbuf = '\0';
+    CREATE( c, http_conn, 1 );
+    c->next = NULL;
+    c->sock = caller;
+    c->wheel_slot = -1;
+    c->state = HTTP_SOCKSTATE_READING_REQUEST;
+    c->writehead = NULL;
 
-  CREATE( req, http_request, 1 );
-  req->next = NULL;
-  req->conn = c;
-  req->query = NULL;
-  req->callback = NULL;
-  c->req = req;
+    memset( &ev, 0, sizeof(ev) );
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
+    ev.data.ptr = c;
 
-  LINK2( req, first_http_req, last_http_req, next, prev );
-  LINK2( c, first_http_conn, last_http_conn, next, prev );
+    if ( epoll_ctl( http_epoll_fd, EPOLL_CTL_ADD, caller, &ev ) == -1 )
+    {
+      close( caller );
+      free( c );
+      continue;
+    }
+
+    CREATE( c->buf, char, HTTP_INITIAL_INBUF_SIZE + 1 );
+    c->bufsize = HTTP_INITIAL_INBUF_SIZE;
+    c->buflen = 0;
+    *c->buf = '\0';
+
+    CREATE( c->outbuf, char, HTTP_INITIAL_OUTBUF_SIZE + 1 );
+    c->outbufsize = HTTP_INITIAL_OUTBUF_SIZE + 1;
+    c->outbuflen = 0;
+    *c->outbuf = '\0';
+
+    c->req = NULL;
+    c->first_req = NULL;
+    c->last_req = NULL;
+    c->reqcnt = 0;
+    c->closing = 0;
+
+    LINK2( c, first_http_conn, last_http_conn, next, prev );
+
+    http_touch_connection( c );
+  }
 }
 
 int resize_buffer( http_conn *c, char **buf )
@@ -368,135 +631,273 @@ int resize_buffer( http_conn *c, char **buf )
     size = &c->outbufsize;
   }
 
-  *size *= 2;
-  if ( *size >= max )
+  if ( *size * 2 >= max )
   {
     http_kill_socket(c);
     return 0;
   }
 
-  CREATE( tmp, char, (*size)+1 );
+  CREATE( tmp, char, (*size * 2)+1 );
 
-  sprintf( tmp, "%s", *buf );
+  memcpy( tmp, *buf, *size );
   free( *buf );
   *buf = tmp;
+  *size *= 2;
   return 1;
 }
 
-void http_listen_to_request( http_conn *c )
+/*
+ * Read whatever the client has sent, queueing each complete request.
+ * Returns 0 if the connection was killed.
+ */
+int http_listen_to_request( http_conn *c )
 {
-  int start = c->buflen, readsize;
+  int readsize;
 
-  if ( start >= c->bufsize - 5
-  &&  !resize_buffer( c, &c->buf ) )
-    return;
+  /*
+   * Requests left unparsed in the buffer while the pipeline queue was full
+   */
+  if ( !http_parse_input( c ) )
+    return 0;
+
+  while ( !c->closing && c->reqcnt < HTTP_MAX_PIPELINED_REQUESTS )
+  {
+    if ( c->buflen >= c->bufsize - 5
+    &&  !resize_buffer( c, &c->buf ) )
+      return 0;
+
+    readsize = recv( c->sock, c->buf + c->buflen, c->bufsize - 5 - c->buflen, 0 );
 
-  readsize = recv( c->sock, c->buf + start, c->bufsize - 5 - start, 0 );
+    if ( readsize > 0 )
+    {
+      c->buflen += readsize;
+
+      if ( !http_parse_input( c ) )
+        return 0;
 
-  if ( readsize > 0 )
+      continue;
+    }
+
+    if ( readsize == 0 )
+    {
+      /*
+       * The client will send nothing more, but may still be waiting
+       * on responses to requests it already sent
+       */
+      c->closing = 1;
+      break;
+    }
+
+    if ( errno == EINTR )
+      continue;
+
+    if ( errno == EWOULDBLOCK || errno == EAGAIN )
+      break;
+
+    http_kill_socket( c );
+    return 0;
+  }
+
+  if ( c->state == HTTP_SOCKSTATE_READING_REQUEST )
   {
-    c->buflen += readsize;
-    http_parse_input( c );
-    return;
+    if ( c->first_req )
+      c->state = HTTP_SOCKSTATE_AWAITING_INSTRUCTIONS;
+    else
+    if ( c->closing )
+    {
+      http_kill_socket( c );
+      return 0;
+    }
   }
 
-  if ( readsize == 0 || errno != EWOULDBLOCK )
-    http_kill_socket( c );
+  return 1;
 }
 
-void http_flush_response( http_conn *c )
+/*
+ * Returns 1 once the whole response has been sent, 0 if the socket
+ * would block or the connection was killed
+ */
+int http_flush_response( http_conn *c )
 {
   int sent_amount;
 
   if ( !c->writehead )
     c->writehead = c->outbuf;
 
-  sent_amount = send( c->sock, c->writehead, c->outbuflen, 0 );
-
-  if ( sent_amount >= c->outbuflen )
+  while ( c->outbuflen > 0 )
   {
-    http_kill_socket( c );
-    return;
+    sent_amount = send( c->sock, c->writehead, c->outbuflen, MSG_NOSIGNAL );
+
+    if ( sent_amount < 0 )
+    {
+      if ( errno == EINTR )
+        continue;
+
+      /*
+       * Socket buffer is full: wait for the next EPOLLOUT edge
+       */
+      if ( errno == EWOULDBLOCK || errno == EAGAIN )
+        return 0;
+
+      http_kill_socket( c );
+      return 0;
+    }
+
+    c->outbuflen -= sent_amount;
+    c->writehead = &c->writehead[sent_amount];
   }
 
-  c->outbuflen -= sent_amount;
-  c->writehead = &c->writehead[sent_amount];
+  return 1;
 }
 
-void http_parse_input( http_conn *c )
+/*
+ * Case-insensitively match an HTTP header name, returning its (trimmed) value
+ */
+char *http_header_value( char *line, const char *name )
 {
-  char *bptr, *end, query[MAX_STRING_LEN], *qptr;
-  int spaces = 0, chars = 0;
+  int len = strlen( name );
+
+  if ( strncasecmp( line, name, len ) || line[len] != ':' )
+    return NULL;
 
-  end = &c->buf[c->buflen];
+  for ( line += len + 1; *line == ' ' || *line == '\t'; line++ )
+    ;
+
+  return line;
+}
 
-  for ( bptr = c->buf; bptr < end; bptr++ )
+/*
+ * Parse as many complete requests (request line plus headers) as are sitting
+ * in the input buffer, and queue them on the connection in the order received.
+ * Returns 0 if the connection was killed.
+ */
+int http_parse_input( http_conn *c )
+{
+  while ( !c->closing && c->reqcnt < HTTP_MAX_PIPELINED_REQUESTS )
   {
-    switch( *bptr )
-    {
-      case ' ':
-        spaces++;
+    char *bptr, *end, *line, *target, *target_end, *val;
+    http_request *req;
+    int keepalive, content_len = 0, consumed;
 
-        if ( spaces == 2 )
-        {
-          *qptr = '\0';
-          c->req->query = strdup( query );
-          c->state = HTTP_SOCKSTATE_AWAITING_INSTRUCTIONS;
-          return;
-        }
-        else
-        {
-          *query = '\0';
-          qptr = query;
-        }
+    end = &c->buf[c->buflen];
 
-        break;
+    /*
+     * Tolerate stray line breaks between pipelined requests
+     */
+    for ( bptr = c->buf; bptr < end && ( *bptr == '\r' || *bptr == '\n' ); bptr++ )
+      ;
+
+    if ( bptr > c->buf )
+    {
+      c->buflen -= bptr - c->buf;
+      memmove( c->buf, bptr, c->buflen );
+      end = &c->buf[c->buflen];
+    }
 
-      case '\0':
-      case '\n':
-      case '\r':
+    /*
+     * Find the blank line ending the headers
+     */
+    for ( bptr = c->buf; bptr < end; bptr++ )
+    {
+      if ( *bptr == '\0' )
+      {
         http_kill_socket( c );
-        return;
+        return 0;
+      }
 
-      default:
-        if ( spaces != 0 )
-        {
-          if ( ++chars >= MAX_STRING_LEN - 10 )
-          {
-            http_kill_socket( c );
-            return;
-          }
-          *qptr++ = *bptr;
-        }
+      if ( *bptr == '\n'
+      && ( ( bptr + 1 < end && bptr[1] == '\n' )
+      ||   ( bptr + 2 < end && bptr[1] == '\r' && bptr[2] == '\n' ) ) )
         break;
     }
-  }
-}
 
-http_request *http_recv( void )
-{
-  http_request *req, *best = NULL;
-  int max_idle = -1;
+    if ( bptr >= end )
+      return 1;
 
-  http_update_connections();
+    consumed = ( bptr[1] == '\n' ? &bptr[2] : &bptr[3] ) - c->buf;
 
-  for ( req = first_http_req; req; req = req->next )
-  {
-    if ( req->conn->state == HTTP_SOCKSTATE_AWAITING_INSTRUCTIONS
-    &&   req->conn->idle > max_idle )
+    /*
+     * Request line: method, target, version
+     */
+    for ( target = c->buf; target < bptr && *target != ' ' && *target != '\r'; target++ )
+      ;
+
+    if ( *target != ' ' )
     {
-      max_idle = req->conn->idle;
-      best = req;
+      http_kill_socket( c );
+      return 0;
     }
-  }
 
-  if ( best )
-  {
-    best->conn->state = HTTP_SOCKSTATE_WRITING_RESPONSE;
-    return best;
+    for ( target_end = ++target; target_end < bptr && *target_end != ' ' && *target_end != '\r'; target_end++ )
+      ;
+
+    if ( *target_end != ' ' || target_end - target >= MAX_STRING_LEN - 10 )
+    {
+      http_kill_socket( c );
+      return 0;
+    }
+
+    keepalive = str_begins( target_end + 1, "HTTP/1.0" ) ? 0 : 1;
+
+    /*
+     * Headers (one per line, up to the blank line at bptr)
+     */
+    for ( line = target_end; line < bptr; )
+    {
+      for ( ; line < bptr && *line != '\n'; line++ )
+        ;
+
+      if ( line++ >= bptr )
+        break;
+
+      if ( (val = http_header_value( line, "Connection" )) != NULL )
+      {
+        if ( !strncasecmp( val, "close", strlen("close") ) )
+          keepalive = 0;
+        else
+        if ( !strncasecmp( val, "keep-alive", strlen("keep-alive") ) )
+          keepalive = 1;
+      }
+      else
+      if ( (val = http_header_value( line, "Content-Length" )) != NULL )
+      {
+        content_len = strtol( val, NULL, 10 );
+
+        if ( content_len < 0 || content_len >= HTTP_MAX_INBUF_SIZE )
+        {
+          http_kill_socket( c );
+          return 0;
+        }
+      }
+    }
+
+    /*
+     * Request bodies are not used by the API, but must be skipped over
+     */
+    if ( consumed + content_len > c->buflen )
+      return 1;
+
+    consumed += content_len;
+
+    CREATE( req, http_request, 1 );
+    req->conn = c;
+    req->query = strndup( target, target_end - target );
+    req->callback = NULL;
+    req->keepalive = keepalive;
+    req->http10 = str_begins( target_end + 1, "HTTP/1.0" );
+
+    LINK2( req, first_http_req, last_http_req, next, prev );
+    LINK( req, c->first_req, c->last_req, next_in_conn );
+    c->reqcnt++;
+
+    if ( !keepalive )
+      c->closing = 1;
+
+    c->buflen -= consumed;
+    memmove( c->buf, c->buf + consumed, c->buflen );
   }
 
-  return NULL;
+  return 1;
 }
 
 void http_write( http_request *req, char *txt )
@@ -509,25 +910,28 @@ void http_write( http_request *req, char *txt )
  * to ensure txt is not too huge.
  */
 void http_send( http_request *req, char *txt, int len )
+{
+  memcpy( http_output_space( req, len ), txt, len );
+}
+
+/*
+ * Make room for a response of the given length, to be written directly
+ * into the connection's output buffer
+ */
+char *http_output_space( http_request *req, int len )
 {
   http_conn *c = req->conn;
 
   if ( len >= c->outbufsize - 5 )
   {
-    char *newbuf;
-
-    CREATE( newbuf, char, len+10 );
-    memcpy( newbuf, txt, len+1 );
     free( c->outbuf );
-    c->outbuf = newbuf;
-    c->outbuflen = len;
+    CREATE( c->outbuf, char, len+10 );
     c->outbufsize = len+10;
   }
-  else
-  {
-    memcpy( c->outbuf, txt, len );
-    c->outbuflen = len;
-  }
+
+  c->outbuflen = len;
+
+  return c->outbuf;
 }
 
 void send_400_response( http_request *req )
@@ -538,11 +942,13 @@ void send_400_response( http_request *req )
                 "Date: %s\r\n"
                 "Content-Type: text/plain; charset=utf-8\r\n"
                 "%s"
+                "%s"
                 "Content-Length: %zd\r\n"
                 "\r\n"
                 "Syntax Error",
                 current_date(),
                 nocache_headers(),
+                connection_header( req ),
                 strlen( "Syntax Error" ) );
 
   http_write( req, buf );
@@ -560,47 +966,60 @@ void send_error_response( http_request *req, char *txt )
 
 void send_response_with_type( http_request *req, char *code, char *txt, char *type )
 {
-  char *buf, *fmt;
+  char headers[MAX_STRING_LEN], *bptr;
+  int hdrlen, txtlen, len;
 
-  if ( !strcmp( type, "application/json" ) )
+  /*
+   * Machine clients don't need the whitespace, so only prettify on request
+   */
+  if ( req->pretty && !strcmp( type, "application/json" ) )
   {
-    fmt = json_format( txt, 2, NULL );
+    char *fmt = json_format( txt, 2, NULL );
 
     if ( fmt )
       txt = fmt;
   }
 
+  txtlen = strlen( txt );
+  len = txtlen;
+
   /*
    * JSONP support
    */
   if ( req->callback )
-  {
-    char *jsonp = malloc( strlen(txt) + strlen(req->callback) + strlen( "(\n\n);" ) + 1 );
+    len += strlen( req->callback ) + strlen( "(\n\n);" );
+
+  hdrlen = sprintf( headers,  "HTTP/1.1 %s\r\n"
+                              "Date: %s\r\n"
+                              "Content-Type: %s; charset=utf-8\r\n"
+                              "%s"
+                              "%s"
+                              "Content-Length: %d\r\n"
+                              "\r\n",
+                              code,
+                              current_date(),
+                              type,
+                              nocache_headers(),
+                              connection_header( req ),
+                              len );
 
-    sprintf( jsonp, "%s(\n%s\n);", req->callback, txt );
-    txt = jsonp;
-  }
+  /*
+   * Assemble the response right in the output buffer, rather than
+   * building it up and then copying it there
+   */
+  bptr = http_output_space( req, hdrlen + len );
 
-  buf = strdupf(  "HTTP/1.1 %s\r\n"
-                  "Date: %s\r\n"
-                  "Content-Type: %s; charset=utf-8\r\n"
-                  "%s"
-                  "Content-Length: %zd\r\n"
-                  "\r\n"
-                  "%s",
-                  code,
-                  current_date(),
-                  type,
-                  nocache_headers(),
-                  strlen(txt),
-                  txt );
+  memcpy( bptr, headers, hdrlen );
+  bptr += hdrlen;
 
   if ( req->callback )
-    free( txt );
+    bptr += sprintf( bptr, "%s(\n", req->callback );
 
-  http_write( req, buf );
+  memcpy( bptr, txt, txtlen );
+  bptr += txtlen;
 
-  free( buf );
+  if ( req->callback )
+    memcpy( bptr, "\n);", strlen( "\n);" ) );
 }
 
 char *nocache_headers(void)
@@ -610,16 +1029,21 @@ char *nocache_headers(void)
          "Expires: 0\r\n";
 }
 
+char *connection_header( http_request *req )
+{
+  return req->keepalive ? "Connection: keep-alive\r\n" : "Connection: close\r\n";
+}
+
 char *current_date(void)
 {
   time_t rawtime;
-  struct tm *timeinfo;
-  static char buf[2048];
+  struct tm timeinfo;
+  static __thread char buf[2048];
   char *bptr;
 
   time ( &rawtime );
-  timeinfo = localtime( &rawtime );
-  sprintf( buf, "%s", asctime ( timeinfo ) );
+  localtime_r( &rawtime, &timeinfo );
+  asctime_r( &timeinfo, buf );
 
   for ( bptr = &buf[strlen(buf)-1]; *bptr == '\n' || *bptr == '\r'; bptr-- )
     ;
@@ -674,22 +1098,25 @@ char *load_file( char *filename )
   }
 }
 
-const char *parse_params( char *buf, http_request *req, url_param **params )
+/*
+ * Split the query string into parameters, decoding each key and value
+ * where it lies, and file them by key
+ */
+const char *parse_params( char *buf, http_request *req, url_params *params )
 {
   char *bptr;
   char *param;
   int fEnd, cnt=0;
-  url_param **pptr = params;
+
+  params->cnt = 0;
+  memset( params->bucket, 0, sizeof(params->bucket) );
 
   for ( bptr = buf; *bptr; bptr++ )
     if ( *bptr == '?' )
       break;
 
   if ( !*bptr )
-  {
-    *params = NULL;
     return NULL;
-  }
 
   *bptr++ = '\0';
   param = bptr;
@@ -707,10 +1134,7 @@ const char *parse_params( char *buf, http_request *req, url_param **params )
         *bptr = '\0';
 
       if ( ++cnt >= MAX_URL_PARAMS )
-      {
-        *pptr = NULL;
         return "Too many URL parameters";
-      }
 
       for ( equals = param; *equals; equals++ )
         if ( *equals == '=' )
@@ -718,34 +1142,39 @@ const char *parse_params( char *buf, http_request *req, url_param **params )
 
       if ( *equals )
       {
+        url_param *p = &params->param[params->cnt++], **bucket;
+
         *equals = '\0';
 
         if ( strlen( param ) >= MAX_URL_PARAM_LEN )
-        {
-          *pptr = NULL;
           return "Url parameter too long";
-        }
 
-        CREATE( *pptr, url_param, 1 );
-        (*pptr)->key = url_decode( param );
-        (*pptr)->val = url_decode( &equals[1] );
+        p->key = url_decode_in_place( param );
+        p->val = url_decode_in_place( &equals[1] );
+        p->next = NULL;
+
+        bucket = &params->bucket[str_hash( p->key, strlen( p->key ), 0 ) % URL_PARAM_HASH];
+
+        while ( *bucket && strcmp( (*bucket)->key, p->key ) )
+          bucket = &(*bucket)->next;
 
-        if ( !strcmp( (*pptr)->key, "callback" ) )
+        if ( !*bucket )
+          *bucket = p;
+
+        if ( !strcmp( p->key, "callback" ) )
         {
           if ( req->callback )
             free( req->callback );
 
-          req->callback = strdup( (*pptr)->val );
+          req->callback = strdup( p->val );
         }
-
-        pptr++;
+        else
+        if ( !strcmp( p->key, "pretty" ) )
+          req->pretty = strcmp( p->val, "0" ) && strcmp( p->val, "no" );
       }
 
       if ( fEnd )
-      {
-        *pptr = NULL;
         return NULL;
-      }
 
       param = &bptr[1];
     }
@@ -769,15 +1198,15 @@ HANDLER( do_constrain_along_path )
   along_path_abstractor( req, params, ALONG_PATH_CONSTRAIN );
 }
 
-void along_path_abstractor( http_request *req, url_param **params, int along_path_type )
+void along_path_abstractor( http_request *req, url_params *params, int along_path_type )
 {
   lyphnode *x, *y;
   lyphplate *L;
   lyph ***paths, ***pathsptr, **p, **pptr, *xlyph, *ylyph;
   lyph_filter *f;
   lyphnode_wrapper *w, *from_head = NULL, *from_tail = NULL, *to_head = NULL, *to_tail = NULL;
-  char *xid, *yid, *Lid, *fid, *xlyphid, *ylyphid, *numpathsstr;
-  int numpaths;
+  char *xid, *yid, *Lid, *fid, *xlyphid, *ylyphid, *numpathsstr, *reversesstr;
+  int numpaths, include_reverses, include_nif;
 
   xid = get_param( params, "from" );
   yid = get_param( params, "to" );
@@ -839,6 +1268,17 @@ void along_path_abstractor( http_request *req, url_param **params, int along_pat
   else
     numpaths = 1;
 
+  reversesstr = get_param( params, "include_reverses" );
+
+  if ( !reversesstr || !strcmp( reversesstr, "yes" ) )
+    include_reverses = 1;
+  else if ( !strcmp( reversesstr, "no" ) )
+    include_reverses = 0;
+  else
+    HND_ERR( "'include_reverses' must be 'yes' or 'no'" );
+
+  include_nif = has_param( params, "nif" );
+
   if ( along_path_type != ALONG_PATH_COMPUTE )
   {
     L = lyphplate_by_id( Lid );
@@ -891,7 +1331,7 @@ void along_path_abstractor( http_request *req, url_param **params, int along_pat
   else
     calc_nodes_in_lyph( ylyph, &to_head, &to_tail );
 
-  paths = compute_lyphpaths( from_head, to_head, f, numpaths, 0, 1, 0 );
+  paths = compute_k_lyphpaths( from_head, to_head, f, numpaths, 0, include_reverses, include_nif );
 
   free_lyphnode_wrappers( from_head );
   free_lyphnode_wrappers( to_head );
@@ -939,6 +1379,8 @@ void along_path_abstractor( http_request *req, url_param **params, int along_pat
       }
     }
 
+    lyph_graph_changed();
+
     save_lyphs();
   }
   else if ( along_path_type == ALONG_PATH_CONSTRAIN )
@@ -1145,7 +1587,7 @@ HANDLER( do_editview )
   makeview_worker( request, req, params, MAKEVIEW_WORKER_EDITVIEW );
 }
 
-void makeview_worker( char *request, http_request *req, url_param **params, int type )
+void makeview_worker( char *request, http_request *req, url_params *params, int type )
 {
   lyphnode **nodes, **nptr;
   lyph **lyphs, **lptr;
@@ -1306,19 +1748,19 @@ void makeview_worker( char *request, http_request *req, url_param **params, int
   }
 
   for ( nptr = v->nodes; *nptr; nptr++ )
-    SET_BIT( (*nptr)->flags, LYPHNODE_ALREADY_IN_VIEW );
+    SET_BIT( (*nptr)->flags[worker_slot], LYPHNODE_ALREADY_IN_VIEW );
 
   for ( rptr = v->rects; *rptr; rptr++ )
     if ( (*rptr)->L && (*rptr)->L != null_rect )
-      SET_BIT( (*rptr)->L->flags, LYPH_ALREADY_IN_VIEW );
+      SET_BIT( (*rptr)->L->flags[worker_slot], LYPH_ALREADY_IN_VIEW );
 
   for ( nptr = nodes, cnt=0; *nptr; nptr++ )
   {
-    if ( IS_SET( (*nptr)->flags, LYPHNODE_ALREADY_IN_VIEW )
-    ||   IS_SET( (*nptr)->flags, LYPHNODE_QUEUED_FOR_ADDING ) )
+    if ( IS_SET( (*nptr)->flags[worker_slot], LYPHNODE_ALREADY_IN_VIEW )
+    ||   IS_SET( (*nptr)->flags[worker_slot], LYPHNODE_QUEUED_FOR_ADDING ) )
       continue;
 
-    SET_BIT( (*nptr)->flags, LYPHNODE_QUEUED_FOR_ADDING );
+    SET_BIT( (*nptr)->flags[worker_slot], LYPHNODE_QUEUED_FOR_ADDING );
     cnt++;
   }
 
@@ -1340,14 +1782,14 @@ void makeview_worker( char *request, http_request *req, url_param **params, int
 
     for ( nptr = nodes, xsptr = xs, ysptr = ys; *nptr; nptr++ )
     {
-      if ( IS_SET( (*nptr)->flags, LYPHNODE_ALREADY_IN_VIEW ) )
+      if ( IS_SET( (*nptr)->flags[worker_slot], LYPHNODE_ALREADY_IN_VIEW ) )
       {
         xsptr++;
         ysptr++;
         continue;
       }
 
-      SET_BIT( (*nptr)->flags, LYPHNODE_ALREADY_IN_VIEW );
+      SET_BIT( (*nptr)->flags[worker_slot], LYPHNODE_ALREADY_IN_VIEW );
 
       *bptr++ = *nptr;
       *newcptr++ = strdup( *xsptr++ );
@@ -1366,7 +1808,7 @@ void makeview_worker( char *request, http_request *req, url_param **params, int
   {
     for ( nptr = nodes, xsptr = xs, ysptr = ys; *nptr; nptr++, xsptr++, ysptr++ )
     {
-      if ( !IS_SET( (*nptr)->flags, LYPHNODE_QUEUED_FOR_ADDING ) )
+      if ( !IS_SET( (*nptr)->flags[worker_slot], LYPHNODE_QUEUED_FOR_ADDING ) )
       {
         /*
          * The node was already in the view, and did not to be added.
@@ -1390,8 +1832,8 @@ void makeview_worker( char *request, http_request *req, url_param **params, int
 
   for ( nptr = v->nodes; *nptr; nptr++ )
   {
-    REMOVE_BIT( (*nptr)->flags, LYPHNODE_ALREADY_IN_VIEW );
-    REMOVE_BIT( (*nptr)->flags, LYPHNODE_QUEUED_FOR_ADDING );
+    REMOVE_BIT( (*nptr)->flags[worker_slot], LYPHNODE_ALREADY_IN_VIEW );
+    REMOVE_BIT( (*nptr)->flags[worker_slot], LYPHNODE_QUEUED_FOR_ADDING );
   }
 
   free( nodes );
@@ -1406,11 +1848,11 @@ void makeview_worker( char *request, http_request *req, url_param **params, int
       continue;
     }
 
-    if ( IS_SET( (*lptr)->flags, LYPH_ALREADY_IN_VIEW )
-    ||   IS_SET( (*lptr)->flags, LYPH_QUEUED_FOR_ADDING ) )
+    if ( IS_SET( (*lptr)->flags[worker_slot], LYPH_ALREADY_IN_VIEW )
+    ||   IS_SET( (*lptr)->flags[worker_slot], LYPH_QUEUED_FOR_ADDING ) )
       continue;
 
-    SET_BIT( (*lptr)->flags, LYPH_QUEUED_FOR_ADDING );
+    SET_BIT( (*lptr)->flags[worker_slot], LYPH_QUEUED_FOR_ADDING );
     cnt++;
   }
 
@@ -1429,7 +1871,7 @@ void makeview_worker( char *request, http_request *req, url_param **params, int
     {
       lv_rect *rect;
 
-      if ( *lptr != null_rect && IS_SET( (*lptr)->flags, LYPH_ALREADY_IN_VIEW ) )
+      if ( *lptr != null_rect && IS_SET( (*lptr)->flags[worker_slot], LYPH_ALREADY_IN_VIEW ) )
       {
         lxsptr++;
         lysptr++;
@@ -1440,7 +1882,7 @@ void makeview_worker( char *request, http_request *req, url_param **params, int
       }
 
       if ( *lptr != null_rect )
-        SET_BIT( (*lptr)->flags, LYPH_ALREADY_IN_VIEW );
+        SET_BIT( (*lptr)->flags[worker_slot], LYPH_ALREADY_IN_VIEW );
 
       CREATE( rect, lv_rect, 1 );
 
@@ -1468,7 +1910,7 @@ void makeview_worker( char *request, http_request *req, url_param **params, int
     for ( lptr = lyphs, lxsptr = lxs, lysptr = lys, wptr = widths, hptr = heights;
           *lptr; lptr++, lxsptr++, lysptr++, wptr++, hptr++ )
     {
-      if ( !IS_SET( (*lptr)->flags, LYPH_QUEUED_FOR_ADDING ) )
+      if ( !IS_SET( (*lptr)->flags[worker_slot], LYPH_QUEUED_FOR_ADDING ) )
       {
         /*
          * The lyph was already present, and didn't need adding.
@@ -1497,8 +1939,8 @@ void makeview_worker( char *request, http_request *req, url_param **params, int
     if ( (*rptr)->L == null_rect || !(*rptr)->L )
       continue;
 
-    REMOVE_BIT( (*rptr)->L->flags, LYPH_ALREADY_IN_VIEW );
-    REMOVE_BIT( (*rptr)->L->flags, LYPH_QUEUED_FOR_ADDING );
+    REMOVE_BIT( (*rptr)->L->flags[worker_slot], LYPH_ALREADY_IN_VIEW );
+    REMOVE_BIT( (*rptr)->L->flags[worker_slot], LYPH_QUEUED_FOR_ADDING );
   }
 
   free( lyphs );
@@ -1625,6 +2067,8 @@ HANDLER( do_assign_template )
     (*e)->modified = longtime();
   }
 
+  lyph_graph_changed();
+
   free( lyphs );
 
   save_lyphs();
@@ -1816,59 +2260,30 @@ HANDLER( do_layer )
   send_response( req, layer_to_json( lyr ) );
 }
 
-void free_url_params( url_param **buf )
-{
-  url_param **ptr;
-
-  for ( ptr = buf; *ptr; ptr++ )
-  {
-    free( (*ptr)->key );
-    free( (*ptr)->val );
-    free( *ptr );
-  }
-}
-
-char *get_param( url_param **params, char *key )
+char *get_param( url_params *params, char *key )
 {
-  url_param **ptr;
+  url_param *p = params->bucket[str_hash( key, strlen( key ), 0 ) % URL_PARAM_HASH];
 
-  for ( ptr = params; *ptr; ptr++ )
-    if ( !strcmp( (*ptr)->key, key ) )
-      return (*ptr)->val;
+  for ( ; p; p = p->next )
+    if ( !strcmp( p->key, key ) )
+      return p->val;
 
   return NULL;
 }
 
-int has_param( url_param **params, char *key )
+int has_param( url_params *params, char *key )
 {
-  for ( ; *params; params++ )
-    if ( !strcmp( (*params)->key, key ) )
-      return 1;
-
-  return 0;
-}
-
-void populate_lyphs_by_species( trie *species, lyph ***ptr, int include_null_species )
-{
-  lyph *e;
-
-  for ( e = first_lyph; e; e = e->next )
-  {
-    if ( e->species == species || ( is_null_species(e) && include_null_species ) )
-    {
-      **ptr = e;
-      (*ptr)++;
-    }
-  }
+  return get_param( params, key ) != NULL;
 }
 
 HANDLER( do_all_lyphs )
 {
-  lyph **lyphs, **ptr, *e;
+  lyph *e;
   lyph_to_json_details details;
-  trie *species;
+  json_stream s;
+  trie *species = NULL;
   char *speciesstr, *briefstr;
-  int include_null_species = 0;
+  int include_null_species = 0, any_species = 0;
 
   speciesstr = get_param( params, "species" );
   briefstr = get_param( params, "brief" );
@@ -1881,57 +2296,56 @@ HANDLER( do_all_lyphs )
   else if ( !strcmp( speciesstr, "Human" ) )
     include_null_species = 1;
 
-  CREATE( lyphs, lyph *, lyphcnt + 1 );
-  ptr = lyphs;
-
   if ( !strcmp( speciesstr, "any" ) )
-  {
-    for ( e = first_lyph; e; e = e->next )
-      *ptr++ = e;
-
-    *ptr = NULL;
-  }
+    any_species = 1;
   else
-  {
-    species = trie_strdup( speciesstr, metadata );
-    populate_lyphs_by_species( species, &ptr, include_null_species );
-    *ptr = NULL;
-  }
+    species = trie_search( speciesstr, metadata );
 
-  if ( briefstr )
-    send_response( req, JS_ARRAY( lyph_to_json_brief, lyphs ) );
-  else
+  details.show_annots = 1;
+  details.suppress_correlations = 1;
+  details.count_correlations = 0;
+  details.buf = NULL;
+  details.show_children = 0;
+
+  json_stream_begin( &s, req );
+  json_stream_open( &s, NULL, '[' );
+
+  for ( e = first_lyph; e; e = e->next )
   {
-    details.show_annots = 1;
-    details.suppress_correlations = 1;
-    details.count_correlations = 0;
-    details.buf = NULL;
-    details.show_children = 0;
+    if ( !any_species
+    &&  !( species && e->species == species )
+    &&  !( is_null_species(e) && include_null_species ) )
+      continue;
 
-    send_response( req, JS_ARRAY_R( lyph_to_json_r, lyphs, &details ) );
+    if ( briefstr )
+      json_stream_value( &s, NULL, lyph_to_json_brief( e ) );
+    else
+      json_stream_value( &s, NULL, lyph_to_json_r( e, &details ) );
   }
 
-  free( lyphs );
+  json_stream_close( &s );
+  json_stream_end( &s );
 }
 
 HANDLER( do_all_templates )
 {
-  lyphplate **tmps = get_all_lyphplates();
-  char *commonsstr, *output;
+  lyphplate **tmps = get_all_lyphplates(), **tptr;
+  lyphplate_to_json_details det;
+  char *commonsstr;
+  json_stream s;
 
   commonsstr = get_param( params, "commons" );
 
-  if ( commonsstr && !strcmp( commonsstr, "yes" ) )
-  {
-    lyphplate_to_json_details det;
+  det.show_common_mats = ( commonsstr && !strcmp( commonsstr, "yes" ) );
 
-    det.show_common_mats = 1;
-    output = JS_ARRAY_R( lyphplate_to_json_r, tmps, &det );
-  }
-  else
-    output = JS_ARRAY( lyphplate_to_json, tmps );
+  json_stream_begin( &s, req );
+  json_stream_open( &s, NULL, '[' );
 
-  send_response( req, output );
+  for ( tptr = tmps; *tptr; tptr++ )
+    json_stream_value( &s, NULL, lyphplate_to_json_r( *tptr, &det ) );
+
+  json_stream_close( &s );
+  json_stream_end( &s );
 
   free( tmps );
 }
@@ -1943,7 +2357,13 @@ HANDLER( do_template_hierarchy )
 
 HANDLER( do_all_ont_terms )
 {
-  send_response( req, all_ont_terms_as_json() );
+  json_stream s;
+
+  json_stream_begin( &s, req );
+  json_stream_open( &s, NULL, '[' );
+  all_ont_terms_to_stream( &s, iri_to_labels );
+  json_stream_close( &s );
+  json_stream_end( &s );
 }
 
 HANDLER( do_all_lyphviews )
@@ -1977,16 +2397,18 @@ HANDLER( do_subtemplates )
 
 HANDLER( do_all_lyphnodes )
 {
-  lyphnode **n = (lyphnode **)datas_to_array( lyphnode_ids );
-  extern int lyphnode_to_json_flags;
+  extern __thread int lyphnode_to_json_flags;
+  json_stream s;
 
   lyphnode_to_json_flags = LTJ_EXITS;
 
-  send_response( req, JS_ARRAY( lyphnode_to_json, n ) );
+  json_stream_begin( &s, req );
+  json_stream_open( &s, NULL, '[' );
+  json_stream_trie( &s, lyphnode_ids, (char * (*) (void *)) lyphnode_to_json );
+  json_stream_close( &s );
+  json_stream_end( &s );
 
   lyphnode_to_json_flags = 0;
-
-  free ( n );
 }
 
 HANDLER( do_reset_db )
@@ -2036,6 +2458,8 @@ HANDLER( do_reset_db )
 void default_config_values( void )
 {
   configs.readonly = 0;
+  configs.workers = DEFAULT_WORKERS;
+  configs.image = 1;
 }
 
 int parse_commandline_args( int argc, const char *argv[], const char **filename, int *port )
@@ -2054,6 +2478,10 @@ int parse_commandline_args( int argc, const char *argv[], const char **filename,
     printf( "\n" );
     printf( "  -readonly <yes or no>\n" );
     printf( "    Specify whether to run in read-only mode (default: no)\n" );
+    printf( "  -image <yes or no>\n" );
+    printf( "    Specify whether to start from, and save, the binary image %s (default: yes)\n", IMAGE_FILE );
+    printf( "  -workers <number>\n" );
+    printf( "    Specify how many threads answer requests (default: %d, max: %d)\n", DEFAULT_WORKERS, MAX_WORKERS );
     printf( "  -help\n" );
     printf( "    Displays this helpfile\n" );
     printf( "\n" );
@@ -2086,6 +2514,34 @@ int parse_commandline_args( int argc, const char *argv[], const char **filename,
       continue;
     }
 
+    if ( !strcmp( param, "workers" ) )
+    {
+      int workers = strtoul( argv[1], NULL, 10 );
+
+      if ( workers < 1 || workers > MAX_WORKERS )
+      {
+        printf( "Number of workers must be between 1 and %d\n", MAX_WORKERS );
+        return 0;
+      }
+
+      configs.workers = workers;
+      printf( "LYPH has been set to use %d worker threads\n", workers );
+
+      continue;
+    }
+
+    if ( !strcmp( param, "image" ) )
+    {
+      if ( !strcmp( argv[1], "yes" ) || !strcmp( argv[1], "no" ) )
+      {
+        configs.image = !strcmp( argv[1], "yes" );
+        printf( "LYPH has been set to %s the binary image\n", configs.image ? "use" : "ignore" );
+        continue;
+      }
+      printf( "Valid options for 'image' are 'yes' or 'no'\n" );
+      return 0;
+    }
+
     if ( !strcmp( param, "readonly" ) )
     {
       if ( !strcmp( argv[1], "yes" ) )
@@ -1,9 +1,13 @@
 #include <sys/socket.h>
+#include <sys/epoll.h>
 #include <netdb.h>
 #include <ctype.h>
+#include <strings.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <time.h>
+#include <signal.h>
+#include <sys/signalfd.h>
 
 #if !defined(FNDELAY)
 #define FNDELAY O_NDELAY
@@ -11,20 +15,20 @@
 
 /*
  * If a browser connects, but doesn't do anything, how long until kicking them off
- * (See also the next comment below)
  */
 #define HTTP_KICK_IDLE_AFTER_X_SECS 60
 
 /*
- * How many times, per second, will your main project be checking for new connections?
- * (Rather than keep track of the exact time a client is idle, rather we keep track of
- *  the number of times we've checked for updates and found none.  When the client has
- *  been idle for HTTP_KICK_IDLE_AFTER_X_SECS * HTTP_PULSE_PER_SEC consecutive checks,
- *  they will be booted.  HTTP_PULSES_PER_SEC is not used anywhere else.  Thus, it is
- *  not terribly important that it be completely precise, a ballpark estimate is good
- *  enough.
+ * Idle connections are kept on a timer wheel with one slot per second.  The wheel
+ * must have more slots than HTTP_KICK_IDLE_AFTER_X_SECS, so that every deadline
+ * lands within one revolution of the current tick.
  */
-#define HTTP_PULSES_PER_SEC 10
+#define HTTP_TIMER_WHEEL_SLOTS 64
+
+/*
+ * Maximum number of socket events to collect from epoll in one wakeup
+ */
+#define HTTP_MAX_EVENTS 64
 
 #define HTTP_INITIAL_OUTBUF_SIZE 16384
 #define HTTP_INITIAL_INBUF_SIZE 16384
@@ -33,6 +37,19 @@
 
 #define HTTP_LISTEN_BACKLOG 32
 
+/*
+ * How many requests a keep-alive client may have queued (pipelined) on one
+ * connection before we stop reading from it until some have been answered
+ */
+#define HTTP_MAX_PIPELINED_REQUESTS 32
+
+/*
+ * Streamed responses go out in chunks of this size (HTTP chunked transfer
+ * encoding), so they never need to be held in memory all at once
+ */
+#define JSON_STREAM_CHUNK 65536
+#define JSON_STREAM_MAX_DEPTH 16
+
 #define HTTP_SOCKSTATE_READING_REQUEST 0
 #define HTTP_SOCKSTATE_WRITING_RESPONSE 1
 #define HTTP_SOCKSTATE_AWAITING_INSTRUCTIONS 2
@@ -41,7 +58,14 @@
 #define ALONG_PATH_CONSTRAIN 2
 #define ALONG_PATH_COMPUTE 3
 
-#define TABLES_HASH 256
+/*
+ * The command table has at least this many slots per command (see tables.c)
+ * and grows if that many seeds in a row fail to give a perfect hash
+ */
+#define COMMAND_TABLE_SPARSENESS 16
+#define COMMAND_TABLE_SEEDS 64
+
+#define URL_PARAM_HASH 64
 
 /*
  * Macros
@@ -109,6 +133,19 @@ do\
 }\
 while(0)
 
+/*
+ * For read-only handlers which nevertheless touch shared state (files,
+ * cached links, etc.).  When running alongside other readers, bail out:
+ * the worker will rerun the request with exclusive access.
+ */
+#define REQUIRE_EXCLUSIVE_ACCESS()\
+do\
+{\
+  if ( !have_exclusive_access() )\
+    return;\
+}\
+while(0)
+
 #define GET_NUMBERED_ARGS( params, base, fnc, err, size )\
         get_numbered_args( (params), (base), (char * (*) (void*))(fnc), (err), (size) )
 
@@ -121,17 +158,24 @@ while(0)
 typedef struct HTTP_REQUEST http_request;
 typedef struct HTTP_CONN http_conn;
 typedef struct URL_PARAM url_param;
+typedef struct URL_PARAMS url_params;
 typedef struct COMMAND_ENTRY command_entry;
+typedef struct JSON_STREAM json_stream;
 
-typedef void do_function ( char *request, http_request *req, url_param **params );
+typedef void do_function ( char *request, http_request *req, url_params *params );
 
 struct HTTP_REQUEST
 {
   http_request *next;
   http_request *prev;
+  http_request *next_in_conn;
+  http_request *next_job;
   http_conn *conn;
   char *query;
   int *dead;
+  int keepalive;
+  int http10;
+  int pretty;
 
   /*
    * JSONP support
@@ -144,9 +188,19 @@ struct HTTP_CONN
   http_conn *next;
   http_conn *prev;
   http_request *req;
+  http_request *first_req;
+  http_request *last_req;
+  int reqcnt;
+  int closing;
+  http_conn *next_done;
+  int busy;
+  int doomed;
   int sock;
   int state;
-  int idle;
+  http_conn *wheel_next;
+  http_conn *wheel_prev;
+  int wheel_slot;
+  long deadline;
   char *buf;
   int bufsize;
   int buflen;
@@ -157,10 +211,23 @@ struct HTTP_CONN
   char *writehead;
 };
 
+/*
+ * A request's parameters are decoded where they lie in the query, and
+ * hashed by key so each lookup is a short chain walk.  When a key is
+ * given more than once, the first one counts.
+ */
 struct URL_PARAM
 {
   char *key;
   char *val;
+  url_param *next;
+};
+
+struct URL_PARAMS
+{
+  url_param param[MAX_URL_PARAMS];
+  url_param *bucket[URL_PARAM_HASH];
+  int cnt;
 };
 
 struct COMMAND_ENTRY
@@ -168,12 +235,34 @@ struct COMMAND_ENTRY
   command_entry *next;
   do_function *f;
   char *cmd;
+  size_t len;
   int read_write_state;
 };
 
+struct JSON_STREAM
+{
+  http_request *req;
+  char *buf;
+  int len;
+  int chunked;
+  int pretty;
+  int failed;
+  char *mark;
+  int depth;
+  int cnt[JSON_STREAM_MAX_DEPTH];
+  int keyed[JSON_STREAM_MAX_DEPTH];
+  char opener[JSON_STREAM_MAX_DEPTH];
+};
+
+/*
+ * CMD_READWRITE_SNAPSHOT: changes the database in a way that can't be
+ * replayed from the journal (e.g. by reading an uploaded file, or at
+ * random), or needs the snapshot files current, so the change is saved
+ * to the snapshot files at once
+ */
 typedef enum
 {
-  CMD_READONLY, CMD_READWRITE
+  CMD_READONLY, CMD_READWRITE, CMD_READWRITE_SNAPSHOT
 } read_write_states;
 
 /*
@@ -184,10 +273,6 @@ http_request *last_http_req;
 http_conn *first_http_conn;
 http_conn *last_http_conn;
 
-fd_set http_inset;
-fd_set http_outset;
-fd_set http_excset;
-
 int srvsock;
 
 /*
@@ -199,34 +284,75 @@ int srvsock;
  */
 int parse_commandline_args( int argc, const char *argv[], const char **filename, int *port );
 void init_lyph_http_server( int port );
+void init_shutdown_signals( void );
+void shutdown_lyph_server( void );
 void http_update_connections( void );
+void http_conn_event( http_conn *c, uint32_t events );
+void http_touch_connection( http_conn *c );
+void http_expire_idle_connections( void );
 void http_kill_socket( http_conn *c );
 void free_http_request( http_request *r );
 void http_answer_the_phone( int srvsock );
 int resize_buffer( http_conn *c, char **buf );
-void http_listen_to_request( http_conn *c );
-void http_flush_response( http_conn *c );
-void http_parse_input( http_conn *c );
-http_request *http_recv( void );
+int http_listen_to_request( http_conn *c );
+int http_flush_response( http_conn *c );
+char *http_header_value( char *line, const char *name );
+int http_parse_input( http_conn *c );
+void http_process_connection( http_conn *c );
+void http_serve_request( http_conn *c );
+int http_finish_response( http_conn *c );
 void http_write( http_request *req, char *txt );
 void http_send( http_request *req, char *txt, int len );
+char *http_output_space( http_request *req, int len );
 void handle_request( http_request *req, char *query );
 void send_400_response( http_request *req );
 void send_response( http_request *req, char *txt );
 void send_response_with_type( http_request *req, char *code, char *txt, char *type );
 char *nocache_headers(void);
+char *connection_header( http_request *req );
 char *current_date(void);
 void send_gui( http_request *req );
 void send_js( http_request *req );
 char *load_file( char *filename );
-const char *parse_params( char *buf, http_request *req, url_param **params );
-void free_url_params( url_param **buf );
-char *get_param( url_param **params, char *key );
-int has_param( url_param **params, char *key );
-void along_path_abstractor( http_request *req, url_param **params, int along_path_type );
-void makeview_worker( char *request, http_request *req, url_param **params, int makeview );
+const char *parse_params( char *buf, http_request *req, url_params *params );
+char *get_param( url_params *params, char *key );
+int has_param( url_params *params, char *key );
+void along_path_abstractor( http_request *req, url_params *params, int along_path_type );
+void makeview_worker( char *request, http_request *req, url_params *params, int makeview );
 void default_config_values( void );
 void send_ok( http_request *req );
+int request_read_write_state( const char *query );
+
+/*
+ * workers.c
+ */
+extern int worker_eventfd;
+void init_workers( void );
+void dispatch_request( http_request *req );
+void *worker_thread( void *arg );
+void run_request( http_request *req );
+void collect_finished_requests( void );
+void stop_workers( void );
+
+/*
+ * stream.c
+ */
+void json_stream_begin( json_stream *s, http_request *req );
+void json_stream_open( json_stream *s, const char *key, char opener );
+void json_stream_close( json_stream *s );
+void json_stream_value( json_stream *s, const char *key, const char *json );
+void json_stream_trie( json_stream *s, trie *t, char * (*fnc) (void *) );
+void json_stream_end( json_stream *s );
+
+/*
+ * csv.c
+ */
+char *run_one_api_cmd( char *cmd );
+
+/*
+ * labels.c
+ */
+void all_ont_terms_to_stream( json_stream *s, trie *t );
 
 /*
  * hier.c
@@ -238,13 +364,13 @@ void between_worker( lyph *root, lyph **ends, http_request *req, int verbose );
  */
 void init_command_table( void );
 void add_handler( char *cmd, do_function *fnc, int read_write_state );
-command_entry *lookup_command( char *cmd );
+command_entry *lookup_command( const char *cmd, size_t len );
 
 /*
  * cmds.c
  */
-void **get_numbered_args( url_param **params, char *base, char * (*fnc) (void *), char **err, int *size );
-void **get_numbered_args_r( url_param **params, char *base, char * (*fnc) (void *, void *), void *data, char **err, int *size );
+void **get_numbered_args( url_params *params, char *base, char * (*fnc) (void *), char **err, int *size );
+void **get_numbered_args_r( url_params *params, char *base, char * (*fnc) (void *, void *), void *data, char **err, int *size );
 void save_annotations( void );
 
 /*
@@ -344,3 +470,4 @@ HANDLER( do_scaimap );
 HANDLER( do_between );
 HANDLER( do_correlation_links );
 HANDLER( do_dump );
+HANDLER( do_save_image );
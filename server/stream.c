@@ -0,0 +1,351 @@
+/*
+ *  stream.c
+ *  Streaming JSON responses.
+ *
+ *  Rather than building an entire response as one string (which, for
+ *  something like the dump command, means holding several copies of the
+ *  whole database in memory), a handler can write the response piece by
+ *  piece as it walks the data:
+ *
+ *    json_stream s;
+ *
+ *    json_stream_begin( &s, req );
+ *    json_stream_open( &s, NULL, '[' );
+ *    for ( e = first_lyph; e; e = e->next )
+ *      json_stream_value( &s, NULL, lyph_to_json( e ) );
+ *    json_stream_close( &s );
+ *    json_stream_end( &s );
+ *
+ *  The output goes out in HTTP chunks, straight from the worker thread to
+ *  the socket.  It's compact, unless the client asked for it pretty, in
+ *  which case it's laid out the same way json_format would lay it out.  Any
+ *  JSON built after json_stream_begin is discarded by each call to
+ *  json_stream_value, so don't hang onto it.  And since output starts going
+ *  out at once, a streaming handler can't be rerun with exclusive access
+ *  (see REQUIRE_EXCLUSIVE_ACCESS): it must only read.
+ */
+#include "lyph.h"
+#include "srv.h"
+#include <poll.h>
+
+/*
+ * Room in front of each chunk for its length line
+ */
+#define JSON_STREAM_CHUNK_HEADER 10
+
+static const char json_stream_spaces[] = "                                                                ";
+
+int json_stream_send( json_stream *s, const char *buf, int len );
+void json_stream_flush( json_stream *s );
+void json_stream_put( json_stream *s, const char *txt, int len );
+void json_stream_indent( json_stream *s, int depth );
+void json_stream_item( json_stream *s, const char *key );
+
+void json_stream_begin( json_stream *s, http_request *req )
+{
+  char *headers;
+
+  s->req = req;
+  s->len = 0;
+  s->failed = 0;
+  s->depth = 0;
+  s->pretty = req->pretty;
+
+  CREATE( s->buf, char, JSON_STREAM_CHUNK_HEADER + JSON_STREAM_CHUNK + strlen("\r\n") );
+
+  /*
+   * HTTP/1.0 clients don't understand chunks: for them, the end of the
+   * response is marked by closing the connection
+   */
+  if ( req->http10 )
+  {
+    s->chunked = 0;
+    req->keepalive = 0;
+  }
+  else
+    s->chunked = 1;
+
+  headers = strdupf(  "HTTP/1.1 200 OK\r\n"
+                      "Date: %s\r\n"
+                      "Content-Type: application/json; charset=utf-8\r\n"
+                      "%s"
+                      "%s"
+                      "%s"
+                      "\r\n",
+                      current_date(),
+                      nocache_headers(),
+                      connection_header( req ),
+                      s->chunked ? "Transfer-Encoding: chunked\r\n" : "" );
+
+  json_stream_send( s, headers, strlen( headers ) );
+  free( headers );
+
+  /*
+   * JSONP support
+   */
+  if ( req->callback )
+  {
+    json_stream_put( s, req->callback, strlen( req->callback ) );
+    json_stream_put( s, "(\n", strlen( "(\n" ) );
+  }
+
+  s->mark = json_arena_mark();
+}
+
+void json_stream_end( json_stream *s )
+{
+  if ( s->req->callback )
+    json_stream_put( s, "\n);", strlen( "\n);" ) );
+
+  json_stream_flush( s );
+
+  if ( s->chunked )
+    json_stream_send( s, "0\r\n\r\n", strlen( "0\r\n\r\n" ) );
+
+  /*
+   * Nothing is left for the main thread to send.  If the client went
+   * away partway through, there's no sense keeping the connection.
+   */
+  s->req->conn->outbuflen = 0;
+
+  if ( s->failed )
+    s->req->keepalive = 0;
+
+  free( s->buf );
+}
+
+/*
+ * Open an array ('[') or object ('{'), either as the value of the given
+ * key in the enclosing object, or (key == NULL) as an array element or the
+ * whole response
+ */
+void json_stream_open( json_stream *s, const char *key, char opener )
+{
+  if ( s->depth >= JSON_STREAM_MAX_DEPTH )
+    return;
+
+  json_stream_item( s, key );
+
+  s->cnt[s->depth] = 0;
+  s->keyed[s->depth] = key ? 1 : 0;
+  s->opener[s->depth] = opener;
+  s->depth++;
+}
+
+void json_stream_close( json_stream *s )
+{
+  char closer;
+
+  if ( !s->depth )
+    return;
+
+  s->depth--;
+  closer = ( s->opener[s->depth] == '[' ) ? ']' : '}';
+
+  if ( !s->cnt[s->depth] )
+    json_stream_put( s, &s->opener[s->depth], 1 );
+  else
+  if ( s->pretty )
+  {
+    json_stream_put( s, "\n", 1 );
+    json_stream_indent( s, s->depth );
+  }
+
+  json_stream_put( s, &closer, 1 );
+}
+
+void json_stream_value( json_stream *s, const char *key, const char *json )
+{
+  const char *fmt, *ptr, *left;
+
+  if ( !json )
+    json = "null";
+
+  json_stream_item( s, key );
+
+  if ( !s->pretty )
+  {
+    json_stream_put( s, json, strlen( json ) );
+    json_arena_rewind( s->mark );
+    return;
+  }
+
+  if ( !(fmt = json_format( json, 2, NULL )) )
+    fmt = json;
+
+  /*
+   * Like json_format, put a non-empty object or array on its own line
+   * when it follows a key
+   */
+  if ( key && ( *fmt == '{' || *fmt == '[' ) && fmt[1] == '\n' )
+  {
+    json_stream_put( s, "\n", 1 );
+    json_stream_indent( s, s->depth );
+  }
+
+  /*
+   * Copy, indenting every line to our depth (json_format escapes any
+   * linebreaks inside strings, so every linebreak here is structural)
+   */
+  for ( left = ptr = fmt; *ptr; ptr++ )
+  {
+    if ( *ptr == '\n' )
+    {
+      json_stream_put( s, left, ptr + 1 - left );
+      json_stream_indent( s, s->depth );
+      left = ptr + 1;
+    }
+  }
+
+  json_stream_put( s, left, ptr - left );
+
+  json_arena_rewind( s->mark );
+}
+
+/*
+ * Stream, as array elements, fnc applied to the data of each entry of a trie
+ */
+void json_stream_trie( json_stream *s, trie *t, char * (*fnc) (void *) )
+{
+  if ( t->data )
+    json_stream_value( s, NULL, (*fnc) ( (void *)t->data ) );
+
+  TRIE_RECURSE( json_stream_trie( s, *child, fnc ) );
+}
+
+/*
+ * Separator, key, and (if this is the first item in its container)
+ * the container's opening brace or bracket
+ */
+void json_stream_item( json_stream *s, const char *key )
+{
+  if ( s->depth && !s->pretty )
+  {
+    if ( s->cnt[s->depth - 1]++ )
+      json_stream_put( s, ",", 1 );
+    else
+      json_stream_put( s, &s->opener[s->depth - 1], 1 );
+  }
+  else
+  if ( s->depth )
+  {
+    int i = s->depth - 1;
+
+    if ( s->cnt[i]++ )
+      json_stream_put( s, ",\n", strlen( ",\n" ) );
+    else
+    {
+      if ( s->keyed[i] )
+      {
+        json_stream_put( s, "\n", 1 );
+        json_stream_indent( s, i );
+      }
+
+      json_stream_put( s, &s->opener[i], 1 );
+      json_stream_put( s, "\n", 1 );
+    }
+
+    json_stream_indent( s, s->depth );
+  }
+
+  if ( key )
+  {
+    json_stream_put( s, "\"", 1 );
+    json_stream_put( s, key, strlen( key ) );
+    json_stream_put( s, "\":", strlen( "\":" ) );
+  }
+}
+
+void json_stream_indent( json_stream *s, int depth )
+{
+  json_stream_put( s, json_stream_spaces, 2 * depth );
+}
+
+void json_stream_put( json_stream *s, const char *txt, int len )
+{
+  while ( len > 0 )
+  {
+    int room = JSON_STREAM_CHUNK - s->len;
+    int amount = ( len < room ) ? len : room;
+
+    memcpy( &s->buf[JSON_STREAM_CHUNK_HEADER + s->len], txt, amount );
+    s->len += amount;
+    txt += amount;
+    len -= amount;
+
+    if ( s->len == JSON_STREAM_CHUNK )
+      json_stream_flush( s );
+  }
+}
+
+void json_stream_flush( json_stream *s )
+{
+  char hdr[JSON_STREAM_CHUNK_HEADER + 1], *start;
+  int hdrlen;
+
+  if ( !s->len )
+    return;
+
+  if ( !s->chunked )
+  {
+    json_stream_send( s, &s->buf[JSON_STREAM_CHUNK_HEADER], s->len );
+    s->len = 0;
+    return;
+  }
+
+  /*
+   * Write the chunk's length line directly in front of it, and the
+   * trailing linebreak directly behind it, so it all goes out in one send
+   */
+  hdrlen = sprintf( hdr, "%x\r\n", s->len );
+  start = &s->buf[JSON_STREAM_CHUNK_HEADER - hdrlen];
+  memcpy( start, hdr, hdrlen );
+  memcpy( &s->buf[JSON_STREAM_CHUNK_HEADER + s->len], "\r\n", strlen("\r\n") );
+
+  json_stream_send( s, start, hdrlen + s->len + strlen("\r\n") );
+  s->len = 0;
+}
+
+/*
+ * The socket belongs to the worker while the request is busy, so it's safe
+ * to write to it directly.  It's non-blocking, so if the client is slow to
+ * read, wait for it (but not forever).
+ */
+int json_stream_send( json_stream *s, const char *buf, int len )
+{
+  int sock = s->req->conn->sock;
+
+  if ( s->failed )
+    return 0;
+
+  while ( len > 0 )
+  {
+    int sent = send( sock, buf, len, MSG_NOSIGNAL );
+
+    if ( sent < 0 )
+    {
+      if ( errno == EINTR )
+        continue;
+
+      if ( errno == EWOULDBLOCK || errno == EAGAIN )
+      {
+        struct pollfd pfd;
+
+        pfd.fd = sock;
+        pfd.events = POLLOUT;
+        pfd.revents = 0;
+
+        if ( poll( &pfd, 1, HTTP_KICK_IDLE_AFTER_X_SECS * 1000 ) > 0 )
+          continue;
+      }
+
+      s->failed = 1;
+      return 0;
+    }
+
+    buf += sent;
+    len -= sent;
+  }
+
+  return 1;
+}
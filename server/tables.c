@@ -2,12 +2,22 @@
  *  tables.c
  *  Maps names of API commands (plain strings) to the API commands
  *  themselves (function pointers).
+ *
+ *  Once every command is added, a seed is found under which each command
+ *  hashes to a slot of its own (a perfect hash), so looking a command up
+ *  takes one hash and one comparison.
  */
 #include "lyph.h"
 #include "srv.h"
 
-command_entry *first_handler[TABLES_HASH];
-command_entry *last_handler[TABLES_HASH];
+command_entry *first_handler;
+command_entry *last_handler;
+
+command_entry **command_table;
+unsigned int command_table_size;
+unsigned int command_table_seed;
+
+void build_command_table( void );
 
 void init_command_table(void)
 {
@@ -89,7 +99,7 @@ void init_command_table(void)
   add_handler( "delete_templates", do_delete_templates, CMD_READWRITE );
   add_handler( "delete_views", do_delete_views, CMD_READWRITE );
   add_handler( "delete_layers", do_delete_layers, CMD_READWRITE );
-  add_handler( "parse_csv", do_parse_csv, CMD_READWRITE );
+  add_handler( "parse_csv", do_parse_csv, CMD_READWRITE_SNAPSHOT );
   add_handler( "nifs", do_nifs, CMD_READONLY );
   add_handler( "fmamap", do_fmamap, CMD_READONLY );
   add_handler( "scaimap", do_scaimap, CMD_READONLY );
@@ -99,35 +109,80 @@ void init_command_table(void)
   //add_handler( "niflyph", do_niflyph, CMD_READWRITE );
   //add_handler( "nifconnection", do_nifconnection, CMD_READWRITE );
   add_handler( "renif", do_renif, CMD_READWRITE );
-  //add_handler( "gen_random_correlations", do_gen_random_correlations, CMD_READWRITE );
+  //add_handler( "gen_random_correlations", do_gen_random_correlations, CMD_READWRITE_SNAPSHOT );
   add_handler( "dotfile", do_dotfile, CMD_READONLY );
   //add_handler( "create_fmalyphs", do_create_fmalyphs, CMD_READWRITE );
-  add_handler( "import_lateralized_brain", do_import_lateralized_brain, CMD_READWRITE );
+  add_handler( "import_lateralized_brain", do_import_lateralized_brain, CMD_READWRITE_SNAPSHOT );
   add_handler( "dump", do_dump, CMD_READONLY );
+  add_handler( "save_image", do_save_image, CMD_READWRITE_SNAPSHOT );
+
+  build_command_table();
 }
 
 void add_handler( char *cmd, do_function *fnc, int read_write_state )
 {
-  int hash = *cmd % TABLES_HASH;
   command_entry *entry;
 
   CREATE( entry, command_entry, 1 );
 
   entry->cmd = cmd;
+  entry->len = strlen( cmd );
   entry->f = fnc;
   entry->read_write_state = read_write_state;
 
-  LINK( entry, first_handler[hash], last_handler[hash], next );
+  LINK( entry, first_handler, last_handler, next );
 }
 
-command_entry *lookup_command( char *cmd )
+/*
+ * Try seeds until one sends every command to a different slot, doubling
+ * the table whenever a run of seeds fails
+ */
+void build_command_table( void )
 {
-  int hash = *cmd % TABLES_HASH;
   command_entry *entry;
+  int cnt = 0, tries = 0;
+
+  for ( entry = first_handler; entry; entry = entry->next )
+    cnt++;
+
+  for ( command_table_size = 1; command_table_size < cnt * COMMAND_TABLE_SPARSENESS; )
+    command_table_size *= 2;
+
+  CREATE( command_table, command_entry *, command_table_size );
+
+  for ( command_table_seed = 1; ; command_table_seed++ )
+  {
+    for ( entry = first_handler; entry; entry = entry->next )
+    {
+      unsigned int slot = str_hash( entry->cmd, entry->len, command_table_seed ) & (command_table_size - 1);
+
+      if ( command_table[slot] )
+        break;
+
+      command_table[slot] = entry;
+    }
+
+    if ( !entry )
+      return;
+
+    free( command_table );
+
+    if ( ++tries % COMMAND_TABLE_SEEDS == 0 )
+      command_table_size *= 2;
+
+    CREATE( command_table, command_entry *, command_table_size );
+  }
+}
+
+/*
+ * The command named by the first len characters of cmd, if any
+ */
+command_entry *lookup_command( const char *cmd, size_t len )
+{
+  command_entry *entry = command_table[str_hash( cmd, len, command_table_seed ) & (command_table_size - 1)];
 
-  for ( entry = first_handler[hash]; entry; entry = entry->next )
-    if ( !strcmp( cmd, entry->cmd ) )
-      return entry;
+  if ( entry && entry->len == len && !memcmp( entry->cmd, cmd, len ) )
+    return entry;
 
   return NULL;
 }
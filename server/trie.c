@@ -10,6 +10,10 @@
  *  price of significantly complicating things.
  */
 #include "lyph.h"
+#include <pthread.h>
+#include <stdint.h>
+
+#define TRIE_ARENA_BLOCK_SIZE (4 * 1024 * 1024)
 
 trie *iri_to_labels;
 trie *label_to_iris;
@@ -21,441 +25,615 @@ trie *layer_ids;
 trie *lyphnode_ids;
 trie *lyph_ids;
 trie *lyph_names;
+trie *lyph_prefixes;
 trie *lyph_fmas;
 
 trie *superclasses;
 
 trie *metadata;
 
+/*
+ * The blocks holding tries made by trie_build
+ */
+trie_arena *trie_arenas;
+pthread_mutex_t trie_arenas_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Each thread hands out nodes from slabs of its own, and keeps the nodes
+ * given back by trie_free_node (linked through their parent pointers)
+ */
+__thread trie *trie_pool_next;
+__thread trie *trie_pool_end;
+__thread trie *trie_pool_free;
+
 void populate_void_buffer( void ***ptr, trie *t );
+void trie_build_range( trie_arena **arena, trie *t, trie_key *k, int cnt, size_t depth );
+void *trie_arena_alloc( trie_arena **arena, size_t size, size_t align );
+int cmp_trie_keys( const void *a, const void *b );
+int cmp_trie_children( const void *a, const void *b );
+trie **trie_alloc_children( int cnt );
+void trie_add_child( trie *t, trie *child );
+trie *trie_split( trie *t, trie *child, const char *lx );
+trie *trie_insert( const char *buf, trie *base );
+char *trie_new_key( trie_arena **arena, size_t len );
 
 trie *blank_trie( void )
 {
   trie *t;
 
-  CREATE( t, trie, 1 );
-  t->parent = NULL;
-  t->children = NULL;
-  t->label = NULL;
-  t->data = NULL;
+  if ( trie_pool_free )
+  {
+    t = trie_pool_free;
+    trie_pool_free = t->parent;
+  }
+  else
+  {
+    if ( trie_pool_next == trie_pool_end )
+    {
+      CREATE( trie_pool_next, trie, TRIE_POOL_SIZE );
+      trie_pool_end = &trie_pool_next[TRIE_POOL_SIZE];
+    }
+
+    t = trie_pool_next++;
+  }
+
+  memset( t, 0, sizeof(trie) );
 
   return t;
 }
 
-trie *trie_strdup( const char *buf, trie *base )
+/*
+ * Free a node (not its descendants) made by blank_trie
+ */
+void trie_free_node( trie *t )
 {
-  const char *bptr;
-  trie *t;
-  int cnt;
+  if ( t->label && t->label != t->inline_label )
+    trie_free( t->label );
 
-  bptr = buf;
-  t = base;
+  if ( t->children )
+    trie_free( t->children );
 
-  for(;;)
+  if ( t->key )
+    trie_free( t->key - sizeof(unsigned int) );
+
+  t->parent = trie_pool_free;
+  trie_pool_free = t;
+}
+
+/*
+ * Labels short enough are kept inside the node.  The new label may
+ * overlap the old one.
+ */
+void trie_set_label( trie *t, const char *label, size_t len )
+{
+  char *old = t->label;
+
+  if ( len < TRIE_INLINE_LABEL_LEN )
+  {
+    memmove( t->inline_label, label, len );
+    t->inline_label[len] = '\0';
+    t->label = t->inline_label;
+  }
+  else
   {
-    trie_strdup_main_loop:
+    CREATE( t->label, char, len + 1 );
+    memcpy( t->label, label, len );
+  }
 
-    if ( !*bptr )
-      return t;
+  if ( old && old != t->inline_label )
+    trie_free( old );
+}
 
-    if ( t->children )
-    {
-      trie **child, *blank=NULL;
+/*
+ * Room for cnt children (plus the terminating NULL) followed by the first
+ * characters of their labels
+ */
+trie **trie_alloc_children( int cnt )
+{
+  trie **children;
 
-      for ( child = t->children, cnt=0; *child; child++ )
-      {
-        cnt++;
+  CREATE( children, trie *, cnt + 1 + ( cnt + sizeof(trie *) - 1 ) / sizeof(trie *) );
 
-        if ( !*((*child)->label) )
-        {
-          blank = *child;
-          continue;
-        }
+  return children;
+}
 
-        if ( *((*child)->label) == *bptr )
-        {
-          /*
-           * Found an edge with same initial char as bptr
-           */
-          const char *bx, *lx;
-
-          for ( bx = bptr, lx = ((*child)->label); ; )
-          {
-            if ( !*lx )
-            {
-              bptr = bx;
-              t = *child;
-              goto trie_strdup_main_loop;
-            }
-
-            if ( !*bx )
-            {
-              trie *inter = blank_trie(), *cx = *child;
-              char *tmp;
-
-              inter->parent = t;
-              inter->label = strndup(cx->label, lx-(cx->label) );
-              CREATE( inter->children, trie *, 2 );
-              inter->children[0] = cx;
-              inter->children[1] = NULL;
-
-              tmp = cx->label;
-              cx->label = strdup(lx);
-              free( tmp );
-              cx->parent = inter;
-              *child = inter;
-
-              return inter;
-            }
-
-            if ( *lx != *bx )
-            {
-              trie *inter = blank_trie(), *cx = *child, *cxx;
-              char *oldlabel;
-
-              inter->parent = t;
-              CREATE( inter->children, trie *, 3 );
-              inter->children[0] = cx;
-              inter->children[1] = blank_trie();
-              inter->children[2] = NULL;
-
-              cxx = inter->children[1];
-              cxx->parent = inter;
-              cx->parent = inter;
-              *child = inter;
-
-              inter->label = strndup(cx->label, (lx-cx->label));
-
-              oldlabel = cx->label;
-
-              cx->label = strdup(lx);
-              free(oldlabel);
-              cxx->label = strdup(bx);
-
-              return cxx;
-            }
-
-            lx++;
-            bx++;
-          }
-        }
-      }
+/*
+ * Give t the children listed in the NULL-terminated array (which is freed),
+ * sorting them by their labels' first characters
+ */
+void trie_set_children( trie *t, trie **children )
+{
+  int i, cnt = VOIDLEN( children );
 
-      /*
-       * No edges have the same first char as bptr.
-       * If there was a blank edge, use that.
-       */
-      if ( blank )
-      {
-        free( blank->label );
-        blank->label = strdup(bptr);
-        return blank;
-      }
-      else
-      {
-        /*
-         * If no edges have same first char as bptr,
-         * and there are no blank edges, then create new edge.
-         */
-        trie **children, *cx;
-
-        CREATE( children, trie *, cnt + 2 );
-        if ( t->children )
-          memcpy( children, t->children, sizeof(trie*) * cnt );
-        children[cnt] = blank_trie();
-        cx = children[cnt];
-        cx->parent = t;
-        cx->label = strdup( bptr );
-        children[cnt+1] = NULL;
-
-        free( t->children );
-        t->children = children;
-
-        return cx;
-      }
-    }
-    else
-    {
-      /*
-       * No outgoing edges:
-       * Create one.
-       */
-      trie *cx;
+  if ( t->children )
+    trie_free( t->children );
+
+  if ( !cnt )
+  {
+    t->children = NULL;
+    t->child_cnt = 0;
+    free( children );
+    return;
+  }
 
-      CREATE( t->children, trie *, 2 );
-      t->children[0] = blank_trie();
-      cx = t->children[0];
-      cx->parent = t;
-      cx->label = strdup(bptr);
+  qsort( children, cnt, sizeof(trie *), cmp_trie_children );
 
-      t->children[1] = NULL;
+  t->children = trie_alloc_children( cnt );
+  t->child_cnt = cnt;
+  memcpy( t->children, children, cnt * sizeof(trie *) );
 
-      return cx;
-    }
+  for ( i = 0; i < cnt; i++ )
+    TRIE_FIRSTS( t )[i] = *t->children[i]->label;
+
+  free( children );
+}
+
+int cmp_trie_children( const void *a, const void *b )
+{
+  const unsigned char x = *(*((trie **) a))->label;
+  const unsigned char y = *(*((trie **) b))->label;
+
+  return x - y;
+}
+
+void trie_add_child( trie *t, trie *child )
+{
+  trie **children;
+  unsigned char c = *child->label, *firsts;
+  int cnt = t->child_cnt, pos;
+
+  children = trie_alloc_children( cnt + 1 );
+  firsts = (unsigned char *) &children[cnt + 2];
+
+  for ( pos = 0; pos < cnt && TRIE_FIRSTS( t )[pos] < c; pos++ )
+    ;
+
+  if ( cnt )
+  {
+    memcpy( children, t->children, pos * sizeof(trie *) );
+    memcpy( &children[pos+1], &t->children[pos], ( cnt - pos ) * sizeof(trie *) );
+    memcpy( firsts, TRIE_FIRSTS( t ), pos );
+    memcpy( &firsts[pos+1], &TRIE_FIRSTS( t )[pos], cnt - pos );
+    trie_free( t->children );
   }
+
+  children[pos] = child;
+  firsts[pos] = c;
+
+  t->children = children;
+  t->child_cnt = cnt + 1;
+  child->parent = t;
 }
 
-trie *trie_search( const char *buf, trie *base )
+/*
+ * Split child's edge where its label reaches lx, returning the new node
+ * in between (which takes child's place, and its first character, in t)
+ */
+trie *trie_split( trie *t, trie *child, const char *lx )
+{
+  trie *inter = blank_trie();
+  int i;
+
+  for ( i = 0; t->children[i] != child; i++ )
+    ;
+
+  trie_set_label( inter, child->label, lx - child->label );
+  trie_set_label( child, lx, strlen( lx ) );
+
+  inter->parent = t;
+  t->children[i] = inter;
+
+  trie_add_child( inter, child );
+
+  return inter;
+}
+
+trie *trie_strdup( const char *buf, trie *base )
+{
+  trie *t = trie_insert( buf, base );
+
+  if ( !t->key )
+    trie_set_key( t );
+
+  return t;
+}
+
+trie *trie_insert( const char *buf, trie *base )
 {
   const char *bptr;
-  trie *t;
+  trie *t, *child, *cx;
 
   bptr = buf;
   t = base;
 
   for(;;)
   {
-    trie_search_main_loop:
+    trie_insert_main_loop:
 
     if ( !*bptr )
       return t;
 
-    if ( t->children )
+    if ( (child = trie_child( t, *bptr )) != NULL )
     {
-      trie **child;
+      /*
+       * Found an edge with same initial char as bptr
+       */
+      const char *bx, *lx;
 
-      for ( child = t->children; *child; child++ )
+      for ( bx = bptr, lx = child->label; ; )
       {
-        if ( *((*child)->label) == *bptr )
+        if ( !*lx )
         {
-          /*
-           * Found an edge with same initial char as bptr
-           */
-          const char *bx, *lx;
-
-          for ( bx = bptr, lx = ((*child)->label); ; )
-          {
-            if ( !*lx )
-            {
-              bptr = bx;
-              t = *child;
-              goto trie_search_main_loop;
-            }
-
-            if ( !*bx )
-              return NULL;
-
-            if ( *lx != *bx )
-              return NULL;
-
-            lx++;
-            bx++;
-          }
+          bptr = bx;
+          t = child;
+          goto trie_insert_main_loop;
         }
-      }
 
-      return NULL;
+        if ( !*bx )
+          return trie_split( t, child, lx );
+
+        if ( *lx != *bx )
+        {
+          trie *inter = trie_split( t, child, lx );
+
+          cx = blank_trie();
+          trie_set_label( cx, bx, strlen( bx ) );
+          trie_add_child( inter, cx );
+
+          return cx;
+        }
+
+        lx++;
+        bx++;
+      }
     }
-    else
-      return NULL;
+
+    /*
+     * No edges have the same first char as bptr: create one
+     */
+    cx = blank_trie();
+    trie_set_label( cx, bptr, strlen( bptr ) );
+    trie_add_child( t, cx );
+
+    return cx;
   }
 }
 
-char *trie_to_json( trie *t )
+/*
+ * Add many keys at once, setting nodes[i] to the node for keys[i] (NULL if
+ * keys[i] is NULL).  If base is still empty, the keys are sorted and the
+ * whole tree is laid out in one pass, with long labels and children arrays
+ * carved from arenas; otherwise they are simply added one by one.  Either
+ * way, trie_strdup works as usual on the result.
+ */
+void trie_build( trie *base, const char **keys, trie **nodes, int cnt )
 {
-  return str_to_json( t ? trie_to_static( t ) : NULL );
+  trie_arena *arena = NULL, *last;
+  trie_key *k;
+  int i, n;
+
+  if ( base->children )
+  {
+    for ( i = 0; i < cnt; i++ )
+      nodes[i] = keys[i] ? trie_strdup( keys[i], base ) : NULL;
+
+    return;
+  }
+
+  CREATE( k, trie_key, cnt + 1 );
+
+  for ( i = 0, n = 0; i < cnt; i++ )
+  {
+    if ( !keys[i] )
+    {
+      nodes[i] = NULL;
+      continue;
+    }
+
+    k[n].key = keys[i];
+    k[n].index = i;
+    n++;
+  }
+
+  qsort( k, n, sizeof(trie_key), cmp_trie_keys );
+
+  trie_build_range( &arena, base, k, n, 0 );
+
+  for ( i = 0; i < n; i++ )
+    nodes[k[i].index] = k[i].node;
+
+  free( k );
+
+  if ( arena )
+  {
+    for ( last = arena; last->next; last = last->next )
+      ;
+
+    pthread_mutex_lock( &trie_arenas_mutex );
+    last->next = trie_arenas;
+    trie_arenas = arena;
+    pthread_mutex_unlock( &trie_arenas_mutex );
+  }
 }
 
-char *trie_to_static( trie *t )
+/*
+ * k[0..cnt) are sorted and all begin with the depth characters spelled out
+ * by the path to t.  Those that end there belong to t; the rest are split,
+ * by their next character, among new children of t, each child's label
+ * running as far as all the keys under it agree.
+ */
+void trie_build_range( trie_arena **arena, trie *t, trie_key *k, int cnt, size_t depth )
 {
-  static char buf[MAX_STRING_LEN + 2], *bptr;
-  trie *ancestor;
-  char *label, *lptr;
+  trie_key *kptr, *kend = &k[cnt], *first;
+  int groups;
+
+  for ( kptr = k; kptr < kend && !kptr->key[depth]; kptr++ )
+  {
+    if ( !t->key )
+    {
+      t->key = trie_new_key( arena, depth );
+      memcpy( t->key, kptr->key, depth + 1 );
+    }
+
+    kptr->node = t;
+  }
 
-  bptr = &buf[MAX_STRING_LEN+1];
-  *bptr-- = '\0';
+  first = kptr;
 
-  ancestor = t;
+  for ( groups = 0; kptr < kend; groups++ )
+  {
+    char c = kptr->key[depth];
+
+    do
+      kptr++;
+    while ( kptr < kend && kptr->key[depth] == c );
+  }
+
+  if ( !groups )
+    return;
 
-  while ( ancestor->parent )
+  t->children = trie_arena_alloc( arena, ( groups + 1 ) * sizeof(trie *) + groups, sizeof(trie *) );
+  t->children[groups] = NULL;
+  t->child_cnt = groups;
+
+  for ( kptr = first, groups = 0; kptr < kend; groups++ )
   {
-    label = ancestor->label;
+    trie_key *start = kptr, *last;
+    trie *child;
+    const char *a, *b;
+    size_t len;
 
-    lptr = &label[strlen(label)-1];
     do
+      kptr++;
+    while ( kptr < kend && kptr->key[depth] == start->key[depth] );
+
+    /*
+     * Sorted, so whatever the first and last keys share, they all share
+     */
+    last = &kptr[-1];
+
+    for ( a = &start->key[depth+1], b = &last->key[depth+1]; *a && *a == *b; a++, b++ )
+      ;
+
+    len = a - &start->key[depth];
+
+    child = blank_trie();
+    child->parent = t;
+
+    if ( len < TRIE_INLINE_LABEL_LEN )
+      trie_set_label( child, &start->key[depth], len );
+    else
     {
-      if ( bptr <= buf )
-      {
-        log_string( "Error_tree: trie_to_static ran out of space!\n" );
-        return buf;
-      }
-      *bptr-- = *lptr--;
+      child->label = trie_arena_alloc( arena, len + 1, 1 );
+      memcpy( child->label, &start->key[depth], len );
+      child->label[len] = '\0';
     }
-    while ( lptr >= label );
 
-    ancestor = ancestor->parent;
-  }
+    t->children[groups] = child;
+    TRIE_FIRSTS( t )[groups] = *child->label;
 
-  return &bptr[1];
+    trie_build_range( arena, child, start, kptr - start, depth + len );
+  }
 }
 
-void trie_search_autocomplete( char *label_ch, trie **buf, trie *base, int translate_to_superclasses, int unlimited )
+void *trie_arena_alloc( trie_arena **arena, size_t size, size_t align )
 {
-  char *chptr = label_ch;
-  trie *t = base;
+  trie_arena *a = *arena;
+  size_t blocksize;
+  char *p;
 
-  for (;;)
+  if ( a )
   {
-    trie_search_autocomplete_loop:
+    p = a->ptr + ( align - (uintptr_t) a->ptr % align ) % align;
 
-    if ( !*chptr )
-      break;
-
-    if ( !t->children )
+    if ( p + size <= a->end )
     {
-      *buf = NULL;
-      return;
+      a->ptr = p + size;
+      return p;
     }
-    else
-    {
-      trie **child;
+  }
 
-      for ( child = t->children; *child; child++ )
-      {
-        if ( *((*child)->label) == *chptr )
-        {
-          char *chx, *lx;
-
-          for ( chx = chptr, lx = ((*child)->label); ; )
-          {
-            if ( !*lx )
-            {
-              chptr = chx;
-              t = *child;
-              goto trie_search_autocomplete_loop;
-            }
-
-            if ( !*chx )
-            {
-              t = *child;
-              goto trie_search_autocomplete_escape;
-            }
-
-            if ( *lx != *chx )
-            {
-              *buf = NULL;
-              return;
-            }
-
-            lx++;
-            chx++;
-          }
-        }
-      }
-      *buf = NULL;
+  blocksize = size + align > TRIE_ARENA_BLOCK_SIZE ? size + align : TRIE_ARENA_BLOCK_SIZE;
+
+  CREATE( a, trie_arena, 1 );
+  CREATE( a->start, char, blocksize );
+  a->end = &a->start[blocksize];
+
+  p = a->start + ( align - (uintptr_t) a->start % align ) % align;
+  a->ptr = p + size;
+
+  a->next = *arena;
+  *arena = a;
+
+  return p;
+}
+
+int cmp_trie_keys( const void *a, const void *b )
+{
+  const trie_key *x = (const trie_key *) a, *y = (const trie_key *) b;
+  int cmp = strcmp( x->key, y->key );
+
+  return cmp ? cmp : x->index - y->index;
+}
+
+/*
+ * Free a label or children array, unless trie_build carved it from an arena
+ */
+void trie_free( void *ptr )
+{
+  trie_arena *a;
+
+  for ( a = trie_arenas; a; a = a->next )
+  {
+    if ( (char *) ptr >= a->start && (char *) ptr < a->end )
       return;
-    }
   }
 
-  trie_search_autocomplete_escape:
-  {
-    int finds = 0;
-    trie **bptr = buf, **children;
-    trie_wrapper *head=NULL, *tail=NULL, *wrap, *wptr, *wptr_next;
+  free( ptr );
+}
 
-    if ( t->data && t->data[0] )
-    {
-      if ( translate_to_superclasses )
-      {
-        char *full_iri = trie_to_static( t->data[0] );
-        char *short_iri = get_url_shortform( full_iri );
+/*
+ * The child whose label begins with c, if any
+ */
+trie *trie_child( const trie *t, char c )
+{
+  const unsigned char *firsts, *p;
 
-        if ( short_iri )
-        {
-          trie *in_superclasses = trie_search( short_iri, superclasses );
+  if ( !t->child_cnt )
+    return NULL;
 
-          if ( in_superclasses )
-          {
-            *bptr++ = in_superclasses;
-            finds++;
-          }
-        }
-      }
-      else
-      {
-        if ( base == label_to_iris )
-          *bptr++ = t;
-        else
-        if ( base == superclasses )
-          *bptr++ = t->data[0]->data[0];
-        finds++;
-      }
-    }
+  firsts = TRIE_FIRSTS( t );
+  p = memchr( firsts, (unsigned char) c, t->child_cnt );
+
+  return p ? t->children[p - firsts] : NULL;
+}
+
+trie *trie_search( const char *buf, trie *base )
+{
+  const char *bptr, *lx;
+  trie *t;
 
-    if ( t->children )
+  bptr = buf;
+  t = base;
+
+  for(;;)
+  {
+    if ( !*bptr )
+      return t;
+
+    if ( (t = trie_child( t, *bptr )) == NULL )
+      return NULL;
+
+    for ( lx = t->label; *lx; lx++, bptr++ )
     {
-      for ( children = t->children; *children; children++ )
-      {
-        CREATE( wrap, trie_wrapper, 1 );
-        wrap->t = *children;
-        LINK2( wrap, head, tail, next, prev );
-      }
+      if ( *lx != *bptr )
+        return NULL;
     }
+  }
+}
 
-    for ( wptr = head; wptr; wptr = wptr->next )
-    {
-      if ( wptr->t->data && wptr->t->data[0] )
-      {
-        if ( translate_to_superclasses )
-        {
-          char *full_iri = trie_to_static( wptr->t->data[0] );
-          char *short_iri = get_url_shortform( full_iri );
-
-          if ( short_iri )
-          {
-            trie *in_superclasses = trie_search( short_iri, superclasses );
-
-            if ( in_superclasses )
-            {
-              *bptr++ = in_superclasses;
-              finds++;
-            }
-          }
-        }
-        else
-        {
-          if ( base == label_to_iris )
-            *bptr++ = wptr->t;
-          else
-            *bptr++ = wptr->t->data[0]->data[0];
-          finds++;
-        }
+/*
+ * The node whose subtree holds exactly the keys starting with buf (or NULL
+ * if none do)
+ */
+trie *trie_search_prefix( const char *buf, trie *base )
+{
+  const char *bptr, *lx;
+  trie *t;
 
-        if ( finds >= MAX_AUTOCOMPLETE_RESULTS_PRESORT && !unlimited )
-          break;
-      }
+  bptr = buf;
+  t = base;
 
-      if ( wptr->t->children )
-      {
-        for ( children = wptr->t->children; *children; children++ )
-        {
-          CREATE( wrap, trie_wrapper, 1 );
-          wrap->t = *children;
-          LINK2( wrap, head, tail, next, prev );
-        }
-      }
-    }
+  for(;;)
+  {
+    if ( !*bptr )
+      return t;
+
+    if ( (t = trie_child( t, *bptr )) == NULL )
+      return NULL;
 
-    *bptr = NULL;
-    for ( wptr = head; wptr; wptr = wptr_next )
+    for ( lx = t->label; *lx && *bptr; lx++, bptr++ )
     {
-      wptr_next = wptr->next;
-      free( wptr );
+      if ( *lx != *bptr )
+        return NULL;
     }
+  }
+}
+
+char *trie_to_json( trie *t )
+{
+  return str_to_json( t ? trie_to_static( t ) : NULL );
+}
+
+/*
+ * The key which t stands for.  Unlike the tree, this is safe to read from
+ * any thread; and it stays put for as long as t does.
+ */
+char *trie_to_static( trie *t )
+{
+  if ( !t->key )
+    trie_set_key( t );
+
+  return t->key;
+}
 
-    qsort(buf, finds, sizeof(trie*), cmp_trie_data);
+/*
+ * Spell out t's key, starting from the nearest ancestor which has one.
+ * Readers may race to do this for a node with no key yet, so the key is
+ * only installed if no one else got there first.
+ */
+void trie_set_key( trie *t )
+{
+  trie *a, *b;
+  size_t len = 0, alen = 0, blen;
+  char *key, *kptr;
+
+  for ( a = t; a->parent && !a->key; a = a->parent )
+    len += strlen( a->label );
+
+  if ( a->key )
+    alen = ((const unsigned int *) a->key)[-1];
 
-    if ( finds > MAX_AUTOCOMPLETE_RESULTS_POSTSORT && !unlimited )
-      buf[MAX_AUTOCOMPLETE_RESULTS_POSTSORT] = NULL;
+  key = trie_new_key( NULL, alen + len );
+  kptr = &key[alen + len];
+  *kptr = '\0';
+
+  for ( b = t; b != a; b = b->parent )
+  {
+    blen = strlen( b->label );
+    kptr -= blen;
+    memcpy( kptr, b->label, blen );
   }
 
-  return;
+  if ( alen )
+    memcpy( key, a->key, alen );
+
+  if ( !__sync_bool_compare_and_swap( &t->key, NULL, key ) )
+    free( key - sizeof(unsigned int) );
+}
+
+/*
+ * Room for a key of length len (plus the terminator), just after the
+ * length itself; from an arena if one is given
+ */
+char *trie_new_key( trie_arena **arena, size_t len )
+{
+  unsigned int *block;
+
+  if ( arena )
+    block = trie_arena_alloc( arena, sizeof(unsigned int) + len + 1, sizeof(unsigned int) );
+  else
+    CREATE( block, unsigned int, 1 + ( len + sizeof(unsigned int) ) / sizeof(unsigned int) );
+
+  *block = len;
+
+  return (char *) &block[1];
 }
 
 int cmp_trie_data (const void * a, const void * b)
 {
-  int len1 = strlen( trie_to_static( *((trie**)a) ) );
-  int len2 = strlen( trie_to_static( *((trie**)b) ) );
+  int len1 = TRIE_KEY_LEN( *((trie**)a) );
+  int len2 = TRIE_KEY_LEN( *((trie**)b) );
 
   return len1-len2;
 }
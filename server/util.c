@@ -164,7 +164,7 @@ void init_html_codes( void )
 
 char *lowercaserize( const char *x )
 {
-  static char buf[MAX_STRING_LEN * 2];
+  static __thread char buf[MAX_STRING_LEN * 2];
   const char *xptr = x;
   char *bptr = buf;
 
@@ -274,6 +274,52 @@ char *url_decode(char *str)
   return buf;
 }
 
+/*
+ * Like url_decode, but overwriting str (the result is never longer)
+ */
+char *url_decode_in_place( char *str )
+{
+  char *pstr = str, *pbuf = str;
+
+  while (*pstr)
+  {
+    if (*pstr == '%')
+    {
+      if (pstr[1] && pstr[2])
+      {
+        *pbuf++ = from_hex(pstr[1]) << 4 | from_hex(pstr[2]);
+        pstr += 2;
+      }
+    }
+    else
+    if (*pstr == '+')
+      *pbuf++ = ' ';
+    else
+      *pbuf++ = *pstr;
+
+    pstr++;
+  }
+
+  *pbuf = '\0';
+  return str;
+}
+
+/*
+ * FNV-1a, starting from a seed (so that tables.c can try several)
+ */
+unsigned int str_hash( const char *str, size_t len, unsigned int seed )
+{
+  unsigned int h = 2166136261u ^ ( seed * 16777619u );
+
+  for ( ; len; len--, str++ )
+  {
+    h ^= (unsigned char) *str;
+    h *= 16777619u;
+  }
+
+  return h;
+}
+
 int is_number( const char *arg )
 {
   int first = 1;
@@ -311,7 +357,7 @@ size_t voidlen( void **x )
 char *constraints_comma_list( lyphplate **constraints )
 {
   lyphplate **ptr;
-  static char *buf;
+  static __thread char *buf;
   char **ids, **iptr, *bptr;
   int len = 0;
 
@@ -588,11 +634,28 @@ char *ul_to_json( unsigned long n )
 
 long long longtime( void )
 {
-  double d = difftime( time(NULL), 0 );
+  double d;
+
+  if ( journal_replay_time )
+    return journal_replay_time;
+
+  d = difftime( time(NULL), 0 );
 
   return (long long) d;
 }
 
+/*
+ * Seconds since an arbitrary fixed point; unaffected by changes to the wall clock
+ */
+long longtime_monotonic( void )
+{
+  struct timespec ts;
+
+  clock_gettime( CLOCK_MONOTONIC, &ts );
+
+  return (long) ts.tv_sec;
+}
+
 int str_begins( const char *full, const char *init )
 {
   const char *fptr = full, *iptr = init;
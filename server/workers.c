@@ -0,0 +1,257 @@
+/*
+ *  workers.c
+ *  Pool of threads which run the API commands.
+ *
+ *  The main thread (srv.c) owns all the sockets.  Once it has parsed a
+ *  request, it hands the request to a worker and moves on.  Commands
+ *  marked CMD_READONLY in tables.c run concurrently under a shared lock;
+ *  everything else runs under the exclusive lock.  When a worker is done,
+ *  it queues the connection and pokes the main thread through an eventfd,
+ *  and the main thread flushes the response.
+ */
+#include "lyph.h"
+#include "srv.h"
+#include <pthread.h>
+#include <sys/eventfd.h>
+
+__thread int worker_slot;
+
+/*
+ * Set while a worker runs a request under the shared lock.  A handler
+ * which finds it needs to change something sets exclusive_needed and
+ * bails out; the request is then rerun under the exclusive lock.
+ */
+__thread int shared_access;
+__thread int exclusive_needed;
+
+pthread_rwlock_t db_lock;
+
+pthread_mutex_t job_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t job_cond = PTHREAD_COND_INITIALIZER;
+http_request *first_job;
+http_request *last_job;
+
+pthread_mutex_t done_mutex = PTHREAD_MUTEX_INITIALIZER;
+http_conn *first_done_conn;
+http_conn *last_done_conn;
+
+int worker_eventfd;
+
+extern int http_epoll_fd;
+
+void init_workers( void )
+{
+  pthread_rwlockattr_t attr;
+  struct epoll_event ev;
+  int i;
+
+  pthread_rwlockattr_init( &attr );
+
+#ifdef __GLIBC__
+  /*
+   * Otherwise a steady stream of readers would starve the writers
+   */
+  pthread_rwlockattr_setkind_np( &attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP );
+#endif
+
+  pthread_rwlock_init( &db_lock, &attr );
+  pthread_rwlockattr_destroy( &attr );
+
+  if ( (worker_eventfd = eventfd( 0, EFD_NONBLOCK )) == -1 )
+  {
+    fprintf( stderr, "Fatal: Couldn't create eventfd for worker threads\n" );
+    abort();
+  }
+
+  memset( &ev, 0, sizeof(ev) );
+  ev.events = EPOLLIN | EPOLLET;
+  ev.data.ptr = &worker_eventfd;
+
+  if ( epoll_ctl( http_epoll_fd, EPOLL_CTL_ADD, worker_eventfd, &ev ) == -1 )
+  {
+    fprintf( stderr, "Fatal: Couldn't register worker eventfd with epoll\n" );
+    abort();
+  }
+
+  for ( i = 1; i <= configs.workers; i++ )
+  {
+    pthread_t thread;
+
+    if ( pthread_create( &thread, NULL, worker_thread, (void *)(intptr_t) i ) )
+    {
+      fprintf( stderr, "Fatal: Couldn't start worker thread %d\n", i );
+      abort();
+    }
+
+    pthread_detach( thread );
+  }
+}
+
+/*
+ * Called from the main thread
+ */
+void dispatch_request( http_request *req )
+{
+  req->conn->busy = 1;
+
+  pthread_mutex_lock( &job_mutex );
+  LINK( req, first_job, last_job, next_job );
+  pthread_cond_signal( &job_cond );
+  pthread_mutex_unlock( &job_mutex );
+}
+
+void *worker_thread( void *arg )
+{
+  worker_slot = (int)(intptr_t) arg;
+
+  for ( ; ; )
+  {
+    http_request *req;
+    http_conn *c;
+    uint64_t one = 1;
+
+    pthread_mutex_lock( &job_mutex );
+
+    while ( !first_job )
+      pthread_cond_wait( &job_cond, &job_mutex );
+
+    req = first_job;
+    first_job = req->next_job;
+
+    if ( !first_job )
+      last_job = NULL;
+
+    pthread_mutex_unlock( &job_mutex );
+
+    run_request( req );
+
+    c = req->conn;
+
+    pthread_mutex_lock( &done_mutex );
+    LINK( c, first_done_conn, last_done_conn, next_done );
+    pthread_mutex_unlock( &done_mutex );
+
+    if ( write( worker_eventfd, &one, sizeof(one) ) != sizeof(one) )
+      log_string( "Could not signal main thread from worker" );
+  }
+
+  return NULL;
+}
+
+void run_request( http_request *req )
+{
+  char *query_copy;
+  long long seq;
+  int state;
+
+  to_logfile( "Got request:\n%s", req->query );
+
+  /*
+   * handle_request parses the query in place, so keep a copy in case
+   * the request has to be rerun, and for the journal
+   */
+  query_copy = strdup( req->query );
+  state = request_read_write_state( req->query );
+
+  if ( state == CMD_READONLY )
+  {
+    pthread_rwlock_rdlock( &db_lock );
+    shared_access = 1;
+    exclusive_needed = 0;
+
+    handle_request( req, req->query );
+
+    shared_access = 0;
+    pthread_rwlock_unlock( &db_lock );
+
+    json_gc();
+
+    if ( !exclusive_needed )
+    {
+      free( query_copy );
+      return;
+    }
+
+    strcpy( req->query, query_copy );
+  }
+
+  pthread_rwlock_wrlock( &db_lock );
+
+  journal_begin();
+  handle_request( req, req->query );
+
+  if ( state == CMD_READWRITE_SNAPSHOT )
+  {
+    journal_end( NULL, 0 );
+    journal_compact();
+    seq = 0;
+  }
+  else
+    seq = journal_end( query_copy, state == CMD_READWRITE );
+
+  pthread_rwlock_unlock( &db_lock );
+
+  /*
+   * Don't answer until the change is safely on disk (the fsync happens
+   * outside the lock, so that other changes can join the same fsync)
+   */
+  if ( seq )
+    journal_wait( seq );
+
+  free( query_copy );
+  json_gc();
+}
+
+/*
+ * Called from the main thread at shutdown: wait for the requests in
+ * progress, and keep the workers (and the journal thread) out for good
+ */
+void stop_workers( void )
+{
+  pthread_rwlock_wrlock( &db_lock );
+}
+
+int have_exclusive_access( void )
+{
+  if ( shared_access )
+  {
+    exclusive_needed = 1;
+    return 0;
+  }
+
+  return 1;
+}
+
+/*
+ * Called from the main thread when the eventfd fires: pick up the
+ * connections whose responses the workers have finished
+ */
+void collect_finished_requests( void )
+{
+  http_conn *c, *c_next;
+  uint64_t cnt;
+
+  while ( read( worker_eventfd, &cnt, sizeof(cnt) ) == sizeof(cnt) )
+    ;
+
+  pthread_mutex_lock( &done_mutex );
+  c = first_done_conn;
+  first_done_conn = NULL;
+  last_done_conn = NULL;
+  pthread_mutex_unlock( &done_mutex );
+
+  for ( ; c; c = c_next )
+  {
+    c_next = c->next_done;
+    c->busy = 0;
+
+    if ( c->doomed )
+    {
+      http_kill_socket( c );
+      continue;
+    }
+
+    http_touch_connection( c );
+    http_process_connection( c );
+  }
+}